@@ -0,0 +1,134 @@
+/*
+ * bench-barrier.c - Measures how long a round at a barrier takes, with
+ *                   sthread_barrier_t and with one built out of a mutex,
+ *                   a condition variable and a counter.
+ *
+ * Usage: bench-barrier [max_threads [waits]]
+ *
+ * For each thread count from 2 up to max_threads (default 1024),
+ * doubling each time, the threads go through waits / threads rounds
+ * (at least 10) together, waiting at the barrier at the end of each.
+ * waits defaults to 200000. The emulated barrier is the usual one: the
+ * last thread to arrive starts a new generation and broadcasts, and
+ * every other thread wakes up, takes the mutex in turn and checks the
+ * generation before going on. The times include creating and joining
+ * the threads, which is the same for both.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+typedef enum { BARRIER_NATIVE, BARRIER_EMULATED } barrier_kind_t;
+
+static const char *kind_names[] = { "native", "emulated" };
+
+static barrier_kind_t kind;
+static long rounds;
+static sthread_barrier_t barrier;
+
+/* The emulated barrier. */
+static sthread_mutex_t lock;
+static sthread_cond_t cond;
+static int count, arrived;
+static long generation;
+
+static void emulated_wait(void) {
+  long seen;
+
+  sthread_mutex_lock(lock);
+  if (++arrived == count) {
+    arrived = 0;
+    generation++;
+    sthread_cond_broadcast(cond);
+  } else {
+    seen = generation;
+    while (generation == seen)
+      sthread_cond_wait(cond, lock);
+  }
+  sthread_mutex_unlock(lock);
+}
+
+static void *worker(void *arg) {
+  long r;
+
+  for (r = 0; r < rounds; r++) {
+    if (kind == BARRIER_NATIVE)
+      sthread_barrier_wait(barrier);
+    else
+      emulated_wait();
+  }
+  return NULL;
+}
+
+/* Returns the average time per round, in nanoseconds. */
+static double run(barrier_kind_t k, int nthreads) {
+  sthread_t *threads;
+  uint64_t start, elapsed;
+  int i;
+
+  threads = malloc(nthreads * sizeof(sthread_t));
+  if (threads == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  kind = k;
+  if (k == BARRIER_NATIVE)
+    barrier = sthread_barrier_init(nthreads);
+  count = nthreads;
+  start = bench_now_ns();
+  for (i = 0; i < nthreads; i++) {
+    threads[i] = sthread_create(worker, NULL, 1);
+    if (threads[i] == NULL) {
+      fprintf(stderr, "sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    sthread_join(threads[i]);
+  elapsed = bench_now_ns() - start;
+  if (k == BARRIER_NATIVE)
+    sthread_barrier_free(barrier);
+  free(threads);
+
+  return (double)elapsed / rounds;
+}
+
+int main(int argc, char **argv) {
+  int max_threads, n, k;
+  long waits;
+  double ns, base;
+
+  max_threads = (argc > 1) ? atoi(argv[1]) : 1024;
+  if (max_threads < 2)
+    max_threads = 2;
+  waits = (argc > 2) ? atol(argv[2]) : 200000;
+
+  sthread_init();
+  lock = sthread_mutex_init();
+  cond = sthread_cond_init();
+
+  for (n = 2; n <= max_threads; n *= 2) {
+    rounds = waits / n;
+    if (rounds < 10)
+      rounds = 10;
+    base = 0;
+    for (k = BARRIER_EMULATED; k >= BARRIER_NATIVE; k--) {
+      ns = run((barrier_kind_t)k, n);
+      if (k == BARRIER_EMULATED)
+        base = ns;
+      printf("bench=barrier impl=%s kind=%s threads=%d rounds=%ld "
+             "ns_per_round=%.0f speedup_vs_emulated=%.2f\n",
+             bench_impl_name(), kind_names[k], n, rounds, ns, base / ns);
+      fflush(stdout);
+    }
+  }
+
+  sthread_cond_free(cond);
+  sthread_mutex_free(lock);
+  return 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * bench-chan.c - Measures how quickly values move down a pipeline of
+ *                threads connected by channels, compared to queues built
+ *                out of a mutex and two condition variables.
+ *
+ * Usage: bench-chan [items [stages [capacity]]]
+ *
+ * A producer sends items (default 200000) values down stages (default 4)
+ * threads, each passing every value on to the next, to a consumer at the
+ * end. The links between them are, in turn: unbuffered channels;
+ * channels holding capacity (default 16) values; and queues of the same
+ * capacity with a mutex, a condition variable to wait for values and one
+ * to wait for room. The result is the time per value from the first
+ * send to the last receive, divided by the number of links.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+typedef enum { LINK_UNBUFFERED, LINK_BUFFERED, LINK_QUEUE } link_kind_t;
+
+static const char *kind_names[] = { "chan-unbuffered", "chan-buffered",
+                                    "mutex-cond-queue" };
+
+/* A queue, as the channels' callers would have built it before. */
+typedef struct {
+  sthread_mutex_t lock;
+  sthread_cond_t not_empty;
+  sthread_cond_t not_full;
+  void **values;
+  int capacity, head, count;
+} queue_t;
+
+typedef struct {
+  sthread_chan_t chan;
+  queue_t queue;
+} link_t;
+
+static link_kind_t kind;
+static long items;
+static link_t *links;
+
+static void queue_init(queue_t *q, int capacity) {
+  q->lock = sthread_mutex_init();
+  q->not_empty = sthread_cond_init();
+  q->not_full = sthread_cond_init();
+  q->values = malloc(capacity * sizeof(void*));
+  if (q->values == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  q->capacity = capacity;
+  q->head = q->count = 0;
+}
+
+static void queue_free(queue_t *q) {
+  sthread_cond_free(q->not_full);
+  sthread_cond_free(q->not_empty);
+  sthread_mutex_free(q->lock);
+  free(q->values);
+}
+
+static void link_send(link_t *l, void *value) {
+  queue_t *q = &l->queue;
+
+  if (kind != LINK_QUEUE) {
+    sthread_chan_send(l->chan, value);
+    return;
+  }
+  sthread_mutex_lock(q->lock);
+  while (q->count == q->capacity)
+    sthread_cond_wait(q->not_full, q->lock);
+  q->values[(q->head + q->count++) % q->capacity] = value;
+  sthread_cond_signal(q->not_empty);
+  sthread_mutex_unlock(q->lock);
+}
+
+static void *link_recv(link_t *l) {
+  queue_t *q = &l->queue;
+  void *value;
+
+  if (kind != LINK_QUEUE) {
+    sthread_chan_recv(l->chan, &value);
+    return value;
+  }
+  sthread_mutex_lock(q->lock);
+  while (q->count == 0)
+    sthread_cond_wait(q->not_empty, q->lock);
+  value = q->values[q->head];
+  q->head = (q->head + 1) % q->capacity;
+  q->count--;
+  sthread_cond_signal(q->not_full);
+  sthread_mutex_unlock(q->lock);
+  return value;
+}
+
+static void *producer(void *arg) {
+  long i;
+
+  for (i = 1; i <= items; i++)
+    link_send(&links[0], (void*)(intptr_t)i);
+  return NULL;
+}
+
+static void *stage(void *arg) {
+  intptr_t n = (intptr_t)arg;
+  long i;
+
+  for (i = 0; i < items; i++)
+    link_send(&links[n + 1], link_recv(&links[n]));
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  intptr_t n = (intptr_t)arg, sum = 0;
+  long i;
+
+  for (i = 0; i < items; i++)
+    sum += (intptr_t)link_recv(&links[n]);
+  return (void*)sum;
+}
+
+static sthread_t create(sthread_start_func_t func, void *arg) {
+  sthread_t t = sthread_create(func, arg, 1);
+
+  if (t == NULL) {
+    fprintf(stderr, "sthread_create failed\n");
+    exit(1);
+  }
+  return t;
+}
+
+/* Returns the average time per value per link, in nanoseconds. */
+static double run(link_kind_t k, int stages, int capacity) {
+  sthread_t *threads;
+  uint64_t start, elapsed;
+  intptr_t sum;
+  int i;
+
+  kind = k;
+  links = malloc((stages + 1) * sizeof(link_t));
+  threads = malloc((stages + 2) * sizeof(sthread_t));
+  if (links == NULL || threads == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (i = 0; i <= stages; i++) {
+    if (k == LINK_QUEUE)
+      queue_init(&links[i].queue, capacity);
+    else
+      links[i].chan = sthread_chan_init((k == LINK_BUFFERED) ? capacity : 0);
+  }
+
+  start = bench_now_ns();
+  threads[0] = create(consumer, (void*)(intptr_t)stages);
+  for (i = stages - 1; i >= 0; i--)
+    threads[i + 1] = create(stage, (void*)(intptr_t)i);
+  threads[stages + 1] = create(producer, NULL);
+  sum = (intptr_t)sthread_join(threads[0]);
+  elapsed = bench_now_ns() - start;
+  for (i = 1; i < stages + 2; i++)
+    sthread_join(threads[i]);
+  if (sum != (intptr_t)items * (items + 1) / 2) {
+    fprintf(stderr, "values were lost\n");
+    exit(1);
+  }
+
+  for (i = 0; i <= stages; i++) {
+    if (k == LINK_QUEUE)
+      queue_free(&links[i].queue);
+    else
+      sthread_chan_free(links[i].chan);
+  }
+  free(links);
+  free(threads);
+  return (double)elapsed / ((double)items * (stages + 1));
+}
+
+int main(int argc, char **argv) {
+  int stages, capacity, k;
+  double ns, base = 0;
+
+  items = (argc > 1) ? atol(argv[1]) : 200000;
+  stages = (argc > 2) ? atoi(argv[2]) : 4;
+  capacity = (argc > 3) ? atoi(argv[3]) : 16;
+  if (items < 1 || stages < 0 || capacity < 1) {
+    fprintf(stderr, "usage: %s [items [stages [capacity]]]\n", argv[0]);
+    return 1;
+  }
+
+  sthread_init();
+
+  for (k = LINK_QUEUE; k >= LINK_UNBUFFERED; k--) {
+    ns = run((link_kind_t)k, stages, capacity);
+    if (k == LINK_QUEUE)
+      base = ns;
+    printf("bench=chan impl=%s link=%s stages=%d capacity=%d items=%ld "
+           "ns_per_hop=%.1f speedup_vs_queue=%.2f\n", bench_impl_name(),
+           kind_names[k], stages, (k == LINK_UNBUFFERED) ? 0 : capacity,
+           items, ns, base / ns);
+    fflush(stdout);
+  }
+  return 0;
+}
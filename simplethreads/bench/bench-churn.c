@@ -0,0 +1,127 @@
+/*
+ * bench-churn.c - Measures the cost of creating and finishing short
+ *                 threads, as a server that runs a thread per request
+ *                 does.
+ *
+ * Usage: bench-churn [threads]
+ *
+ * Three patterns are timed, each with threads that do nothing but
+ * return:
+ *
+ *   - join: create one joinable thread and join it, over and over.
+ *
+ *   - batch: create a batch of joinable threads, then join them all.
+ *
+ *   - detached: create detached threads, each of which counts itself
+ *     done; the main thread waits for the count.
+ *
+ * Results are per thread, and include both creating it and finishing
+ * with it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+static const long DEFAULT_THREADS = 200000;
+
+#define BATCH 100
+
+static sthread_mutex_t done_lock;
+static sthread_cond_t done_cond;
+static long done;
+
+static void *nothing(void *arg) {
+  return arg;
+}
+
+static void *count_done(void *arg) {
+  sthread_mutex_lock(done_lock);
+  if (++done == (long)arg)
+    sthread_cond_signal(done_cond);
+  sthread_mutex_unlock(done_lock);
+  return NULL;
+}
+
+static sthread_t create(sthread_start_func_t func, void *arg, int joinable) {
+  sthread_t t = sthread_create(func, arg, joinable);
+
+  if (t == NULL) {
+    printf("sthread_create failed\n");
+    exit(1);
+  }
+  return t;
+}
+
+static void report(const char *mode, long threads, uint64_t elapsed) {
+  printf("bench=churn mode=%s impl=%s threads=%ld ns_per_thread=%.1f\n",
+         mode, bench_impl_name(), threads, (double)elapsed / threads);
+}
+
+static void join_bench(long threads) {
+  uint64_t start;
+  long i;
+
+  start = bench_now_ns();
+  for (i = 0; i < threads; i++)
+    sthread_join(create(nothing, NULL, 1));
+  report("join", threads, bench_now_ns() - start);
+}
+
+static void batch_bench(long threads) {
+  sthread_t batch[BATCH];
+  uint64_t start;
+  long i, j;
+
+  start = bench_now_ns();
+  for (i = 0; i < threads; i += BATCH) {
+    for (j = 0; j < BATCH; j++)
+      batch[j] = create(nothing, NULL, 1);
+    for (j = 0; j < BATCH; j++)
+      sthread_join(batch[j]);
+  }
+  report("batch", i, bench_now_ns() - start);
+}
+
+static void detached_bench(long threads) {
+  uint64_t start;
+  long i;
+
+  done = 0;
+  start = bench_now_ns();
+  for (i = 0; i < threads; i++)
+    create(count_done, (void*)threads, 0);
+  sthread_mutex_lock(done_lock);
+  while (done < threads)
+    sthread_cond_wait(done_cond, done_lock);
+  sthread_mutex_unlock(done_lock);
+  report("detached", threads, bench_now_ns() - start);
+}
+
+int main(int argc, char **argv) {
+  sthread_t batch[BATCH];
+  long threads, i;
+
+  threads = (argc > 1) ? atol(argv[1]) : DEFAULT_THREADS;
+  if (threads < 1)
+    threads = DEFAULT_THREADS;
+
+  sthread_init();
+  done_lock = sthread_mutex_init();
+  done_cond = sthread_cond_init();
+
+  /* Warm up, so that pooled stacks and threads are there to reuse. */
+  for (i = 0; i < BATCH; i++)
+    batch[i] = create(nothing, NULL, 1);
+  for (i = 0; i < BATCH; i++)
+    sthread_join(batch[i]);
+
+  join_bench(threads);
+  batch_bench(threads);
+  detached_bench(threads);
+  return 0;
+}
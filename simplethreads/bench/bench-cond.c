@@ -0,0 +1,169 @@
+/*
+ * bench-cond.c - Measures how quickly threads waiting on a condition
+ *                variable wake up.
+ *
+ * Usage: bench-cond [iterations [waiters]]
+ *
+ * Two measurements are made:
+ *
+ *   - signal: two threads hand a turn back and forth, each waiting on
+ *     the condition variable until it is its turn and signalling the
+ *     other when it is done; iterations (default 200000) round trips.
+ *     The result is per hand-off, from one thread's signal to the
+ *     other's return from sthread_cond_wait().
+ *
+ *   - broadcast: a number of waiters (default 8) wait on a condition
+ *     variable, the main thread wakes them all with one broadcast, and
+ *     each records how long it took to get back from sthread_cond_wait()
+ *     (including its turn at the mutex); iterations / 10 rounds. The
+ *     results are the mean over all wakeups, and the mean over rounds of
+ *     the last waiter's.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+static const long DEFAULT_ITERATIONS = 200000;
+static const int DEFAULT_WAITERS = 8;
+
+static sthread_mutex_t lock;
+static sthread_cond_t cond;
+
+static sthread_t create(sthread_start_func_t func, void *arg) {
+  sthread_t t = sthread_create(func, arg, 1);
+
+  if (t == NULL) {
+    printf("sthread_create failed\n");
+    exit(1);
+  }
+  return t;
+}
+
+/* Signal: whose turn it is, 0 or 1. */
+static int turn;
+static long iterations;
+
+static void *ponger(void *arg) {
+  int me = (int)(intptr_t)arg;
+  long i;
+
+  sthread_mutex_lock(lock);
+  for (i = 0; i < iterations; i++) {
+    while (turn != me)
+      sthread_cond_wait(cond, lock);
+    turn = !me;
+    sthread_cond_signal(cond);
+  }
+  sthread_mutex_unlock(lock);
+  return NULL;
+}
+
+static void signal_bench(void) {
+  sthread_t a, b;
+  uint64_t start, elapsed;
+
+  turn = 0;
+  start = bench_now_ns();
+  a = create(ponger, (void*)0);
+  b = create(ponger, (void*)1);
+  sthread_join(a);
+  sthread_join(b);
+  elapsed = bench_now_ns() - start;
+
+  printf("bench=cond mode=signal impl=%s iterations=%ld "
+         "ns_per_wakeup=%.1f\n", bench_impl_name(), iterations,
+         (double)elapsed / (2.0 * iterations));
+}
+
+/* Broadcast: the main thread waits on ready_cond until all of the
+ * waiters are waiting, then bumps generation and broadcasts. */
+static sthread_cond_t ready_cond;
+static int nwaiters, waiting, stop;
+static long generation;
+static uint64_t broadcast_at, round_last, wake_total, last_total;
+
+static void *waiter(void *arg) {
+  long seen;
+  uint64_t latency;
+
+  sthread_mutex_lock(lock);
+  for (;;) {
+    seen = generation;
+    if (++waiting == nwaiters)
+      sthread_cond_signal(ready_cond);
+    while (generation == seen && !stop)
+      sthread_cond_wait(cond, lock);
+    if (stop)
+      break;
+    latency = bench_now_ns() - broadcast_at;
+    wake_total += latency;
+    if (latency > round_last)
+      round_last = latency;
+  }
+  sthread_mutex_unlock(lock);
+  return NULL;
+}
+
+static void broadcast_bench(long rounds) {
+  sthread_t *threads;
+  long r;
+  int i;
+
+  threads = malloc(nwaiters * sizeof(sthread_t));
+  if (threads == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (i = 0; i < nwaiters; i++)
+    threads[i] = create(waiter, NULL);
+
+  sthread_mutex_lock(lock);
+  for (r = 0; r <= rounds; r++) {
+    while (waiting < nwaiters)
+      sthread_cond_wait(ready_cond, lock);
+    /* The waiters are all back: the previous round is complete. */
+    if (r > 0)
+      last_total += round_last;
+    if (r == rounds)
+      break;
+    waiting = 0;
+    round_last = 0;
+    generation++;
+    broadcast_at = bench_now_ns();
+    sthread_cond_broadcast(cond);
+  }
+  stop = 1;
+  sthread_cond_broadcast(cond);
+  sthread_mutex_unlock(lock);
+  for (i = 0; i < nwaiters; i++)
+    sthread_join(threads[i]);
+  free(threads);
+
+  printf("bench=cond mode=broadcast impl=%s waiters=%d rounds=%ld "
+         "mean_wake_ns=%.0f last_wake_ns=%.0f\n", bench_impl_name(),
+         nwaiters, rounds, (double)wake_total / ((double)rounds * nwaiters),
+         (double)last_total / rounds);
+}
+
+int main(int argc, char **argv) {
+  iterations = (argc > 1) ? atol(argv[1]) : DEFAULT_ITERATIONS;
+  nwaiters = (argc > 2) ? atoi(argv[2]) : DEFAULT_WAITERS;
+  if (iterations < 10 || nwaiters < 1) {
+    fprintf(stderr, "usage: %s [iterations [waiters]]\n", argv[0]);
+    return 1;
+  }
+
+  sthread_init();
+  lock = sthread_mutex_init();
+  cond = sthread_cond_init();
+  ready_cond = sthread_cond_init();
+
+  signal_bench();
+  broadcast_bench(iterations / 10);
+  return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * bench-future.c - Measures fanning work out to threads and gathering
+ *                  the results: futures with sthread_join_all(), joining
+ *                  threads one at a time, and a counter the children
+ *                  decrement under a mutex, signalling a condition
+ *                  variable each time.
+ *
+ * Usage: bench-future [max_width [rounds [yields]]]
+ *
+ * For each width from 2 up to max_width (default 256), doubling each
+ * time, the main thread does rounds (default 2000, divided by the
+ * width) fan-outs: it starts width children and waits until they have
+ * all finished. Each child yields a pseudo-random number of times, up
+ * to yields (default 16), so that they finish in no particular order,
+ * like replies to RPCs. The results are the time per fan-out and the
+ * number of times per fan-out the main thread blocked and was woken
+ * (its voluntary switches, from sthread_stats_snapshot()).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+typedef enum { FAN_JOIN_ALL, FAN_JOIN, FAN_COUNTER } fan_kind_t;
+
+static const char *kind_names[] = { "join-all", "join", "cond-counter" };
+
+static fan_kind_t kind;
+static int yields;
+
+/* The counter the children of FAN_COUNTER count down. */
+static sthread_mutex_t lock;
+static sthread_cond_t cond;
+static int remaining;
+
+static void *child(void *arg) {
+  uint32_t x = (uint32_t)(uintptr_t)arg * 2654435761u;
+  int i, n = (int)((x >> 16) % (yields + 1));
+
+  for (i = 0; i < n; i++)
+    sthread_yield();
+  if (kind == FAN_COUNTER) {
+    sthread_mutex_lock(lock);
+    remaining--;
+    sthread_cond_signal(cond);
+    sthread_mutex_unlock(lock);
+  }
+  return arg;
+}
+
+static sthread_t create(sthread_start_func_t func, void *arg, int joinable) {
+  sthread_t t = sthread_create(func, arg, joinable);
+
+  if (t == NULL) {
+    fprintf(stderr, "sthread_create failed\n");
+    exit(1);
+  }
+  return t;
+}
+
+/* The main thread's voluntary switches so far. */
+static unsigned long main_switches(void) {
+  sthread_stats_t *stats = sthread_stats_snapshot();
+  unsigned long n = 0;
+  int i;
+
+  for (i = 0; i < stats->nthreads; i++) {
+    if (stats->threads[i].thread == NULL)
+      n = stats->threads[i].counters.voluntary_switches;
+  }
+  sthread_stats_free(stats);
+  return n;
+}
+
+/* Returns the average time per fan-out, in nanoseconds, and sets
+ * *wakeups to the average number of times the main thread blocked. */
+static double run(fan_kind_t k, int width, long rounds, double *wakeups) {
+  sthread_future_t *futures;
+  sthread_t *threads;
+  uint64_t start, elapsed;
+  unsigned long switches;
+  long r;
+  int i;
+
+  futures = malloc(width * sizeof(sthread_future_t));
+  threads = malloc(width * sizeof(sthread_t));
+  if (futures == NULL || threads == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  kind = k;
+  switches = main_switches();
+  start = bench_now_ns();
+  for (r = 0; r < rounds; r++) {
+    switch (k) {
+    case FAN_JOIN_ALL:
+      for (i = 0; i < width; i++) {
+        futures[i] = sthread_future_spawn(child, (void*)(r * width + i));
+        if (futures[i] == NULL) {
+          fprintf(stderr, "sthread_future_spawn failed\n");
+          exit(1);
+        }
+      }
+      sthread_join_all(futures, width);
+      for (i = 0; i < width; i++)
+        sthread_future_free(futures[i]);
+      break;
+    case FAN_JOIN:
+      for (i = 0; i < width; i++)
+        threads[i] = create(child, (void*)(r * width + i), 1);
+      for (i = 0; i < width; i++)
+        sthread_join(threads[i]);
+      break;
+    case FAN_COUNTER:
+      remaining = width;
+      for (i = 0; i < width; i++)
+        create(child, (void*)(r * width + i), 0);
+      sthread_mutex_lock(lock);
+      while (remaining > 0)
+        sthread_cond_wait(cond, lock);
+      sthread_mutex_unlock(lock);
+      break;
+    }
+  }
+  elapsed = bench_now_ns() - start;
+  *wakeups = (double)(main_switches() - switches) / rounds;
+  free(futures);
+  free(threads);
+  return (double)elapsed / rounds;
+}
+
+int main(int argc, char **argv) {
+  int max_width, width, k;
+  long rounds, n;
+  double ns, wakeups, base;
+
+  max_width = (argc > 1) ? atoi(argv[1]) : 256;
+  if (max_width < 2)
+    max_width = 2;
+  rounds = (argc > 2) ? atol(argv[2]) : 2000;
+  yields = (argc > 3) ? atoi(argv[3]) : 16;
+  if (yields < 0)
+    yields = 0;
+
+  sthread_init();
+  lock = sthread_mutex_init();
+  cond = sthread_cond_init();
+
+  for (width = 2; width <= max_width; width *= 2) {
+    n = rounds / width;
+    if (n < 10)
+      n = 10;
+    base = 0;
+    for (k = FAN_COUNTER; k >= FAN_JOIN_ALL; k--) {
+      ns = run((fan_kind_t)k, width, n, &wakeups);
+      if (k == FAN_COUNTER)
+        base = ns;
+      printf("bench=future impl=%s kind=%s width=%d rounds=%ld "
+             "ns_per_fanout=%.1f wakeups_per_fanout=%.2f "
+             "speedup_vs_counter=%.2f\n", bench_impl_name(),
+             kind_names[k], width, n, ns, wakeups, base / ns);
+      fflush(stdout);
+    }
+  }
+
+  sthread_cond_free(cond);
+  sthread_mutex_free(lock);
+  return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * bench-latency.c - Measures how quickly interactive threads get to run
+ *                   while CPU-bound threads keep the workers busy.
+ *
+ * Usage: bench-latency [hogs [interactive [seconds]]]
+ *
+ * Starts a number of CPU-bound "hog" threads (default 4) that spin
+ * until the run is over, and a number of interactive threads (default
+ * 2) that repeatedly sleep for 1ms and record how late they woke up.
+ * After the given number of seconds (default 2) it reports percentiles
+ * of the wakeup latency, and how much work the hogs got done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+/* Interactive threads sleep this long, in microseconds. */
+#define SLEEP_USEC 1000
+
+/* Most samples each interactive thread keeps. */
+#define MAX_SAMPLES 100000
+
+static volatile int stop = 0;
+static volatile uint64_t hog_work = 0;
+
+static void *hog(void *arg) {
+  uint64_t i = 0, x = (uint64_t)(uintptr_t)arg | 1;
+
+  while (!stop) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    i++;
+  }
+  __sync_fetch_and_add(&hog_work, i);
+  return (void*)(uintptr_t)x;
+}
+
+typedef struct {
+  uint64_t *samples;   /* latencies, in nanoseconds */
+  int n;
+} interactive_t;
+
+static void *interactive(void *arg) {
+  interactive_t *it = (interactive_t*)arg;
+  uint64_t deadline, now;
+
+  while (!stop && it->n < MAX_SAMPLES) {
+    deadline = bench_now_ns() + SLEEP_USEC * 1000ULL;
+    sthread_sleep_usec(SLEEP_USEC);
+    now = bench_now_ns();
+    it->samples[it->n++] = (now > deadline) ? now - deadline : 0;
+  }
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  int nhogs, ninteractive, seconds, i, n;
+  sthread_t *threads;
+  interactive_t *its;
+  uint64_t *all, start, elapsed;
+
+  nhogs = (argc > 1) ? atoi(argv[1]) : 4;
+  ninteractive = (argc > 2) ? atoi(argv[2]) : 2;
+  seconds = (argc > 3) ? atoi(argv[3]) : 2;
+  if (nhogs < 0 || ninteractive < 1 || seconds < 1) {
+    fprintf(stderr, "usage: %s [hogs [interactive [seconds]]]\n", argv[0]);
+    return 1;
+  }
+
+  threads = malloc((nhogs + ninteractive) * sizeof(sthread_t));
+  its = calloc(ninteractive, sizeof(interactive_t));
+  if (threads == NULL || its == NULL) {
+    perror("malloc");
+    return 1;
+  }
+
+  sthread_init();
+  start = bench_now_ns();
+  for (i = 0; i < nhogs; i++)
+    threads[i] = sthread_create(hog, (void*)(uintptr_t)(i + 1), 1);
+  for (i = 0; i < ninteractive; i++) {
+    its[i].samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    if (its[i].samples == NULL) {
+      perror("malloc");
+      return 1;
+    }
+    threads[nhogs + i] = sthread_create(interactive, &its[i], 1);
+  }
+  for (i = 0; i < nhogs + ninteractive; i++) {
+    if (threads[i] == NULL) {
+      fprintf(stderr, "sthread_create failed\n");
+      return 1;
+    }
+  }
+
+  sthread_sleep_usec(seconds * 1000000UL);
+  stop = 1;
+  for (i = 0; i < nhogs + ninteractive; i++)
+    sthread_join(threads[i]);
+  elapsed = bench_now_ns() - start;
+
+  for (n = 0, i = 0; i < ninteractive; i++)
+    n += its[i].n;
+  all = malloc((n + 1) * sizeof(uint64_t));
+  if (all == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  for (n = 0, i = 0; i < ninteractive; i++) {
+    memcpy(all + n, its[i].samples, its[i].n * sizeof(uint64_t));
+    n += its[i].n;
+  }
+  if (n == 0) {
+    fprintf(stderr, "no samples\n");
+    return 1;
+  }
+  qsort(all, n, sizeof(uint64_t), compare_u64);
+
+  printf("bench=latency impl=%s hogs=%d interactive=%d sleep_us=%d "
+         "samples=%d p50_us=%.1f p99_us=%.1f max_us=%.1f "
+         "hog_work_per_ms=%.0f\n", bench_impl_name(), nhogs, ninteractive,
+         SLEEP_USEC, n, all[n / 2] / 1000.0, all[(n * 99) / 100] / 1000.0,
+         all[n - 1] / 1000.0, (double)hog_work / (elapsed / 1000000.0));
+  return 0;
+}
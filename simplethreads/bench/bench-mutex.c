@@ -0,0 +1,118 @@
+/*
+ * bench-mutex.c - Measures the cost of sthread mutexes, uncontended and
+ *                 contended.
+ *
+ * Usage: bench-mutex [max_threads [iterations]]
+ *
+ * For each thread count from 1 up to max_threads (default 4), doubling
+ * each time, every thread takes and releases a mutex iterations times
+ * (default 1000000) around a short critical section, with a little work
+ * between critical sections. One thread measures the uncontended path;
+ * more measure hand-off under contention.
+ *
+ * With the pthread implementation, the same runs are repeated with a
+ * plain glibc pthread_mutex_t as a baseline. (User threads can't use a
+ * pthread_mutex_t: a worker that blocks on one stops all of the threads
+ * it runs, including the holder.)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+typedef enum { LOCK_STHREAD, LOCK_GLIBC } lock_kind_t;
+
+static lock_kind_t kind;
+static long iterations;
+static sthread_mutex_t smutex;
+static pthread_mutex_t pmutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile uint64_t shared;
+
+/* A few rounds of xorshift, standing in for work done with or without
+ * the lock held. */
+static inline uint64_t work(uint64_t x, int rounds) {
+  while (rounds-- > 0) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+  }
+  return x;
+}
+
+static void *locker(void *arg) {
+  uint64_t x = (uint64_t)(uintptr_t)arg | 1;
+  long i;
+
+  for (i = 0; i < iterations; i++) {
+    if (kind == LOCK_STHREAD)
+      sthread_mutex_lock(smutex);
+    else
+      pthread_mutex_lock(&pmutex);
+    shared = work(shared + 1, 4);
+    if (kind == LOCK_STHREAD)
+      sthread_mutex_unlock(smutex);
+    else
+      pthread_mutex_unlock(&pmutex);
+    x = work(x, 16);
+  }
+  return (void*)(uintptr_t)x;
+}
+
+/* Returns the average time per lock/unlock pair, in nanoseconds. */
+static double run(lock_kind_t k, int nthreads) {
+  sthread_t threads[nthreads];
+  uint64_t start, elapsed;
+  int i;
+
+  kind = k;
+  start = bench_now_ns();
+  for (i = 0; i < nthreads; i++) {
+    threads[i] = sthread_create(locker, (void*)(uintptr_t)(i + 1), 1);
+    if (threads[i] == NULL) {
+      fprintf(stderr, "sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    sthread_join(threads[i]);
+  elapsed = bench_now_ns() - start;
+
+  return (double)elapsed / ((double)iterations * nthreads);
+}
+
+int main(int argc, char **argv) {
+  int max_threads, n, glibc;
+  double ns, base;
+
+  max_threads = (argc > 1) ? atoi(argv[1]) : 4;
+  if (max_threads < 1)
+    max_threads = 1;
+  iterations = (argc > 2) ? atol(argv[2]) : 1000000;
+  if (iterations < 1)
+    iterations = 1;
+
+  sthread_init();
+  smutex = sthread_mutex_init();
+  glibc = (sthread_get_impl() == STHREAD_PTHREAD_IMPL);
+
+  for (n = 1; n <= max_threads; n *= 2) {
+    ns = run(LOCK_STHREAD, n);
+    printf("bench=mutex impl=%s lock=sthread threads=%d iterations=%ld "
+           "ns_per_op=%.1f\n", bench_impl_name(), n, iterations, ns);
+    if (glibc) {
+      base = run(LOCK_GLIBC, n);
+      printf("bench=mutex impl=%s lock=glibc threads=%d iterations=%ld "
+             "ns_per_op=%.1f sthread_speedup=%.2f\n", bench_impl_name(), n,
+             iterations, base, base / ns);
+    }
+    fflush(stdout);
+  }
+
+  sthread_mutex_free(smutex);
+  return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * bench-preempt.c - Measures what timer preemption costs CPU-bound
+ *                   threads.
+ *
+ * Usage: bench-preempt [threads [work]]
+ *
+ * A fixed amount of CPU-bound work (default 200000000 iterations of a
+ * xorshift loop) is timed three ways:
+ *
+ *   - baseline: by the main thread, before sthread_init(), so with no
+ *     timer running at all.
+ *
+ *   - alone: by a single sthread, which takes timer interrupts but has
+ *     nobody to be preempted for.
+ *
+ *   - shared: split between a number of sthreads (default 4), which the
+ *     timer preempts in favour of one another.
+ *
+ * Overheads are relative to the baseline; the shared run's is also
+ * given per involuntary switch, as counted by sthread_stats_snapshot().
+ * They are small enough to be lost in the noise (and come out negative)
+ * unless the machine is quiet. With one CPU per thread or more, the
+ * threads may never be preempted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+static const uint64_t DEFAULT_WORK = 200000000ULL;
+static const int DEFAULT_THREADS = 4;
+
+/* Timed runs of each kind; the fastest counts. */
+#define RUNS 3
+
+static uint64_t spin(uint64_t n, uint64_t x) {
+  while (n-- > 0) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+  }
+  return x;
+}
+
+static volatile uint64_t sink;
+
+static void *spinner(void *arg) {
+  sink = spin((uint64_t)(uintptr_t)arg, (uint64_t)(uintptr_t)&arg | 1);
+  return NULL;
+}
+
+/* Run work split over nthreads sthreads. Returns the elapsed time, and
+ * adds the preemptions and timer interrupts during the run to *switches
+ * and *interrupts. */
+static uint64_t run_threads(int nthreads, uint64_t work,
+                            unsigned long long *switches,
+                            unsigned long long *interrupts) {
+  sthread_stats_t *before, *after;
+  sthread_t *threads;
+  uint64_t start, elapsed;
+  int i;
+
+  threads = malloc(nthreads * sizeof(sthread_t));
+  if (threads == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  before = sthread_stats_snapshot();
+  start = bench_now_ns();
+  for (i = 0; i < nthreads; i++) {
+    threads[i] = sthread_create(spinner, (void*)(uintptr_t)(work / nthreads),
+                                1);
+    if (threads[i] == NULL) {
+      printf("sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    sthread_join(threads[i]);
+  elapsed = bench_now_ns() - start;
+  after = sthread_stats_snapshot();
+
+  *switches += after->total.involuntary_switches -
+               before->total.involuntary_switches;
+  *interrupts += after->interrupts - before->interrupts;
+  sthread_stats_free(before);
+  sthread_stats_free(after);
+  free(threads);
+  return elapsed;
+}
+
+static double overhead_pct(uint64_t t, uint64_t baseline) {
+  return 100.0 * ((double)t - (double)baseline) / (double)baseline;
+}
+
+int main(int argc, char **argv) {
+  unsigned long long switches = 0, interrupts = 0;
+  uint64_t work, baseline = 0, alone = 0, shared = 0, t, start;
+  int nthreads, i;
+
+  nthreads = (argc > 1) ? atoi(argv[1]) : DEFAULT_THREADS;
+  work = (argc > 2) ? strtoull(argv[2], NULL, 10) : DEFAULT_WORK;
+  if (nthreads < 1 || work < (uint64_t)nthreads) {
+    fprintf(stderr, "usage: %s [threads [work]]\n", argv[0]);
+    return 1;
+  }
+
+  for (i = 0; i < RUNS; i++) {
+    start = bench_now_ns();
+    sink = spin(work, start | 1);
+    t = bench_now_ns() - start;
+    if (baseline == 0 || t < baseline)
+      baseline = t;
+  }
+
+  sthread_init();
+  for (i = 0; i < RUNS; i++) {
+    t = run_threads(1, work, &switches, &interrupts);
+    if (alone == 0 || t < alone)
+      alone = t;
+  }
+  printf("bench=preempt mode=alone impl=%s work=%llu baseline_ms=%.1f "
+         "ms=%.1f overhead_pct=%.2f interrupts_per_run=%llu\n",
+         bench_impl_name(), (unsigned long long)work, baseline / 1e6,
+         alone / 1e6, overhead_pct(alone, baseline), interrupts / RUNS);
+
+  switches = interrupts = 0;
+  for (i = 0; i < RUNS; i++) {
+    t = run_threads(nthreads, work, &switches, &interrupts);
+    if (shared == 0 || t < shared)
+      shared = t;
+  }
+  printf("bench=preempt mode=shared impl=%s threads=%d work=%llu "
+         "ms=%.1f overhead_pct=%.2f preemptions_per_run=%llu "
+         "ns_per_preemption=%.0f\n", bench_impl_name(), nthreads,
+         (unsigned long long)work, shared / 1e6,
+         overhead_pct(shared, baseline), switches / RUNS,
+         (switches > 0) ? ((double)shared - (double)baseline) /
+                          ((double)switches / RUNS) : 0.0);
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * bench-rwlock.c - Measures how read-mostly access to a shared table
+ *                  scales with a reader-writer lock, compared to a mutex.
+ *
+ * Usage: bench-rwlock [max_threads [iterations [writes_per_1000]]]
+ *
+ * For each thread count from 1 up to max_threads (default 4), doubling
+ * each time, every thread does iterations (default 200000) operations on
+ * a small table: writes_per_1000 (default 10) of each 1000 update an
+ * entry, and the rest look a few entries up. The same runs are made with
+ * the table guarded by an sthread_mutex_t, and by an sthread_rwlock_t
+ * preferring readers and preferring writers. With more than one worker
+ * (or with pthreads on several CPUs), lookups under the rwlock proceed
+ * in parallel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+#define TABLE_SIZE 256
+
+typedef enum {
+  LOCK_MUTEX, LOCK_RWLOCK_READERS, LOCK_RWLOCK_WRITERS
+} lock_kind_t;
+
+static const char *lock_names[] = { "mutex", "rwlock-readers",
+                                    "rwlock-writers" };
+
+static lock_kind_t kind;
+static long iterations;
+static int writes_per_1000;
+static sthread_mutex_t mutex;
+static sthread_rwlock_t rwlock;
+static uint64_t table[TABLE_SIZE];
+
+static inline uint64_t next_random(uint64_t x) {
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+/* Stands in for the work of a lookup: a few dependent table reads. */
+static uint64_t lookup(uint64_t key) {
+  int i;
+
+  for (i = 0; i < 8; i++)
+    key = next_random(key + table[key % TABLE_SIZE]);
+  return key;
+}
+
+static void *worker(void *arg) {
+  uint64_t x = (uint64_t)(uintptr_t)arg | 1, sum = 0;
+  long i;
+
+  for (i = 0; i < iterations; i++) {
+    x = next_random(x);
+    if ((int)(x % 1000) < writes_per_1000) {
+      if (kind == LOCK_MUTEX)
+        sthread_mutex_lock(mutex);
+      else
+        sthread_rwlock_wrlock(rwlock);
+      table[(x >> 16) % TABLE_SIZE] = x;
+      if (kind == LOCK_MUTEX)
+        sthread_mutex_unlock(mutex);
+      else
+        sthread_rwlock_unlock(rwlock);
+    } else {
+      if (kind == LOCK_MUTEX)
+        sthread_mutex_lock(mutex);
+      else
+        sthread_rwlock_rdlock(rwlock);
+      sum += lookup(x);
+      if (kind == LOCK_MUTEX)
+        sthread_mutex_unlock(mutex);
+      else
+        sthread_rwlock_unlock(rwlock);
+    }
+  }
+  return (void*)(uintptr_t)sum;
+}
+
+/* Returns the average time per operation, in nanoseconds. */
+static double run(lock_kind_t k, int nthreads) {
+  sthread_t threads[nthreads];
+  uint64_t start, elapsed;
+  int i;
+
+  kind = k;
+  if (k != LOCK_MUTEX)
+    rwlock = sthread_rwlock_init((k == LOCK_RWLOCK_READERS) ?
+                                 STHREAD_RWLOCK_PREFER_READERS :
+                                 STHREAD_RWLOCK_PREFER_WRITERS);
+  start = bench_now_ns();
+  for (i = 0; i < nthreads; i++) {
+    threads[i] = sthread_create(worker, (void*)(uintptr_t)(i + 1), 1);
+    if (threads[i] == NULL) {
+      fprintf(stderr, "sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    sthread_join(threads[i]);
+  elapsed = bench_now_ns() - start;
+  if (k != LOCK_MUTEX)
+    sthread_rwlock_free(rwlock);
+
+  return (double)elapsed / ((double)iterations * nthreads);
+}
+
+int main(int argc, char **argv) {
+  int max_threads, n, k;
+  double ns, base;
+
+  max_threads = (argc > 1) ? atoi(argv[1]) : 4;
+  if (max_threads < 1)
+    max_threads = 1;
+  iterations = (argc > 2) ? atol(argv[2]) : 200000;
+  if (iterations < 1)
+    iterations = 1;
+  writes_per_1000 = (argc > 3) ? atoi(argv[3]) : 10;
+  if (writes_per_1000 < 0 || writes_per_1000 > 1000)
+    writes_per_1000 = 10;
+
+  sthread_init();
+  mutex = sthread_mutex_init();
+
+  for (n = 1; n <= max_threads; n *= 2) {
+    base = 0;
+    for (k = LOCK_MUTEX; k <= LOCK_RWLOCK_WRITERS; k++) {
+      ns = run((lock_kind_t)k, n);
+      if (k == LOCK_MUTEX)
+        base = ns;
+      printf("bench=rwlock impl=%s lock=%s threads=%d iterations=%ld "
+             "writes_per_1000=%d ns_per_op=%.1f mops_per_sec=%.2f "
+             "speedup_vs_mutex=%.2f\n", bench_impl_name(), lock_names[k], n,
+             iterations, writes_per_1000, ns, 1000.0 / ns, base / ns);
+      fflush(stdout);
+    }
+  }
+
+  sthread_mutex_free(mutex);
+  return 0;
+}
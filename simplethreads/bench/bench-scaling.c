@@ -0,0 +1,125 @@
+/*
+ * bench-scaling.c - Measures how CPU-bound user threads scale with the
+ *                   number of workers (kernel threads) they run on.
+ *
+ * Usage: bench-scaling [max_workers [threads]]
+ *
+ * For each worker count from 1 to max_workers (default: the number of
+ * online CPUs), a child process is started with STHREAD_WORKERS set,
+ * which runs a fixed amount of CPU-bound work split over a number of
+ * threads (default: 4 per worker at max_workers) and reports how long
+ * that took.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+/* Total work, in iterations of the inner loop of spin(). */
+static const uint64_t TOTAL_WORK = 100000000ULL;
+
+static uint64_t work_per_thread;
+
+/* Stands in for real computation: a xorshift generator that the
+ * compiler can't throw away. */
+static void *spin(void *arg) {
+  uint64_t i, x = (uint64_t)(uintptr_t)arg | 1;
+
+  for (i = 0; i < work_per_thread; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+  }
+  return (void*)(uintptr_t)x;
+}
+
+/* Run the workload with the given number of workers, in the calling
+ * (child) process. Returns the elapsed time in nanoseconds. */
+static uint64_t run(int nthreads) {
+  sthread_t *threads;
+  uint64_t start, elapsed;
+  int i;
+
+  threads = malloc(nthreads * sizeof(sthread_t));
+  if (threads == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  work_per_thread = TOTAL_WORK / nthreads;
+
+  sthread_init();
+  start = bench_now_ns();
+  for (i = 0; i < nthreads; i++) {
+    threads[i] = sthread_create(spin, (void*)(uintptr_t)(i + 1), 1);
+    if (threads[i] == NULL) {
+      fprintf(stderr, "sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    sthread_join(threads[i]);
+  elapsed = bench_now_ns() - start;
+
+  free(threads);
+  return elapsed;
+}
+
+int main(int argc, char **argv) {
+  int max_workers, nthreads, n, status, fds[2];
+  uint64_t elapsed, base = 0;
+  char workers_env[16];
+  pid_t pid;
+
+  max_workers = (argc > 1) ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_workers < 1)
+    max_workers = 1;
+  nthreads = (argc > 2) ? atoi(argv[2]) : 4 * max_workers;
+  if (nthreads < 1)
+    nthreads = 1;
+
+  /* sthread_init() can only be called once per process, so each
+   * configuration runs in its own child. */
+  for (n = 1; n <= max_workers; n++) {
+    if (pipe(fds) != 0) {
+      perror("pipe");
+      return 1;
+    }
+    pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      snprintf(workers_env, sizeof(workers_env), "%d", n);
+      setenv("STHREAD_WORKERS", workers_env, 1);
+      elapsed = run(nthreads);
+      if (write(fds[1], &elapsed, sizeof(elapsed)) != sizeof(elapsed))
+        _exit(1);
+      _exit(0);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], &elapsed, sizeof(elapsed)) != sizeof(elapsed)) {
+      fprintf(stderr, "bench-scaling: child for %d workers failed\n", n);
+      return 1;
+    }
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    if (n == 1)
+      base = elapsed;
+    printf("bench=scaling impl=%s workers=%d threads=%d elapsed_ms=%.2f "
+           "speedup=%.2f\n", bench_impl_name(), n, nthreads,
+           elapsed / 1e6, (double)base / elapsed);
+    fflush(stdout);
+  }
+  return 0;
+}
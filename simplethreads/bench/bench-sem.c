@@ -0,0 +1,143 @@
+/*
+ * bench-sem.c - Measures a contended counting semaphore: sthread_sem_t,
+ *               and one built out of a mutex, a condition variable and
+ *               a counter.
+ *
+ * Usage: bench-sem [max_threads [operations [units]]]
+ *
+ * The semaphore stands for a pool of units (default 4) resources. For
+ * each thread count from 2 up to max_threads (default 1024), doubling
+ * each time, the threads share operations (default 200000) turns at the
+ * pool between them: each waits for a unit, yields while holding it, as
+ * if it were waiting for the resource, and posts it back. The emulated
+ * semaphore signals its condition variable once per post, so a post
+ * wakes one waiter, which must then take the mutex and find the unit
+ * still there. The times include creating and joining the threads,
+ * which is the same for both.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+typedef enum { SEM_NATIVE, SEM_EMULATED } sem_kind_t;
+
+static const char *kind_names[] = { "native", "emulated" };
+
+static sem_kind_t kind;
+static long turns;
+static sthread_sem_t sem;
+
+/* The emulated semaphore. */
+static sthread_mutex_t lock;
+static sthread_cond_t cond;
+static unsigned int value;
+
+static void emulated_wait(void) {
+  sthread_mutex_lock(lock);
+  while (value == 0)
+    sthread_cond_wait(cond, lock);
+  value--;
+  sthread_mutex_unlock(lock);
+}
+
+static void emulated_post(void) {
+  sthread_mutex_lock(lock);
+  value++;
+  sthread_cond_signal(cond);
+  sthread_mutex_unlock(lock);
+}
+
+static void *worker(void *arg) {
+  long i;
+
+  for (i = 0; i < turns; i++) {
+    if (kind == SEM_NATIVE) {
+      sthread_sem_wait(sem);
+      sthread_yield();
+      sthread_sem_post(sem);
+    } else {
+      emulated_wait();
+      sthread_yield();
+      emulated_post();
+    }
+  }
+  return NULL;
+}
+
+/* Returns the average time per turn at the pool, in nanoseconds. */
+static double run(sem_kind_t k, int nthreads, unsigned int units) {
+  sthread_t *threads;
+  uint64_t start, elapsed;
+  int i;
+
+  threads = malloc(nthreads * sizeof(sthread_t));
+  if (threads == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  kind = k;
+  if (k == SEM_NATIVE)
+    sem = sthread_sem_init(units);
+  value = units;
+  start = bench_now_ns();
+  for (i = 0; i < nthreads; i++) {
+    threads[i] = sthread_create(worker, NULL, 1);
+    if (threads[i] == NULL) {
+      fprintf(stderr, "sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    sthread_join(threads[i]);
+  elapsed = bench_now_ns() - start;
+  if (k == SEM_NATIVE)
+    sthread_sem_free(sem);
+  free(threads);
+
+  return (double)elapsed / ((double)turns * nthreads);
+}
+
+int main(int argc, char **argv) {
+  int max_threads, n, k;
+  long operations;
+  unsigned int units;
+  double ns, base;
+
+  max_threads = (argc > 1) ? atoi(argv[1]) : 1024;
+  if (max_threads < 2)
+    max_threads = 2;
+  operations = (argc > 2) ? atol(argv[2]) : 200000;
+  units = (argc > 3) ? (unsigned int)atoi(argv[3]) : 4;
+  if (units < 1)
+    units = 1;
+
+  sthread_init();
+  lock = sthread_mutex_init();
+  cond = sthread_cond_init();
+
+  for (n = 2; n <= max_threads; n *= 2) {
+    turns = operations / n;
+    if (turns < 10)
+      turns = 10;
+    base = 0;
+    for (k = SEM_EMULATED; k >= SEM_NATIVE; k--) {
+      ns = run((sem_kind_t)k, n, units);
+      if (k == SEM_EMULATED)
+        base = ns;
+      printf("bench=sem impl=%s kind=%s threads=%d units=%u turns=%ld "
+             "ns_per_turn=%.1f speedup_vs_emulated=%.2f\n",
+             bench_impl_name(), kind_names[k], n, units, turns, ns,
+             base / ns);
+      fflush(stdout);
+    }
+  }
+
+  sthread_cond_free(cond);
+  sthread_mutex_free(lock);
+  return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * bench-switch.c - Measures the cost of a context switch by ping-ponging
+ *                  between two contexts.
+ *
+ * Usage: bench-switch [iterations]
+ *
+ * Two measurements are made:
+ *
+ *   - raw: two bare contexts switch back and forth directly, once with
+ *     the library's Xsthread_switch and once with a copy of the original
+ *     x86_64 routine, which saved all 15 general-purpose registers (and
+ *     no FPU state). This isolates the cost of the switch routine itself.
+ *
+ *   - yield: two sthreads call sthread_yield() in turn, which includes
+ *     the scheduler's overhead.
+ *
+ * Each round trip is two switches; results are per switch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+static const long DEFAULT_ITERATIONS = 10000000;
+
+static long iterations;
+
+#ifdef __x86_64__
+
+typedef void (*switch_func_t)(char **old_sp, char *new_sp);
+
+/* The library's switch routine, from sthread_switch_x86_64.h. */
+void Xsthread_switch(char **old_sp, char *new_sp);
+
+/* The x86_64 switch routine as it was before it was reduced to the
+ * callee-saved registers, for comparison. */
+void bench_switch_full(char **old_sp, char *new_sp);
+__asm__(
+    ".text\n"
+    ".globl bench_switch_full\n"
+    "bench_switch_full:\n"
+    "  push %rax\n  push %rbx\n  push %rcx\n  push %rdx\n  push %rdi\n"
+    "  push %rsi\n  push %rbp\n  push %r8\n  push %r9\n  push %r10\n"
+    "  push %r11\n  push %r12\n  push %r13\n  push %r14\n  push %r15\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq %rsi, %rsp\n"
+    "  pop %r15\n  pop %r14\n  pop %r13\n  pop %r12\n  pop %r11\n"
+    "  pop %r10\n  pop %r9\n  pop %r8\n  pop %rbp\n  pop %rsi\n"
+    "  pop %rdi\n  pop %rdx\n  pop %rcx\n  pop %rbx\n  pop %rax\n"
+    "  ret\n");
+
+/* Bytes each routine saves below the return address. */
+#define FULL_CONTEXT_SIZE (15 * 8)
+#define CALLEE_CONTEXT_SIZE (7 * 8)
+
+#define STACK_SIZE (64 * 1024)
+
+static switch_func_t switch_func;
+static char *main_sp, *co_sp;
+
+/* The other end of the ping-pong: switch straight back, forever. */
+static void co_loop(void) {
+  for (;;)
+    switch_func(&co_sp, main_sp);
+}
+
+/* Set up co_sp as if co_loop() had been switched away from by a routine
+ * that saves context_size bytes. For the callee-saved routine, the
+ * first 8 of those bytes are MXCSR and the x87 control word. */
+static void co_init(char *stack, size_t context_size) {
+  char *sp = stack + STACK_SIZE - 16;
+
+  sp -= 8;                       /* co_loop's (fake) return address */
+  sp -= sizeof(void*);
+  *(void**)sp = (void*)co_loop;
+  sp -= context_size;
+  memset(sp, 0, context_size);
+  if (context_size == CALLEE_CONTEXT_SIZE)
+    __asm__ __volatile__("stmxcsr (%0)\n\tfnstcw 4(%0)" : : "r"(sp)
+                         : "memory");
+  co_sp = sp;
+}
+
+/* Time iterations round trips with the given routine. Returns
+ * nanoseconds per switch. */
+static double raw_run(switch_func_t func, size_t context_size) {
+  static char stack[STACK_SIZE] __attribute__((aligned(16)));
+  uint64_t start, elapsed;
+  long i;
+
+  switch_func = func;
+  co_init(stack, context_size);
+  start = bench_now_ns();
+  for (i = 0; i < iterations; i++)
+    switch_func(&main_sp, co_sp);
+  elapsed = bench_now_ns() - start;
+  return (double)elapsed / (2.0 * iterations);
+}
+
+static void raw_bench(void) {
+  double full, callee;
+
+  /* Warm up, then measure each routine. */
+  raw_run(bench_switch_full, FULL_CONTEXT_SIZE);
+  full = raw_run(bench_switch_full, FULL_CONTEXT_SIZE);
+  callee = raw_run(Xsthread_switch, CALLEE_CONTEXT_SIZE);
+
+  printf("bench=switch mode=raw routine=full-gpr context_bytes=%d "
+         "iterations=%ld ns_per_switch=%.2f\n", FULL_CONTEXT_SIZE,
+         iterations, full);
+  printf("bench=switch mode=raw routine=callee-saved context_bytes=%d "
+         "iterations=%ld ns_per_switch=%.2f speedup=%.2f\n",
+         CALLEE_CONTEXT_SIZE, iterations, callee, full / callee);
+}
+
+#else
+
+static void raw_bench(void) {
+  printf("bench=switch mode=raw skipped=not-x86_64\n");
+}
+
+#endif /* __x86_64__ */
+
+static void *yielder(void *arg) {
+  long i;
+
+  for (i = 0; i < iterations; i++)
+    sthread_yield();
+  return NULL;
+}
+
+static void yield_bench(void) {
+  sthread_t a, b;
+  uint64_t start, elapsed;
+
+  sthread_init();
+  start = bench_now_ns();
+  a = sthread_create(yielder, NULL, 1);
+  b = sthread_create(yielder, NULL, 1);
+  if (a == NULL || b == NULL) {
+    printf("sthread_create failed\n");
+    exit(1);
+  }
+  sthread_join(a);
+  sthread_join(b);
+  elapsed = bench_now_ns() - start;
+
+  printf("bench=switch mode=yield impl=%s iterations=%ld "
+         "ns_per_switch=%.2f\n", bench_impl_name(), iterations,
+         (double)elapsed / (2.0 * iterations));
+}
+
+int main(int argc, char **argv) {
+  iterations = (argc > 1) ? atol(argv[1]) : DEFAULT_ITERATIONS;
+  if (iterations < 1)
+    iterations = DEFAULT_ITERATIONS;
+
+  raw_bench();
+  yield_bench();
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * bench-task.c - Measures running many small pieces of work as tasks,
+ *                compared to a thread apiece.
+ *
+ * Usage: bench-task [units [batch [fib]]]
+ *
+ * The main thread runs units (default 200000) pieces of work, each
+ * summing a small array, batch (default 1000) at a time: it starts a
+ * batch, then waits for all of it. The pieces are, in turn, tasks
+ * (sthread_task_spawn() and sthread_task_wait()) and joinable threads
+ * (sthread_create() and sthread_join()). The result is the time per
+ * piece. Then it computes Fibonacci number fib (default 24) with a task
+ * for each call, which waits for the tasks it spawns, and reports the
+ * time per task.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#include "bench.h"
+
+#define WORK 64
+
+typedef enum { UNIT_TASK, UNIT_THREAD } unit_kind_t;
+
+static const char *kind_names[] = { "task", "thread" };
+
+static int work[WORK];
+
+static void *unit(void *arg) {
+  intptr_t sum = 0;
+  int i;
+
+  for (i = 0; i < WORK; i++)
+    sum += work[i];
+  return (void*)sum;
+}
+
+/* Returns the average time per unit, in nanoseconds. */
+static double run(unit_kind_t k, long units, int batch) {
+  sthread_task_t *tasks;
+  sthread_t *threads;
+  uint64_t start, elapsed;
+  long done;
+  int i, n;
+
+  tasks = malloc(batch * sizeof(sthread_task_t));
+  threads = malloc(batch * sizeof(sthread_t));
+  if (tasks == NULL || threads == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  start = bench_now_ns();
+  for (done = 0; done < units; done += n) {
+    n = (units - done < batch) ? (int)(units - done) : batch;
+    if (k == UNIT_TASK) {
+      for (i = 0; i < n; i++)
+        tasks[i] = sthread_task_spawn(unit, NULL);
+      for (i = 0; i < n; i++)
+        sthread_task_wait(tasks[i]);
+    } else {
+      for (i = 0; i < n; i++) {
+        threads[i] = sthread_create(unit, NULL, 1);
+        if (threads[i] == NULL) {
+          fprintf(stderr, "sthread_create failed\n");
+          exit(1);
+        }
+      }
+      for (i = 0; i < n; i++)
+        sthread_join(threads[i]);
+    }
+  }
+  elapsed = bench_now_ns() - start;
+  free(tasks);
+  free(threads);
+  return (double)elapsed / units;
+}
+
+static volatile long fib_tasks;
+
+static void *fib(void *arg) {
+  intptr_t n = (intptr_t)arg, a;
+  sthread_task_t t;
+
+  if (n < 2)
+    return (void*)n;
+  __sync_fetch_and_add(&fib_tasks, 1);
+  t = sthread_task_spawn(fib, (void*)(n - 1));
+  a = (intptr_t)fib((void*)(n - 2));
+  return (void*)(a + (intptr_t)sthread_task_wait(t));
+}
+
+int main(int argc, char **argv) {
+  long units;
+  int batch, n, k, i;
+  double ns, base = 0;
+  uint64_t start, elapsed;
+  intptr_t result;
+  sthread_task_t t;
+
+  units = (argc > 1) ? atol(argv[1]) : 200000;
+  batch = (argc > 2) ? atoi(argv[2]) : 1000;
+  n = (argc > 3) ? atoi(argv[3]) : 24;
+  if (units < 1 || batch < 1 || n < 2) {
+    fprintf(stderr, "usage: %s [units [batch [fib]]]\n", argv[0]);
+    return 1;
+  }
+  for (i = 0; i < WORK; i++)
+    work[i] = i;
+
+  sthread_init();
+
+  for (k = UNIT_THREAD; k >= UNIT_TASK; k--) {
+    ns = run((unit_kind_t)k, units, batch);
+    if (k == UNIT_THREAD)
+      base = ns;
+    printf("bench=task impl=%s kind=%s units=%ld batch=%d "
+           "ns_per_unit=%.1f speedup_vs_thread=%.2f\n", bench_impl_name(),
+           kind_names[k], units, batch, ns, base / ns);
+    fflush(stdout);
+  }
+
+  start = bench_now_ns();
+  t = sthread_task_spawn(fib, (void*)(intptr_t)n);
+  result = (intptr_t)sthread_task_wait(t);
+  elapsed = bench_now_ns() - start;
+  printf("bench=task impl=%s kind=fib n=%d result=%ld tasks=%ld "
+         "ns_per_task=%.1f\n", bench_impl_name(), n, (long)result,
+         fib_tasks + 1, (double)elapsed / (fib_tasks + 1));
+  return 0;
+}
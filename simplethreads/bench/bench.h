@@ -0,0 +1,29 @@
+/*
+ * bench.h - Small helpers shared by the sthread benchmarks.
+ *
+ * Every benchmark prints its results as lines of space-separated
+ * key=value pairs, starting with bench=<name>, so that they can be
+ * collected and compared by scripts.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sthread.h>
+
+/* Current time in nanoseconds, from the monotonic clock. */
+static inline uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Name of the sthread implementation in use, for the impl= field. */
+static inline const char *bench_impl_name(void) {
+  return sthread_get_impl_name();
+}
+
+#endif /* BENCH_H */
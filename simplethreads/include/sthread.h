@@ -7,6 +7,11 @@
 #ifndef STHREAD_H
 #define STHREAD_H 1
 
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
 /* Define the sthread_t type (a pointer to an _sthread structure)
  * without knowing how it is actually implemented (that detail is
  * hidden from the public API).
@@ -18,14 +23,20 @@ typedef void *(*sthread_start_func_t)(void *);
 
 /* Sthreads supports multiple implementations, so that one can test
  * programs with different kinds of threads (e.g. compare kernel to user
- * threads). This enum represents an implementation choice. (Which
- * is actually a compile time choice.)
+ * threads). This enum represents an implementation choice. Every
+ * program has them all; which one it uses is chosen when it starts, by
+ * the STHREAD_IMPL environment variable: "user" for user-level threads,
+ * "mn" for user-level threads on a kernel thread per CPU, or "pthread".
+ * The default is set by configure (--with-pthreads).
  */
 typedef enum { STHREAD_PTHREAD_IMPL, STHREAD_USER_IMPL } sthread_impl_t;
 
-/* Return the implementation that was selected at compile time. */
+/* Return the implementation in use ("mn" is STHREAD_USER_IMPL). */
 sthread_impl_t sthread_get_impl(void);
 
+/* Return the name of the implementation in use, as for STHREAD_IMPL. */
+const char *sthread_get_impl_name(void);
+
 /* 
  * Perform any initialization needed. Should be called exactly
  * once, before any other sthread functions (sthread_get_impl 
@@ -42,6 +53,65 @@ void sthread_init();
 sthread_t sthread_create(sthread_start_func_t start_routine, void *arg,
 		int joinable);
 
+/**********************************************************************/
+/* Thread Attributes                                                  */
+/**********************************************************************/
+
+/* Optional settings for a new thread, for use with sthread_create_attr.
+ * An attribute object can be used to create any number of threads, and
+ * may be freed as soon as sthread_create_attr returns.
+ */
+typedef struct _sthread_attr *sthread_attr_t;
+
+/* Threads have one of STHREAD_PRIORITY_LEVELS priorities. 0 is the
+ * highest, and threads get STHREAD_PRIORITY_DEFAULT unless told
+ * otherwise. */
+#define STHREAD_PRIORITY_LEVELS 4
+#define STHREAD_PRIORITY_DEFAULT 1
+
+/* Longest thread name, including the terminating NUL. Longer names
+ * are truncated. */
+#define STHREAD_NAME_MAX 16
+
+/* Smallest stack size; smaller sizes are rounded up to it. */
+#define STHREAD_STACK_MIN (16 * 1024)
+
+/* Return a new attribute object holding the defaults: the default stack
+ * size, no name, STHREAD_PRIORITY_DEFAULT, and no affinity. */
+sthread_attr_t sthread_attr_init(void);
+
+/* Free an attribute object. Threads created with it are not affected. */
+void sthread_attr_free(sthread_attr_t attr);
+
+/* Set the size of the new thread's stack, in bytes. 0 means the
+ * default size. */
+void sthread_attr_setstacksize(sthread_attr_t attr, size_t size);
+
+/* Set the new thread's name, for debuggers and tools. The name is
+ * copied. */
+void sthread_attr_setname(sthread_attr_t attr, const char *name);
+
+/* Set the new thread's priority, from 0 (highest) to
+ * STHREAD_PRIORITY_LEVELS - 1 (lowest). */
+void sthread_attr_setpriority(sthread_attr_t attr, int priority);
+
+/* Ask for the new thread to run on the given CPU, or on no particular
+ * CPU if cpu is -1. This is only a hint: the user-level threads treat
+ * it as a preferred worker, and may still run the thread elsewhere. */
+void sthread_attr_setaffinity(sthread_attr_t attr, int cpu);
+
+/* Like sthread_create, but with the settings in attr. A NULL attr
+ * means the defaults. */
+sthread_t sthread_create_attr(sthread_start_func_t start_routine, void *arg,
+		int joinable, sthread_attr_t attr);
+
+/* Change the priority of thread t, or of the calling thread if t is
+ * NULL, as with sthread_attr_setpriority. The user-level threads treat
+ * it as the highest priority the thread can have: a thread that keeps
+ * using the CPU for a whole time slice drops below it, and comes back
+ * up as it blocks. */
+void sthread_set_priority(sthread_t t, int priority);
+
 /* Exit the calling thread with return value ret.
  * Note: In this version of simplethreads, there is no way
  * to retrieve the return value.
@@ -53,6 +123,11 @@ void sthread_exit(void *ret);
  */
 void sthread_yield(void);
 
+/* Block the calling thread for at least usec microseconds, without
+ * using the CPU in the meantime.
+ */
+void sthread_sleep_usec(unsigned long usec);
+
 /* Wait until the specified thread has exited.
  * Returns the value returned by that thread's
  * start function.  Results are undefined if
@@ -62,7 +137,35 @@ void sthread_yield(void);
 void* sthread_join( sthread_t t);
 
 /**********************************************************************/
-/* Synchronization Primitives: Mutexs and Condition Variables         */
+/* Thread-Local Storage                                               */
+/**********************************************************************/
+
+/* A key names a slot that every thread has its own value in, like a
+ * pthread_key_t. The values start out NULL in each new thread. User
+ * threads can't use __thread variables for this, since those belong to
+ * the kernel thread and so are shared by all the threads it runs. */
+typedef unsigned int sthread_key_t;
+
+/* How many keys may be created, including the four the library uses
+ * for futures and tasks. Keys last as long as the program does. */
+#define STHREAD_KEYS_MAX 32
+
+/* Create a new key in *key. When a thread exits, destructor (unless it
+ * is NULL) is called with the thread's value for the key, if that isn't
+ * NULL. Returns 0, or EAGAIN (from <errno.h>) if all STHREAD_KEYS_MAX
+ * keys have been created. */
+int sthread_key_create(sthread_key_t *key, void (*destructor)(void*));
+
+/* Return the calling thread's value for key. */
+void *sthread_getspecific(sthread_key_t key);
+
+/* Set the calling thread's value for key. Returns 0, or EINVAL if key
+ * hasn't been created. */
+int sthread_setspecific(sthread_key_t key, const void *value);
+
+/**********************************************************************/
+/* Synchronization Primitives: Mutexs, Condition Variables,          */
+/* Reader-Writer Locks, Semaphores and Barriers                       */
 /**********************************************************************/
 
 typedef struct _sthread_mutex *sthread_mutex_t;
@@ -106,4 +209,278 @@ void sthread_cond_broadcast(sthread_cond_t cond);
  * 3. Sleeps thread until awoken. */
 void sthread_cond_wait(sthread_cond_t cond, sthread_mutex_t lock);
 
+/* Like sthread_cond_wait(), but stop waiting if the condition hasn't
+ * been signaled after usec microseconds. Either way, the lock is held
+ * again on return. Returns 0 if the thread was woken by a signal or
+ * broadcast, or ETIMEDOUT (from <errno.h>) if the time ran out. */
+int sthread_cond_timedwait(sthread_cond_t cond, sthread_mutex_t lock,
+                           unsigned long usec);
+
+
+typedef struct _sthread_rwlock *sthread_rwlock_t;
+
+/* Which waiters a reader-writer lock favours. With PREFER_READERS, a
+ * thread asking to read gets in whenever no writer holds the lock, even
+ * if writers are waiting, so a steady stream of readers can keep writers
+ * out. With PREFER_WRITERS, readers queue up behind any waiting writer,
+ * and a writer releasing the lock hands it to the next writer before
+ * any reader. */
+typedef enum {
+  STHREAD_RWLOCK_PREFER_READERS,
+  STHREAD_RWLOCK_PREFER_WRITERS
+} sthread_rwlock_pref_t;
+
+/* Return a new, unlocked reader-writer lock. */
+sthread_rwlock_t sthread_rwlock_init(sthread_rwlock_pref_t pref);
+
+/* Free a no-longer needed reader-writer lock.
+ * Assume it is unlocked and has no waiters. */
+void sthread_rwlock_free(sthread_rwlock_t lock);
+
+/* Acquire the lock for reading, which any number of threads may do at
+ * once, blocking while a writer holds it (or, with PREFER_WRITERS, waits
+ * for it). A thread must not take the lock for reading again while it
+ * already holds it. */
+void sthread_rwlock_rdlock(sthread_rwlock_t lock);
+
+/* Acquire the lock for writing, blocking until nobody else holds it. */
+void sthread_rwlock_wrlock(sthread_rwlock_t lock);
+
+/* Release the lock, whether the calling thread holds it for reading or
+ * for writing. */
+void sthread_rwlock_unlock(sthread_rwlock_t lock);
+
+
+typedef struct _sthread_sem *sthread_sem_t;
+
+/* Return a new counting semaphore with the given initial value. */
+sthread_sem_t sthread_sem_init(unsigned int value);
+
+/* Free a no-longer needed semaphore.
+ * Assume semaphore has no waiters. */
+void sthread_sem_free(sthread_sem_t sem);
+
+/* Decrement the semaphore, first blocking until it is above zero. */
+void sthread_sem_wait(sthread_sem_t sem);
+
+/* Decrement the semaphore if it is above zero, without blocking.
+ * Returns 0 if it did, or EAGAIN (from <errno.h>) if it was zero. */
+int sthread_sem_trywait(sthread_sem_t sem);
+
+/* Increment the semaphore, or, if threads are waiting, let one of them
+ * go instead. */
+void sthread_sem_post(sthread_sem_t sem);
+
+
+typedef struct _sthread_barrier *sthread_barrier_t;
+
+/* Returned by sthread_barrier_wait() to one of the threads. */
+#define STHREAD_BARRIER_SERIAL_THREAD 1
+
+/* Return a new barrier for count threads (at least 1). */
+sthread_barrier_t sthread_barrier_init(unsigned int count);
+
+/* Free a no-longer needed barrier.
+ * Assume no threads are waiting at it. */
+void sthread_barrier_free(sthread_barrier_t barrier);
+
+/* Block until count threads (counting this one) have called this, then
+ * let them all go. The barrier is then ready for the next round. Returns
+ * STHREAD_BARRIER_SERIAL_THREAD in one thread of each round (the last to
+ * arrive, for tasks that must be done once per round), and 0 in the
+ * others. */
+int sthread_barrier_wait(sthread_barrier_t barrier);
+
+/**********************************************************************/
+/* Channels                                                           */
+/**********************************************************************/
+
+/* A channel passes values (pointers) from threads that send them to
+ * threads that receive them, in the order they were sent, like a Go
+ * channel. A buffered channel holds up to its capacity of values that
+ * have been sent but not yet received; on an unbuffered one, each send
+ * waits for a receiver to take its value. A value sent while a thread
+ * is waiting to receive is given straight to that thread.
+ */
+typedef struct _sthread_chan *sthread_chan_t;
+
+/* Return a new channel that holds up to capacity values, or an
+ * unbuffered one if capacity is 0. */
+sthread_chan_t sthread_chan_init(unsigned int capacity);
+
+/* Free a no-longer needed channel, and any values still in it.
+ * Assume no threads are waiting on it. */
+void sthread_chan_free(sthread_chan_t chan);
+
+/* Send value on chan, first blocking until there is room for it (or,
+ * if chan is unbuffered, until a thread receives it). Returns 0, or
+ * EPIPE (from <errno.h>) if the channel is or gets closed. */
+int sthread_chan_send(sthread_chan_t chan, void *value);
+
+/* Receive the next value from chan into *value, first blocking until
+ * there is one. Returns 0, or EPIPE if the channel has been closed and
+ * every value sent before that has been received (*value is then set
+ * to NULL). */
+int sthread_chan_recv(sthread_chan_t chan, void **value);
+
+/* Close chan: later sends fail, as do those waiting to, and receivers
+ * get EPIPE once the values already sent run out. */
+void sthread_chan_close(sthread_chan_t chan);
+
+typedef enum { STHREAD_CHAN_SEND, STHREAD_CHAN_RECV } sthread_chan_dir_t;
+
+/* One of the operations sthread_chan_select() chooses between. */
+typedef struct {
+  sthread_chan_t chan;          /* NULL cases are never chosen */
+  sthread_chan_dir_t dir;
+  void *value;                  /* to send, or the value received */
+  int err;                      /* 0, or EPIPE: as for send and recv */
+} sthread_chan_case_t;
+
+/* Do whichever one of the ncases sends and receives in cases can go
+ * ahead without blocking, picking one at random if several can, and
+ * return its index; its value and err are set as sthread_chan_send()
+ * or sthread_chan_recv() would. If none can go ahead, block until one
+ * can, or, if block is 0, return -1 right away instead. */
+int sthread_chan_select(sthread_chan_case_t *cases, int ncases, int block);
+
+/**********************************************************************/
+/* Futures                                                            */
+/**********************************************************************/
+
+/* A future is the result of a function running in a thread of its own,
+ * for fanning work out and gathering the results. A thread waiting for
+ * several futures is woken once, when the last of them (or, for
+ * sthread_when_any(), the first) completes, rather than once for each.
+ */
+typedef struct _sthread_future *sthread_future_t;
+
+/* Start a new thread running start_routine(arg), and return the future
+ * that its return value (or NULL, if it calls sthread_exit()) will be
+ * in. Returns NULL if the thread couldn't be created. */
+sthread_future_t sthread_future_spawn(sthread_start_func_t start_routine,
+                                      void *arg);
+
+/* Free a future that is no longer needed. Its thread keeps running if
+ * it hasn't finished; nobody may be waiting for the future. */
+void sthread_future_free(sthread_future_t future);
+
+/* Return the future's result, first blocking until its thread has
+ * finished. It may be called any number of times. */
+void *sthread_future_get(sthread_future_t future);
+
+/* Block until every one of the nfutures futures has its result. NULL
+ * entries are skipped. */
+void sthread_join_all(sthread_future_t *futures, int nfutures);
+
+/* Block until one of the nfutures futures has its result, and return
+ * its index, or -1 if all of them are NULL. */
+int sthread_when_any(sthread_future_t *futures, int nfutures);
+
+/**********************************************************************/
+/* Tasks                                                              */
+/**********************************************************************/
+
+/* A task is a function call that one of a fixed set of worker threads
+ * runs to completion, without a thread or a stack of its own, so that
+ * fine-grained parallel work can be split into very many of them. The
+ * workers start with the first task; there are as many as the
+ * STHREAD_TASK_WORKERS environment variable says, or one per CPU.
+ *
+ * Tasks should compute rather than block: a task that blocks holds up
+ * its worker. Waiting for another task is fine, though, as the worker
+ * runs other tasks in the meantime.
+ */
+typedef struct _sthread_task *sthread_task_t;
+
+/* Queue start_routine(arg) to be run by a worker, and return the task.
+ * Every task must be waited for, exactly once. */
+sthread_task_t sthread_task_spawn(sthread_start_func_t start_routine,
+                                  void *arg);
+
+/* Wait until the task has run, free it, and return what start_routine
+ * returned. */
+void *sthread_task_wait(sthread_task_t task);
+
+/**********************************************************************/
+/* I/O                                                                */
+/**********************************************************************/
+
+/* Like read(), write(), accept() and connect(), except that when a
+ * user-level thread has to wait for the descriptor, only that thread
+ * blocks: the others keep running until the descriptor is ready. To do
+ * this they put fd in non-blocking mode (and leave it that way), so once
+ * a descriptor has been used with these, do all of its I/O with them.
+ * sthread_write() only returns once all count bytes have been written,
+ * or on an error. At most one thread at a time may wait to read from (or
+ * accept on) a descriptor, and one to write to it.
+ */
+ssize_t sthread_read(int fd, void *buf, size_t count);
+ssize_t sthread_write(int fd, const void *buf, size_t count);
+int sthread_accept(int fd, struct sockaddr *addr, socklen_t *len);
+int sthread_connect(int fd, const struct sockaddr *addr, socklen_t len);
+
+/**********************************************************************/
+/* Statistics                                                         */
+/**********************************************************************/
+
+/* What a thread (or all threads together) has been doing. Times are in
+ * nanoseconds. A switch is voluntary when the thread blocked, yielded or
+ * exited, and involuntary when it was preempted. */
+typedef struct {
+  unsigned long voluntary_switches;
+  unsigned long involuntary_switches;
+  unsigned long long run_ns;        /* running */
+  unsigned long long runnable_ns;   /* ready to run, waiting for a CPU */
+  unsigned long long blocked_ns;    /* waiting for anything else */
+  unsigned long mutex_contended;    /* mutex locks that found it held */
+} sthread_counters_t;
+
+typedef struct {
+  sthread_t thread;             /* NULL for the main thread */
+  char name[STHREAD_NAME_MAX];
+  int priority;
+  char state;                   /* 'R'unning, 'W'aiting to run, 'B'locked */
+  sthread_counters_t counters;
+} sthread_thread_stats_t;
+
+typedef struct {
+  const char *impl;             /* as sthread_get_impl_name() */
+  unsigned long threads_created; /* including the main thread */
+  unsigned long threads_exited;
+  /* Summed over every thread, including those that have exited. */
+  sthread_counters_t total;
+  /* Timer interrupts taken, and dropped because interrupts were
+   * disabled; always 0 with pthreads. */
+  unsigned long interrupts;
+  unsigned long dropped_interrupts;
+  /* The threads alive when the snapshot was taken. */
+  int nthreads;
+  sthread_thread_stats_t *threads;
+} sthread_stats_t;
+
+/* Return a snapshot of the statistics, to be freed with
+ * sthread_stats_free(). Counters are read while the threads keep
+ * running, so they are only consistent to within a time slice.
+ *
+ * With the user-level threads, run time is the time a thread spends as
+ * the one its worker is running, which includes any time the kernel
+ * gives the worker's CPU to someone else. With pthreads, times and
+ * switch counts come from the kernel, and those of a thread cover the
+ * whole life of the kernel thread it runs on, which may have run other
+ * threads before it. */
+sthread_stats_t *sthread_stats_snapshot(void);
+
+void sthread_stats_free(sthread_stats_t *stats);
+
+/* Print stats in human-readable form, a line per thread. */
+void sthread_stats_print(FILE *out, const sthread_stats_t *stats);
+
+/* When the STHREAD_TRACE environment variable names a file, the library
+ * records a trace of scheduling events (see lib/README), and writes it
+ * there when the program exits. This writes the trace so far to path
+ * (or to that file, if path is NULL) right away. Returns 0, or -1 if
+ * tracing is off or the file can't be written. */
+int sthread_trace_write(const char *path);
+
 #endif /* STHREAD_H */
@@ -1,104 +1,398 @@
 /*
  * sthread.c - Implements the public API (the functions defined in
- *             include/sthread.h). Since sthreads supports two implementations
- *             (pthreads and student supplied user-level threads), this
- *             just consists of dispatching the calls to the implementation
- *             that the application choose.
+ *             include/sthread.h). Since sthreads supports several
+ *             implementations (pthreads, and user-level threads on one or
+ *             on many kernel threads), this just consists of dispatching
+ *             the calls to the implementation chosen when the program
+ *             starts, through a table of its functions.
  *
  */
 
 #include <config.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <sthread.h>
+#include <sthread_attr.h>
 #include <sthread_pthread.h>
 #include <sthread_user.h>
+#include <sthread_trace.h>
+#include <sthread_key.h>
+#include <sthread_future.h>
+#include <sthread_task.h>
 
+/* An implementation's versions of the public functions. */
+typedef struct {
+  const char *name;
+  sthread_impl_t impl;
+  void (*init)(void);
+  sthread_t (*create)(sthread_start_func_t start_routine, void *arg,
+                      int joinable, const struct _sthread_attr *attr);
+  void (*set_priority)(sthread_t t, int priority);
+  void (*exit)(void *ret);
+  void (*yield)(void);
+  void (*sleep_usec)(unsigned long usec);
+  void *(*join)(sthread_t t);
+  void **(*specific)(void);
+  sthread_mutex_t (*mutex_init)(void);
+  void (*mutex_free)(sthread_mutex_t lock);
+  void (*mutex_lock)(sthread_mutex_t lock);
+  void (*mutex_unlock)(sthread_mutex_t lock);
+  sthread_cond_t (*cond_init)(void);
+  void (*cond_free)(sthread_cond_t cond);
+  void (*cond_signal)(sthread_cond_t cond);
+  void (*cond_broadcast)(sthread_cond_t cond);
+  void (*cond_wait)(sthread_cond_t cond, sthread_mutex_t lock);
+  int (*cond_timedwait)(sthread_cond_t cond, sthread_mutex_t lock,
+                        unsigned long usec);
+  sthread_rwlock_t (*rwlock_init)(sthread_rwlock_pref_t pref);
+  void (*rwlock_free)(sthread_rwlock_t lock);
+  void (*rwlock_rdlock)(sthread_rwlock_t lock);
+  void (*rwlock_wrlock)(sthread_rwlock_t lock);
+  void (*rwlock_unlock)(sthread_rwlock_t lock);
+  sthread_sem_t (*sem_init)(unsigned int value);
+  void (*sem_free)(sthread_sem_t sem);
+  void (*sem_wait)(sthread_sem_t sem);
+  int (*sem_trywait)(sthread_sem_t sem);
+  void (*sem_post)(sthread_sem_t sem);
+  sthread_barrier_t (*barrier_init)(unsigned int count);
+  void (*barrier_free)(sthread_barrier_t barrier);
+  int (*barrier_wait)(sthread_barrier_t barrier);
+  sthread_chan_t (*chan_init)(unsigned int capacity);
+  void (*chan_free)(sthread_chan_t chan);
+  int (*chan_send)(sthread_chan_t chan, void *value);
+  int (*chan_recv)(sthread_chan_t chan, void **value);
+  void (*chan_close)(sthread_chan_t chan);
+  int (*chan_select)(sthread_chan_case_t *cases, int ncases, int block);
+  ssize_t (*read)(int fd, void *buf, size_t count);
+  ssize_t (*write)(int fd, const void *buf, size_t count);
+  int (*accept)(int fd, struct sockaddr *addr, socklen_t *len);
+  int (*connect)(int fd, const struct sockaddr *addr, socklen_t len);
+  void (*stats_snapshot)(sthread_stats_t *stats);
+} sthread_impl_ops_t;
+
+#define STHREAD_USER_OPS(name, init) {                                  \
+  name, STHREAD_USER_IMPL, init, sthread_user_create,                   \
+  sthread_user_set_priority, sthread_user_exit, sthread_user_yield,     \
+  sthread_user_sleep_usec, sthread_user_join, sthread_user_specific,    \
+  sthread_user_mutex_init, sthread_user_mutex_free,                     \
+  sthread_user_mutex_lock, sthread_user_mutex_unlock,                   \
+  sthread_user_cond_init,                                               \
+  sthread_user_cond_free, sthread_user_cond_signal,                     \
+  sthread_user_cond_broadcast, sthread_user_cond_wait,                  \
+  sthread_user_cond_timedwait, sthread_user_rwlock_init,                \
+  sthread_user_rwlock_free, sthread_user_rwlock_rdlock,                 \
+  sthread_user_rwlock_wrlock, sthread_user_rwlock_unlock,               \
+  sthread_user_sem_init, sthread_user_sem_free, sthread_user_sem_wait,  \
+  sthread_user_sem_trywait, sthread_user_sem_post,                      \
+  sthread_user_barrier_init, sthread_user_barrier_free,                 \
+  sthread_user_barrier_wait, sthread_user_chan_init,                   \
+  sthread_user_chan_free, sthread_user_chan_send,                       \
+  sthread_user_chan_recv, sthread_user_chan_close,                      \
+  sthread_user_chan_select,                                             \
+  sthread_user_read, sthread_user_write,                                \
+  sthread_user_accept, sthread_user_connect,                            \
+  sthread_user_stats_snapshot                                           \
+}
+
+/* The choices for STHREAD_IMPL. "user" and "mn" are the same user-level
+ * threads, but "mn" runs them on a worker per CPU unless STHREAD_WORKERS
+ * says otherwise. */
+static const sthread_impl_ops_t sthread_impls[] = {
+  STHREAD_USER_OPS("user", sthread_user_init),
+  STHREAD_USER_OPS("mn", sthread_user_init_mn),
+  { "pthread", STHREAD_PTHREAD_IMPL, sthread_pthread_init,
+    sthread_pthread_create, sthread_pthread_set_priority,
+    sthread_pthread_exit, sthread_pthread_yield, sthread_pthread_sleep_usec,
+    sthread_pthread_join, sthread_pthread_specific,
+    sthread_pthread_mutex_init,
+    sthread_pthread_mutex_free, sthread_pthread_mutex_lock,
+    sthread_pthread_mutex_unlock, sthread_pthread_cond_init,
+    sthread_pthread_cond_free, sthread_pthread_cond_signal,
+    sthread_pthread_cond_broadcast, sthread_pthread_cond_wait,
+    sthread_pthread_cond_timedwait, sthread_pthread_rwlock_init,
+    sthread_pthread_rwlock_free, sthread_pthread_rwlock_rdlock,
+    sthread_pthread_rwlock_wrlock, sthread_pthread_rwlock_unlock,
+    sthread_pthread_sem_init, sthread_pthread_sem_free,
+    sthread_pthread_sem_wait, sthread_pthread_sem_trywait,
+    sthread_pthread_sem_post, sthread_pthread_barrier_init,
+    sthread_pthread_barrier_free, sthread_pthread_barrier_wait,
+    sthread_pthread_chan_init, sthread_pthread_chan_free,
+    sthread_pthread_chan_send, sthread_pthread_chan_recv,
+    sthread_pthread_chan_close, sthread_pthread_chan_select,
+    sthread_pthread_read,
+    sthread_pthread_write, sthread_pthread_accept, sthread_pthread_connect,
+    sthread_pthread_stats_snapshot }
+};
+
+#define NUM_IMPLS (sizeof(sthread_impls) / sizeof(sthread_impls[0]))
+
+/* Used when STHREAD_IMPL isn't set; see configure's --with-pthreads. */
 #ifdef USE_PTHREADS
-#define IMPL_CHOOSE(pthread, user) pthread
+#define STHREAD_IMPL_DEFAULT "pthread"
 #else
-#define IMPL_CHOOSE(pthread, user) user
+#define STHREAD_IMPL_DEFAULT "user"
 #endif
 
+/* The implementation in use, once chosen. */
+static const sthread_impl_ops_t *impl;
+
+/* Choose the implementation named by STHREAD_IMPL, the first time this
+ * is called. Aborts if there's no such implementation. */
+static const sthread_impl_ops_t *sthread_choose_impl(void) {
+  const char *name;
+  unsigned i;
+
+  if (impl != NULL)
+    return impl;
+  name = getenv("STHREAD_IMPL");
+  if (name == NULL || *name == '\0')
+    name = STHREAD_IMPL_DEFAULT;
+  for (i = 0; i < NUM_IMPLS; i++) {
+    if (strcmp(name, sthread_impls[i].name) == 0) {
+      impl = &sthread_impls[i];
+      return impl;
+    }
+  }
+  fprintf(stderr, "sthread: unknown STHREAD_IMPL \"%s\" "
+          "(expected user, mn or pthread)\n", name);
+  abort();
+}
+
+sthread_impl_t sthread_get_impl(void) {
+  return sthread_choose_impl()->impl;
+}
+
+const char *sthread_get_impl_name(void) {
+  return sthread_choose_impl()->name;
+}
+
 void sthread_init(void) {
-  IMPL_CHOOSE(sthread_pthread_init(), sthread_user_init());
+  sthread_choose_impl();
+  sthread_trace_init();
+  impl->init();
+  sthread_future_init();
+  sthread_task_init();
 }
 
 sthread_t sthread_create(sthread_start_func_t start_routine, void *arg,
                          int joinable) {
-  sthread_t newth;
-  IMPL_CHOOSE(newth = sthread_pthread_create(start_routine, arg, joinable),
-              newth = sthread_user_create(start_routine, arg, joinable));
-  return newth;
+  return sthread_create_attr(start_routine, arg, joinable, NULL);
+}
+
+sthread_t sthread_create_attr(sthread_start_func_t start_routine, void *arg,
+                              int joinable, sthread_attr_t attr) {
+  const struct _sthread_attr *a = attr;
+  if (a == NULL)
+    a = &sthread_attr_default;
+  return impl->create(start_routine, arg, joinable, a);
+}
+
+void sthread_set_priority(sthread_t t, int priority) {
+  assert(priority >= 0 && priority < STHREAD_PRIORITY_LEVELS);
+  impl->set_priority(t, priority);
 }
 
 void sthread_exit(void *ret) {
-  IMPL_CHOOSE(sthread_pthread_exit(ret), sthread_user_exit(ret));
+  impl->exit(ret);
 }
 
 void sthread_yield(void) {
-  IMPL_CHOOSE(sthread_pthread_yield(), sthread_user_yield());
+  impl->yield();
+}
+
+void sthread_sleep_usec(unsigned long usec) {
+  impl->sleep_usec(usec);
 }
 
 void* sthread_join(sthread_t t) {
-  void *retptr;
-  IMPL_CHOOSE(retptr = sthread_pthread_join(t),
-              retptr = sthread_user_join(t));
-  return retptr;
+  return impl->join(t);
 }
 
 /**********************************************************************/
-/* Synchronization Primitives: Mutexs and Condition Variables         */
+/* Thread-Local Storage                                               */
+/**********************************************************************/
+
+/* sthread_key_create() is in sthread_util.c. Each implementation just
+ * finds the calling thread's slots, which are then indexed directly. */
+
+void *sthread_getspecific(sthread_key_t key) {
+  assert(key < STHREAD_KEYS_MAX);
+  return impl->specific()[key];
+}
+
+int sthread_setspecific(sthread_key_t key, const void *value) {
+  if (key >= sthread_nkeys)
+    return EINVAL;
+  impl->specific()[key] = (void*)value;
+  return 0;
+}
+
+/**********************************************************************/
+/* Synchronization Primitives: Mutexs, Condition Variables,          */
+/* Reader-Writer Locks, Semaphores and Barriers                       */
 /**********************************************************************/
 
 
 sthread_mutex_t sthread_mutex_init() {
-  sthread_mutex_t lock;
-  IMPL_CHOOSE(lock = sthread_pthread_mutex_init(),
-              lock = sthread_user_mutex_init());
-  return lock;
+  return impl->mutex_init();
 }
 
 void sthread_mutex_free(sthread_mutex_t lock) {
-  IMPL_CHOOSE(sthread_pthread_mutex_free(lock),
-              sthread_user_mutex_free(lock));
+  impl->mutex_free(lock);
 }
 
 void sthread_mutex_lock(sthread_mutex_t lock) {
-  IMPL_CHOOSE(sthread_pthread_mutex_lock(lock),
-              sthread_user_mutex_lock(lock));
+  impl->mutex_lock(lock);
 }
 
 void sthread_mutex_unlock(sthread_mutex_t lock) {
-  IMPL_CHOOSE(sthread_pthread_mutex_unlock(lock),
-              sthread_user_mutex_unlock(lock));
+  impl->mutex_unlock(lock);
 }
 
 
 sthread_cond_t sthread_cond_init(void) {
-  sthread_cond_t cond;
-  IMPL_CHOOSE(cond = sthread_pthread_cond_init(),
-              cond = sthread_user_cond_init());
-  return cond;
+  return impl->cond_init();
 }
 
 void sthread_cond_free(sthread_cond_t cond) {
-  IMPL_CHOOSE(sthread_pthread_cond_free(cond),
-              sthread_user_cond_free(cond));
+  impl->cond_free(cond);
 }
 
 void sthread_cond_signal(sthread_cond_t cond) {
-  IMPL_CHOOSE(sthread_pthread_cond_signal(cond),
-              sthread_user_cond_signal(cond));
+  impl->cond_signal(cond);
 }
 
 void sthread_cond_broadcast(sthread_cond_t cond) {
-  IMPL_CHOOSE(sthread_pthread_cond_broadcast(cond),
-              sthread_user_cond_broadcast(cond));
+  impl->cond_broadcast(cond);
 }
 
 void sthread_cond_wait(sthread_cond_t cond, sthread_mutex_t lock) {
-  IMPL_CHOOSE(sthread_pthread_cond_wait(cond, lock),
-              sthread_user_cond_wait(cond, lock));
+  impl->cond_wait(cond, lock);
+}
+
+int sthread_cond_timedwait(sthread_cond_t cond, sthread_mutex_t lock,
+                           unsigned long usec) {
+  return impl->cond_timedwait(cond, lock, usec);
+}
+
+
+sthread_rwlock_t sthread_rwlock_init(sthread_rwlock_pref_t pref) {
+  return impl->rwlock_init(pref);
+}
+
+void sthread_rwlock_free(sthread_rwlock_t lock) {
+  impl->rwlock_free(lock);
+}
+
+void sthread_rwlock_rdlock(sthread_rwlock_t lock) {
+  impl->rwlock_rdlock(lock);
+}
+
+void sthread_rwlock_wrlock(sthread_rwlock_t lock) {
+  impl->rwlock_wrlock(lock);
+}
+
+void sthread_rwlock_unlock(sthread_rwlock_t lock) {
+  impl->rwlock_unlock(lock);
+}
+
+
+sthread_sem_t sthread_sem_init(unsigned int value) {
+  return impl->sem_init(value);
+}
+
+void sthread_sem_free(sthread_sem_t sem) {
+  impl->sem_free(sem);
+}
+
+void sthread_sem_wait(sthread_sem_t sem) {
+  impl->sem_wait(sem);
+}
+
+int sthread_sem_trywait(sthread_sem_t sem) {
+  return impl->sem_trywait(sem);
+}
+
+void sthread_sem_post(sthread_sem_t sem) {
+  impl->sem_post(sem);
+}
+
+
+sthread_barrier_t sthread_barrier_init(unsigned int count) {
+  return impl->barrier_init(count);
+}
+
+void sthread_barrier_free(sthread_barrier_t barrier) {
+  impl->barrier_free(barrier);
+}
+
+int sthread_barrier_wait(sthread_barrier_t barrier) {
+  return impl->barrier_wait(barrier);
+}
+
+/**********************************************************************/
+/* Channels                                                           */
+/**********************************************************************/
+
+sthread_chan_t sthread_chan_init(unsigned int capacity) {
+  return impl->chan_init(capacity);
+}
+
+void sthread_chan_free(sthread_chan_t chan) {
+  impl->chan_free(chan);
+}
+
+int sthread_chan_send(sthread_chan_t chan, void *value) {
+  return impl->chan_send(chan, value);
+}
+
+int sthread_chan_recv(sthread_chan_t chan, void **value) {
+  return impl->chan_recv(chan, value);
+}
+
+void sthread_chan_close(sthread_chan_t chan) {
+  impl->chan_close(chan);
+}
+
+int sthread_chan_select(sthread_chan_case_t *cases, int ncases, int block) {
+  return impl->chan_select(cases, ncases, block);
+}
+
+/**********************************************************************/
+/* I/O                                                                */
+/**********************************************************************/
+
+ssize_t sthread_read(int fd, void *buf, size_t count) {
+  return impl->read(fd, buf, count);
+}
+
+ssize_t sthread_write(int fd, const void *buf, size_t count) {
+  return impl->write(fd, buf, count);
+}
+
+int sthread_accept(int fd, struct sockaddr *addr, socklen_t *len) {
+  return impl->accept(fd, addr, len);
+}
+
+int sthread_connect(int fd, const struct sockaddr *addr, socklen_t len) {
+  return impl->connect(fd, addr, len);
+}
+
+/**********************************************************************/
+/* Statistics                                                         */
+/**********************************************************************/
+
+sthread_stats_t *sthread_stats_snapshot(void) {
+  sthread_stats_t *stats;
+
+  stats = (sthread_stats_t*)calloc(1, sizeof(sthread_stats_t));
+  assert(stats != NULL);
+  stats->impl = impl->name;
+  impl->stats_snapshot(stats);
+  return stats;
 }
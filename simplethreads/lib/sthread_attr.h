@@ -0,0 +1,23 @@
+/*
+ * sthread_attr.h - The contents of an sthread_attr_t, shared by the
+ *                  implementations. The attribute functions themselves
+ *                  are described in the sthread.h file.
+ *
+ */
+
+#ifndef STHREAD_ATTR_H
+#define STHREAD_ATTR_H 1
+
+#include <sthread.h>
+
+struct _sthread_attr {
+  size_t stacksize;            /* 0 for the default */
+  char name[STHREAD_NAME_MAX]; /* empty for none */
+  int priority;
+  int affinity;                /* -1 for none */
+};
+
+/* The attributes used when sthread_create_attr is passed NULL. */
+extern const struct _sthread_attr sthread_attr_default;
+
+#endif /* STHREAD_ATTR_H */
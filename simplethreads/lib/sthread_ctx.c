@@ -10,8 +10,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include <sthread_ctx.h>
+#include <sthread_preempt.h>
 
 #ifdef STHREAD_CPU_I386
 #include "sthread_switch_i386.h"
@@ -34,10 +36,40 @@
  */
 const size_t sthread_stack_size = 2 * 1024 * 1024;
 
+/* Stacks are mmap()ed rather than malloc()ed, with an inaccessible guard
+ * page below each one so that a stack overflow faults instead of
+ * silently corrupting a neighbour. The kernel hands out the pages of an
+ * anonymous mapping on first touch, so a new thread only costs the pages
+ * of stack it actually uses, starting with the top one.
+ *
+ * Freed stacks are kept in a pool for the next sthread_new_ctx(). Their
+ * pages, except the top one, are given back to the kernel with
+ * MADV_FREE; the pool is linked through the word at the top of each
+ * stack, since that page stays resident anyway.
+ *
+ * Note that every stack is two mappings (guard and stack), and Linux
+ * limits a process to vm.max_map_count (65530 by default) mappings. If
+ * that limit is hit, stacks are made without guard pages. Raise it to
+ * run more than ~30000 threads with guard pages.
+ */
+#define STHREAD_STACK_POOL_MAX 1024
+
+static char *stack_pool = NULL;
+static int stack_pool_size = 0;
+static lock_t stack_pool_lock = 0;
+static size_t page_size = 0;
+
+static char *sthread_stack_alloc(size_t size);
+static void sthread_stack_release(char *stackbase, size_t size);
 static void sthread_init_stack(sthread_ctx_t *ctx,
                                sthread_ctx_start_func_t func);
 
 sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func) {
+  return sthread_new_ctx_size(func, 0);
+}
+
+sthread_ctx_t *sthread_new_ctx_size(sthread_ctx_start_func_t func,
+                                    size_t stacksize) {
   sthread_ctx_t *ctx;
 
   ctx = (sthread_ctx_t*)malloc(sizeof(sthread_ctx_t));
@@ -46,12 +78,21 @@ sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func) {
     return NULL;
   }
 
-  ctx->stackbase = (char*)malloc(sthread_stack_size);
+  if (page_size == 0)
+    page_size = sysconf(_SC_PAGESIZE);
+  if (stacksize == 0)
+    stacksize = sthread_stack_size;
+  if (stacksize < STHREAD_STACK_MIN)
+    stacksize = STHREAD_STACK_MIN;
+  stacksize = (stacksize + page_size - 1) & ~(page_size - 1);
+
+  ctx->stackbase = sthread_stack_alloc(stacksize);
   if (ctx->stackbase == NULL) {
     free(ctx);
     fprintf(stderr, "Out of memory (sthread_new_ctx)\n");
     return NULL;
   }
+  ctx->stacksize = stacksize;
 
   /* The stack grows down (towards lower memory addresses), so the first
    * SP is at the top (highest memory address). The stack pointer is
@@ -61,18 +102,23 @@ sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func) {
    * i386 code), but I don't think it makes any big difference, except
    * for reducing the size of the stack by 16 bytes.
    */
-  ctx->sp = ctx->stackbase + sthread_stack_size - 16;
+  ctx->sp = ctx->stackbase + ctx->stacksize - 16;
 
   sthread_init_stack(ctx, func);
 
   return ctx;
 }
 
-/* Initialize a stack as if it had been saved by sthread_switch. */
+void sthread_reset_ctx(sthread_ctx_t *ctx, sthread_ctx_start_func_t func) {
+  assert(ctx->stackbase != NULL);
+  ctx->sp = ctx->stackbase + ctx->stacksize - 16;
+  sthread_init_stack(ctx, func);
+}
+
+/* Initialize a stack as if it had been saved by sthread_switch. Only
+ * the top of the stack is written, so only its top page is touched. */
 static void sthread_init_stack(
     sthread_ctx_t *ctx, sthread_ctx_start_func_t func) {
-  memset(ctx->stackbase, 0, sthread_stack_size);
-
   /* Push the address of the thread's starting function onto the stack
    * (decrement the stack pointer, then store the item). This will
    * become the initial stack frame, with the return instruction pointer
@@ -81,13 +127,88 @@ static void sthread_init_stack(
    * of the Intel Software Developer's Manual:
    * http://www.intel.com/content/www/us/en/processors/architectures-software-developer-manuals.html
    */
+#ifdef STHREAD_START_PAD
+  /* Where the start function's return address would be, if it had been
+   * called; it never returns. */
+  ctx->sp -= STHREAD_START_PAD;
+  memset(ctx->sp, 0, STHREAD_START_PAD);
+#endif
   ctx->sp -= sizeof(sthread_ctx_start_func_t);
   *((sthread_ctx_start_func_t*)ctx->sp) = func;
 
   /* Leave room for the values pushed on the stack by the "save" half
    * of _sthread_switch. The amount of room varies between CPUs, so we
-   * get this value from the architecture-specific header file. */
+   * get this value from the architecture-specific header file. The
+   * saved registers start out zeroed, as a fresh stack used to be, and
+   * any control state (such as the FPU mode) is copied from ours. */
   ctx->sp -= STHREAD_CONTEXT_SIZE;
+  memset(ctx->sp, 0, STHREAD_CONTEXT_SIZE);
+#ifdef STHREAD_CONTEXT_INIT
+  STHREAD_CONTEXT_INIT(ctx->sp);
+#endif
+}
+
+/* The pool link of a pooled stack lives in its top word. */
+static char **sthread_stack_link(char *stackbase) {
+  return (char**)(stackbase + sthread_stack_size - sizeof(char*));
+}
+
+/* Get a stack of size bytes, a multiple of the page size. Stacks of the
+ * default size come from the pool if possible. Returns the lowest usable
+ * address, or NULL. */
+static char *sthread_stack_alloc(size_t size) {
+  static int warned = 0;
+  char *stackbase, *region;
+
+  if (size == sthread_stack_size) {
+    spin_lock(&stack_pool_lock);
+    stackbase = stack_pool;
+    if (stackbase != NULL) {
+      stack_pool = *sthread_stack_link(stackbase);
+      stack_pool_size--;
+    }
+    spin_unlock(&stack_pool_lock);
+    if (stackbase != NULL)
+      return stackbase;
+  }
+
+  region = mmap(NULL, size + page_size, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED)
+    return NULL;
+  if (mprotect(region, page_size, PROT_NONE) != 0 && !warned) {
+    warned = 1;
+    perror("sthread_new_ctx: mprotect of stack guard page failed "
+           "(raise vm.max_map_count?)");
+  }
+  return region + page_size;
+}
+
+/* Put a stack back in the pool, or unmap it if the pool is full or
+ * the stack isn't of the default size. */
+static void sthread_stack_release(char *stackbase, size_t size) {
+  if (size != sthread_stack_size ||
+      stack_pool_size >= STHREAD_STACK_POOL_MAX) {
+    munmap(stackbase - page_size, size + page_size);
+    return;
+  }
+
+  /* Everything below the top page can be discarded. This must happen
+   * before the stack is in the pool, where someone else may take it.
+   * MADV_FREE lets the kernel reclaim the pages lazily; kernels before
+   * 4.5 don't have it, so fall back to dropping them right away. */
+#ifdef MADV_FREE
+  if (madvise(stackbase, sthread_stack_size - page_size, MADV_FREE) != 0)
+#endif
+    madvise(stackbase, sthread_stack_size - page_size, MADV_DONTNEED);
+
+  /* The size check above is only a hint; the pool may overfill a
+   * little when several workers free stacks at once. */
+  spin_lock(&stack_pool_lock);
+  *sthread_stack_link(stackbase) = stack_pool;
+  stack_pool = stackbase;
+  stack_pool_size++;
+  spin_unlock(&stack_pool_lock);
 }
 
 /* Create a new sthread_ctx_t, but don't initialize it.
@@ -106,13 +227,14 @@ sthread_ctx_t *sthread_new_blank_ctx() {
   /* Put some bogus values in */
   ctx->sp = (char*)0xbeefcafe;
   ctx->stackbase = NULL;
+  ctx->stacksize = 0;
   return ctx;
 }
 
 /* Free resources used by given (not currently running) context. */
 void sthread_free_ctx(sthread_ctx_t *ctx) {
   if (ctx->stackbase) {
-    free(ctx->stackbase);
+    sthread_stack_release(ctx->stackbase, ctx->stacksize);
   }
   ctx->stackbase = (char*)0xdeaddead;
   ctx->sp = (char*)0xdeaddead;
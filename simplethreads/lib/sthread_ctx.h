@@ -14,10 +14,12 @@
 #include <sthread.h>
 
 typedef struct _sthread_ctx {
-  // Bottom of the stack
+  // Bottom of the stack (just above its guard page)
   char *stackbase;
+  // Usable size of the stack, in bytes
+  size_t stacksize;
   // Current stackpointer (if thread is not running).
-  // Initialized to stackbase + sthread_stack_size.
+  // Initialized to stackbase + stacksize.
   char *sp;
 } sthread_ctx_t;
 
@@ -26,9 +28,24 @@ typedef void (*sthread_ctx_start_func_t)(void);
 /* Make a new context. Note the sthread_ctx_start_func_t is not
  * the same as the sthread_start_func_t; the former takes no arguments
  * and returns nothing, while the later is takes/returns a void*.
+ *
+ * Stacks come from a pool shared by all kernel threads, which is
+ * protected by a spin lock: once preemption is running, call this (and
+ * sthread_free_ctx()) with interrupts disabled.
  */
 sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func);
 
+/* Like sthread_new_ctx, but with a stack of (at least) stacksize bytes.
+ * A stacksize of 0 means the default size. Only default-size stacks are
+ * pooled. */
+sthread_ctx_t *sthread_new_ctx_size(sthread_ctx_start_func_t func,
+                                    size_t stacksize);
+
+/* Reinitialize a context that is no longer running (its thread has
+ * exited) to start func again, as sthread_new_ctx() would have, but
+ * reusing its stack as it is: only the top frame is rewritten. */
+void sthread_reset_ctx(sthread_ctx_t *ctx, sthread_ctx_start_func_t func);
+
 /* Create a new sthread_ctx_t, but don't initialize it.
  * This new sthread_ctx_t is suitable for use as 'old' in
  * a call to sthread_switch, since sthread_switch is defined to overwrite
@@ -37,7 +54,8 @@ sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func);
 sthread_ctx_t *sthread_new_blank_ctx();
 
 /* Free the resources used by the given context. The passed
- * context should not be the currently active context. */
+ * context should not be the currently active context. Its stack
+ * goes back to the pool. */
 void sthread_free_ctx(sthread_ctx_t *ctx);
 
 void sthread_switch(sthread_ctx_t *old, sthread_ctx_t *new);
@@ -0,0 +1,148 @@
+/*
+ * sthread_deque.c - A growable, lock-free work-stealing deque.
+ *
+ * This is the Chase-Lev deque, with the memory orderings that Le,
+ * Pop, Cohen and Zappa Nardelli worked out for weak memory models.
+ * Items live at positions top..bottom-1 of a circular array. The owner
+ * moves bottom; thieves, and the owner when it takes the last item,
+ * claim an item by advancing top with a compare-and-swap, so each item
+ * is taken exactly once.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include <sthread_deque.h>
+
+/* Keep top and bottom on separate cache lines, so that thieves don't
+ * slow the owner down. */
+#define CACHE_LINE 64
+
+typedef struct _sthread_deque_array {
+  long mask;
+  /* The array this one replaced, kept for thieves still reading it. */
+  struct _sthread_deque_array *prev;
+  void *items[];
+} sthread_deque_array_t;
+
+struct _sthread_deque {
+  long top;
+  char pad0[CACHE_LINE - sizeof(long)];
+  long bottom;
+  sthread_deque_array_t *array;
+  char pad1[CACHE_LINE - sizeof(long) - sizeof(void*)];
+};
+
+static sthread_deque_array_t *sthread_deque_new_array(long capacity) {
+  sthread_deque_array_t *a;
+
+  a = (sthread_deque_array_t*)malloc(sizeof(sthread_deque_array_t) +
+                                     capacity * sizeof(void*));
+  assert(a != NULL);
+  a->mask = capacity - 1;
+  a->prev = NULL;
+  return a;
+}
+
+sthread_deque_t sthread_new_deque(int capacity) {
+  sthread_deque_t deque;
+
+  assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+  if (posix_memalign((void**)&deque, CACHE_LINE,
+                     sizeof(struct _sthread_deque)) != 0)
+    deque = NULL;
+  assert(deque != NULL);
+  deque->top = 0;
+  deque->bottom = 0;
+  deque->array = sthread_deque_new_array(capacity);
+  return deque;
+}
+
+void sthread_free_deque(sthread_deque_t deque) {
+  sthread_deque_array_t *a, *prev;
+
+  assert(deque->top == deque->bottom);
+  for (a = deque->array; a != NULL; a = prev) {
+    prev = a->prev;
+    free(a);
+  }
+  free(deque);
+}
+
+/* Move the items from top to bottom into an array twice the size. */
+static sthread_deque_array_t *sthread_deque_grow(sthread_deque_t deque,
+                                                 long top, long bottom) {
+  sthread_deque_array_t *old = deque->array, *a;
+  long i;
+
+  a = sthread_deque_new_array(2 * (old->mask + 1));
+  for (i = top; i < bottom; i++)
+    a->items[i & a->mask] = old->items[i & old->mask];
+  a->prev = old;
+  __atomic_store_n(&deque->array, a, __ATOMIC_RELEASE);
+  return a;
+}
+
+void sthread_deque_push(sthread_deque_t deque, void *item) {
+  sthread_deque_array_t *a;
+  long top, bottom;
+
+  assert(item != NULL);
+  bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  a = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  if (bottom - top > a->mask)
+    a = sthread_deque_grow(deque, top, bottom);
+  __atomic_store_n(&a->items[bottom & a->mask], item, __ATOMIC_RELAXED);
+  /* The item must be there before a thief can see the new bottom. */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+void *sthread_deque_pop(sthread_deque_t deque) {
+  sthread_deque_array_t *a;
+  long top, bottom;
+  void *item;
+
+  bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  a = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  /* Thieves must see the smaller bottom before we read top, or we and a
+   * thief could both take the last item. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  if (top > bottom) {
+    /* Empty. */
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  item = __atomic_load_n(&a->items[bottom & a->mask], __ATOMIC_RELAXED);
+  if (top == bottom) {
+    /* The last item: race the thieves for it. */
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      item = NULL;
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return item;
+}
+
+void *sthread_deque_steal(sthread_deque_t deque) {
+  sthread_deque_array_t *a;
+  long top, bottom;
+  void *item;
+
+  top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom)
+    return NULL;
+  a = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+  item = __atomic_load_n(&a->items[top & a->mask], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+  return item;
+}
@@ -0,0 +1,40 @@
+/*
+ * sthread_deque.h - A growable, lock-free work-stealing deque of
+ *                   pointers (Chase and Lev's).
+ *
+ * One kernel thread, the owner, pushes and pops at the bottom, like a
+ * stack; any other may steal from the top, oldest first. The owner only
+ * needs atomic instructions when it pops the last item, which is when
+ * it may race with a thief. The deque grows when a push finds it full;
+ * the arrays it outgrows are kept until it is destroyed, since a thief
+ * may still be reading them.
+ *
+ * The owner of a deque used by user-level threads is the thread that
+ * pushes to it, whichever worker that thread happens to run on.
+ */
+
+#ifndef STHREAD_DEQUE_H
+#define STHREAD_DEQUE_H 1
+
+typedef struct _sthread_deque *sthread_deque_t;
+
+/* Create a new, empty deque with room for capacity items to begin
+ * with, which must be a power of two. */
+sthread_deque_t sthread_new_deque(int capacity);
+
+/* Destroy the given deque. Asserts that the deque is empty. */
+void sthread_free_deque(sthread_deque_t deque);
+
+/* Add item, which must not be NULL, to the bottom of the deque. Only
+ * the owner may push. */
+void sthread_deque_push(sthread_deque_t deque, void *item);
+
+/* Return, and remove, the item at the bottom of the deque (the one
+ * pushed last), or NULL if the deque is empty. Only the owner may pop. */
+void *sthread_deque_pop(sthread_deque_t deque);
+
+/* Return, and remove, the item at the top of the deque (the oldest), or
+ * NULL if the deque is empty or another thread took the item first. */
+void *sthread_deque_steal(sthread_deque_t deque);
+
+#endif /* STHREAD_DEQUE_H */
@@ -0,0 +1,241 @@
+/*
+ * sthread_future.c - Futures, built on the public API, so the same code
+ *                    serves every implementation.
+ *
+ * A future's thread completes it when it exits, from the destructor of
+ * future_key, so that sthread_exit() completes it too. A thread waiting
+ * for a set of futures links a sthread_future_link_t into each one that
+ * isn't complete yet, all pointing at one sthread_future_wait_t on its
+ * stack, and then blocks on its own semaphore. Each completion counts
+ * down the wait's remaining, and only the one that brings it to zero
+ * posts the semaphore, so the waiter is woken once however many futures
+ * it waits for.
+ *
+ * Completions update the wait while holding the future's lock, so once
+ * the waiter has taken the lock of every future it linked into (and
+ * unlinked anything left there), nobody can touch the wait any more.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <sthread.h>
+#include <sthread_future.h>
+
+/* Sets of up to this many futures are waited for without malloc(). */
+#define FUTURE_WAIT_STACK 8
+
+/* A thread waiting for futures. */
+typedef struct {
+  /* The completions still needed. sthread_join_all() holds one more
+   * while it links the wait in, so that it can't reach zero early. */
+  int remaining;
+  /* The waiting thread's semaphore, and the index of the future whose
+   * completion brought remaining to zero. */
+  sthread_sem_t sem;
+  int index;
+} sthread_future_wait_t;
+
+/* Links a wait into one future's list of waiters. */
+typedef struct _sthread_future_link {
+  struct _sthread_future_link *next, *prev;
+  sthread_future_wait_t *wait;   /* NULL if it was never linked in */
+  int index;
+  int linked;                    /* cleared when the future completes */
+} sthread_future_link_t;
+
+struct _sthread_future {
+  /* Protects done and waiters. */
+  sthread_mutex_t lock;
+  int done;
+  sthread_future_link_t *waiters;
+  void *result;
+  sthread_start_func_t start_routine;
+  void *arg;
+  /* One for the caller's handle, one for the thread. */
+  int refs;
+};
+
+/* future_key holds a future's thread's own future; wait_key each
+ * thread's semaphore for waiting on futures. */
+static sthread_key_t future_key, wait_key;
+
+static void sthread_future_release(sthread_future_t future) {
+  if (__sync_sub_and_fetch(&future->refs, 1) == 0) {
+    sthread_mutex_free(future->lock);
+    free(future);
+  }
+}
+
+/* Runs when a future's thread exits. */
+static void sthread_future_complete(void *arg) {
+  sthread_future_t future = (sthread_future_t)arg;
+  sthread_future_link_t *link;
+
+  sthread_mutex_lock(future->lock);
+  future->done = 1;
+  for (link = future->waiters; link != NULL; link = link->next) {
+    link->linked = 0;
+    if (__sync_sub_and_fetch(&link->wait->remaining, 1) == 0) {
+      link->wait->index = link->index;
+      sthread_sem_post(link->wait->sem);
+    }
+  }
+  future->waiters = NULL;
+  sthread_mutex_unlock(future->lock);
+  sthread_future_release(future);
+}
+
+static void sthread_future_free_sem(void *sem) {
+  sthread_sem_free((sthread_sem_t)sem);
+}
+
+void sthread_future_init(void) {
+  if (sthread_key_create(&future_key, sthread_future_complete) != 0 ||
+      sthread_key_create(&wait_key, sthread_future_free_sem) != 0) {
+    fprintf(stderr, "sthread_future_init: out of keys\n");
+    abort();
+  }
+}
+
+static void *sthread_future_start(void *arg) {
+  sthread_future_t future = (sthread_future_t)arg;
+
+  sthread_setspecific(future_key, future);
+  future->result = future->start_routine(future->arg);
+  return NULL;
+}
+
+sthread_future_t sthread_future_spawn(sthread_start_func_t start_routine,
+                                      void *arg) {
+  sthread_future_t future;
+
+  future = (sthread_future_t)malloc(sizeof(struct _sthread_future));
+  assert(future != NULL);
+  future->lock = sthread_mutex_init();
+  future->done = 0;
+  future->waiters = NULL;
+  future->result = NULL;
+  future->start_routine = start_routine;
+  future->arg = arg;
+  future->refs = 2;
+  if (sthread_create(sthread_future_start, future, 0) == NULL) {
+    sthread_mutex_free(future->lock);
+    free(future);
+    return NULL;
+  }
+  return future;
+}
+
+void sthread_future_free(sthread_future_t future) {
+  sthread_future_release(future);
+}
+
+/* Wait for all of the futures, or, if any is set, for one of them, and
+ * return the index of one that is complete (-1 if all are NULL). */
+static int sthread_future_wait(sthread_future_t *futures, int nfutures,
+                               int any) {
+  sthread_future_link_t stack_links[FUTURE_WAIT_STACK], *links, *link;
+  sthread_future_wait_t wait;
+  sthread_future_t future;
+  int i, n, index = -1, linked = 0;
+
+  links = stack_links;
+  if (nfutures > FUTURE_WAIT_STACK) {
+    links = (sthread_future_link_t*)malloc(
+        nfutures * sizeof(sthread_future_link_t));
+    assert(links != NULL);
+  }
+  wait.remaining = 1;
+  wait.index = -1;
+  wait.sem = (sthread_sem_t)sthread_getspecific(wait_key);
+  if (wait.sem == NULL) {
+    wait.sem = sthread_sem_init(0);
+    sthread_setspecific(wait_key, wait.sem);
+  }
+
+  for (n = 0; n < nfutures; n++) {
+    links[n].wait = NULL;
+    future = futures[n];
+    if (future == NULL)
+      continue;
+    sthread_mutex_lock(future->lock);
+    if (future->done) {
+      sthread_mutex_unlock(future->lock);
+      index = n;
+      if (any) {
+        n++;
+        break;
+      }
+      continue;
+    }
+    if (!any)
+      __sync_add_and_fetch(&wait.remaining, 1);
+    link = &links[n];
+    link->wait = &wait;
+    link->index = n;
+    link->linked = 1;
+    link->prev = NULL;
+    link->next = future->waiters;
+    if (link->next != NULL)
+      link->next->prev = link;
+    future->waiters = link;
+    sthread_mutex_unlock(future->lock);
+    linked = 1;
+  }
+
+  if (any && index >= 0) {
+    /* Claim the completion we found, unless one of the others beat us
+     * to it and has posted the semaphore. */
+    if (__sync_sub_and_fetch(&wait.remaining, 1) != 0) {
+      sthread_sem_wait(wait.sem);
+      index = wait.index;
+    }
+  } else if (any) {
+    if (linked) {
+      sthread_sem_wait(wait.sem);
+      index = wait.index;
+    }
+  } else if (__sync_sub_and_fetch(&wait.remaining, 1) != 0) {
+    sthread_sem_wait(wait.sem);
+  }
+
+  /* Take our links out of the futures still holding them, and make sure
+   * those that completed are done with the wait. */
+  for (i = 0; i < n; i++) {
+    link = &links[i];
+    if (link->wait == NULL)
+      continue;
+    future = futures[i];
+    sthread_mutex_lock(future->lock);
+    if (link->linked) {
+      if (link->prev != NULL)
+        link->prev->next = link->next;
+      else
+        future->waiters = link->next;
+      if (link->next != NULL)
+        link->next->prev = link->prev;
+    }
+    sthread_mutex_unlock(future->lock);
+  }
+
+  if (links != stack_links)
+    free(links);
+  return index;
+}
+
+void *sthread_future_get(sthread_future_t future) {
+  sthread_future_wait(&future, 1, 0);
+  return future->result;
+}
+
+void sthread_join_all(sthread_future_t *futures, int nfutures) {
+  sthread_future_wait(futures, nfutures, 0);
+}
+
+int sthread_when_any(sthread_future_t *futures, int nfutures) {
+  return sthread_future_wait(futures, nfutures, 1);
+}
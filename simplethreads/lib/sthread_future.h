@@ -0,0 +1,13 @@
+/*
+ * sthread_future.h - Setting up futures. The future API itself is
+ *                    described in the sthread.h file.
+ *
+ */
+
+#ifndef STHREAD_FUTURE_H
+#define STHREAD_FUTURE_H 1
+
+/* Create the keys futures use; called by sthread_init(). */
+void sthread_future_init(void);
+
+#endif /* STHREAD_FUTURE_H */
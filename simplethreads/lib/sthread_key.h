@@ -0,0 +1,23 @@
+/*
+ * sthread_key.h - Helpers for the implementations' thread-local storage.
+ *                 The key API itself is described in the sthread.h file.
+ *
+ */
+
+#ifndef STHREAD_KEY_H
+#define STHREAD_KEY_H 1
+
+#include <sthread.h>
+
+/* How many times an exiting thread's destructors are run, in case they
+ * set values of their own (as PTHREAD_DESTRUCTOR_ITERATIONS). */
+#define STHREAD_DESTRUCTOR_ITERATIONS 4
+
+/* The number of keys created so far; keys below it are valid. */
+extern unsigned int sthread_nkeys;
+
+/* Call the destructors for the values in an exiting thread's slots,
+ * clearing each slot first. */
+void sthread_key_run_destructors(void **specific);
+
+#endif /* STHREAD_KEY_H */
@@ -0,0 +1,255 @@
+/*
+ * sthread_netpoll.c - Waiting for file descriptors to become ready.
+ *
+ * See sthread_netpoll.h. Each descriptor has a small record of who is
+ * waiting on it for reading and for writing; the records live in a
+ * two-level table indexed by descriptor number, allocated a chunk at a
+ * time as descriptors are first waited on, and never freed or moved, so
+ * looking one up takes no lock.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include <sthread_netpoll.h>
+#include <sthread_preempt.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#define STHREAD_EPOLL 1
+#endif
+
+/* The table covers descriptors 0 to FD_CHUNKS * FD_CHUNK - 1. */
+#define FD_CHUNK_BITS 10
+#define FD_CHUNK (1 << FD_CHUNK_BITS)
+#define FD_CHUNKS 1024
+
+/* Most events taken from the kernel by one sthread_netpoll_run(). */
+#define NETPOLL_EVENTS 64
+
+typedef struct {
+  lock_t lock;
+  void *waiter[2];    /* by STHREAD_POLL_READ / STHREAD_POLL_WRITE */
+} sthread_pollfd_t;
+
+struct _sthread_netpoll {
+  int epfd;
+  /* An eventfd in the epoll set, written to by sthread_netpoll_kick(). */
+  int kickfd;
+  volatile int nwaiting;
+  sthread_netpoll_func_t wake;
+  sthread_pollfd_t *volatile fds[FD_CHUNKS];
+};
+
+sthread_netpoll_t sthread_new_netpoll(sthread_netpoll_func_t wake) {
+  sthread_netpoll_t np;
+#ifdef STHREAD_EPOLL
+  struct epoll_event ev;
+#endif
+
+  np = (sthread_netpoll_t)calloc(1, sizeof(struct _sthread_netpoll));
+  assert(np != NULL);
+  np->wake = wake;
+  np->epfd = np->kickfd = -1;
+#ifdef STHREAD_EPOLL
+  np->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (np->epfd == -1) {
+    perror("epoll_create1 failed");
+    abort();
+  }
+  np->kickfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (np->kickfd == -1) {
+    perror("eventfd failed");
+    abort();
+  }
+  ev.events = EPOLLIN;
+  ev.data.fd = np->kickfd;
+  if (epoll_ctl(np->epfd, EPOLL_CTL_ADD, np->kickfd, &ev) == -1) {
+    perror("epoll_ctl failed");
+    abort();
+  }
+#endif
+  return np;
+}
+
+void sthread_free_netpoll(sthread_netpoll_t np) {
+  int i;
+
+  assert(np->nwaiting == 0);
+  if (np->epfd != -1)
+    close(np->epfd);
+  if (np->kickfd != -1)
+    close(np->kickfd);
+  for (i = 0; i < FD_CHUNKS; i++)
+    free(np->fds[i]);
+  free(np);
+}
+
+/* Return fd's record, allocating its chunk of the table if create is
+ * set, or NULL if there is none. */
+static sthread_pollfd_t *sthread_netpoll_lookup(sthread_netpoll_t np, int fd,
+                                                int create) {
+  sthread_pollfd_t *chunk;
+
+  if (fd < 0 || fd >= FD_CHUNKS * FD_CHUNK)
+    return NULL;
+  chunk = np->fds[fd >> FD_CHUNK_BITS];
+  if (chunk == NULL && create) {
+    chunk = (sthread_pollfd_t*)calloc(FD_CHUNK, sizeof(sthread_pollfd_t));
+    assert(chunk != NULL);
+    if (!__sync_bool_compare_and_swap(&np->fds[fd >> FD_CHUNK_BITS], NULL,
+                                      chunk)) {
+      free(chunk);
+      chunk = np->fds[fd >> FD_CHUNK_BITS];
+    }
+  }
+  return (chunk == NULL) ? NULL : &chunk[fd & (FD_CHUNK - 1)];
+}
+
+/* Arm fd in the epoll set for whatever its waiters wait for. pfd must be
+ * locked. Returns 0, or -1 with errno set. */
+static int sthread_netpoll_update(sthread_netpoll_t np, int fd,
+                                  sthread_pollfd_t *pfd) {
+#ifdef STHREAD_EPOLL
+  struct epoll_event ev;
+
+  ev.events = EPOLLONESHOT;
+  if (pfd->waiter[STHREAD_POLL_READ] != NULL)
+    ev.events |= EPOLLIN | EPOLLRDHUP;
+  if (pfd->waiter[STHREAD_POLL_WRITE] != NULL)
+    ev.events |= EPOLLOUT;
+  if (ev.events == EPOLLONESHOT)
+    return 0;
+  ev.data.fd = fd;
+  /* fd may not be in the set yet, or may have been closed (which takes
+   * it out) since it was last waited on. */
+  if (epoll_ctl(np->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+    return 0;
+  if (errno != ENOENT)
+    return -1;
+  return epoll_ctl(np->epfd, EPOLL_CTL_ADD, fd, &ev);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int sthread_netpoll_arm(sthread_netpoll_t np, int fd, int mode,
+                        void *waiter) {
+  sthread_pollfd_t *pfd;
+
+  assert(mode == STHREAD_POLL_READ || mode == STHREAD_POLL_WRITE);
+  pfd = sthread_netpoll_lookup(np, fd, 1);
+  if (pfd == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+
+  spin_lock(&pfd->lock);
+  assert(pfd->waiter[mode] == NULL);
+  pfd->waiter[mode] = waiter;
+  if (sthread_netpoll_update(np, fd, pfd) != 0) {
+    pfd->waiter[mode] = NULL;
+    spin_unlock(&pfd->lock);
+    return -1;
+  }
+  __sync_fetch_and_add(&np->nwaiting, 1);
+  spin_unlock(&pfd->lock);
+  return 0;
+}
+
+int sthread_netpoll_waiting(sthread_netpoll_t np) {
+  return np->nwaiting;
+}
+
+#ifdef STHREAD_EPOLL
+/* fd has the given events: take the waiters they satisfy off it, and
+ * re-arm it for the rest. Fills in woken, and returns how many. */
+static int sthread_netpoll_ready(sthread_netpoll_t np, int fd,
+                                 uint32_t events, void *woken[2]) {
+  sthread_pollfd_t *pfd;
+  int n = 0;
+
+  pfd = sthread_netpoll_lookup(np, fd, 0);
+  assert(pfd != NULL);
+  spin_lock(&pfd->lock);
+  if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) &&
+      pfd->waiter[STHREAD_POLL_READ] != NULL) {
+    woken[n++] = pfd->waiter[STHREAD_POLL_READ];
+    pfd->waiter[STHREAD_POLL_READ] = NULL;
+  }
+  if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+      pfd->waiter[STHREAD_POLL_WRITE] != NULL) {
+    woken[n++] = pfd->waiter[STHREAD_POLL_WRITE];
+    pfd->waiter[STHREAD_POLL_WRITE] = NULL;
+  }
+  /* A one-shot event disarms the descriptor for both directions. If it
+   * can't be re-armed, its other waiter will find out why by retrying. */
+  if (sthread_netpoll_update(np, fd, pfd) != 0) {
+    for (; n < 2 && pfd->waiter[STHREAD_POLL_READ] != NULL; n++) {
+      woken[n] = pfd->waiter[STHREAD_POLL_READ];
+      pfd->waiter[STHREAD_POLL_READ] = NULL;
+    }
+    for (; n < 2 && pfd->waiter[STHREAD_POLL_WRITE] != NULL; n++) {
+      woken[n] = pfd->waiter[STHREAD_POLL_WRITE];
+      pfd->waiter[STHREAD_POLL_WRITE] = NULL;
+    }
+  }
+  __sync_fetch_and_sub(&np->nwaiting, n);
+  spin_unlock(&pfd->lock);
+  return n;
+}
+#endif
+
+int sthread_netpoll_run(sthread_netpoll_t np, int timeout_ms) {
+#ifdef STHREAD_EPOLL
+  struct epoll_event events[NETPOLL_EVENTS];
+  void *woken[2];
+  uint64_t count;
+  int i, j, n, nready, total = 0;
+
+  nready = epoll_wait(np->epfd, events, NETPOLL_EVENTS, timeout_ms);
+  if (nready == -1) {
+    if (errno == EINTR)
+      return 0;
+    perror("epoll_wait failed");
+    abort();
+  }
+
+  for (i = 0; i < nready; i++) {
+    if (events[i].data.fd == np->kickfd) {
+      /* Whoever kicked us only wanted epoll_wait() to return. */
+      if (read(np->kickfd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        perror("netpoll: reading eventfd failed");
+      continue;
+    }
+    n = sthread_netpoll_ready(np, events[i].data.fd, events[i].events,
+                              woken);
+    for (j = 0; j < n; j++)
+      np->wake(woken[j]);
+    total += n;
+  }
+  return total;
+#else
+  return 0;
+#endif
+}
+
+void sthread_netpoll_kick(sthread_netpoll_t np) {
+  uint64_t one = 1;
+
+  if (np->kickfd != -1 &&
+      write(np->kickfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    perror("netpoll: writing eventfd failed");
+}
@@ -0,0 +1,62 @@
+/*
+ * sthread_netpoll.h - Waiting for file descriptors to become ready.
+ *
+ * A netpoller lets threads wait for a (non-blocking) file descriptor to
+ * become readable or writable without blocking the kernel thread they
+ * run on: a thread arms the netpoller for its descriptor and blocks, and
+ * whoever next runs the netpoller (typically a worker with nothing else
+ * to do) calls the wake function for it once the descriptor is ready.
+ *
+ * On Linux this is an epoll instance. Descriptors are registered one-shot
+ * and level-triggered, and re-armed by each wait, so a descriptor that is
+ * closed (and its number reused) between waits needs no cleaning up.
+ * Other systems have no netpoller: sthread_netpoll_arm() fails, and
+ * callers have to block the kernel thread instead.
+ *
+ * Like the timer wheel, a netpoller may be used by several kernel threads
+ * at once, and takes spinlocks, so callers must have interrupts disabled
+ * (see sthread_preempt.h).
+ */
+
+#ifndef STHREAD_NETPOLL_H
+#define STHREAD_NETPOLL_H 1
+
+/* What a waiter waits for. */
+#define STHREAD_POLL_READ  0
+#define STHREAD_POLL_WRITE 1
+
+typedef struct _sthread_netpoll *sthread_netpoll_t;
+
+/* Called by sthread_netpoll_run() with the waiter passed to
+ * sthread_netpoll_arm(), once its descriptor is ready (or has an error,
+ * or has been hung up). */
+typedef void (*sthread_netpoll_func_t)(void *waiter);
+
+/* Create a new netpoller that calls wake for its waiters. */
+sthread_netpoll_t sthread_new_netpoll(sthread_netpoll_func_t wake);
+
+/* Destroy the given netpoller. Asserts that nobody is waiting. */
+void sthread_free_netpoll(sthread_netpoll_t np);
+
+/* Have waiter woken once fd is ready for mode (STHREAD_POLL_READ or
+ * STHREAD_POLL_WRITE). At most one waiter may wait for each mode of a
+ * descriptor at a time. The wake function may be called, by another
+ * kernel thread, before this returns. Returns 0, or -1 with errno set if
+ * fd can't be polled (a regular file, say, or there is no netpoller on
+ * this system). */
+int sthread_netpoll_arm(sthread_netpoll_t np, int fd, int mode,
+                        void *waiter);
+
+/* Return the number of waiters armed and not yet woken. */
+int sthread_netpoll_waiting(sthread_netpoll_t np);
+
+/* Wait for up to timeout_ms milliseconds (forever if -1, not at all if
+ * 0) for descriptors to become ready, and wake their waiters. Returns the
+ * number woken. Several kernel threads may run the netpoller at once. */
+int sthread_netpoll_run(sthread_netpoll_t np, int timeout_ms);
+
+/* Make a sthread_netpoll_run() that is waiting in another kernel thread
+ * return as soon as possible. */
+void sthread_netpoll_kick(sthread_netpoll_t np);
+
+#endif /* STHREAD_NETPOLL_H */
@@ -4,6 +4,9 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
 #include <sys/ucontext.h>
 #include "sthread_preempt.h"
 #include "sthread_ctx.h"
@@ -20,6 +23,22 @@
 #include <sys/time.h>
 #include <sys/timeb.h>
 #include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* Where the system allows it, each kernel thread gets its own
+ * preemption timer, which counts the CPU time used by that thread and
+ * signals only that thread (see sthread_thread_timer_start()). Otherwise
+ * a single process-wide ITIMER_REAL is used, and its SIGALRM goes to
+ * whichever thread the kernel picks. */
+#if defined(HAVE_TIMER_CREATE) && defined(SIGEV_THREAD_ID)
+#define STHREAD_THREAD_TIMERS 1
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
 
 #include <stdlib.h>
 #include <assert.h>
@@ -33,6 +52,9 @@
 #define LOCK_UNLOCKED 0
 #define LOCK_LOCKED 1
 
+/* How many times spin_lock() tries before giving up the CPU. */
+#define SPIN_LIMIT 100
+
 int good_interrupts = 0;
 int handled_interrupts = 0;
 int dropped_interrupts = 0;
@@ -42,21 +64,46 @@ int inited = false;
 void timer_tick64(int signo, siginfo_t *siginfo, void *context);
 void vtimer_tick(int signo, siginfo_t *siginfo, void *context);
 void vtimer_reset(void);
+#ifdef STHREAD_THREAD_TIMERS
+static void sthread_thread_timer_start(void);
+#endif
 
 /* defined in the start.c and end.c files respectively */
 extern void proc_start();
 extern void proc_end();
 
 static sthread_ctx_start_func_t interruptHandler;
-static int sthread_interrupts_enabled;
+/* Per kernel thread: the timer signal can be delivered to any worker, and
+ * must only preempt it if that worker has interrupts enabled. A tick that
+ * can't be taken right away (interrupts are disabled, or the thread is
+ * running outside our code) is remembered in sthread_tick_pending, and
+ * taken by the next splx(LOW). Both are only written by their own kernel
+ * thread and its signal handler, so volatile is all the synchronization
+ * they need. */
+static __thread volatile sig_atomic_t sthread_interrupts_enabled;
+static __thread volatile sig_atomic_t sthread_tick_pending;
 static struct itimerval sthread_period; // stores timer period
 static const int WD_PERIOD = 500000; // watchdog period in usec.
 static int sthread_watchdog_sleep;           // if 0, wd resets itimer_real
+#ifdef STHREAD_THREAD_TIMERS
+/* With per-thread timers, the watchdog is a count of the ticks a kernel
+ * thread has taken in a row with interrupts disabled. */
+static int sthread_watchdog_ticks;
+static __thread int sthread_ticks_masked;
+#endif
+
+static void sthread_watchdog_warn(void);
 
 void sthread_print_stats() {
   printf("\ngood interrupts: %d\n", good_interrupts);
   printf("dropped interrupts: %d\n", dropped_interrupts);
 
+  /* Interrupts that arrive while interrupts are disabled, or while
+   * running in libc, are deferred until the next splx(LOW) and counted
+   * as good interrupts when they are taken. Only a tick that arrives
+   * while one is already pending is dropped.
+   */
+
   /* handled_interrupts is tracked, but not printed here. In general, the
    * handled_interrupts count is expected to be a few less than the
    * good_interrupts count: because handled_interrupts is incremented
@@ -122,8 +169,7 @@ void sthread_timer_reset(void) {
   int ret;
 
   // Check that value isn't 0.  If it is, then do a full reset.  This
-  // situation occurs when the interval timer was turned off in
-  // timer_tick64() or if the interval timer wasn't properly reset.
+  // situation occurs if the interval timer wasn't properly reset.
   if (sthread_period.it_value.tv_sec == 0 &&
       sthread_period.it_value.tv_usec == 0) {
     sthread_period.it_value.tv_sec = sthread_period.it_interval.tv_sec;
@@ -157,9 +203,11 @@ void vtimer_reset(void) {
 void sthread_timer_init(sthread_ctx_start_func_t func, int period) {
   int ret;
   struct sigaction sa;
-  struct sigaction virt_sa;
   sigset_t mask;
+#ifndef STHREAD_THREAD_TIMERS
+  struct sigaction virt_sa;
   sigset_t virt_mask;
+#endif
 
   sthread_init_stats();
   interruptHandler = func;
@@ -190,6 +238,10 @@ void sthread_timer_init(sthread_ctx_start_func_t func, int period) {
     abort();
   }
   // 2) Start the interval timer
+#ifdef STHREAD_THREAD_TIMERS
+  sthread_thread_timer_start();
+  sthread_watchdog_ticks = (period < WD_PERIOD) ? WD_PERIOD / period : 1;
+#else
   sthread_timer_reset();
 
   // We'll use the virtual interval timer as a watchdog aganst anything funny
@@ -207,20 +259,25 @@ void sthread_timer_init(sthread_ctx_start_func_t func, int period) {
   }
   // 2) Activate the virtual timer to fire every 100ms
   vtimer_reset();
+#endif
+}
+
+static void sthread_watchdog_warn(void) {
+  fprintf(stderr,
+          ".-------------------------------------------------------------------.\n"
+          "| Warning: The watchdog timer has gone off.  You may have disabled  |\n"
+          "| interrupts for longer than you should.  If you are 100%% sure your |\n"
+          "| code works, then this may indicate a preemption error, so please  |\n"
+          "| contact the TAs.                                                  |\n"
+          "'-------------------------------------------------------------------'\n"
+          );
 }
 
 void vtimer_tick(int signo, siginfo_t *siginfo, void *context) {
   if (sthread_watchdog_sleep) {
     sthread_watchdog_sleep = 0; // wake up next time if not reset
   } else {
-    fprintf(stderr,
-            ".-------------------------------------------------------------------.\n"
-            "| Warning: The watchdog timer has gone off.  You may have disabled  |\n"
-            "| interrupts for longer than you should.  If you are 100%% sure your |\n"
-            "| code works, then this may indicate a preemption error, so please  |\n"
-            "| contact the TAs.                                                  |\n"
-            "'-------------------------------------------------------------------'\n"
-            );
+    sthread_watchdog_warn();
     // Force a full reset
     sthread_period.it_value.tv_sec = sthread_period.it_interval.tv_sec;
     sthread_period.it_value.tv_sec = sthread_period.it_interval.tv_usec;
@@ -228,6 +285,48 @@ void vtimer_tick(int signo, siginfo_t *siginfo, void *context) {
   }
 }
 
+/* Remember a tick that can't be taken now, for the next splx(LOW). */
+static void sthread_tick_defer(void) {
+  if (sthread_tick_pending)
+    dropped_interrupts++;
+  sthread_tick_pending = 1;
+#ifdef STHREAD_THREAD_TIMERS
+  if (!sthread_interrupts_enabled &&
+      ++sthread_ticks_masked == sthread_watchdog_ticks)
+    sthread_watchdog_warn();
+#endif
+}
+
+#ifdef STHREAD_THREAD_TIMERS
+/* Start a timer that sends SIGALRM to the calling kernel thread each
+ * time it has used another sthread_period of CPU time. Since the timer
+ * counts CPU time, a thread that is blocked or asleep gets no ticks, and
+ * a thread that shares its CPU with others is only charged for the time
+ * it actually ran. */
+static void sthread_thread_timer_start(void) {
+  struct sigevent sev;
+  struct itimerspec its;
+  timer_t timer;
+
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGALRM;
+  sev.sigev_notify_thread_id = syscall(SYS_gettid);
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) != 0) {
+    perror("timer_create(CLOCK_THREAD_CPUTIME_ID) failed");
+    abort();
+  }
+
+  its.it_interval.tv_sec = sthread_period.it_interval.tv_sec;
+  its.it_interval.tv_nsec = sthread_period.it_interval.tv_usec * 1000;
+  its.it_value = its.it_interval;
+  if (timer_settime(timer, 0, &its, NULL) != 0) {
+    perror("timer_settime() failed");
+    abort();
+  }
+}
+#endif
+
 #ifdef STHREAD_CPU_X86_64
 void timer_tick64(int signo, siginfo_t *siginfo, void *context) {
   int ret;
@@ -237,13 +336,7 @@ void timer_tick64(int signo, siginfo_t *siginfo, void *context) {
   sthread_watchdog_sleep = 1;
 
   if (!sthread_interrupts_enabled) {
-    // Turn off the timer
-    struct itimerval it;
-    it.it_interval.tv_sec = 0;
-    it.it_interval.tv_usec = 0;
-    it.it_value.tv_sec = 0;
-    it.it_value.tv_usec = 0;
-    setitimer(ITIMER_REAL, &it, NULL);
+    sthread_tick_defer();
     return;
   }
 
@@ -302,6 +395,7 @@ void timer_tick64(int signo, siginfo_t *siginfo, void *context) {
       perror("sigprocmask() failed");
       abort();
     }
+    sthread_tick_pending = 0;
     interruptHandler();
     handled_interrupts++;
   } else {
@@ -314,8 +408,11 @@ void timer_tick64(int signo, siginfo_t *siginfo, void *context) {
      *   __write_nocancel (several times)
      *   __sigprocmask
      *   _IO_vfprintf_internal
-     * All of these seem to make sense. */
-    dropped_interrupts++;
+     * All of these seem to make sense.
+     *
+     * Rather than being dropped, the tick is taken as soon as the thread
+     * is back in our code and re-enables interrupts. */
+    sthread_tick_defer();
 #ifdef DEBUG_PREEMPT
     sthread_print_stats();
 #endif
@@ -344,7 +441,8 @@ void timer_tick(int sig, struct sigcontext scp) {
    *   argument of type struct sigcontext.  See the relevant kernel sources
    *   for details. This use is obsolete now.
    */
-  if (scp.eip >= (uint64_t) proc_start &&
+  if (sthread_interrupts_enabled &&
+      scp.eip >= (uint64_t) proc_start &&
       scp.eip < (uint64_t) proc_end &&
       !(scp.eip >= (uint64_t) Xsthread_switch &&
         scp.eip < (uint64_t) Xsthread_switch_end)) {
@@ -353,10 +451,11 @@ void timer_tick(int sig, struct sigcontext scp) {
     sigemptyset(&mask);
     sigaddset(&mask, SIGALRM);
     sigprocmask(SIG_UNBLOCK, &mask, &oldmask);
+    sthread_tick_pending = 0;
     interruptHandler();
     handled_interrupts++;
   } else {
-    dropped_interrupts++;
+    sthread_tick_defer();
   }
 }
 #endif
@@ -372,9 +471,12 @@ void debug_print_sigaction(struct sigaction *sa, const char *name) {
  * Returns the last state of the interrupts
  * LOW = interrupts ON
  * HIGH = interrupts OFF
+ *
+ * This is only a flag, checked by the timer signal handler, so it costs
+ * no system calls; the timer keeps running. A tick that arrived while
+ * interrupts were off is taken here, as soon as they are turned back on.
  */
 int splx(int splval) {
-  struct itimerval it;
   int ret = sthread_interrupts_enabled;
 
   if (!inited) {
@@ -383,21 +485,20 @@ int splx(int splval) {
   }
 
   if (splval == HIGH) {
-    // Turn off interrupts.
-    // First save the currentf value on the timer so that when interrupts
-    // are turned back on, this time is used.  Then, flag that they should
-    // be disabled next time SIGALRM is delivered.
-    getitimer(ITIMER_REAL, &it);
-    sthread_period.it_value.tv_sec = it.it_value.tv_sec;
-    sthread_period.it_value.tv_usec = it.it_value.tv_usec;
     sthread_interrupts_enabled = 0;
   } else {
-    // Turn on interrupts.
-    // Set the enabled flag high and reset the timer.  Reset here will use
-    // the values saved above so that no thread can hog all the time by
-    // abusing functions that use splx internally.
+    // Enable first, then look for a pending tick: one that arrives in
+    // between is either seen here or taken by the signal handler itself.
     sthread_interrupts_enabled = 1;
-    sthread_timer_reset();
+#ifdef STHREAD_THREAD_TIMERS
+    sthread_ticks_masked = 0;
+#endif
+    if (sthread_tick_pending) {
+      sthread_tick_pending = 0;
+      good_interrupts++;
+      interruptHandler();
+      handled_interrupts++;
+    }
   }
   return ret;
 }
@@ -406,8 +507,18 @@ int splx(int splval) {
 void sthread_preemption_init(sthread_ctx_start_func_t func, int period) {
 #ifndef DISABLE_PREEMPTION
   sthread_timer_init(func, period);
+#endif
+  /* splx() is still used to protect the scheduler's critical sections
+   * when preemption is disabled, so always mark it usable. */
   inited = true;
   splx(LOW);
+}
+
+/* start preemption on the calling kernel thread, which must not be the
+ * one that called sthread_preemption_init() */
+void sthread_preemption_thread_init(void) {
+#if !defined(DISABLE_PREEMPTION) && defined(STHREAD_THREAD_TIMERS)
+  sthread_thread_timer_start();
 #endif
 }
 
@@ -512,4 +623,52 @@ void atomic_clear(lock_t *l) {
    */
   *l = LOCK_UNLOCKED;
 }
+
+/*
+ * atomic_swap - XCHG with a memory operand is always locked, so it needs
+ * no lock prefix.
+ */
+lock_t atomic_swap(lock_t *l, lock_t v) {
+  __asm__ __volatile__("xchgl %0, (%1)"
+                       : "+r" (v)
+                       : "r" (l)
+                       : "memory");
+  return v;
+}
+
+/*
+ * atomic_cmpxchg - the same instruction as atomic_test_and_set(), with
+ * the expected and new values as arguments.
+ */
+lock_t atomic_cmpxchg(lock_t *l, lock_t old, lock_t v) {
+  lock_t val;
+  __asm__ __volatile__("lock cmpxchgl %2, (%3)"
+                       : "=a" (val)
+                       : "a" (old), "r" (v), "r" (l)
+                       : "memory");
+  return val;
+}
+
+void spin_lock(lock_t *l) {
+  int spins = 0;
+
+  while (atomic_test_and_set(l)) {
+    /* PAUSE tells the CPU we are in a spin-wait loop, which saves power
+     * and avoids a memory-order mis-speculation when the lock is freed. */
+    __asm__ __volatile__("pause" ::: "memory");
+    /* The holder may be a worker that the kernel descheduled (there may
+     * be more workers than CPUs); let it run instead of spinning away
+     * the rest of our time slice. */
+    if (++spins == SPIN_LIMIT) {
+      spins = 0;
+#ifdef HAVE_SCHED_YIELD
+      sched_yield();
+#endif
+    }
+  }
+}
+
+void spin_unlock(lock_t *l) {
+  atomic_clear(l);
+}
 #endif  // (STHREAD_CPU_I386 || STHREAD_CPU_X86_64)
@@ -17,10 +17,20 @@ typedef uint32_t lock_t;
 /* start preemption - func will be called every period microseconds */
 void sthread_preemption_init(sthread_ctx_start_func_t func, int period);
 
+/* Start preemption on another kernel thread, e.g. a worker of the
+ * user-level scheduler. Where the system supports it, every kernel thread
+ * has its own timer, which ticks once per period of CPU time that thread
+ * uses; each worker must call this once before it runs any threads. */
+void sthread_preemption_thread_init(void);
+
 /* Turns inturrupts ON and off 
  * Returns the last state of the inturrupts
  * LOW = inturrupts ON
  * HIGH = inturrupts OFF
+ * The interrupt state belongs to the calling kernel thread, so each
+ * worker of the user-level scheduler masks its own interrupts. A timer
+ * tick that arrives while interrupts are off is held until the splx(LOW)
+ * that turns them back on, which then calls the interrupt handler.
  */
 int splx(int splval);
 
@@ -39,6 +49,36 @@ int splx(int splval);
 int atomic_test_and_set(lock_t *l);
 void atomic_clear(lock_t *l);
 
+/*
+ * atomic_swap - atomically store v in *l; returns the value *l held.
+ * atomic_cmpxchg - atomically store v in *l if *l holds old; returns the
+ *   value *l held, so the store happened if that is equal to old.
+ *
+ * These let a lock word hold more than two states, e.g. "locked, and
+ * somebody is waiting for it" (see the mutexes in sthread_user.c and
+ * sthread_pthread.c).
+ */
+lock_t atomic_swap(lock_t *l, lock_t v);
+lock_t atomic_cmpxchg(lock_t *l, lock_t old, lock_t v);
+
+/*
+ * spin_lock, spin_unlock - busy-wait on a lock_t until it can be taken.
+ * Meant for the short critical sections the user-level scheduler needs
+ * to protect state shared between worker kernel threads. The caller
+ * should have interrupts disabled (splx(HIGH)), otherwise it may be
+ * preempted while holding the lock.
+ */
+void spin_lock(lock_t *l);
+void spin_unlock(lock_t *l);
+
+
+/*
+ * good_interrupts, dropped_interrupts - timer interrupts taken, and
+ *   dropped because another one was still waiting to be taken. Updated
+ *   without locking, so only approximate with several workers.
+ */
+extern int good_interrupts;
+extern int dropped_interrupts;
 
 /*
  * sthread_print_stats - prints out the number of drupped interrupts
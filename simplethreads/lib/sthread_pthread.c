@@ -13,6 +13,7 @@
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 
 #if defined(HAVE_SCHED_H)
 #include <sched.h>
@@ -21,6 +22,8 @@
 #endif
 
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 
 #include <stdlib.h>
 #include <assert.h>
@@ -29,39 +32,441 @@
 #endif
 #include <stdio.h>
 
+#include <limits.h>
+#include <setjmp.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
 #include <sthread.h>
+#include <sthread_attr.h>
+#include <sthread_preempt.h>
+#include <sthread_stats.h>
+#include <sthread_trace.h>
+#include <sthread_key.h>
+
+/* Threads run on pooled kernel threads, "carriers": a carrier that has
+ * finished its thread parks (on a futex) in the pool, and the next
+ * sthread_pthread_create() hands it a new start routine instead of
+ * paying for pthread_create() and a fresh stack. Thread descriptors are
+ * recycled too, once joined (or, if detached, once they have exited).
+ *
+ * sthread_pthread_exit() longjmp()s back to the carrier's loop instead of
+ * calling pthread_exit(), which would end the carrier. Anything a thread
+ * changed about its carrier (priority, name, affinity) is put back before
+ * the carrier runs another thread.
+ */
+
+/* Most carriers, and most spare descriptors, kept for reuse. Carriers
+ * beyond that exit when their thread does. */
+#define STHREAD_POOL_MAX 256
+#define STHREAD_FREE_MAX 1024
+
+/* States of a thread's done word, which its joiner sleeps on. */
+#define THREAD_RUNNING 0
+#define THREAD_JOINING 1   /* running, and the joiner is asleep */
+#define THREAD_DONE    2
 
 struct _sthread {
-  pthread_t pth;
+  /* Identifies the thread in traces; the main thread is 1. */
+  uint32_t id;
+  sthread_start_func_t start_routine;
+  void *arg;
+  void *ret;
+  int joinable;
+  int affinity;
+  char name[STHREAD_NAME_MAX];
+  lock_t done;
+  /* Protects priority and tid, so that sthread_pthread_set_priority()
+   * never renices a carrier that has moved on to another thread. */
+  lock_t lock;
+  int priority;
+  /* The kernel's id for the carrier, while the thread is running on it. */
+  pid_t tid;
+  /* Links the descriptor into the free list. */
+  sthread_t next;
+  /* Mutex locks that found the mutex held; the kernel keeps the rest of
+   * the statistics (see sthread_pthread_stats_snapshot()). */
+  unsigned long mutex_contended;
+  /* When the carrier running the thread started. */
+  uint64_t carrier_started;
+  /* Links the thread into the list of live threads. */
+  sthread_t all_prev, all_next;
+  /* The thread's values for the sthread_key_t keys. */
+  void *specific[STHREAD_KEYS_MAX];
+};
+
+typedef struct _sthread_carrier sthread_carrier_t;
+struct _sthread_carrier {
+  /* The thread to run; the creator sets go and wakes the carrier. */
+  sthread_t thread;
+  lock_t go;
+  size_t stacksize;    /* 0 for the default */
+  pid_t tid;
+  uint64_t started;
+  /* Where sthread_pthread_exit() returns to. */
+  jmp_buf exit_jmp;
+  sthread_carrier_t *next;
+#ifdef HAVE_PTHREAD_SETNAME_NP
+  char name[STHREAD_NAME_MAX];
+#endif
 };
 
+/* Parked carriers and spare descriptors, both protected by pool_lock. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static sthread_carrier_t *idle_carriers;
+static int nidle_carriers;
+static sthread_t free_threads;
+static int nfree_threads;
+
+/* Every live thread, for statistics, and what is left of those that
+ * have exited. The main thread isn't on the list. */
+static pthread_mutex_t all_lock = PTHREAD_MUTEX_INITIALIZER;
+static sthread_t all_threads;
+static int nall_threads;
+static unsigned long threads_created, threads_exited;
+static unsigned long exited_contended, main_contended;
+static uint64_t main_started;
+static uint32_t last_thread_id = 1;
+
+/* The carrier of the calling kernel thread, and the sthread it is running
+ * (NULL for the main thread, which isn't a carrier). */
+static __thread sthread_carrier_t *self_carrier;
+static __thread sthread_t self_thread;
+/* The main thread's values for the keys, since it has no descriptor. */
+static void *main_specific[STHREAD_KEYS_MAX];
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+/* The CPUs the process may use, for undoing an affinity hint. */
+static cpu_set_t sthread_all_cpus;
+#endif
+
+/* Each priority level is this much "nicer" than the one above it. */
+static const int sthread_nice_step = 5;
+
+/* How many times a contended lock spins waiting for the holder to let go
+ * before it sleeps: most critical sections are much shorter than a trip
+ * through the kernel. With a single CPU the holder can't be running while
+ * we spin, so sthread_pthread_init() turns spinning off. */
+#define MUTEX_SPINS 100
+static int sthread_mutex_spins = MUTEX_SPINS;
+
 #if !defined(HAVE_SCHED_YIELD) && defined(HAVE_SELECT)
 const int sthread_select_sec_timeout = 0;
 const int sthread_select_usec_timeout = 1;
 #endif
 
+static long sthread_futex(lock_t *uaddr, int op, lock_t val);
+
+/* The trace's id for the calling thread. */
+static uint32_t sthread_pthread_self_id(void) {
+  return (self_thread != NULL) ? self_thread->id : 1;
+}
+
+/* Record in the trace that the calling thread blocks, or has woken up. */
+static void sthread_pthread_trace_block(int why) {
+  sthread_trace(STHREAD_TRACE_BLOCK, sthread_pthread_self_id(), 0, why);
+}
+
+static void sthread_pthread_trace_wake(void) {
+  sthread_trace(STHREAD_TRACE_WAKE, sthread_pthread_self_id(), 0, 0);
+}
+
+static uint64_t sthread_pthread_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
 void sthread_pthread_init(void) {
-  /* pthreads don't need to be initialized explicitly */
+  /* pthreads don't need to be initialized explicitly; we only decide
+   * whether contended mutexes should spin, and note which CPUs carriers
+   * go back to after running a thread with an affinity hint. */
+  if (sysconf(_SC_NPROCESSORS_ONLN) <= 1)
+    sthread_mutex_spins = 0;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  if (sched_getaffinity(0, sizeof(sthread_all_cpus), &sthread_all_cpus) != 0)
+    CPU_ZERO(&sthread_all_cpus);
+#endif
+  main_started = sthread_pthread_now();
+  threads_created = 1;   /* the main thread */
+}
+
+/* Set the nice value of the kernel thread tid for the given priority:
+ * on Linux, setpriority() on a thread id affects only that thread.
+ * Raising the priority above the default usually needs privileges, so
+ * failure to do that is ignored. */
+static void sthread_pthread_renice(pid_t tid, int priority) {
+  int nice = (priority - STHREAD_PRIORITY_DEFAULT) * sthread_nice_step;
+
+  setpriority(PRIO_PROCESS, tid, nice);
+}
+
+/* Return a descriptor for a new thread, from the free list if there are
+ * any. */
+static sthread_t sthread_pthread_alloc(void) {
+  sthread_t sth = NULL;
+
+  pthread_mutex_lock(&pool_lock);
+  if (free_threads != NULL) {
+    sth = free_threads;
+    free_threads = sth->next;
+    nfree_threads--;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  if (sth == NULL) {
+    sth = malloc(sizeof(struct _sthread));
+    assert(sth != NULL);
+  }
+  return sth;
+}
+
+/* Put a descriptor nobody refers to any more back on the free list. */
+static void sthread_pthread_free(sthread_t sth) {
+  pthread_mutex_lock(&pool_lock);
+  if (nfree_threads < STHREAD_FREE_MAX) {
+    sth->next = free_threads;
+    free_threads = sth;
+    nfree_threads++;
+    sth = NULL;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  free(sth);
+}
+
+/* Add a new thread to the list of live threads. */
+static void sthread_pthread_link(sthread_t sth) {
+  pthread_mutex_lock(&all_lock);
+  sth->all_prev = NULL;
+  sth->all_next = all_threads;
+  if (all_threads != NULL)
+    all_threads->all_prev = sth;
+  all_threads = sth;
+  nall_threads++;
+  threads_created++;
+  pthread_mutex_unlock(&all_lock);
+}
+
+/* Take a thread off the list of live threads, once it has exited, or
+ * (if ran is 0) because it couldn't be started after all. */
+static void sthread_pthread_unlink(sthread_t sth, int ran) {
+  pthread_mutex_lock(&all_lock);
+  if (sth->all_prev != NULL)
+    sth->all_prev->all_next = sth->all_next;
+  else
+    all_threads = sth->all_next;
+  if (sth->all_next != NULL)
+    sth->all_next->all_prev = sth->all_prev;
+  nall_threads--;
+  if (ran) {
+    threads_exited++;
+    exited_contended += sth->mutex_contended;
+  } else {
+    threads_created--;
+  }
+  pthread_mutex_unlock(&all_lock);
+}
+
+/* Run sth on the calling carrier, and clean up after it. */
+static void sthread_pthread_run(sthread_carrier_t *c, sthread_t sth) {
+  int priority;
+
+  self_thread = sth;
+  spin_lock(&sth->lock);
+  sth->tid = c->tid;
+  sth->carrier_started = c->started;
+  priority = sth->priority;
+  spin_unlock(&sth->lock);
+  if (priority != STHREAD_PRIORITY_DEFAULT)
+    sthread_pthread_renice(c->tid, priority);
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  /* Affinity is only a hint, so it's fine if the CPU isn't available. */
+  if (sth->affinity >= 0 && sth->affinity < CPU_SETSIZE) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(sth->affinity, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+#endif
+#ifdef HAVE_PTHREAD_SETNAME_NP
+  if (sth->name[0] != '\0')
+    pthread_setname_np(pthread_self(), sth->name);
+#endif
+
+  if (setjmp(c->exit_jmp) == 0)
+    sth->ret = sth->start_routine(sth->arg);
+  /* Otherwise sthread_pthread_exit() has set sth->ret. */
+  sthread_key_run_destructors(sth->specific);
+
+  spin_lock(&sth->lock);
+  sth->tid = 0;
+  priority = sth->priority;
+  spin_unlock(&sth->lock);
+  if (priority != STHREAD_PRIORITY_DEFAULT)
+    sthread_pthread_renice(c->tid, STHREAD_PRIORITY_DEFAULT);
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  if (sth->affinity >= 0 && CPU_COUNT(&sthread_all_cpus) > 0)
+    pthread_setaffinity_np(pthread_self(), sizeof(sthread_all_cpus),
+                           &sthread_all_cpus);
+#endif
+#ifdef HAVE_PTHREAD_SETNAME_NP
+  if (sth->name[0] != '\0')
+    pthread_setname_np(pthread_self(), c->name);
+#endif
+  self_thread = NULL;
+  sthread_trace(STHREAD_TRACE_EXIT, sth->id, 0, 0);
+  sthread_pthread_unlink(sth, 1);
+
+  if (!sth->joinable) {
+    sthread_pthread_free(sth);
+  } else if (atomic_swap(&sth->done, THREAD_DONE) == THREAD_JOINING) {
+    /* The joiner may already have seen THREAD_DONE and recycled sth, but
+     * descriptors are never unmapped, and a stray wakeup is harmless. */
+    sthread_futex(&sth->done, FUTEX_WAKE_PRIVATE, INT_MAX);
+  }
+}
+
+/* Park the calling carrier in the pool until it is given another thread.
+ * Returns 0, without parking, if the pool is full. */
+static int sthread_pthread_park(sthread_carrier_t *c) {
+  pthread_mutex_lock(&pool_lock);
+  if (nidle_carriers >= STHREAD_POOL_MAX) {
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+  }
+  c->thread = NULL;
+  c->go = 0;
+  c->next = idle_carriers;
+  idle_carriers = c;
+  nidle_carriers++;
+  pthread_mutex_unlock(&pool_lock);
+
+  while (__atomic_load_n(&c->go, __ATOMIC_ACQUIRE) == 0)
+    sthread_futex(&c->go, FUTEX_WAIT_PRIVATE, 0);
+  return 1;
+}
+
+/* Carriers start here, with their first thread already assigned. */
+static void *sthread_pthread_carrier_main(void *arg) {
+  sthread_carrier_t *c = (sthread_carrier_t*)arg;
+
+  c->tid = (pid_t)syscall(SYS_gettid);
+  c->started = sthread_pthread_now();
+  self_carrier = c;
+  sthread_trace_thread_init();
+#ifdef HAVE_PTHREAD_SETNAME_NP
+  if (pthread_getname_np(pthread_self(), c->name, sizeof(c->name)) != 0)
+    c->name[0] = '\0';
+#endif
+  do {
+    sthread_pthread_run(c, c->thread);
+  } while (sthread_pthread_park(c));
+  free(c);
+  return NULL;
+}
+
+void sthread_pthread_set_priority(sthread_t t, int priority) {
+  if (t == NULL)
+    t = self_thread;
+  if (t == NULL) {
+    /* The main thread. */
+    sthread_pthread_renice((pid_t)syscall(SYS_gettid), priority);
+    return;
+  }
+  spin_lock(&t->lock);
+  t->priority = priority;
+  if (t->tid != 0)
+    sthread_pthread_renice(t->tid, priority);
+  spin_unlock(&t->lock);
 }
 
 sthread_t sthread_pthread_create(
-    sthread_start_func_t start_routine, void *arg, int joinable) {
+    sthread_start_func_t start_routine, void *arg, int joinable,
+    const struct _sthread_attr *attr) {
+  sthread_carrier_t *c, **cp;
   sthread_t sth;
+  pthread_attr_t pattr;
+  pthread_t pth;
+  size_t stacksize = 0;
   int err;
 
-  sth = malloc(sizeof(struct _sthread));
+  sth = sthread_pthread_alloc();
+  sth->start_routine = start_routine;
+  sth->arg = arg;
+  sth->ret = NULL;
+  sth->joinable = joinable;
+  sth->affinity = attr->affinity;
+  strcpy(sth->name, attr->name);
+  sth->done = THREAD_RUNNING;
+  sth->lock = 0;
+  sth->priority = attr->priority;
+  sth->tid = 0;
+  sth->mutex_contended = 0;
+  memset(sth->specific, 0, sizeof(sth->specific));
+  sth->id = __sync_add_and_fetch(&last_thread_id, 1);
+  sthread_pthread_link(sth);
+  sthread_trace(STHREAD_TRACE_CREATE, sth->id, sthread_pthread_self_id(), 0);
 
-  err = pthread_create(&(sth->pth), NULL, start_routine, arg);
-  if (!err && !joinable) {
-    err = pthread_detach(sth->pth);
+  if (attr->stacksize != 0) {
+    stacksize = attr->stacksize;
+    if (stacksize < STHREAD_STACK_MIN)
+      stacksize = STHREAD_STACK_MIN;
   }
 
+  /* Hand the thread to a parked carrier with the right size stack. */
+  pthread_mutex_lock(&pool_lock);
+  for (cp = &idle_carriers; *cp != NULL; cp = &(*cp)->next) {
+    if ((*cp)->stacksize == stacksize)
+      break;
+  }
+  c = *cp;
+  if (c != NULL) {
+    *cp = c->next;
+    nidle_carriers--;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  if (c != NULL) {
+    c->thread = sth;
+    __atomic_store_n(&c->go, 1, __ATOMIC_RELEASE);
+    sthread_futex(&c->go, FUTEX_WAKE_PRIVATE, 1);
+    return sth;
+  }
+
+  /* None: start a new one. */
+  c = malloc(sizeof(sthread_carrier_t));
+  assert(c != NULL);
+  c->thread = sth;
+  c->stacksize = stacksize;
+  pthread_attr_init(&pattr);
+  pthread_attr_setdetachstate(&pattr, PTHREAD_CREATE_DETACHED);
+  if (stacksize != 0)
+    pthread_attr_setstacksize(&pattr, stacksize);
+  err = pthread_create(&pth, &pattr, sthread_pthread_carrier_main, c);
+  pthread_attr_destroy(&pattr);
+  if (err) {
+    fprintf(stderr, "pthread_create error: %s\n", strerror(err));
+    free(c);
+    sthread_pthread_unlink(sth, 0);
+    sthread_pthread_free(sth);
+    return NULL;
+  }
   return sth;
 }
 
 void sthread_pthread_exit(void *ret) {
-  pthread_exit(ret);
-  assert(0); /* pthread_exit should never return */
+  if (self_carrier == NULL) {
+    /* The main thread. */
+    sthread_key_run_destructors(main_specific);
+    pthread_exit(ret);
+  }
+  self_thread->ret = ret;
+  longjmp(self_carrier->exit_jmp, 1);
+  assert(0); /* longjmp should never return */
+}
+
+void **sthread_pthread_specific(void) {
+  return (self_thread != NULL) ? self_thread->specific : main_specific;
 }
 
 void sthread_pthread_yield(void) {
@@ -79,86 +484,982 @@ void sthread_pthread_yield(void) {
 }
 
 void* sthread_pthread_join(sthread_t t) {
-  void*  result;
-  if ( pthread_join(t->pth, &result) ) {
-    result = NULL;
+  void *result;
+
+  if (atomic_cmpxchg(&t->done, THREAD_RUNNING, THREAD_JOINING) !=
+      THREAD_DONE) {
+    sthread_pthread_trace_block(STHREAD_TRACE_JOIN);
+    while (__atomic_load_n(&t->done, __ATOMIC_ACQUIRE) != THREAD_DONE)
+      sthread_futex(&t->done, FUTEX_WAIT_PRIVATE, THREAD_JOINING);
+    sthread_pthread_trace_wake();
   }
+  result = t->ret;
+  sthread_pthread_free(t);
   return result;
 }
 
+void sthread_pthread_sleep_usec(unsigned long usec) {
+  struct timespec ts;
+
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  sthread_pthread_trace_block(STHREAD_TRACE_SLEEP);
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    ;
+  sthread_pthread_trace_wake();
+}
+
 /**********************************************************************/
-/* Synchronization Primitives: Mutexs and Condition Variables         */
+/* Synchronization Primitives: Mutexs, Condition Variables,          */
+/* Reader-Writer Locks, Semaphores and Barriers                       */
 /**********************************************************************/
 
-/* In the pthreads implementation, sthread_mutex_t is just
- * a wrapper for pthread_mutext_t. (And similarly for sthread_cond_t.)
+/* Mutexes, condition variables, reader-writer locks, semaphores and
+ * barriers are built directly on Linux futexes (see Ulrich Drepper's
+ * "Futexes Are Tricky") rather than wrapping their pthread counterparts,
+ * so that the uncontended cases are a single atomic instruction with no
+ * system call, and so that a contended lock can spin for a while before
+ * it goes to sleep.
+ *
+ * The mutex word is MUTEX_FREE, MUTEX_LOCKED, or MUTEX_CONTENDED (held,
+ * and other threads may be asleep waiting for it); only an unlock that
+ * finds MUTEX_CONTENDED has to make a system call to wake one of them.
  */
+#define MUTEX_FREE      0
+#define MUTEX_LOCKED    1
+#define MUTEX_CONTENDED 2
+
 struct _sthread_mutex {
-  pthread_mutex_t plock;
+  lock_t word;
 };
 
+static long sthread_futex(lock_t *uaddr, int op, lock_t val) {
+  return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/* FUTEX_WAIT for at most the (relative) timeout. */
+static long sthread_futex_wait_timeout(lock_t *uaddr, lock_t val,
+                                       const struct timespec *timeout) {
+  return syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
 sthread_mutex_t sthread_pthread_mutex_init() {
   sthread_mutex_t lock;
   lock = (sthread_mutex_t)malloc(sizeof(struct _sthread_mutex));
   assert(lock != NULL);
-  pthread_mutex_init(&(lock->plock), NULL);
+  lock->word = MUTEX_FREE;
   return lock;
 }
 
 void sthread_pthread_mutex_free(sthread_mutex_t lock) {
-  if (pthread_mutex_destroy(&(lock->plock)) != 0) {
-    fprintf(stderr, "pthread_mutex_destroy failed: mutex not unlocked\n");
+  if (lock->word != MUTEX_FREE) {
+    fprintf(stderr, "sthread_mutex_free failed: mutex not unlocked\n");
     abort();
   }
   free(lock);
 }
 
+/* Sleep until the mutex is free, and take it. Since we can't tell whether
+ * anybody else is asleep on it, leave it marked MUTEX_CONTENDED. */
+static void sthread_pthread_mutex_lock_slow(sthread_mutex_t lock) {
+  while (atomic_swap(&(lock->word), MUTEX_CONTENDED) != MUTEX_FREE)
+    sthread_futex(&(lock->word), FUTEX_WAIT_PRIVATE, MUTEX_CONTENDED);
+}
+
 void sthread_pthread_mutex_lock(sthread_mutex_t lock) {
-  int err;
-  if ((err = pthread_mutex_lock(&(lock->plock))) != 0) {
-    fprintf(stderr, "pthred_mutex_lock error: %s", strerror(err));
-    abort();
+  int i;
+
+  if (atomic_test_and_set(&(lock->word)) == MUTEX_FREE)
+    return;
+  if (self_thread != NULL)
+    self_thread->mutex_contended++;
+  else
+    __sync_fetch_and_add(&main_contended, 1);
+
+  for (i = 0; i < sthread_mutex_spins; i++) {
+    __asm__ __volatile__("pause" ::: "memory");
+    if (lock->word == MUTEX_FREE &&
+        atomic_test_and_set(&(lock->word)) == MUTEX_FREE)
+      return;
   }
+
+  sthread_pthread_trace_block(STHREAD_TRACE_MUTEX);
+  sthread_pthread_mutex_lock_slow(lock);
+  sthread_pthread_trace_wake();
 }
 
 void sthread_pthread_mutex_unlock(sthread_mutex_t lock) {
-  int err;
-  if ((err = pthread_mutex_unlock(&(lock->plock))) != 0) {
-    fprintf(stderr, "pthred_mutex_unlock error: %s\n", strerror(err));
-    abort();
-  }
+  if (atomic_swap(&(lock->word), MUTEX_FREE) == MUTEX_CONTENDED)
+    sthread_futex(&(lock->word), FUTEX_WAKE_PRIVATE, 1);
 }
 
 
+/* A condition variable is a sequence number that every signal or
+ * broadcast bumps; a waiter sleeps on it only if it hasn't changed since
+ * before the waiter released the mutex, so no wakeup can be lost in
+ * between. The waiter count lets signal and broadcast skip the system
+ * call when nobody is waiting.
+ *
+ * Broadcast wakes only one waiter, and has the kernel move the rest
+ * straight onto the mutex's futex (FUTEX_CMP_REQUEUE), so that they are
+ * woken one at a time as the mutex is released rather than all at once
+ * to fight over it. For that to work, a thread coming back from a wait
+ * always takes the mutex as MUTEX_CONTENDED, so that its unlock wakes
+ * the next one.
+ */
 struct _sthread_cond {
-  pthread_cond_t pcond;
+  lock_t seq;
+  lock_t waiters;
+  /* The mutex the waiters released; they must all use the same one. */
+  sthread_mutex_t mutex;
 };
 
 sthread_cond_t sthread_pthread_cond_init(void) {
   sthread_cond_t cond;
   cond = (sthread_cond_t)malloc(sizeof(struct _sthread_cond));
   assert(cond != NULL);
-  pthread_cond_init(&(cond->pcond), NULL);
+  cond->seq = 0;
+  cond->waiters = 0;
+  cond->mutex = NULL;
   return cond;
 }
 
 void sthread_pthread_cond_free(sthread_cond_t cond) {
-  if (pthread_cond_destroy(&(cond->pcond)) != 0) {
-    fprintf(stderr, "pthread_cond_destroy failed: cond has waiters\n");
+  if (cond->waiters != 0) {
+    fprintf(stderr, "sthread_cond_free failed: cond has waiters\n");
     abort();
   }
   free(cond);
 }
 
 void sthread_pthread_cond_signal(sthread_cond_t cond) {
-  pthread_cond_signal(&(cond->pcond));
+  __atomic_add_fetch(&(cond->seq), 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&(cond->waiters), __ATOMIC_SEQ_CST) != 0)
+    sthread_futex(&(cond->seq), FUTEX_WAKE_PRIVATE, 1);
 }
 
 void sthread_pthread_cond_broadcast(sthread_cond_t cond) {
-  pthread_cond_broadcast(&(cond->pcond));
+  lock_t seq;
+
+  seq = __atomic_add_fetch(&(cond->seq), 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&(cond->waiters), __ATOMIC_SEQ_CST) == 0)
+    return;
+  /* This fails only if seq has changed again, i.e. somebody else
+   * signalled in the meantime; then just wake everybody. */
+  if (syscall(SYS_futex, &(cond->seq), FUTEX_CMP_REQUEUE_PRIVATE, 1,
+              (void*)(long)INT_MAX, &(cond->mutex->word), seq) < 0)
+    sthread_futex(&(cond->seq), FUTEX_WAKE_PRIVATE, INT_MAX);
 }
 
 void sthread_pthread_cond_wait(sthread_cond_t cond,
                                sthread_mutex_t lock) {
-  pthread_cond_wait(&(cond->pcond), &(lock->plock));
+  lock_t seq;
+
+  /* We hold the mutex, so no broadcast can be reading cond->mutex
+   * while there are no waiters yet. */
+  cond->mutex = lock;
+  __atomic_add_fetch(&(cond->waiters), 1, __ATOMIC_SEQ_CST);
+  seq = __atomic_load_n(&(cond->seq), __ATOMIC_SEQ_CST);
+  sthread_pthread_mutex_unlock(lock);
+  sthread_pthread_trace_block(STHREAD_TRACE_COND);
+  sthread_futex(&(cond->seq), FUTEX_WAIT_PRIVATE, seq);
+  sthread_pthread_trace_wake();
+  __atomic_sub_fetch(&(cond->waiters), 1, __ATOMIC_SEQ_CST);
+  sthread_pthread_mutex_lock_slow(lock);
+}
+
+int sthread_pthread_cond_timedwait(sthread_cond_t cond,
+                                   sthread_mutex_t lock,
+                                   unsigned long usec) {
+  struct timespec timeout;
+  lock_t seq;
+  int timed_out;
+
+  timeout.tv_sec = usec / 1000000;
+  timeout.tv_nsec = (usec % 1000000) * 1000;
+
+  cond->mutex = lock;
+  __atomic_add_fetch(&(cond->waiters), 1, __ATOMIC_SEQ_CST);
+  seq = __atomic_load_n(&(cond->seq), __ATOMIC_SEQ_CST);
+  sthread_pthread_mutex_unlock(lock);
+  sthread_pthread_trace_block(STHREAD_TRACE_COND);
+  timed_out = (sthread_futex_wait_timeout(&(cond->seq), seq, &timeout) != 0 &&
+               errno == ETIMEDOUT);
+  sthread_pthread_trace_wake();
+  __atomic_sub_fetch(&(cond->waiters), 1, __ATOMIC_SEQ_CST);
+  sthread_pthread_mutex_lock_slow(lock);
+  return timed_out ? ETIMEDOUT : 0;
+}
+
+
+/* A reader-writer lock word holds the number of readers, or
+ * RWLOCK_WRITER (all of the count bits) while a writer holds it, and
+ * flags saying that readers or writers may be asleep waiting for it.
+ * Readers sleep on the word itself; writers sleep on writer_seq, which
+ * each wakeup of a writer bumps, so that waking one writer doesn't wake
+ * the readers and vice versa. Unlocking only makes a system call when a
+ * waiting flag is set. */
+#define RWLOCK_COUNT           0x3fffffffU
+#define RWLOCK_WRITER          RWLOCK_COUNT
+#define RWLOCK_READERS_WAITING 0x40000000U
+#define RWLOCK_WRITERS_WAITING 0x80000000U
+
+struct _sthread_rwlock {
+  lock_t word;
+  lock_t writer_seq;
+  sthread_rwlock_pref_t pref;
+};
+
+sthread_rwlock_t sthread_pthread_rwlock_init(sthread_rwlock_pref_t pref) {
+  sthread_rwlock_t lock;
+  lock = (sthread_rwlock_t)malloc(sizeof(struct _sthread_rwlock));
+  assert(lock != NULL);
+  lock->word = 0;
+  lock->writer_seq = 0;
+  lock->pref = pref;
+  return lock;
+}
+
+void sthread_pthread_rwlock_free(sthread_rwlock_t lock) {
+  if (lock->word != 0) {
+    fprintf(stderr, "sthread_rwlock_free failed: lock not unlocked\n");
+    abort();
+  }
+  free(lock);
+}
+
+/* Can a reader take the lock, given its word? Not while a writer holds
+ * it, and if writers are preferred, not while anybody is waiting: a
+ * reader that barged in past waiting readers could keep a writer behind
+ * them waiting too. */
+static int sthread_pthread_rwlock_readable(sthread_rwlock_t lock,
+                                           lock_t word) {
+  if ((word & RWLOCK_COUNT) >= RWLOCK_COUNT - 1)
+    return 0;
+  if (lock->pref == STHREAD_RWLOCK_PREFER_WRITERS)
+    return (word & (RWLOCK_READERS_WAITING | RWLOCK_WRITERS_WAITING)) == 0;
+  return 1;
+}
+
+void sthread_pthread_rwlock_rdlock(sthread_rwlock_t lock) {
+  lock_t word;
+  int i, blocked = 0;
+
+  word = __atomic_load_n(&(lock->word), __ATOMIC_RELAXED);
+  for (i = 0; ; i++) {
+    if (sthread_pthread_rwlock_readable(lock, word)) {
+      if (__atomic_compare_exchange_n(&(lock->word), &word, word + 1, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+      continue;
+    }
+    if (i < sthread_mutex_spins) {
+      __asm__ __volatile__("pause" ::: "memory");
+      word = __atomic_load_n(&(lock->word), __ATOMIC_RELAXED);
+      continue;
+    }
+    if (!(word & RWLOCK_READERS_WAITING) &&
+        !__atomic_compare_exchange_n(&(lock->word), &word,
+                                     word | RWLOCK_READERS_WAITING, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      continue;
+    if (!blocked) {
+      sthread_pthread_trace_block(STHREAD_TRACE_RWLOCK);
+      blocked = 1;
+    }
+    sthread_futex(&(lock->word), FUTEX_WAIT_PRIVATE,
+                  word | RWLOCK_READERS_WAITING);
+    word = __atomic_load_n(&(lock->word), __ATOMIC_RELAXED);
+  }
+  if (blocked)
+    sthread_pthread_trace_wake();
+}
+
+void sthread_pthread_rwlock_wrlock(sthread_rwlock_t lock) {
+  lock_t word, seq, other_writers = 0;
+  int i, blocked = 0;
+
+  word = 0;
+  if (__atomic_compare_exchange_n(&(lock->word), &word, RWLOCK_WRITER, 0,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+  for (i = 0; ; i++) {
+    word = __atomic_load_n(&(lock->word), __ATOMIC_RELAXED);
+    if ((word & RWLOCK_COUNT) == 0) {
+      /* Once we have slept, other writers may be asleep too, and we
+       * can't tell, so keep the flag set for our unlock to wake them. */
+      if (__atomic_compare_exchange_n(&(lock->word), &word,
+                                      word | RWLOCK_WRITER | other_writers,
+                                      0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+      continue;
+    }
+    if (i < sthread_mutex_spins) {
+      __asm__ __volatile__("pause" ::: "memory");
+      continue;
+    }
+    if (!(word & RWLOCK_WRITERS_WAITING) &&
+        !__atomic_compare_exchange_n(&(lock->word), &word,
+                                     word | RWLOCK_WRITERS_WAITING, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      continue;
+    /* Read writer_seq and then check that the lock is still held, so
+     * that an unlock in between, which bumps writer_seq, can't be
+     * missed. */
+    seq = __atomic_load_n(&(lock->writer_seq), __ATOMIC_ACQUIRE);
+    word = __atomic_load_n(&(lock->word), __ATOMIC_ACQUIRE);
+    if ((word & RWLOCK_COUNT) != 0 && (word & RWLOCK_WRITERS_WAITING)) {
+      if (!blocked) {
+        sthread_pthread_trace_block(STHREAD_TRACE_RWLOCK);
+        blocked = 1;
+      }
+      sthread_futex(&(lock->writer_seq), FUTEX_WAIT_PRIVATE, seq);
+    }
+    other_writers = RWLOCK_WRITERS_WAITING;
+  }
+  if (blocked)
+    sthread_pthread_trace_wake();
+}
+
+/* Wake one writer. Returns nonzero if there was one asleep. */
+static int sthread_pthread_rwlock_wake_writer(sthread_rwlock_t lock) {
+  __atomic_add_fetch(&(lock->writer_seq), 1, __ATOMIC_RELEASE);
+  return sthread_futex(&(lock->writer_seq), FUTEX_WAKE_PRIVATE, 1) > 0;
+}
+
+/* The lock has just been released with word left in it, and somebody
+ * may be waiting: wake a writer, or all of the readers, as lock->pref
+ * says, clearing their flag first. Once somebody else holds the lock
+ * again, leave the waking to their unlock. */
+static void sthread_pthread_rwlock_wake(sthread_rwlock_t lock, lock_t word) {
+  lock_t both = RWLOCK_READERS_WAITING | RWLOCK_WRITERS_WAITING, rest;
+
+  while ((word & RWLOCK_COUNT) == 0 && word != 0) {
+    if (word == RWLOCK_WRITERS_WAITING ||
+        (word == both && lock->pref == STHREAD_RWLOCK_PREFER_WRITERS)) {
+      rest = word & ~RWLOCK_WRITERS_WAITING;
+      if (!__atomic_compare_exchange_n(&(lock->word), &word, rest, 0,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        continue;
+      /* If no writer was asleep after all, wake the readers instead. */
+      if (sthread_pthread_rwlock_wake_writer(lock))
+        return;
+      word = rest;
+    } else {
+      /* Writers stay flagged; the last of these readers wakes one. */
+      rest = word & ~RWLOCK_READERS_WAITING;
+      if (!__atomic_compare_exchange_n(&(lock->word), &word, rest, 0,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        continue;
+      sthread_futex(&(lock->word), FUTEX_WAKE_PRIVATE, INT_MAX);
+      return;
+    }
+  }
+}
+
+void sthread_pthread_rwlock_unlock(sthread_rwlock_t lock) {
+  lock_t word;
+
+  word = __atomic_load_n(&(lock->word), __ATOMIC_RELAXED);
+  if ((word & RWLOCK_COUNT) == RWLOCK_WRITER) {
+    word = __atomic_sub_fetch(&(lock->word), RWLOCK_WRITER,
+                              __ATOMIC_RELEASE);
+    if (word != 0)
+      sthread_pthread_rwlock_wake(lock, word);
+  } else {
+    word = __atomic_sub_fetch(&(lock->word), 1, __ATOMIC_RELEASE);
+    /* Readers only wait while a writer holds the lock (or, if writers
+     * are preferred, while writers wait), so the last reader out only
+     * has writers to wake. */
+    if ((word & RWLOCK_COUNT) == 0 && (word & RWLOCK_WRITERS_WAITING))
+      sthread_pthread_rwlock_wake(lock, word);
+  }
+}
+
+
+/* A semaphore is its value, on which waiters sleep while it is zero.
+ * The waiter count lets posts skip the system call when nobody is
+ * asleep. */
+struct _sthread_sem {
+  lock_t value;
+  lock_t waiters;
+};
+
+sthread_sem_t sthread_pthread_sem_init(unsigned int value) {
+  sthread_sem_t sem;
+  sem = (sthread_sem_t)malloc(sizeof(struct _sthread_sem));
+  assert(sem != NULL);
+  sem->value = value;
+  sem->waiters = 0;
+  return sem;
+}
+
+void sthread_pthread_sem_free(sthread_sem_t sem) {
+  if (sem->waiters != 0) {
+    fprintf(stderr, "sthread_sem_free failed: semaphore has waiters\n");
+    abort();
+  }
+  free(sem);
+}
+
+/* Take a unit if there is one. Returns 1 if it did. */
+static int sthread_pthread_sem_take(sthread_sem_t sem) {
+  lock_t value = __atomic_load_n(&(sem->value), __ATOMIC_RELAXED);
+
+  while (value > 0) {
+    if (__atomic_compare_exchange_n(&(sem->value), &value, value - 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return 1;
+  }
+  return 0;
+}
+
+void sthread_pthread_sem_wait(sthread_sem_t sem) {
+  int i;
+
+  if (sthread_pthread_sem_take(sem))
+    return;
+  for (i = 0; i < sthread_mutex_spins; i++) {
+    __asm__ __volatile__("pause" ::: "memory");
+    if (sthread_pthread_sem_take(sem))
+      return;
+  }
+
+  sthread_pthread_trace_block(STHREAD_TRACE_SEM);
+  __atomic_add_fetch(&(sem->waiters), 1, __ATOMIC_SEQ_CST);
+  while (!sthread_pthread_sem_take(sem))
+    sthread_futex(&(sem->value), FUTEX_WAIT_PRIVATE, 0);
+  __atomic_sub_fetch(&(sem->waiters), 1, __ATOMIC_SEQ_CST);
+  sthread_pthread_trace_wake();
+}
+
+int sthread_pthread_sem_trywait(sthread_sem_t sem) {
+  return sthread_pthread_sem_take(sem) ? 0 : EAGAIN;
+}
+
+void sthread_pthread_sem_post(sthread_sem_t sem) {
+  __atomic_add_fetch(&(sem->value), 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&(sem->waiters), __ATOMIC_SEQ_CST) != 0)
+    sthread_futex(&(sem->value), FUTEX_WAKE_PRIVATE, 1);
+}
+
+
+/* A barrier counts the threads that have arrived in the current round,
+ * and the round number, which waiters sleep on. The last thread to
+ * arrive resets the count for the next round before it bumps the round,
+ * and wakes everybody with one system call. */
+struct _sthread_barrier {
+  lock_t round;
+  lock_t arrived;
+  unsigned int count;
+};
+
+sthread_barrier_t sthread_pthread_barrier_init(unsigned int count) {
+  sthread_barrier_t barrier;
+  assert(count > 0);
+  barrier = (sthread_barrier_t)malloc(sizeof(struct _sthread_barrier));
+  assert(barrier != NULL);
+  barrier->round = 0;
+  barrier->arrived = 0;
+  barrier->count = count;
+  return barrier;
+}
+
+void sthread_pthread_barrier_free(sthread_barrier_t barrier) {
+  if (barrier->arrived != 0) {
+    fprintf(stderr, "sthread_barrier_free failed: barrier has waiters\n");
+    abort();
+  }
+  free(barrier);
+}
+
+int sthread_pthread_barrier_wait(sthread_barrier_t barrier) {
+  lock_t round;
+
+  round = __atomic_load_n(&(barrier->round), __ATOMIC_ACQUIRE);
+  if (__atomic_add_fetch(&(barrier->arrived), 1, __ATOMIC_ACQ_REL) ==
+      barrier->count) {
+    __atomic_store_n(&(barrier->arrived), 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(barrier->round), 1, __ATOMIC_RELEASE);
+    sthread_futex(&(barrier->round), FUTEX_WAKE_PRIVATE, INT_MAX);
+    return STHREAD_BARRIER_SERIAL_THREAD;
+  }
+  sthread_pthread_trace_block(STHREAD_TRACE_BARRIER);
+  while (__atomic_load_n(&(barrier->round), __ATOMIC_ACQUIRE) == round)
+    sthread_futex(&(barrier->round), FUTEX_WAIT_PRIVATE, round);
+  sthread_pthread_trace_wake();
+  return 0;
+}
+
+/**********************************************************************/
+/* Channels                                                           */
+/**********************************************************************/
+
+/* Channels work as in the user-level implementation (see the comment on
+ * sthread_chan_sel_t in sthread_user.c): a blocked select has a waiter
+ * on a queue of the channel of each of its cases, and whoever claims it
+ * does the exchange for it. Here the blocked thread then sleeps on the
+ * woken word of its select, which its claimer sets once it has unlocked
+ * the channel. A kernel thread can't be handed the CPU, so a sender
+ * that finds a receiver waiting just wakes it. */
+typedef struct _sthread_chan_sel {
+  lock_t claimed;
+  lock_t woken;
+  int fired;                    /* the index of the case done */
+} sthread_chan_sel_t;
+
+typedef struct _sthread_chan_waiter {
+  struct _sthread_chan_waiter *next;
+  struct _sthread_chan_waiter *prev;
+  int queued;
+  sthread_chan_sel_t *sel;
+  int index;
+  sthread_chan_case_t *c;
+} sthread_chan_waiter_t;
+
+typedef struct {
+  sthread_chan_waiter_t *head;
+  sthread_chan_waiter_t *tail;
+} sthread_chan_waitq_t;
+
+struct _sthread_chan {
+  /* Protects everything below. */
+  pthread_mutex_t guard;
+  int closed;
+  /* The values sent but not yet received: count of them, starting at
+   * buffer[head], in a ring of capacity. */
+  unsigned int capacity;
+  unsigned int count;
+  unsigned int head;
+  void **buffer;
+  sthread_chan_waitq_t senders;
+  sthread_chan_waitq_t receivers;
+};
+
+/* Selects with up to this many cases keep their waiters on the stack. */
+#define CHAN_SELECT_STACK 8
+
+/* Picks among the cases of a select that can all go ahead. */
+static __thread uint32_t chan_random;
+
+sthread_chan_t sthread_pthread_chan_init(unsigned int capacity) {
+  sthread_chan_t chan;
+
+  chan = (sthread_chan_t)calloc(1, sizeof(struct _sthread_chan));
+  assert(chan != NULL);
+  pthread_mutex_init(&chan->guard, NULL);
+  chan->capacity = capacity;
+  if (capacity > 0) {
+    chan->buffer = (void**)malloc(capacity * sizeof(void*));
+    assert(chan->buffer != NULL);
+  }
+  return chan;
+}
+
+void sthread_pthread_chan_free(sthread_chan_t chan) {
+  if (chan->senders.head != NULL || chan->receivers.head != NULL) {
+    fprintf(stderr, "sthread_chan_free failed: channel has waiters\n");
+    abort();
+  }
+  pthread_mutex_destroy(&chan->guard);
+  free(chan->buffer);
+  free(chan);
+}
+
+static void sthread_pthread_chan_enqueue(sthread_chan_waitq_t *q,
+                                         sthread_chan_waiter_t *w) {
+  w->next = NULL;
+  w->prev = q->tail;
+  if (q->tail != NULL)
+    q->tail->next = w;
+  else
+    q->head = w;
+  q->tail = w;
+  w->queued = 1;
+}
+
+static void sthread_pthread_chan_remove(sthread_chan_waitq_t *q,
+                                        sthread_chan_waiter_t *w) {
+  if (!w->queued)
+    return;
+  if (w->prev != NULL)
+    w->prev->next = w->next;
+  else
+    q->head = w->next;
+  if (w->next != NULL)
+    w->next->prev = w->prev;
+  else
+    q->tail = w->prev;
+  w->queued = 0;
+}
+
+/* Take the first waiter off q whose select nobody has claimed yet, and
+ * claim it. Returns NULL if there is none. */
+static sthread_chan_waiter_t *sthread_pthread_chan_claim(
+    sthread_chan_waitq_t *q) {
+  sthread_chan_waiter_t *w;
+  lock_t unclaimed;
+
+  while ((w = q->head) != NULL) {
+    sthread_pthread_chan_remove(q, w);
+    unclaimed = 0;
+    if (__atomic_compare_exchange_n(&(w->sel->claimed), &unclaimed, 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      w->sel->fired = w->index;
+      return w;
+    }
+  }
+  return NULL;
+}
+
+/* Do the send or receive c on chan, which is locked, if it can go ahead
+ * without blocking; returns true if it did. If that meant taking over
+ * a blocked thread's half of the exchange, that thread's select is
+ * returned in *wake, for the caller to wake once it has unlocked chan. */
+static int sthread_pthread_chan_try(sthread_chan_t chan,
+                                    sthread_chan_case_t *c,
+                                    sthread_chan_sel_t **wake) {
+  sthread_chan_waiter_t *w;
+
+  *wake = NULL;
+  c->err = 0;
+  if (c->dir == STHREAD_CHAN_SEND) {
+    if (chan->closed) {
+      c->err = EPIPE;
+      return 1;
+    }
+    if ((w = sthread_pthread_chan_claim(&chan->receivers)) != NULL) {
+      w->c->value = c->value;
+      w->c->err = 0;
+      *wake = w->sel;
+      return 1;
+    }
+    if (chan->count < chan->capacity) {
+      chan->buffer[(chan->head + chan->count++) % chan->capacity] = c->value;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (chan->count > 0) {
+    c->value = chan->buffer[chan->head];
+    chan->head = (chan->head + 1) % chan->capacity;
+    chan->count--;
+    /* Make room for the first blocked sender's value. */
+    if ((w = sthread_pthread_chan_claim(&chan->senders)) != NULL) {
+      chan->buffer[(chan->head + chan->count++) % chan->capacity] =
+        w->c->value;
+      w->c->err = 0;
+      *wake = w->sel;
+    }
+    return 1;
+  }
+  if ((w = sthread_pthread_chan_claim(&chan->senders)) != NULL) {
+    c->value = w->c->value;
+    w->c->err = 0;
+    *wake = w->sel;
+    return 1;
+  }
+  if (chan->closed) {
+    c->value = NULL;
+    c->err = EPIPE;
+    return 1;
+  }
+  return 0;
+}
+
+/* Wake the thread blocked in sel, whose half of an exchange has just
+ * been done for it. Once woken is set, sel may be gone. */
+static void sthread_pthread_chan_wake(sthread_chan_sel_t *sel) {
+  __atomic_store_n(&(sel->woken), 1, __ATOMIC_RELEASE);
+  sthread_futex(&(sel->woken), FUTEX_WAKE_PRIVATE, 1);
+}
+
+/* Lock, or unlock, each channel of cases once, taking them in address
+ * order so that selects over the same channels can't deadlock. order
+ * holds the indexes of the n cases with channels, sorted by channel. */
+static void sthread_pthread_chan_lock_all(sthread_chan_case_t *cases,
+                                          int *order, int n, int lock) {
+  sthread_chan_t chan, prev = NULL;
+  int k;
+
+  for (k = 0; k < n; k++) {
+    chan = cases[order[k]].chan;
+    if (chan == prev)
+      continue;
+    if (lock)
+      pthread_mutex_lock(&chan->guard);
+    else
+      pthread_mutex_unlock(&chan->guard);
+    prev = chan;
+  }
+}
+
+int sthread_pthread_chan_select(sthread_chan_case_t *cases, int ncases,
+                                int block) {
+  sthread_chan_waiter_t stack_waiters[CHAN_SELECT_STACK], *waiters;
+  int stack_order[CHAN_SELECT_STACK], *order;
+  sthread_chan_sel_t sel, *wake;
+  sthread_chan_case_t *c;
+  int i, j, k, n, start, fired = -1;
+
+  waiters = stack_waiters;
+  order = stack_order;
+  if (ncases > CHAN_SELECT_STACK) {
+    waiters = (sthread_chan_waiter_t*)malloc(ncases * sizeof(*waiters));
+    order = (int*)malloc(ncases * sizeof(int));
+    assert(waiters != NULL && order != NULL);
+  }
+  /* Sort the cases with channels by channel, for locking. */
+  n = 0;
+  for (i = 0; i < ncases; i++) {
+    if (cases[i].chan == NULL)
+      continue;
+    for (j = n; j > 0 && cases[order[j - 1]].chan > cases[i].chan; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+    n++;
+  }
+  assert(n > 0 || !block);
+
+  start = 0;
+  if (n > 1) {
+    if (chan_random == 0)
+      chan_random = sthread_pthread_self_id() | 1;
+    chan_random ^= chan_random << 13;
+    chan_random ^= chan_random >> 17;
+    chan_random ^= chan_random << 5;
+    start = chan_random % ncases;
+  }
+  sthread_pthread_chan_lock_all(cases, order, n, 1);
+  for (k = 0; k < ncases && fired < 0; k++) {
+    c = &cases[(start + k) % ncases];
+    if (c->chan != NULL && sthread_pthread_chan_try(c->chan, c, &wake))
+      fired = (start + k) % ncases;
+  }
+  if (fired >= 0) {
+    sthread_pthread_chan_lock_all(cases, order, n, 0);
+    if (wake != NULL)
+      sthread_pthread_chan_wake(wake);
+  } else if (!block) {
+    sthread_pthread_chan_lock_all(cases, order, n, 0);
+  } else {
+    sel.claimed = 0;
+    sel.woken = 0;
+    sel.fired = -1;
+    for (k = 0; k < n; k++) {
+      i = order[k];
+      waiters[i].sel = &sel;
+      waiters[i].index = i;
+      waiters[i].c = &cases[i];
+      sthread_pthread_chan_enqueue((cases[i].dir == STHREAD_CHAN_SEND) ?
+                                   &cases[i].chan->senders :
+                                   &cases[i].chan->receivers, &waiters[i]);
+    }
+    sthread_pthread_chan_lock_all(cases, order, n, 0);
+    sthread_pthread_trace_block(STHREAD_TRACE_CHAN);
+    while (__atomic_load_n(&(sel.woken), __ATOMIC_ACQUIRE) == 0)
+      sthread_futex(&(sel.woken), FUTEX_WAIT_PRIVATE, 0);
+    sthread_pthread_trace_wake();
+
+    /* Whoever claimed sel took that case's waiter off its queue; take
+     * the others off theirs. */
+    fired = sel.fired;
+    if (n > 1) {
+      sthread_pthread_chan_lock_all(cases, order, n, 1);
+      for (k = 0; k < n; k++) {
+        i = order[k];
+        sthread_pthread_chan_remove((cases[i].dir == STHREAD_CHAN_SEND) ?
+                                    &cases[i].chan->senders :
+                                    &cases[i].chan->receivers,
+                                    &waiters[i]);
+      }
+      sthread_pthread_chan_lock_all(cases, order, n, 0);
+    }
+  }
+
+  if (waiters != stack_waiters) {
+    free(waiters);
+    free(order);
+  }
+  return fired;
+}
+
+int sthread_pthread_chan_send(sthread_chan_t chan, void *value) {
+  sthread_chan_case_t c;
+
+  c.chan = chan;
+  c.dir = STHREAD_CHAN_SEND;
+  c.value = value;
+  sthread_pthread_chan_select(&c, 1, 1);
+  return c.err;
+}
+
+int sthread_pthread_chan_recv(sthread_chan_t chan, void **value) {
+  sthread_chan_case_t c;
+
+  c.chan = chan;
+  c.dir = STHREAD_CHAN_RECV;
+  sthread_pthread_chan_select(&c, 1, 1);
+  *value = c.value;
+  return c.err;
+}
+
+void sthread_pthread_chan_close(sthread_chan_t chan) {
+  sthread_chan_waiter_t *w, *woken = NULL;
+
+  pthread_mutex_lock(&chan->guard);
+  assert(!chan->closed);
+  chan->closed = 1;
+  /* Nobody is waiting to receive if there are values left. */
+  while ((w = sthread_pthread_chan_claim(&chan->receivers)) != NULL ||
+         (w = sthread_pthread_chan_claim(&chan->senders)) != NULL) {
+    if (w->c->dir == STHREAD_CHAN_RECV)
+      w->c->value = NULL;
+    w->c->err = EPIPE;
+    w->next = woken;
+    woken = w;
+  }
+  pthread_mutex_unlock(&chan->guard);
+  while (woken != NULL) {
+    w = woken;
+    woken = w->next;
+    sthread_pthread_chan_wake(w->sel);
+  }
+}
+
+/**********************************************************************/
+/* I/O                                                                */
+/**********************************************************************/
+
+/* A kernel thread blocking in the kernel blocks only itself, so these
+ * are just the system calls. */
+
+ssize_t sthread_pthread_read(int fd, void *buf, size_t count) {
+  return read(fd, buf, count);
+}
+
+ssize_t sthread_pthread_write(int fd, const void *buf, size_t count) {
+  const char *p = (const char*)buf;
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < count) {
+    n = write(fd, p + done, count - done);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      return (done > 0) ? (ssize_t)done : -1;
+    done += n;
+  }
+  return done;
+}
+
+int sthread_pthread_accept(int fd, struct sockaddr *addr, socklen_t *len) {
+  return accept(fd, addr, len);
+}
+
+int sthread_pthread_connect(int fd, const struct sockaddr *addr,
+                            socklen_t len) {
+  return connect(fd, addr, len);
+}
+
+/* Statistics. The kernel already counts what each kernel thread does,
+ * in /proc/self/task/<tid>/, so a thread's figures are those of its
+ * carrier, since the carrier started. Totals of run time and switches
+ * come from getrusage(), which includes threads that have exited; the
+ * other totals only cover the live threads. */
+
+/* Fill in c (all but mutex_contended) and state for the kernel thread
+ * tid, which started at the given time. Returns -1 if it has gone. */
+static int sthread_pthread_task_stats(pid_t tid, uint64_t started,
+                                      uint64_t now, sthread_counters_t *c,
+                                      char *state) {
+  char path[64], line[256], *p;
+  unsigned long long run, wait;
+  FILE *f;
+  int ok;
+
+  snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", (int)tid);
+  if ((f = fopen(path, "r")) == NULL)
+    return -1;
+  ok = (fscanf(f, "%llu %llu", &run, &wait) == 2);
+  fclose(f);
+  if (!ok)
+    return -1;
+  c->run_ns = run;
+  c->runnable_ns = wait;
+  c->blocked_ns = (now - started > run + wait) ? now - started - run - wait
+                                               : 0;
+
+  snprintf(path, sizeof(path), "/proc/self/task/%d/status", (int)tid);
+  if ((f = fopen(path, "r")) == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    sscanf(line, "voluntary_ctxt_switches: %lu", &c->voluntary_switches);
+    sscanf(line, "nonvoluntary_ctxt_switches: %lu",
+           &c->involuntary_switches);
+    /* "State:\tS (sleeping)": R covers running and waiting to run. */
+    if (strncmp(line, "State:", 6) == 0) {
+      for (p = line + 6; *p == ' ' || *p == '\t'; p++)
+        ;
+      *state = (*p == 'R') ? 'R' : 'B';
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+void sthread_pthread_stats_snapshot(sthread_stats_t *stats) {
+  sthread_thread_stats_t *ts;
+  struct rusage ru;
+  sthread_t t;
+  pid_t tid;
+  uint64_t now, started;
+
+  pthread_mutex_lock(&all_lock);
+  now = sthread_pthread_now();
+  stats->nthreads = nall_threads + 1;
+  stats->threads = (sthread_thread_stats_t*)calloc(
+      stats->nthreads, sizeof(sthread_thread_stats_t));
+  assert(stats->threads != NULL);
+  stats->threads_created = threads_created;
+  stats->threads_exited = threads_exited;
+  stats->total.mutex_contended = exited_contended;
+
+  /* The main thread first, then the sthreads. */
+  ts = stats->threads;
+  strcpy(ts->name, "main");
+  ts->priority = STHREAD_PRIORITY_DEFAULT;
+  ts->state = 'R';
+  sthread_pthread_task_stats(getpid(), main_started, now, &ts->counters,
+                             &ts->state);
+  ts->counters.mutex_contended = main_contended;
+  for (t = all_threads; t != NULL; t = t->all_next) {
+    ts++;
+    ts->thread = t;
+    strcpy(ts->name, t->name);
+    spin_lock(&t->lock);
+    ts->priority = t->priority;
+    tid = t->tid;
+    started = t->carrier_started;
+    spin_unlock(&t->lock);
+    /* Not yet picked up by a carrier. */
+    ts->state = 'W';
+    if (tid != 0)
+      sthread_pthread_task_stats(tid, started, now, &ts->counters,
+                                 &ts->state);
+    ts->counters.mutex_contended = t->mutex_contended;
+  }
+  for (ts = stats->threads; ts < stats->threads + stats->nthreads; ts++)
+    sthread_counters_add(&stats->total, &ts->counters);
+  pthread_mutex_unlock(&all_lock);
+
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+    stats->total.run_ns =
+        (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+    stats->total.voluntary_switches = ru.ru_nvcsw;
+    stats->total.involuntary_switches = ru.ru_nivcsw;
+  }
 }
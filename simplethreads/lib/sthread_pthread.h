@@ -11,10 +11,14 @@
 
 void sthread_pthread_init(void);
 sthread_t sthread_pthread_create(
-    sthread_start_func_t start_routine, void *arg, int joinable);
+    sthread_start_func_t start_routine, void *arg, int joinable,
+    const struct _sthread_attr *attr);
 void sthread_pthread_exit(void *ret);
 void sthread_pthread_yield(void);
 void* sthread_pthread_join(sthread_t t);
+void **sthread_pthread_specific(void);
+void sthread_pthread_sleep_usec(unsigned long usec);
+void sthread_pthread_set_priority(sthread_t t, int priority);
 
 sthread_mutex_t sthread_pthread_mutex_init(void);
 void sthread_pthread_mutex_free(sthread_mutex_t lock);
@@ -26,5 +30,36 @@ void sthread_pthread_cond_signal(sthread_cond_t cond);
 void sthread_pthread_cond_broadcast(sthread_cond_t cond);
 void sthread_pthread_cond_wait(
     sthread_cond_t cond, sthread_mutex_t lock);
+int sthread_pthread_cond_timedwait(
+    sthread_cond_t cond, sthread_mutex_t lock, unsigned long usec);
+sthread_rwlock_t sthread_pthread_rwlock_init(sthread_rwlock_pref_t pref);
+void sthread_pthread_rwlock_free(sthread_rwlock_t lock);
+void sthread_pthread_rwlock_rdlock(sthread_rwlock_t lock);
+void sthread_pthread_rwlock_wrlock(sthread_rwlock_t lock);
+void sthread_pthread_rwlock_unlock(sthread_rwlock_t lock);
+sthread_sem_t sthread_pthread_sem_init(unsigned int value);
+void sthread_pthread_sem_free(sthread_sem_t sem);
+void sthread_pthread_sem_wait(sthread_sem_t sem);
+int sthread_pthread_sem_trywait(sthread_sem_t sem);
+void sthread_pthread_sem_post(sthread_sem_t sem);
+sthread_barrier_t sthread_pthread_barrier_init(unsigned int count);
+void sthread_pthread_barrier_free(sthread_barrier_t barrier);
+int sthread_pthread_barrier_wait(sthread_barrier_t barrier);
+
+sthread_chan_t sthread_pthread_chan_init(unsigned int capacity);
+void sthread_pthread_chan_free(sthread_chan_t chan);
+int sthread_pthread_chan_send(sthread_chan_t chan, void *value);
+int sthread_pthread_chan_recv(sthread_chan_t chan, void **value);
+void sthread_pthread_chan_close(sthread_chan_t chan);
+int sthread_pthread_chan_select(
+    sthread_chan_case_t *cases, int ncases, int block);
+
+ssize_t sthread_pthread_read(int fd, void *buf, size_t count);
+ssize_t sthread_pthread_write(int fd, const void *buf, size_t count);
+int sthread_pthread_accept(int fd, struct sockaddr *addr, socklen_t *len);
+int sthread_pthread_connect(
+    int fd, const struct sockaddr *addr, socklen_t len);
+
+void sthread_pthread_stats_snapshot(sthread_stats_t *stats);
 
 #endif /* STHREAD_PTHREAD_H */
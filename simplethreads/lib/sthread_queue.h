@@ -1,11 +1,17 @@
 /* Note: sthread_queue_t is not synchronized. If used from multiple
  * threads, it is the users responsibility to provide suitable mutual
- * exclusion. The sthread queue library maintains a global free list
- * from which it allocates links, so even if all queues are freed via
- * sthread_free_queue(), Valgrind will still report memory as "in use
- * at exit". Applications or libraries building on the sthread library
- * may use sthread_queue_clear_free_list() to free the memory associated
- * with this free list prior to exit in order to avoid such reports.
+ * exclusion.
+ *
+ * Queues are intrusive: the links live in the threads themselves, so
+ * enqueueing and dequeueing never allocate memory or touch any state
+ * shared with other queues. This means that a thread can be on at most
+ * one queue at a time, and that the implementation's struct _sthread
+ * must begin with an sthread_queue_link_t:
+ *
+ *   struct _sthread {
+ *     sthread_queue_link_t qlink;   (must be first)
+ *     ...
+ *   };
  */
 
 #ifndef STHREAD_QUEUE_H
@@ -16,29 +22,42 @@
 struct _sthread_queue;
 typedef struct _sthread_queue* sthread_queue_t;
 
+/* The queue bookkeeping embedded in each thread. Zero-filled, it means
+ * "not on any queue". */
+typedef struct _sthread_queue_link {
+  struct _sthread_queue_link *next;
+  struct _sthread_queue_link *prev;
+  sthread_queue_t queue;   /* The queue this thread is on, or NULL */
+} sthread_queue_link_t;
+
 /* Create a new, empty queue */
 sthread_queue_t sthread_new_queue();
 
 /* Destroy the given queue. Asserts that the queue is empty. */
 void sthread_free_queue(sthread_queue_t queue);
 
-/* Add the given thread to the end of the queue */
+/* Add the given thread to the end of the queue. Asserts that the
+ * thread isn't already on a queue. */
 void sthread_enqueue(sthread_queue_t queue, sthread_t sth);
 
 /* Return, and remove, the next thread from the queue, or NULL
  * if queue is empty */
 sthread_t sthread_dequeue(sthread_queue_t queue);
 
+/* Remove the given thread from the queue, wherever it is in the queue,
+ * in constant time. Returns true if the thread was on the queue, or
+ * false (and does nothing) if it was not. */
+int sthread_queue_remove(sthread_queue_t queue, sthread_t sth);
+
 /* Return the number of threads currently in the queue */
 int sthread_queue_size(sthread_queue_t queue);
 
 /* Return true if queue has no threads, false otherwise */
 int sthread_queue_is_empty(sthread_queue_t queue);
 
-/* Clear the global free list associated with the sthread
- * queue library. In order to maintain efficiency of queue
- * insertions, this should be called a single time when
- * the sthread library has no further use for queues. */
+/* Queues used to allocate their links from a global free list, which
+ * this freed. Now that links are part of the threads, there is nothing
+ * to free; this is kept for programs that call it. */
 void sthread_queue_clear_free_list(void);
 
 #endif /* STHREAD_QUEUE_H */
@@ -0,0 +1,138 @@
+/*
+ * sthread_ring.c - A bounded, lock-free MPMC ring of threads.
+ *
+ * This is Dmitry Vyukov's bounded MPMC queue. Each cell carries a
+ * sequence number saying whose turn it is: a cell at position pos is free
+ * for the producer that claims pos when its sequence is pos, and holds a
+ * thread for the consumer that claims pos when its sequence is pos + 1.
+ * Producers and consumers claim positions with a compare-and-swap on the
+ * enqueue and dequeue counters, so the only contention is between two
+ * producers or two consumers, and a producer never waits for a consumer
+ * (or vice versa) except when the ring is full (or empty).
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include <sthread.h>
+#include <sthread_ring.h>
+
+/* Keep the counters on separate cache lines, so that producers and
+ * consumers don't slow each other down. */
+#define CACHE_LINE 64
+
+struct _sthread_ring_cell {
+  size_t seq;
+  sthread_t sth;
+};
+
+struct _sthread_ring {
+  struct _sthread_ring_cell *cells;
+  size_t mask;
+  char pad0[CACHE_LINE - sizeof(void*) - sizeof(size_t)];
+  size_t enqueue_pos;
+  char pad1[CACHE_LINE - sizeof(size_t)];
+  size_t dequeue_pos;
+  char pad2[CACHE_LINE - sizeof(size_t)];
+};
+
+sthread_ring_t sthread_new_ring(int capacity) {
+  sthread_ring_t ring;
+  size_t i;
+
+  assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+  if (posix_memalign((void**)&ring, CACHE_LINE,
+                     sizeof(struct _sthread_ring)) != 0)
+    ring = NULL;
+  assert(ring != NULL);
+  ring->cells = (struct _sthread_ring_cell*)malloc(
+      capacity * sizeof(struct _sthread_ring_cell));
+  assert(ring->cells != NULL);
+
+  ring->mask = capacity - 1;
+  for (i = 0; i < (size_t)capacity; i++) {
+    ring->cells[i].seq = i;
+    ring->cells[i].sth = NULL;
+  }
+  ring->enqueue_pos = 0;
+  ring->dequeue_pos = 0;
+  return ring;
+}
+
+void sthread_free_ring(sthread_ring_t ring) {
+  assert(sthread_ring_size(ring) == 0);
+  free(ring->cells);
+  free(ring);
+}
+
+int sthread_ring_push(sthread_ring_t ring, sthread_t sth) {
+  struct _sthread_ring_cell *cell;
+  size_t pos, seq;
+  intptr_t dif;
+
+  pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    cell = &ring->cells[pos & ring->mask];
+    seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    dif = (intptr_t)seq - (intptr_t)pos;
+    if (dif == 0) {
+      /* The cell is free; try to claim it. */
+      if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (dif < 0) {
+      /* The cell still holds the thread pushed one lap ago: full. */
+      return 0;
+    } else {
+      /* Another producer claimed pos first. */
+      pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->sth = sth;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+sthread_t sthread_ring_pop(sthread_ring_t ring) {
+  struct _sthread_ring_cell *cell;
+  size_t pos, seq;
+  intptr_t dif;
+  sthread_t sth;
+
+  pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    cell = &ring->cells[pos & ring->mask];
+    seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    dif = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (dif == 0) {
+      /* The cell holds a thread; try to claim it. */
+      if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (dif < 0) {
+      /* Nothing has been pushed into the cell yet: empty. */
+      return NULL;
+    } else {
+      /* Another consumer claimed pos first. */
+      pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  sth = cell->sth;
+  /* Free the cell for the producer one lap from now. */
+  __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+  return sth;
+}
+
+int sthread_ring_size(sthread_ring_t ring) {
+  size_t enq, deq;
+
+  deq = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+  enq = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+  /* Consumers may have moved past a snapshot of enqueue_pos. */
+  return (enq > deq) ? (int)(enq - deq) : 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * sthread_ring.h - A bounded, lock-free, multi-producer multi-consumer
+ *                  FIFO of threads.
+ *
+ * Unlike sthread_queue_t, an sthread_ring_t may be used by several
+ * kernel threads at once without any locking: any number of them can
+ * push and pop concurrently. It holds at most a fixed number of threads,
+ * set when it is created; a push to a full ring fails, and the caller
+ * has to put the thread somewhere else.
+ *
+ * The ring doesn't use the thread's queue link, so a thread on a ring
+ * is not on an sthread_queue_t, but the ring can't tell if a thread is
+ * pushed twice: that is up to the caller.
+ */
+
+#ifndef STHREAD_RING_H
+#define STHREAD_RING_H 1
+
+#include <sthread.h>
+
+typedef struct _sthread_ring *sthread_ring_t;
+
+/* Create a new, empty ring with room for capacity threads, which must be
+ * a power of two. */
+sthread_ring_t sthread_new_ring(int capacity);
+
+/* Destroy the given ring. Asserts that the ring is empty. */
+void sthread_free_ring(sthread_ring_t ring);
+
+/* Add the given thread to the end of the ring. Returns true, or false
+ * if the ring is full. */
+int sthread_ring_push(sthread_ring_t ring, sthread_t sth);
+
+/* Return, and remove, the next thread from the ring, or NULL if the
+ * ring is empty. A pop that races with a push may return NULL although
+ * the pushed thread is about to become visible. */
+sthread_t sthread_ring_pop(sthread_ring_t ring);
+
+/* Return the number of threads in the ring. Only a snapshot, since
+ * other kernel threads may be pushing and popping. */
+int sthread_ring_size(sthread_ring_t ring);
+
+#endif /* STHREAD_RING_H */
@@ -0,0 +1,17 @@
+/*
+ * sthread_stats.h - Helpers for the implementations' statistics. The
+ *                   statistics API itself is described in the sthread.h
+ *                   file.
+ *
+ */
+
+#ifndef STHREAD_STATS_H
+#define STHREAD_STATS_H 1
+
+#include <sthread.h>
+
+/* Add the counters in c to sum. */
+void sthread_counters_add(sthread_counters_t *sum,
+                          const sthread_counters_t *c);
+
+#endif /* STHREAD_STATS_H */
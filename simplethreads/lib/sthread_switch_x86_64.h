@@ -6,12 +6,16 @@
  * void Xsthread_switch(char **old_sp, char *new_sp)
  *   Save the currently running thread's context on its stack, switch to
  *   the new thread by swapping in its stack pointer, then pop that thread's
- *   context off of the stack and return. The state that we store on the
- *   stack includes all of the general-purpose registers; note that we
- *   DON'T store other state that makes up "context" such as the floating-
- *   point registers, MMX registers, and so on. So, this means that this
- *   code may not work (may cause mysterious bugs) for threads in a program
- *   that uses these floating-point / SIMD registers.
+ *   context off of the stack and return. Xsthread_switch is only ever
+ *   called as an ordinary C function (a preempted thread gets here from
+ *   its signal handler, and the kernel saved everything else in the
+ *   signal frame), so the only state we have to store is the state that
+ *   the System V ABI says a called function must preserve: the callee-
+ *   saved registers rbx, rbp and r12-r15, and the control bits of the
+ *   SSE and x87 units (MXCSR and the x87 control word), which hold the
+ *   rounding mode and exception masks. Everything else is dead across
+ *   the call as far as the caller is concerned, so SSE/AVX code can run
+ *   in threads without its registers being saved here.
  *
  * We put this code in a .S file, instead of using the gcc 'asm (...)' syntax,
  * to make it more robust (this way, the compiler won't change _anything_, and
@@ -51,15 +55,26 @@ void Xsthread_switch(char **old_sp, char *new_sp);
 void Xsthread_switch_end();
 
 /* This value tells the stack-setup code (sthread_new_ctx(), sthread_init_stack())
- * how much space (in bytes) we need on the stack to store the general-purpose
- * registers that make up a thread's context. On x86_64 architectures, there
- * are 16 64-bit (8-byte) general-purpose registers; however, we don't store
- * the stack pointer register on the stack, because we store it separately in
- * the thread context structures and pass it as an argument to this function.
- * Therefore, we only need room for 15 registers in our stack context (and so
- * there are 15 pushes and 15 pops in the code below).
+ * how much space (in bytes) we need on the stack to store a thread's
+ * context: the six callee-saved general-purpose registers, plus 8 bytes
+ * holding MXCSR (at offset 0) and the x87 control word (at offset 4).
  */
-#define STHREAD_CONTEXT_SIZE (15*8)
+#define STHREAD_CONTEXT_SIZE (7*8)
+
+/* Fill in the MXCSR and x87 control word of a new context saved at sp.
+ * As with pthread_create(), a new thread inherits them from the thread
+ * that creates it.
+ */
+#define STHREAD_CONTEXT_INIT(sp) \
+  __asm__ __volatile__("stmxcsr (%0)\n\tfnstcw 4(%0)" : : "r"(sp) : "memory")
+
+/* On entry to a function, the stack pointer must be 8 bytes past a
+ * 16-byte boundary (the call having pushed the return address onto an
+ * aligned stack), or compiler-generated SSE code will fault. A new
+ * thread's start function is entered by "ret" rather than "call", so
+ * sthread_init_stack() pads its initial frame by this much.
+ */
+#define STHREAD_START_PAD 8
 
 #else  /* in assembly mode */
 
@@ -70,17 +85,13 @@ void Xsthread_switch_end();
 
     /* in C terms: void Xsthread_switch(char **old_sp, char *new_sp) */
     Xsthread_switch:
-    /* Push register state onto our current (old) stack. The i386 pusha
-     * and popa instructions no longer work in 64-bit mode, so instead
-     * we explicitly push all of the general-purpose registers here.
-     * We don't push any of the floating-point or special purpose
-     * registers (e.g. MMX, SSE, and other SIMD registers). Also, we
-     * ignore the stack pointer register RSP, because we store it directly
-     * in our thread context structures and pass it as an argument to this
-     * code (see the documentation for the i386 POPA instruction: it also
-     * ignores the ESP register when restoring the register state).
-     * Specifying the 64-bit registers as operands causes the stack pointer
-     * to be decremented by 8 bytes.
+    /* Push register state onto our current (old) stack. Only the
+     * registers that the calling convention says are preserved across a
+     * call need saving; the caller of Xsthread_switch has already
+     * assumed that the others (rax, rcx, rdx, rsi, rdi, r8-r11) are
+     * clobbered. We ignore the stack pointer register RSP, because we
+     * store it directly in our thread context structures and pass it as
+     * an argument to this code.
      *
      * The amount of data pushed onto the stack here (and popped off later
      * on) must match STHREAD_CONTEXT_SIZE!
@@ -93,22 +104,20 @@ void Xsthread_switch_end();
      * is that the registers are popped in the opposite order that they
      * were pushed.
      */
-    push %rax
-    push %rbx
-    push %rcx
-    push %rdx
-    push %rdi
-    push %rsi
     push %rbp
-    push %r8
-    push %r9
-    push %r10
-    push %r11
+    push %rbx
     push %r12
     push %r13
     push %r14
     push %r15
 
+    /* Save the SSE control/status register and the x87 control word
+     * below them. (The x87 and SSE data registers are all caller-saved.)
+     */
+    sub $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+
     /* Save old stack into memory at *old_sp; old_sp is passed to us in
      * register rdi. The stack pointer on x86_64 is rsp, rather than esp;
      * the Intel documentation for the PUSH instruction says that "in
@@ -120,22 +129,28 @@ void Xsthread_switch_end();
     /* Load new stack from new_sp, which is passed to us in register rsi. */
     movq %rsi, %rsp
 
-    /* Pop saved registers off new stack: */
+    /* Restore the new thread's control words. Loading them is slow
+     * (each load serializes the FPU), and nearly always they are the
+     * same as the old thread's, which are still in the old stack's
+     * frame at (%rdi), so only load the ones that differ.
+     */
+    movq (%rdi), %rax
+    movl (%rsp), %ecx
+    cmpl %ecx, (%rax)
+    je 1f
+    ldmxcsr (%rsp)
+1:  movw 4(%rsp), %cx
+    cmpw %cx, 4(%rax)
+    je 2f
+    fldcw 4(%rsp)
+2:  add $8, %rsp
+
     pop %r15
     pop %r14
     pop %r13
     pop %r12
-    pop %r11
-    pop %r10
-    pop %r9
-    pop %r8
-    pop %rbp
-    pop %rsi
-    pop %rdi
-    pop %rdx
-    pop %rcx
     pop %rbx
-    pop %rax
+    pop %rbp
 
     /* Return to whatever PC the current (new) stack tells us to: */
     ret
@@ -0,0 +1,302 @@
+/*
+ * sthread_task.c - Tasks: functions run to completion by a fixed set of
+ *                  worker threads, without a stack or a thread of their
+ *                  own. Built on the public API, so the same code serves
+ *                  every implementation.
+ *
+ * Each worker has a work-stealing deque (sthread_deque.c). A task
+ * spawned by a task goes on the bottom of its worker's deque, and the
+ * worker takes its next task from there, newest first; a worker whose
+ * deque is empty steals the oldest task of another, picked at random.
+ * Tasks spawned by other threads go on a shared queue under a mutex.
+ * Workers with nothing to do sleep on a semaphore, and a spawn wakes
+ * one of them.
+ *
+ * A worker waiting for a task runs other tasks (its own first, which
+ * is usually the one it is waiting for) until that one is done, so
+ * tasks can wait for the tasks they spawn without tying up workers.
+ * Any other thread blocks on its own semaphore, which the task posts
+ * when it completes.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <sthread.h>
+#include <sthread_deque.h>
+#include <sthread_task.h>
+
+/* The size each worker's deque starts at. */
+#define TASK_DEQUE_SIZE 256
+
+/* A task's state: pending, then done. A thread that isn't a worker
+ * waits by replacing TASK_PENDING with its semaphore, and then for
+ * TASK_RELEASED, which says that the task has finished posting it. */
+#define TASK_PENDING  ((uintptr_t)0)
+#define TASK_DONE     ((uintptr_t)1)
+#define TASK_RELEASED ((uintptr_t)2)
+
+struct _sthread_task {
+  sthread_start_func_t start_routine;
+  void *arg;
+  void *result;
+  uintptr_t state;
+  /* Links the task into the shared queue. */
+  sthread_task_t next;
+};
+
+typedef struct {
+  sthread_deque_t deque;
+  /* Picks the workers to steal from. */
+  uint32_t random;
+} sthread_task_worker_t;
+
+static sthread_task_worker_t *workers;
+static int nworkers;
+static volatile int workers_started;
+
+/* The calling thread's worker, if it is one; and each thread's
+ * semaphore for waiting on tasks. */
+static sthread_key_t worker_key, wait_key;
+
+/* Tasks spawned by threads that aren't workers. */
+static sthread_mutex_t shared_lock;
+static sthread_task_t shared_head, shared_tail;
+static volatile int nshared;
+
+/* Workers about to sleep on wake, less the posts already made for
+ * them. */
+static sthread_sem_t wake;
+static volatile int sleepers;
+
+static void sthread_task_free_sem(void *sem) {
+  sthread_sem_free((sthread_sem_t)sem);
+}
+
+void sthread_task_init(void) {
+  if (sthread_key_create(&worker_key, NULL) != 0 ||
+      sthread_key_create(&wait_key, sthread_task_free_sem) != 0) {
+    fprintf(stderr, "sthread_task_init: out of keys\n");
+    abort();
+  }
+  shared_lock = sthread_mutex_init();
+  wake = sthread_sem_init(0);
+}
+
+/* Run the task and tell whoever waits for it. */
+static void sthread_task_run(sthread_task_t task) {
+  uintptr_t waiter;
+
+  task->result = task->start_routine(task->arg);
+  waiter = __atomic_exchange_n(&task->state, TASK_DONE, __ATOMIC_ACQ_REL);
+  if (waiter != TASK_PENDING) {
+    sthread_sem_post((sthread_sem_t)waiter);
+    __atomic_store_n(&task->state, TASK_RELEASED, __ATOMIC_RELEASE);
+  }
+}
+
+/* Find a task for worker w to run: its own newest, then a shared one,
+ * then another worker's oldest. Returns NULL if there are none. */
+static sthread_task_t sthread_task_find(sthread_task_worker_t *w) {
+  sthread_task_t task;
+  uint32_t x;
+  int i, victim;
+
+  task = (sthread_task_t)sthread_deque_pop(w->deque);
+  if (task != NULL)
+    return task;
+
+  if (nshared > 0) {
+    sthread_mutex_lock(shared_lock);
+    task = shared_head;
+    if (task != NULL) {
+      shared_head = task->next;
+      if (shared_head == NULL)
+        shared_tail = NULL;
+      nshared--;
+    }
+    sthread_mutex_unlock(shared_lock);
+    if (task != NULL)
+      return task;
+  }
+
+  x = w->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  w->random = x;
+  victim = x % nworkers;
+  for (i = 0; i < nworkers; i++) {
+    if (&workers[victim] != w) {
+      task = (sthread_task_t)sthread_deque_steal(workers[victim].deque);
+      if (task != NULL)
+        return task;
+    }
+    victim = (victim + 1) % nworkers;
+  }
+  return NULL;
+}
+
+/* Wake one sleeping worker, if any. */
+static void sthread_task_wake_one(void) {
+  int n;
+
+  /* The new task must be visible before we look for sleepers, as their
+   * announcement is before they look for tasks. */
+  __sync_synchronize();
+  while ((n = sleepers) > 0) {
+    if (__sync_bool_compare_and_swap(&sleepers, n, n - 1)) {
+      sthread_sem_post(wake);
+      return;
+    }
+  }
+}
+
+static void *sthread_task_worker_main(void *arg) {
+  sthread_task_worker_t *w = (sthread_task_worker_t*)arg;
+  sthread_task_t task;
+  int n;
+
+  sthread_setspecific(worker_key, w);
+  for (;;) {
+    task = sthread_task_find(w);
+    if (task == NULL) {
+      /* Say we are going to sleep, and then look again, so that a
+       * spawn either sees us or we see its task. */
+      __sync_fetch_and_add(&sleepers, 1);
+      task = sthread_task_find(w);
+      if (task == NULL) {
+        sthread_sem_wait(wake);
+        continue;
+      }
+      /* Take back our announcement, unless a spawn has already posted
+       * for it, in which case the post is ours to take. */
+      for (;;) {
+        n = sleepers;
+        if (n == 0) {
+          sthread_sem_wait(wake);
+          break;
+        }
+        if (__sync_bool_compare_and_swap(&sleepers, n, n - 1))
+          break;
+      }
+    }
+    sthread_task_run(task);
+  }
+  return NULL;
+}
+
+/* Start the workers: STHREAD_TASK_WORKERS of them, or one per CPU. */
+static void sthread_task_start(void) {
+  const char *env;
+  sthread_attr_t attr;
+  long n;
+  int i;
+
+  sthread_mutex_lock(shared_lock);
+  if (workers_started) {
+    sthread_mutex_unlock(shared_lock);
+    return;
+  }
+  env = getenv("STHREAD_TASK_WORKERS");
+  n = (env != NULL && *env != '\0') ? strtol(env, NULL, 10) : 0;
+  if (n <= 0)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  nworkers = (n < 1) ? 1 : (int)n;
+  workers = (sthread_task_worker_t*)calloc(nworkers,
+                                           sizeof(sthread_task_worker_t));
+  assert(workers != NULL);
+  for (i = 0; i < nworkers; i++) {
+    workers[i].deque = sthread_new_deque(TASK_DEQUE_SIZE);
+    workers[i].random = i + 1;
+  }
+  attr = sthread_attr_init();
+  sthread_attr_setname(attr, "task-worker");
+  for (i = 0; i < nworkers; i++) {
+    if (sthread_create_attr(sthread_task_worker_main, &workers[i], 0,
+                            attr) == NULL) {
+      fprintf(stderr, "sthread_task_start: sthread_create failed\n");
+      abort();
+    }
+  }
+  sthread_attr_free(attr);
+  __atomic_store_n(&workers_started, 1, __ATOMIC_RELEASE);
+  sthread_mutex_unlock(shared_lock);
+}
+
+sthread_task_t sthread_task_spawn(sthread_start_func_t start_routine,
+                                  void *arg) {
+  sthread_task_worker_t *w;
+  sthread_task_t task;
+
+  if (!__atomic_load_n(&workers_started, __ATOMIC_ACQUIRE))
+    sthread_task_start();
+  task = (sthread_task_t)malloc(sizeof(struct _sthread_task));
+  assert(task != NULL);
+  task->start_routine = start_routine;
+  task->arg = arg;
+  task->result = NULL;
+  task->state = TASK_PENDING;
+
+  w = (sthread_task_worker_t*)sthread_getspecific(worker_key);
+  if (w != NULL) {
+    sthread_deque_push(w->deque, task);
+  } else {
+    task->next = NULL;
+    sthread_mutex_lock(shared_lock);
+    if (shared_tail != NULL)
+      shared_tail->next = task;
+    else
+      shared_head = task;
+    shared_tail = task;
+    nshared++;
+    sthread_mutex_unlock(shared_lock);
+  }
+  sthread_task_wake_one();
+  return task;
+}
+
+void *sthread_task_wait(sthread_task_t task) {
+  sthread_task_worker_t *w;
+  sthread_task_t other;
+  sthread_sem_t sem;
+  uintptr_t pending = TASK_PENDING;
+  void *result;
+
+  w = (sthread_task_worker_t*)sthread_getspecific(worker_key);
+  if (w != NULL) {
+    /* Keep our worker busy until the task is done. */
+    while (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) == TASK_PENDING) {
+      other = sthread_task_find(w);
+      if (other != NULL)
+        sthread_task_run(other);
+      else
+        sthread_yield();
+    }
+  } else if (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) ==
+             TASK_PENDING) {
+    sem = (sthread_sem_t)sthread_getspecific(wait_key);
+    if (sem == NULL) {
+      sem = sthread_sem_init(0);
+      sthread_setspecific(wait_key, sem);
+    }
+    if (__atomic_compare_exchange_n(&task->state, &pending, (uintptr_t)sem,
+                                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      sthread_sem_wait(sem);
+      /* Don't free the task (or, should we exit, the semaphore) until
+       * the worker is done posting. */
+      while (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) !=
+             TASK_RELEASED)
+        sthread_yield();
+    }
+  }
+
+  result = task->result;
+  free(task);
+  return result;
+}
@@ -0,0 +1,14 @@
+/*
+ * sthread_task.h - Setting up tasks. The task API itself is described
+ *                  in the sthread.h file.
+ *
+ */
+
+#ifndef STHREAD_TASK_H
+#define STHREAD_TASK_H 1
+
+/* Create what the task workers share; called by sthread_init(). The
+ * workers themselves start with the first task. */
+void sthread_task_init(void);
+
+#endif /* STHREAD_TASK_H */
@@ -0,0 +1,267 @@
+/*
+ * sthread_timer.c - A hierarchical timing wheel.
+ *
+ * This is the scheme of Varghese and Lauck's "Hashed and Hierarchical
+ * Timing Wheels", as used by the Linux kernel's timers: see
+ * sthread_timer.h for an overview. Each level also keeps a bitmap of its
+ * non-empty slots, so that finding the next deadline, and skipping over
+ * stretches of time with nothing to expire, don't have to look at every
+ * slot.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <assert.h>
+
+#include <sthread_timer.h>
+
+#define LEVELS 4
+#define SLOT_BITS 6
+#define SLOTS (1 << SLOT_BITS)
+#define SLOT_MASK (SLOTS - 1)
+
+/* Timers further away than this many ticks go in the last slot that
+ * reaches (and are moved on from there as time passes). */
+#define MAX_DELTA ((1ULL << (LEVELS * SLOT_BITS)) - 1)
+
+struct _sthread_timer_wheel {
+  lock_t lock;
+  /* Time of tick 0. */
+  uint64_t base;
+  /* The next tick to process: every timer due before it has expired. */
+  uint64_t now;
+  int npending;
+  /* Bit i of occupied[l] is set if slots[l][i] has any timers. */
+  uint64_t occupied[LEVELS];
+  sthread_timer_t *slots[LEVELS][SLOTS];
+};
+
+uint64_t sthread_timer_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+sthread_timer_wheel_t sthread_new_timer_wheel(void) {
+  sthread_timer_wheel_t wheel;
+
+  wheel = (sthread_timer_wheel_t)calloc(1,
+                                        sizeof(struct _sthread_timer_wheel));
+  assert(wheel != NULL);
+  wheel->base = sthread_timer_now();
+  return wheel;
+}
+
+void sthread_free_timer_wheel(sthread_timer_wheel_t wheel) {
+  assert(wheel->npending == 0);
+  free(wheel);
+}
+
+void sthread_init_timer(sthread_timer_t *timer, sthread_timer_func_t func) {
+  timer->next = timer->prev = NULL;
+  timer->expires = 0;
+  timer->slot = -1;
+  timer->running = 0;
+  timer->func = func;
+}
+
+/* Put timer in the slot for its deadline. The wheel must be locked. */
+static void sthread_timer_insert(sthread_timer_wheel_t wheel,
+                                 sthread_timer_t *timer) {
+  uint64_t expires = timer->expires, delta;
+  int level, index;
+
+  if (expires < wheel->now)
+    expires = wheel->now;
+  delta = expires - wheel->now;
+  if (delta > MAX_DELTA) {
+    delta = MAX_DELTA;
+    expires = wheel->now + MAX_DELTA;
+  }
+  for (level = 0; delta >= (1ULL << (SLOT_BITS * (level + 1))); level++)
+    ;
+  index = (expires >> (SLOT_BITS * level)) & SLOT_MASK;
+
+  timer->slot = level * SLOTS + index;
+  timer->prev = NULL;
+  timer->next = wheel->slots[level][index];
+  if (timer->next != NULL)
+    timer->next->prev = timer;
+  wheel->slots[level][index] = timer;
+  wheel->occupied[level] |= 1ULL << index;
+}
+
+/* Take timer out of its slot. The wheel must be locked. */
+static void sthread_timer_unlink(sthread_timer_wheel_t wheel,
+                                 sthread_timer_t *timer) {
+  int level = timer->slot / SLOTS, index = timer->slot % SLOTS;
+
+  if (timer->prev != NULL)
+    timer->prev->next = timer->next;
+  else
+    wheel->slots[level][index] = timer->next;
+  if (timer->next != NULL)
+    timer->next->prev = timer->prev;
+  if (wheel->slots[level][index] == NULL)
+    wheel->occupied[level] &= ~(1ULL << index);
+  timer->next = timer->prev = NULL;
+  timer->slot = -1;
+}
+
+void sthread_timer_add(sthread_timer_wheel_t wheel, sthread_timer_t *timer,
+                       uint64_t deadline) {
+  assert(timer->slot == -1);
+  spin_lock(&wheel->lock);
+  /* Round up, so that a timer never expires before its deadline. */
+  if (deadline <= wheel->base)
+    timer->expires = 0;
+  else
+    timer->expires = (deadline - wheel->base + STHREAD_TIMER_TICK_NS - 1) /
+        STHREAD_TIMER_TICK_NS;
+  sthread_timer_insert(wheel, timer);
+  wheel->npending++;
+  spin_unlock(&wheel->lock);
+}
+
+int sthread_timer_del(sthread_timer_wheel_t wheel, sthread_timer_t *timer) {
+  int pending = 0;
+
+  spin_lock(&wheel->lock);
+  if (timer->slot >= 0) {
+    sthread_timer_unlink(wheel, timer);
+    wheel->npending--;
+    pending = 1;
+  }
+  spin_unlock(&wheel->lock);
+
+  /* sthread_timer_run() sets running before it unlocks the wheel. */
+  while (timer->running)
+    __asm__ __volatile__("pause" ::: "memory");
+  return pending;
+}
+
+/* Called at each multiple of SLOTS ticks, before the timers of the
+ * tick are expired: move the timers of the slot of level 1 that has
+ * come due down to level 0, and so on up the levels whose slots have
+ * also come due. The wheel must be locked. */
+static void sthread_timer_cascade(sthread_timer_wheel_t wheel) {
+  sthread_timer_t *timer, *next;
+  int level, index;
+
+  for (level = 1; level < LEVELS; level++) {
+    index = (wheel->now >> (SLOT_BITS * level)) & SLOT_MASK;
+    timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    wheel->occupied[level] &= ~(1ULL << index);
+    for (; timer != NULL; timer = next) {
+      next = timer->next;
+      sthread_timer_insert(wheel, timer);
+    }
+    if (index != 0)
+      break;
+  }
+}
+
+int sthread_timer_run(sthread_timer_wheel_t wheel, uint64_t now) {
+  sthread_timer_t *expired = NULL, **tail = &expired, *timer, *next;
+  uint64_t target;
+  int index, n = 0;
+
+  if (now < wheel->base)
+    return 0;
+  target = (now - wheel->base) / STHREAD_TIMER_TICK_NS;
+  /* Let whoever has the wheel locked expire the timers. */
+  if (target < wheel->now || atomic_test_and_set(&wheel->lock))
+    return 0;
+
+  while (wheel->now <= target) {
+    if (wheel->npending == 0) {
+      wheel->now = target + 1;
+      break;
+    }
+    index = wheel->now & SLOT_MASK;
+    if (index == 0)
+      sthread_timer_cascade(wheel);
+    if (wheel->occupied[0] & (1ULL << index)) {
+      for (timer = wheel->slots[0][index]; timer != NULL; timer = next) {
+        next = timer->next;
+        timer->slot = -1;
+        timer->prev = NULL;
+        timer->running = 1;
+        *tail = timer;
+        tail = &timer->next;
+        wheel->npending--;
+      }
+      *tail = NULL;
+      wheel->slots[0][index] = NULL;
+      wheel->occupied[0] &= ~(1ULL << index);
+    }
+    wheel->now++;
+    /* With level 0 empty, nothing can happen until the next cascade. */
+    if (wheel->occupied[0] == 0) {
+      wheel->now = (wheel->now + SLOT_MASK) & ~(uint64_t)SLOT_MASK;
+      if (wheel->now > target + 1)
+        wheel->now = target + 1;
+    }
+  }
+  spin_unlock(&wheel->lock);
+
+  for (timer = expired; timer != NULL; timer = next) {
+    next = timer->next;
+    timer->next = NULL;
+    timer->func(timer);
+    /* The owner may free the timer as soon as this is clear. */
+    __atomic_store_n(&timer->running, 0, __ATOMIC_RELEASE);
+    n++;
+  }
+  return n;
+}
+
+/* The first set bit of bits at or after index, counting round from the
+ * top back to 0, as an offset from index. bits must not be 0. */
+static int sthread_timer_next_bit(uint64_t bits, int index) {
+  if (index != 0)
+    bits = (bits >> index) | (bits << (SLOTS - index));
+  return __builtin_ctzll(bits);
+}
+
+uint64_t sthread_timer_next(sthread_timer_wheel_t wheel) {
+  uint64_t next = UINT64_MAX, start, bucket;
+  int level, shift, offset;
+
+  spin_lock(&wheel->lock);
+  if (wheel->npending == 0) {
+    spin_unlock(&wheel->lock);
+    return UINT64_MAX;
+  }
+
+  /* A slot of level 0 holds the timers of exactly one tick. */
+  if (wheel->occupied[0] != 0)
+    next = wheel->now + sthread_timer_next_bit(wheel->occupied[0],
+                                               wheel->now & SLOT_MASK);
+
+  /* A higher level only tells us when its timers will be cascaded. The
+   * slot for the current bucket holds that bucket's timers if it hasn't
+   * been cascaded yet (we are at its very start), and otherwise the
+   * timers of the bucket a full turn of the level later. */
+  for (level = 1; level < LEVELS; level++) {
+    if (wheel->occupied[level] == 0)
+      continue;
+    shift = SLOT_BITS * level;
+    bucket = wheel->now >> shift;
+    offset = sthread_timer_next_bit(wheel->occupied[level],
+                                    bucket & SLOT_MASK);
+    if (offset == 0 && (wheel->now & ((1ULL << shift) - 1)) != 0)
+      offset = SLOTS;
+    start = (bucket + offset) << shift;
+    if (start < next)
+      next = start;
+  }
+  spin_unlock(&wheel->lock);
+
+  return wheel->base + next * STHREAD_TIMER_TICK_NS;
+}
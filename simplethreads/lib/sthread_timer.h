@@ -0,0 +1,84 @@
+/*
+ * sthread_timer.h - A hierarchical timing wheel.
+ *
+ * A wheel keeps timers in four levels of 64 slots. Level 0 has one slot
+ * per tick (STHREAD_TIMER_TICK_NS) for the next 64 ticks, level 1 one
+ * slot per 64 ticks for the next 64*64, and so on; a timer is put in the
+ * slot that covers its deadline, on the lowest level that reaches that
+ * far. As time passes, the timers in a slot of a higher level are moved
+ * down ("cascaded") to the level below when their slot comes due. So
+ * adding and removing a timer are constant time, and so is expiring
+ * one, less the few times it is moved down a level.
+ *
+ * Timers are intrusive, like the links of sthread_queue.h: an
+ * sthread_timer_t lives in whatever it times (a thread, for example),
+ * and the wheel never allocates memory.
+ *
+ * A wheel may be used by several kernel threads at once; it has its own
+ * lock, a spinlock, so callers must have interrupts disabled (see
+ * sthread_preempt.h).
+ */
+
+#ifndef STHREAD_TIMER_H
+#define STHREAD_TIMER_H 1
+
+#include <stdint.h>
+
+#include <sthread_preempt.h>
+
+/* The length of a tick, in nanoseconds: timers expire at most this long
+ * after their deadline (plus however long it takes until the wheel is
+ * next run). */
+#define STHREAD_TIMER_TICK_NS 1000000ULL
+
+/* Deadlines are in nanoseconds of the monotonic clock; this returns the
+ * current time. */
+uint64_t sthread_timer_now(void);
+
+typedef struct _sthread_timer sthread_timer_t;
+typedef void (*sthread_timer_func_t)(sthread_timer_t *timer);
+
+struct _sthread_timer {
+  sthread_timer_t *next;
+  sthread_timer_t *prev;
+  uint64_t expires;            /* in ticks */
+  int slot;                    /* where it is in the wheel, or -1 */
+  volatile int running;        /* func is being called */
+  sthread_timer_func_t func;
+};
+
+typedef struct _sthread_timer_wheel *sthread_timer_wheel_t;
+
+/* Create a new wheel with no timers. */
+sthread_timer_wheel_t sthread_new_timer_wheel(void);
+
+/* Destroy the given wheel. Asserts that it has no timers. */
+void sthread_free_timer_wheel(sthread_timer_wheel_t wheel);
+
+/* Set up a timer that will call func when it expires. */
+void sthread_init_timer(sthread_timer_t *timer, sthread_timer_func_t func);
+
+/* Start the given timer, which must not be pending, so that it expires
+ * at the given deadline. */
+void sthread_timer_add(sthread_timer_wheel_t wheel, sthread_timer_t *timer,
+                       uint64_t deadline);
+
+/* Stop the given timer. Returns true if it was pending, or false if it
+ * had already expired (or was never started). If its function is being
+ * called by another kernel thread, waits for that to finish, so that
+ * once this returns the timer can be freed. */
+int sthread_timer_del(sthread_timer_wheel_t wheel, sthread_timer_t *timer);
+
+/* Expire every timer whose deadline is at or before now, calling their
+ * functions without the wheel locked, so they may add and delete
+ * timers. Returns the number expired. If another kernel thread is
+ * already running the wheel, returns 0 and leaves the work to it. */
+int sthread_timer_run(sthread_timer_wheel_t wheel, uint64_t now);
+
+/* Return a time at or before the earliest deadline of any pending timer,
+ * or UINT64_MAX if there are none: when to next run the wheel. This may
+ * be earlier than any deadline, when timers only need moving down a
+ * level. */
+uint64_t sthread_timer_next(sthread_timer_wheel_t wheel);
+
+#endif /* STHREAD_TIMER_H */
@@ -0,0 +1,182 @@
+/*
+ * sthread_trace.c - A trace of scheduling events.
+ *
+ * See sthread_trace.h. The rings are only ever added to, never freed:
+ * a ring whose kernel thread has exited still holds its events.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include <sthread.h>
+#include <sthread_trace.h>
+
+/* Events each ring holds; a power of two. */
+#define STHREAD_TRACE_EVENTS (1 << 16)
+
+typedef struct _sthread_trace_ring {
+  uint32_t tid;
+  /* Events recorded so far; the next one goes in
+   * events[next % STHREAD_TRACE_EVENTS]. */
+  uint64_t next;
+  struct _sthread_trace_ring *link;
+  sthread_trace_event_t events[STHREAD_TRACE_EVENTS];
+} sthread_trace_ring_t;
+
+int sthread_tracing = 0;
+
+static const char *trace_path;
+static uint64_t tsc_start, ns_start;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static sthread_trace_ring_t *rings;
+static uint32_t nrings;
+static __thread sthread_trace_ring_t *self_ring;
+
+static uint64_t sthread_trace_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* The timestamp counter, where there is one, and otherwise the
+ * monotonic clock. */
+static inline uint64_t sthread_trace_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return sthread_trace_ns();
+#endif
+}
+
+static void sthread_trace_atexit(void) {
+  sthread_trace_write(NULL);
+}
+
+void sthread_trace_init(void) {
+  const char *path;
+
+  if (sthread_tracing)
+    return;
+  path = getenv("STHREAD_TRACE");
+  if (path == NULL || *path == '\0')
+    return;
+  trace_path = path;
+  ns_start = sthread_trace_ns();
+  tsc_start = sthread_trace_tsc();
+  sthread_tracing = 1;
+  sthread_trace_thread_init();
+  atexit(sthread_trace_atexit);
+}
+
+void sthread_trace_thread_init(void) {
+  sthread_trace_ring_t *ring;
+
+  if (!sthread_tracing || self_ring != NULL)
+    return;
+  /* calloc()ed memory is mapped lazily, so a ring only costs the pages
+   * its thread has filled. */
+  ring = (sthread_trace_ring_t*)calloc(1, sizeof(sthread_trace_ring_t));
+  assert(ring != NULL);
+  ring->tid = (uint32_t)syscall(SYS_gettid);
+  pthread_mutex_lock(&rings_lock);
+  ring->link = rings;
+  rings = ring;
+  nrings++;
+  pthread_mutex_unlock(&rings_lock);
+  self_ring = ring;
+}
+
+void sthread_trace_record(int type, uint32_t thread, uint32_t other,
+                          int arg) {
+  sthread_trace_ring_t *ring = self_ring;
+  sthread_trace_event_t *e;
+
+  if (ring == NULL)
+    return;
+  e = &ring->events[ring->next & (STHREAD_TRACE_EVENTS - 1)];
+  e->tsc = sthread_trace_tsc();
+  e->thread = thread;
+  e->other = other;
+  e->type = (uint16_t)type;
+  e->arg = (uint16_t)arg;
+  e->reserved = 0;
+  ring->next++;
+}
+
+int sthread_trace_write(const char *path) {
+  sthread_trace_header_t header;
+  sthread_trace_ring_header_t rh;
+  sthread_trace_ring_t *ring;
+  uint64_t next, first;
+  size_t start;
+  FILE *f;
+  int ok = 1;
+
+  if (!sthread_tracing) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (path == NULL)
+    path = trace_path;
+  f = fopen(path, "wb");
+  if (f == NULL) {
+    perror("sthread_trace_write: can't open trace file");
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, STHREAD_TRACE_MAGIC, sizeof(header.magic));
+  header.event_size = sizeof(sthread_trace_event_t);
+  header.tsc_start = tsc_start;
+  header.ns_start = ns_start;
+  header.tsc_end = sthread_trace_tsc();
+  header.ns_end = sthread_trace_ns();
+
+  /* Other threads may go on recording while we write; at worst, a ring
+   * that wraps around meanwhile has a few of its oldest events replaced
+   * by newer ones. */
+  pthread_mutex_lock(&rings_lock);
+  header.nrings = nrings;
+  ok &= fwrite(&header, sizeof(header), 1, f) == 1;
+  for (ring = rings; ring != NULL; ring = ring->link) {
+    next = ring->next;
+    first = (next > STHREAD_TRACE_EVENTS) ? next - STHREAD_TRACE_EVENTS : 0;
+    rh.tid = ring->tid;
+    rh.nevents = (uint32_t)(next - first);
+    ok &= fwrite(&rh, sizeof(rh), 1, f) == 1;
+    /* Oldest first: from first to the end of the array, then from the
+     * start of the array. */
+    start = first & (STHREAD_TRACE_EVENTS - 1);
+    if (start + rh.nevents <= STHREAD_TRACE_EVENTS) {
+      ok &= fwrite(&ring->events[start], sizeof(sthread_trace_event_t),
+                   rh.nevents, f) == rh.nevents;
+    } else {
+      ok &= fwrite(&ring->events[start], sizeof(sthread_trace_event_t),
+                   STHREAD_TRACE_EVENTS - start, f) ==
+            STHREAD_TRACE_EVENTS - start;
+      ok &= fwrite(&ring->events[0], sizeof(sthread_trace_event_t),
+                   rh.nevents - (STHREAD_TRACE_EVENTS - start), f) ==
+            rh.nevents - (STHREAD_TRACE_EVENTS - start);
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  if (fclose(f) != 0)
+    ok = 0;
+  if (!ok) {
+    perror("sthread_trace_write: writing trace file failed");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * sthread_trace.h - A trace of scheduling events.
+ *
+ * When the STHREAD_TRACE environment variable names a file, the
+ * implementations record what their threads do (created, switched to
+ * and from, blocked, woken, exited, and timer ticks) as fixed-size
+ * binary events, each stamped with the CPU's timestamp counter. Every
+ * kernel thread records into a ring of its own, so recording takes no
+ * lock; when a ring is full its oldest events are overwritten, so the
+ * trace always holds the most recent events. The rings are written to
+ * the file when the program exits, or when sthread_trace_write() is
+ * called. tools/sthread-trace2json turns the file into Chrome trace JSON
+ * (for chrome://tracing or Perfetto).
+ *
+ * The file is a sthread_trace_header_t, followed by each ring: a
+ * sthread_trace_ring_header_t and then its events, oldest first.
+ *
+ * An event must be recorded by the kernel thread that owns the ring
+ * (so, in the user-level threads, with interrupts disabled, since the
+ * timer interrupt records events too).
+ */
+
+#ifndef STHREAD_TRACE_H
+#define STHREAD_TRACE_H 1
+
+#include <stdint.h>
+
+/* Event types. Threads are identified by a number: 1 is the main thread,
+ * and 0 a worker's idle thread. */
+#define STHREAD_TRACE_CREATE 1  /* thread created by other */
+#define STHREAD_TRACE_SWITCH 2  /* worker arg switched from thread to other */
+#define STHREAD_TRACE_BLOCK  3  /* thread blocked, for reason arg */
+#define STHREAD_TRACE_WAKE   4  /* thread made runnable by other (0 if
+                                 * unknown) */
+#define STHREAD_TRACE_EXIT   5  /* thread exited */
+#define STHREAD_TRACE_TICK   6  /* timer interrupt on worker arg, while
+                                 * thread ran */
+
+/* What a STHREAD_TRACE_BLOCK waits for. */
+#define STHREAD_TRACE_MUTEX   1
+#define STHREAD_TRACE_COND    2
+#define STHREAD_TRACE_JOIN    3
+#define STHREAD_TRACE_SLEEP   4
+#define STHREAD_TRACE_IO      5
+#define STHREAD_TRACE_RWLOCK  6
+#define STHREAD_TRACE_SEM     7
+#define STHREAD_TRACE_BARRIER 8
+#define STHREAD_TRACE_CHAN    9
+
+#define STHREAD_TRACE_MAGIC "STTRACE1"
+
+typedef struct {
+  char magic[8];            /* STHREAD_TRACE_MAGIC, without the NUL */
+  uint32_t nrings;
+  uint32_t event_size;      /* sizeof(sthread_trace_event_t) */
+  /* Timestamps, in counter ticks and in nanoseconds (CLOCK_MONOTONIC),
+   * from when tracing started and when the file was written, to convert
+   * the one into the other. */
+  uint64_t tsc_start, ns_start;
+  uint64_t tsc_end, ns_end;
+} sthread_trace_header_t;
+
+typedef struct {
+  uint32_t tid;             /* the kernel's id for the ring's thread */
+  uint32_t nevents;
+} sthread_trace_ring_header_t;
+
+typedef struct {
+  uint64_t tsc;
+  uint32_t thread;
+  uint32_t other;
+  uint16_t type;
+  uint16_t arg;
+  uint32_t reserved;
+} sthread_trace_event_t;
+
+/* Set if tracing is on. */
+extern int sthread_tracing;
+
+/* Turn tracing on if STHREAD_TRACE is set, and give the calling kernel
+ * thread a ring. Called by sthread_init(). */
+void sthread_trace_init(void);
+
+/* Give the calling kernel thread a ring, if tracing is on. Kernel
+ * threads without one record nothing. */
+void sthread_trace_thread_init(void);
+
+void sthread_trace_record(int type, uint32_t thread, uint32_t other,
+                          int arg);
+
+/* Record an event, if tracing is on. */
+#define sthread_trace(type, thread, other, arg)                  \
+  do {                                                           \
+    if (sthread_tracing)                                         \
+      sthread_trace_record((type), (thread), (other), (arg));    \
+  } while (0)
+
+#endif /* STHREAD_TRACE_H */
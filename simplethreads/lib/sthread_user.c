@@ -1,96 +1,2195 @@
 /* Simplethreads Instructional Thread Package
- * 
+ *
  * sthread_user.c - Implements the sthread API using user-level threads.
  *
- *    You need to implement the routines in this file.
+ *    User threads are multiplexed onto a set of "workers". A worker is
+ *    a kernel thread that runs user threads by switching between their
+ *    contexts with sthread_switch(). By default there is a single worker
+ *    (the kernel thread that called sthread_init()), which gives the
+ *    classic uniprocessor user-level threads package. Setting the
+ *    STHREAD_WORKERS environment variable to N > 1 starts N workers
+ *    (N = 0 means one per online CPU), so that CPU-bound sthreads can
+ *    use more than one core.
+ *
+ *    Every worker has its own run queue, with a level for each thread
+ *    priority; higher levels always run first. Threads made runnable by
+ *    a worker go on that worker's queue (or on the queue of the worker
+ *    the thread has affinity for), and a worker that runs out of work
+ *    steals half of another worker's highest non-empty level. A worker
+ *    with nothing to steal runs its idle thread, which sleeps until work
+ *    shows up.
+ *
+ *    The levels form a multi-level feedback queue. A thread's priority
+ *    is the highest level it can run at; it starts there, drops a level
+ *    each time it uses up a whole quantum (which is longer on lower
+ *    levels), and climbs back a level each time it blocks. So CPU-bound
+ *    threads sink and get long slices, and threads that mostly wait
+ *    (for I/O, a lock, a timer) stay near the top and are run soon
+ *    after they wake: a timer interrupt switches to a thread on a
+ *    higher level right away. Once every STHREAD_BOOST_TICKS ticks a
+ *    worker runs a thread from its lowest level, restored to its
+ *    priority, so no thread can starve.
+ *
+ *    Each level of a run queue is a lock-free ring (sthread_ring.h), so
+ *    that a worker can make a thread runnable on another worker, and
+ *    steal from it, without locking anything; only when a ring is full
+ *    do threads go on a locked overflow queue.
+ *
+ *    A thread that waits for a file descriptor (sthread_read() and
+ *    friends) is parked on the netpoller (sthread_netpoll.h) instead of
+ *    blocking its worker in the kernel. An idle worker waits in the
+ *    netpoller rather than on idle_cond while anyone is waiting for I/O,
+ *    and busy workers check it, without waiting, on each timer interrupt.
+ *
+ *    All scheduler state is manipulated with interrupts disabled
+ *    (splx(HIGH)). Other state shared between workers is additionally
+ *    protected by spin locks.
  *
  * Change Log:
  * 2002-04-15        rick
  *   - Initial version.
  */
 
+#include <config.h>
+
 #include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 #include <sthread.h>
 #include <sthread_queue.h>
+#include <sthread_ring.h>
 #include <sthread_user.h>
+#include <sthread_attr.h>
 #include <sthread_ctx.h>
-#include <sthread_user.h>
+#include <sthread_preempt.h>
+#include <sthread_timer.h>
+#include <sthread_netpoll.h>
+#include <sthread_stats.h>
+#include <sthread_trace.h>
+#include <sthread_key.h>
+
+/* Length of a time slice, in microseconds: the running thread is
+ * preempted this often. */
+static const int STHREAD_TIME_SLICE = 1000;
+
+/* A thread on level l of the run queue runs for up to this many time
+ * slices before it is moved down a level. */
+#define STHREAD_QUANTUM(l) (1 << (l))
+
+/* How often, in time slices, a worker makes sure that the threads on
+ * the lowest levels get to run. */
+#define STHREAD_BOOST_TICKS 50
+
+/* Most threads taken from another worker's run queue at once. */
+#define STHREAD_STEAL_MAX 32
+
+/* Number of threads each level of a run queue holds before it
+ * overflows; a power of two. */
+#define STHREAD_RUNQ_SIZE 256
+
+/* Most exited threads each worker keeps for reuse, and most kept in the
+ * shared list that takes the overflow. */
+#define STHREAD_CACHE_MAX 64
+#define STHREAD_FREE_MAX 1024
+
+typedef enum {
+  STHREAD_RUNNING,
+  STHREAD_RUNNABLE,
+  STHREAD_BLOCKED,
+  STHREAD_ZOMBIE
+} sthread_state_t;
 
 struct _sthread {
+  /* Links the thread into a run queue or a wait queue; must be first
+   * (see sthread_queue.h). */
+  sthread_queue_link_t qlink;
+  /* Identifies the thread in traces: 1 for the main thread, 0 for the
+   * idle threads. */
+  uint32_t id;
   sthread_ctx_t *saved_ctx;
-  /* Add your fields to the thread data structure here */
+  sthread_start_func_t start_routine;
+  void *arg;
+  void *ret;
+  int joinable;
+  sthread_state_t state;
+  /* The highest run queue level the thread may use, and the level the
+   * scheduler has it on, with the time slices it has used there. */
+  int priority;
+  int level;
+  int ticks;
+  /* The worker to queue this thread on, or -1 for any. */
+  int affinity;
+  char name[STHREAD_NAME_MAX];
+  /* Protects state and joiner while the thread exits. */
+  lock_t lock;
+  /* The thread blocked in sthread_join() on this one, if any. */
+  sthread_t joiner;
+  /* Wakes the thread from sthread_sleep_usec() or
+   * sthread_cond_timedwait(). */
+  sthread_timer_t timer;
+  sthread_cond_t wait_cond;
+  int timed_out;
+  /* Set if the thread has a default-size stack, so that once it exits
+   * the next sthread_user_create() can reuse it, context and all. */
+  int recycle;
+  sthread_t next_free;
+  /* What the thread has done so far, and when it last started running,
+   * waiting to run or blocking. Only the worker running the thread, or
+   * the one making it runnable, updates them. */
+  sthread_counters_t counters;
+  uint64_t since;
+  /* Links the thread into the list of live threads, for statistics. */
+  sthread_t all_prev, all_next;
+  /* The thread's values for the sthread_key_t keys. */
+  void *specific[STHREAD_KEYS_MAX];
 };
 
+typedef struct _sthread_worker {
+  int id;
+  pthread_t pth;
+  /* Timer interrupts taken, for STHREAD_BOOST_TICKS. */
+  unsigned long ticks;
+  /* Threads ready to run, by priority. Any worker may push onto and
+   * steal from it. */
+  sthread_ring_t runq[STHREAD_PRIORITY_LEVELS];
+  /* Where threads go when their level of runq is full; only the owner
+   * takes from it. */
+  lock_t overflow_lock;
+  sthread_queue_t overflow[STHREAD_PRIORITY_LEVELS];
+  volatile int noverflow;
+  /* The thread this worker is running, and the thread it runs when
+   * there is nothing else to do. */
+  sthread_t current;
+  sthread_t idle;
+  /* Work left for the next thread by the thread that switched away;
+   * see sthread_user_finish_switch(). */
+  sthread_t requeue;
+  sthread_t exited;
+  lock_t *unlock;
+  /* Exited threads for reuse; only this worker touches the list. */
+  sthread_t free_threads;
+  int nfree;
+  /* Set by the timer interrupt while it switches threads, so that the
+   * switch is counted as involuntary. */
+  int involuntary;
+  /* Picks among the cases of a select that can all go ahead. */
+  uint32_t random;
+} sthread_worker_t;
+
+static sthread_worker_t *workers;
+static int nworkers;
+/* Where exited threads go when their worker's list is full. */
+static lock_t free_lock;
+static sthread_t free_threads;
+static volatile int nfree_threads;
+/* Every live thread except the idle threads, and the counters of those
+ * that have exited. */
+static lock_t all_lock;
+static sthread_t all_threads;
+static int nall_threads;
+static unsigned long threads_created, threads_exited;
+static sthread_counters_t exited_counters;
+static sthread_t main_thread;
+static uint32_t last_thread_id = 1;
+static __thread sthread_worker_t *self_worker;
+
+/* Number of sthreads that have not exited yet. */
+static int live_threads;
+
+/* Idle workers sleep on idle_cond; idle_sleepers says whether a thread
+ * that makes work available needs to wake one of them up. They sleep
+ * until the next timer is due, and idle_deadline is when the last of
+ * them to go to sleep will wake (UINT64_MAX if never, or if it's awake),
+ * so that setting an earlier timer can wake it up. */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond;
+static volatile int idle_sleepers;
+static uint64_t idle_deadline = UINT64_MAX;
+
+/* Timers for sleeping threads and timed waits, shared by all workers.
+ * Every worker runs it on each timer interrupt, and idle workers when
+ * they wake up. */
+static sthread_timer_wheel_t timers;
+
+/* Threads waiting for file descriptors. While anyone is, one idle worker
+ * (the one that set idle_polling) waits in the netpoller instead of on
+ * idle_cond, until idle_poll_deadline at the latest; it is woken with
+ * sthread_netpoll_kick(). */
+static sthread_netpoll_t netpoll;
+static volatile int idle_polling;
+static volatile uint64_t idle_poll_deadline = UINT64_MAX;
+
+static sthread_worker_t *sthread_user_worker(void) __attribute__((noinline));
+static sthread_t sthread_user_alloc(sthread_ctx_t *ctx);
+static void sthread_user_free(sthread_t t);
+static sthread_t sthread_user_reuse(void);
+static void sthread_user_recycle(sthread_t t);
+static void sthread_user_link(sthread_t t);
+static void sthread_user_unlink(sthread_t t);
+static void sthread_user_ready(sthread_t t);
+static void sthread_user_woken(sthread_t t);
+static void sthread_user_handoff(sthread_t t);
+static sthread_t sthread_user_find_work(sthread_worker_t *w, int maxlevel);
+static sthread_t sthread_user_find_lowest(sthread_worker_t *w);
+static int sthread_user_has_work(sthread_worker_t *w);
+static void sthread_user_push(sthread_worker_t *w, sthread_t t);
+static sthread_t sthread_user_steal(sthread_worker_t *thief, int maxlevel);
+static void sthread_user_switch(sthread_worker_t *w, sthread_t next);
+static void sthread_user_finish_switch(void);
+static void sthread_user_block(lock_t *guard, int why);
+static void sthread_user_resched(sthread_worker_t *w, int maxlevel);
+static void sthread_user_reap(sthread_t t);
+static void sthread_user_start(void);
+static void sthread_user_preempt(void);
+static void sthread_user_idle_start(void);
+static void sthread_user_idle_loop(sthread_worker_t *w);
+static void sthread_user_idle_wait(void);
+static void sthread_user_idle_poll(void);
+static void *sthread_user_worker_main(void *arg);
+static void sthread_user_timer_add(sthread_t t, sthread_timer_func_t func,
+                                   unsigned long usec);
+static void sthread_user_io_ready(void *waiter);
 
 
 /*********************************************************************/
 /* Part 1: Creating and Scheduling Threads                           */
 /*********************************************************************/
 
+/* Decide how many workers to run, from STHREAD_WORKERS, or from
+ * default_workers if it isn't set. 0 means one per online CPU. */
+static int sthread_user_nworkers(int default_workers) {
+  const char *env = getenv("STHREAD_WORKERS");
+  long n;
+
+  if (env == NULL || *env == '\0')
+    n = default_workers;
+  else
+    n = strtol(env, NULL, 10);
+  if (n <= 0)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n < 1) ? 1 : (int)n;
+}
+
+/* Set up the scheduler, with default_workers workers unless
+ * STHREAD_WORKERS says otherwise. */
+static void sthread_user_init_workers(int default_workers) {
+  pthread_condattr_t cattr;
+  int i, j, err;
+
+  assert(offsetof(struct _sthread, qlink) == 0);
+  /* Idle workers sleep until a deadline of the (monotonic) timers. */
+  pthread_condattr_init(&cattr);
+  pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&idle_cond, &cattr);
+  pthread_condattr_destroy(&cattr);
+  timers = sthread_new_timer_wheel();
+  netpoll = sthread_new_netpoll(sthread_user_io_ready);
+
+  nworkers = sthread_user_nworkers(default_workers);
+  workers = (sthread_worker_t*)calloc(nworkers, sizeof(sthread_worker_t));
+  assert(workers != NULL);
+  for (i = 0; i < nworkers; i++) {
+    workers[i].id = i;
+    workers[i].random = i + 1;
+    for (j = 0; j < STHREAD_PRIORITY_LEVELS; j++) {
+      workers[i].runq[j] = sthread_new_ring(STHREAD_RUNQ_SIZE);
+      workers[i].overflow[j] = sthread_new_queue();
+    }
+  }
+
+  /* The calling thread becomes the first sthread, running on worker 0.
+   * Its context is filled in the first time it switches away. */
+  main_thread = sthread_user_alloc(sthread_new_blank_ctx());
+  main_thread->state = STHREAD_RUNNING;
+  main_thread->id = 1;
+  main_thread->since = sthread_timer_now();
+  strcpy(main_thread->name, "main");
+  sthread_user_link(main_thread);
+  live_threads = 1;
+
+  self_worker = &workers[0];
+  workers[0].current = main_thread;
+  workers[0].idle = sthread_user_alloc(
+      sthread_new_ctx(sthread_user_idle_start));
+
+  sthread_preemption_init(sthread_user_preempt, STHREAD_TIME_SLICE);
+
+  for (i = 1; i < nworkers; i++) {
+    err = pthread_create(&workers[i].pth, NULL, sthread_user_worker_main,
+                         &workers[i]);
+    if (err != 0) {
+      fprintf(stderr, "sthread_user_init: pthread_create failed: %s\n",
+              strerror(err));
+      abort();
+    }
+  }
+}
+
 void sthread_user_init(void) {
+  sthread_user_init_workers(1);
+}
+
+void sthread_user_init_mn(void) {
+  sthread_user_init_workers(0);
 }
 
 sthread_t sthread_user_create(sthread_start_func_t start_routine, void *arg,
-                              int joinable) {
-  return NULL;
+                              int joinable, const struct _sthread_attr *attr) {
+  sthread_t t;
+  sthread_ctx_t *ctx;
+  int old;
+
+  old = splx(HIGH);
+  if (attr->stacksize != 0 || (t = sthread_user_reuse()) == NULL) {
+    ctx = sthread_new_ctx_size(sthread_user_start, attr->stacksize);
+    if (ctx == NULL) {
+      splx(old);
+      return NULL;
+    }
+    t = sthread_user_alloc(ctx);
+    t->recycle = (attr->stacksize == 0);
+  }
+  t->start_routine = start_routine;
+  t->arg = arg;
+  t->joinable = joinable;
+  t->priority = t->level = attr->priority;
+  t->affinity = (attr->affinity < 0) ? -1 : attr->affinity % nworkers;
+  strcpy(t->name, attr->name);
+  memset(&t->counters, 0, sizeof(t->counters));
+  memset(t->specific, 0, sizeof(t->specific));
+  t->since = sthread_timer_now();
+  t->id = __sync_add_and_fetch(&last_thread_id, 1);
+  sthread_user_link(t);
+  __sync_fetch_and_add(&live_threads, 1);
+  sthread_trace(STHREAD_TRACE_CREATE, t->id,
+                sthread_user_worker()->current->id, 0);
+
+  sthread_user_ready(t);
+  splx(old);
+  return t;
 }
 
 void sthread_user_exit(void *ret) {
+  sthread_worker_t *w;
+  sthread_t next;
+
+  /* The destructors may block, so they run before anything else. */
+  sthread_key_run_destructors(sthread_user_specific());
+  splx(HIGH);
+  w = sthread_user_worker();
+  w->current->ret = ret;
+  sthread_trace(STHREAD_TRACE_EXIT, w->current->id, 0, 0);
+  /* Like pthreads, the process exits along with its last thread. */
+  if (__sync_sub_and_fetch(&live_threads, 1) == 0)
+    exit(0);
+
+  /* We are still running on our own stack, so the rest of the work
+   * (freeing it, or waking the joiner) is left to the next thread. */
+  w->exited = w->current;
+  next = sthread_user_find_work(w, STHREAD_PRIORITY_LEVELS - 1);
+  if (next == NULL)
+    next = w->idle;
+  sthread_user_switch(w, next);
+  assert(0); /* an exited thread is never switched back to */
 }
 
 void* sthread_user_join(sthread_t t) {
-  return NULL;
+  void *ret;
+  int old;
+
+  old = splx(HIGH);
+  spin_lock(&t->lock);
+  if (t->state != STHREAD_ZOMBIE) {
+    t->joiner = sthread_user_worker()->current;
+    sthread_user_block(&t->lock, STHREAD_TRACE_JOIN);
+    /* Only sthread_user_reap() wakes us, once t is a zombie. */
+  } else {
+    spin_unlock(&t->lock);
+  }
+  assert(t->state == STHREAD_ZOMBIE);
+
+  ret = t->ret;
+  sthread_user_recycle(t);
+  splx(old);
+  return ret;
+}
+
+/* The slots stay with the thread, but finding them means reading the
+ * worker's current thread, which must not change as we do. */
+void **sthread_user_specific(void) {
+  void **specific;
+  int old;
+
+  old = splx(HIGH);
+  specific = sthread_user_worker()->current->specific;
+  splx(old);
+  return specific;
 }
 
 void sthread_user_yield(void) {
+  int old;
+
+  old = splx(HIGH);
+  sthread_user_resched(sthread_user_worker(), STHREAD_PRIORITY_LEVELS - 1);
+  splx(old);
+}
+
+/* Called on each timer interrupt. The running thread keeps going until
+ * it has used up its quantum, and then makes way for the other threads
+ * on its new, lower level; before that, only for a higher level. */
+static void sthread_user_preempt(void) {
+  sthread_worker_t *w;
+  sthread_t t, next;
+  int old;
+
+  old = splx(HIGH);
+  sthread_timer_run(timers, sthread_timer_now());
+  /* Unless an idle worker is already waiting for them, see if any
+   * descriptors are ready. */
+  if (sthread_netpoll_waiting(netpoll) > 0 && !idle_polling)
+    sthread_netpoll_run(netpoll, 0);
+  w = sthread_user_worker();
+  t = w->current;
+  sthread_trace(STHREAD_TRACE_TICK, t->id, 0, w->id);
+  /* The idle thread finds work on its own. */
+  if (t != w->idle) {
+    w->involuntary = 1;
+    if (++w->ticks % STHREAD_BOOST_TICKS == 0 &&
+        (next = sthread_user_find_lowest(w)) != NULL) {
+      next->level = next->priority;
+      next->ticks = 0;
+      w->requeue = t;
+      sthread_user_switch(w, next);
+    } else if (++t->ticks >= STHREAD_QUANTUM(t->level)) {
+      if (t->level < STHREAD_PRIORITY_LEVELS - 1)
+        t->level++;
+      t->ticks = 0;
+      sthread_user_resched(w, t->level);
+    } else if (t->level > 0) {
+      sthread_user_resched(w, t->level - 1);
+    }
+    /* In case there was nothing to switch to. */
+    sthread_user_worker()->involuntary = 0;
+  }
+  splx(old);
+}
+
+void sthread_user_set_priority(sthread_t t, int priority) {
+  int old;
+
+  old = splx(HIGH);
+  if (t == NULL)
+    t = sthread_user_worker()->current;
+  t->priority = t->level = priority;
+  t->ticks = 0;
+  splx(old);
+}
+
+/* The worker running the calling thread. This must not be inlined:
+ * a user thread can move to another worker (a different kernel thread)
+ * across any switch, so callers must not reuse an earlier lookup of the
+ * thread-local variable. */
+static sthread_worker_t *sthread_user_worker(void) {
+  return self_worker;
+}
+
+static sthread_t sthread_user_alloc(sthread_ctx_t *ctx) {
+  sthread_t t;
+
+  assert(ctx != NULL);
+  t = (sthread_t)malloc(sizeof(struct _sthread));
+  assert(t != NULL);
+  memset(t, 0, sizeof(struct _sthread));
+  t->saved_ctx = ctx;
+  t->state = STHREAD_RUNNABLE;
+  t->priority = t->level = STHREAD_PRIORITY_DEFAULT;
+  t->affinity = -1;
+  sthread_init_timer(&t->timer, NULL);
+  return t;
 }
 
-/* Add any new part 1 functions here */
+static void sthread_user_free(sthread_t t) {
+  sthread_free_ctx(t->saved_ctx);
+  free(t);
+}
+
+/* Take an exited thread to reuse for a new one with a default-size
+ * stack, from the calling worker's list or else the shared one, and
+ * reset what sthread_user_create() doesn't set; returns NULL if there
+ * are none. Interrupts must be disabled. */
+static sthread_t sthread_user_reuse(void) {
+  sthread_worker_t *w = sthread_user_worker();
+  sthread_t t;
+
+  if ((t = w->free_threads) != NULL) {
+    w->free_threads = t->next_free;
+    w->nfree--;
+  } else if (nfree_threads > 0) {
+    spin_lock(&free_lock);
+    if ((t = free_threads) != NULL) {
+      free_threads = t->next_free;
+      nfree_threads--;
+    }
+    spin_unlock(&free_lock);
+  }
+  if (t == NULL)
+    return NULL;
+
+  sthread_reset_ctx(t->saved_ctx, sthread_user_start);
+  t->ret = NULL;
+  t->state = STHREAD_RUNNABLE;
+  t->ticks = 0;
+  t->lock = 0;
+  t->joiner = NULL;
+  t->wait_cond = NULL;
+  t->timed_out = 0;
+  return t;
+}
+
+/* Free a thread that has exited and that nobody refers to any more, or
+ * keep it for sthread_user_reuse(). Interrupts must be disabled. */
+static void sthread_user_recycle(sthread_t t) {
+  sthread_worker_t *w = sthread_user_worker();
+
+  if (t->recycle && w->nfree < STHREAD_CACHE_MAX) {
+    t->next_free = w->free_threads;
+    w->free_threads = t;
+    w->nfree++;
+    return;
+  }
+  if (t->recycle && nfree_threads < STHREAD_FREE_MAX) {
+    spin_lock(&free_lock);
+    t->next_free = free_threads;
+    free_threads = t;
+    nfree_threads++;
+    spin_unlock(&free_lock);
+    return;
+  }
+  sthread_user_free(t);
+}
+
+/* Add a new thread to the list of live threads. Interrupts must be
+ * disabled. */
+static void sthread_user_link(sthread_t t) {
+  spin_lock(&all_lock);
+  t->all_prev = NULL;
+  t->all_next = all_threads;
+  if (all_threads != NULL)
+    all_threads->all_prev = t;
+  all_threads = t;
+  nall_threads++;
+  threads_created++;
+  spin_unlock(&all_lock);
+}
+
+/* Take an exited thread off the list of live threads, keeping its
+ * counters. Interrupts must be disabled. */
+static void sthread_user_unlink(sthread_t t) {
+  spin_lock(&all_lock);
+  if (t->all_prev != NULL)
+    t->all_prev->all_next = t->all_next;
+  else
+    all_threads = t->all_next;
+  if (t->all_next != NULL)
+    t->all_next->all_prev = t->all_prev;
+  nall_threads--;
+  threads_exited++;
+  sthread_counters_add(&exited_counters, &t->counters);
+  spin_unlock(&all_lock);
+}
+
+/* Make t runnable on the calling worker (or the one it has affinity
+ * for), and wake an idle worker to steal it if there is one. Interrupts
+ * must be disabled. */
+static void sthread_user_ready(sthread_t t) {
+  sthread_worker_t *w;
+
+  if (t->affinity >= 0)
+    w = &workers[t->affinity];
+  else
+    w = sthread_user_worker();
+  if (t->state == STHREAD_BLOCKED)
+    sthread_user_woken(t);
+  t->state = STHREAD_RUNNABLE;
+  sthread_user_push(w, t);
+
+  __sync_synchronize();
+  if (idle_sleepers > 0) {
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+  } else if (idle_polling) {
+    sthread_netpoll_kick(netpoll);
+  }
+}
+
+/* Account for t, which was blocked, being woken up. */
+static void sthread_user_woken(sthread_t t) {
+  uint64_t now = sthread_timer_now();
+
+  t->counters.blocked_ns += now - t->since;
+  t->since = now;
+  sthread_trace(STHREAD_TRACE_WAKE, t->id,
+                sthread_user_worker()->current->id, 0);
+}
+
+/* Like sthread_user_ready(t), except that t, which must have finished
+ * switching out, runs right away in place of the calling thread, which
+ * goes back on the run queue. A thread that has just given t what it was
+ * blocked waiting for uses this to pass t the CPU along with it, rather
+ * than have t wait its turn while the data goes cold. If t may only run
+ * on another worker, it is just made runnable. Interrupts must be
+ * disabled. */
+static void sthread_user_handoff(sthread_t t) {
+  sthread_worker_t *w = sthread_user_worker();
+
+  if (t->affinity >= 0 && t->affinity != w->id) {
+    sthread_user_ready(t);
+    return;
+  }
+  if (t->state == STHREAD_BLOCKED)
+    sthread_user_woken(t);
+  t->state = STHREAD_RUNNABLE;
+  w->requeue = w->current;
+  sthread_user_switch(w, t);
+}
+
+/* Return the next thread w should run, from levels 0 to maxlevel of
+ * the run queues, or NULL if there is none. Interrupts must be
+ * disabled. */
+static sthread_t sthread_user_find_work(sthread_worker_t *w, int maxlevel) {
+  sthread_t t = NULL;
+  int prio;
+
+  for (prio = 0; prio <= maxlevel && t == NULL; prio++) {
+    t = sthread_ring_pop(w->runq[prio]);
+    if (t == NULL && w->noverflow > 0) {
+      spin_lock(&w->overflow_lock);
+      t = sthread_dequeue(w->overflow[prio]);
+      if (t != NULL)
+        w->noverflow--;
+      spin_unlock(&w->overflow_lock);
+    }
+  }
+
+  if (t == NULL && nworkers > 1)
+    t = sthread_user_steal(w, maxlevel);
+  return t;
+}
+
+/* Return a thread from the lowest non-empty level of w's run queue, or
+ * NULL if there is none. Interrupts must be disabled. */
+static sthread_t sthread_user_find_lowest(sthread_worker_t *w) {
+  sthread_t t = NULL;
+  int prio;
+
+  for (prio = STHREAD_PRIORITY_LEVELS - 1; prio >= 0 && t == NULL; prio--)
+    t = sthread_ring_pop(w->runq[prio]);
+  return t;
+}
+
+/* Return true if any level of w's run queue has a thread. Only a hint,
+ * since the queue isn't locked. */
+static int sthread_user_has_work(sthread_worker_t *w) {
+  int prio;
+
+  if (w->noverflow > 0)
+    return 1;
+  for (prio = 0; prio < STHREAD_PRIORITY_LEVELS; prio++) {
+    if (sthread_ring_size(w->runq[prio]) > 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Put t on w's run queue, which may belong to another worker. Interrupts
+ * must be disabled. */
+static void sthread_user_push(sthread_worker_t *w, sthread_t t) {
+  if (sthread_ring_push(w->runq[t->level], t))
+    return;
+  spin_lock(&w->overflow_lock);
+  sthread_enqueue(w->overflow[t->level], t);
+  w->noverflow++;
+  spin_unlock(&w->overflow_lock);
+}
+
+/* Take half of the highest non-empty level, no lower than maxlevel, of
+ * the run queue of the first worker that has any work, keeping all but
+ * one of the stolen threads on the thief's run queue. A victim's
+ * overflow queue is left to the victim. */
+static sthread_t sthread_user_steal(sthread_worker_t *thief, int maxlevel) {
+  sthread_worker_t *victim;
+  sthread_t first, t;
+  int i, n, count, prio;
+
+  for (i = 1; i < nworkers; i++) {
+    victim = &workers[(thief->id + i) % nworkers];
+    for (prio = 0; prio <= maxlevel; prio++) {
+      count = (sthread_ring_size(victim->runq[prio]) + 1) / 2;
+      if (count == 0)
+        continue;
+      if (count > STHREAD_STEAL_MAX)
+        count = STHREAD_STEAL_MAX;
+
+      first = sthread_ring_pop(victim->runq[prio]);
+      if (first == NULL)
+        continue;
+      for (n = 1; n < count; n++) {
+        if ((t = sthread_ring_pop(victim->runq[prio])) == NULL)
+          break;
+        sthread_user_push(thief, t);
+      }
+      return first;
+    }
+  }
+  return NULL;
+}
+
+/* Switch w from its current thread to next. Whoever set up the switch
+ * (in w->requeue, w->exited, w->unlock) has already decided what happens
+ * to the current thread. Interrupts must be disabled. When this returns,
+ * the calling thread has been switched back to, possibly on a different
+ * worker than w. */
+static void sthread_user_switch(sthread_worker_t *w, sthread_t next) {
+  sthread_t prev = w->current;
+  uint64_t now = sthread_timer_now();
+
+  if (prev != w->idle) {
+    prev->counters.run_ns += now - prev->since;
+    prev->since = now;
+    if (w->involuntary)
+      prev->counters.involuntary_switches++;
+    else
+      prev->counters.voluntary_switches++;
+  }
+  w->involuntary = 0;
+  sthread_trace(STHREAD_TRACE_SWITCH, prev->id, next->id, w->id);
+  if (next != w->idle) {
+    next->counters.runnable_ns += now - next->since;
+    next->since = now;
+  }
+  next->state = STHREAD_RUNNING;
+  w->current = next;
+  sthread_switch(prev->saved_ctx, next->saved_ctx);
+  sthread_user_finish_switch();
+}
+
+/* Finish a switch on behalf of the thread that was switched away from.
+ * Until its context has been saved another worker must not be able to
+ * run it (or free it), so putting it back on a run queue, releasing the
+ * lock of the wait queue it sleeps on, and cleaning up after an exit
+ * all happen here, in the thread that was switched to. */
+static void sthread_user_finish_switch(void) {
+  sthread_worker_t *w = sthread_user_worker();
+  sthread_t t;
+
+  if (w->unlock != NULL) {
+    spin_unlock(w->unlock);
+    w->unlock = NULL;
+  }
+  if ((t = w->requeue) != NULL) {
+    w->requeue = NULL;
+    sthread_user_ready(t);
+  }
+  if ((t = w->exited) != NULL) {
+    w->exited = NULL;
+    sthread_user_reap(t);
+  }
+}
+
+/* Block the calling thread, which the caller has already put on a wait
+ * queue. guard, if not NULL, is the lock protecting that queue; it is
+ * released once the thread is switched out. why is what the thread
+ * waits for, for the trace (STHREAD_TRACE_MUTEX, ...). Interrupts must
+ * be disabled. Returns once another thread has made this one
+ * runnable. */
+static void sthread_user_block(lock_t *guard, int why) {
+  sthread_worker_t *w = sthread_user_worker();
+  sthread_t self = w->current, next;
+
+  sthread_trace(STHREAD_TRACE_BLOCK, self->id, 0, why);
+
+  /* It didn't use up its quantum, so move it up a level. */
+  if (self->level > self->priority)
+    self->level--;
+  self->ticks = 0;
+
+  next = sthread_user_find_work(w, STHREAD_PRIORITY_LEVELS - 1);
+  if (next == NULL)
+    next = w->idle;
+  self->state = STHREAD_BLOCKED;
+  w->unlock = guard;
+  sthread_user_switch(w, next);
+}
+
+/* Give the rest of the current thread's time slice to the next runnable
+ * thread on levels 0 to maxlevel, if any. Interrupts must be disabled. */
+static void sthread_user_resched(sthread_worker_t *w, int maxlevel) {
+  sthread_t next;
+
+  next = sthread_user_find_work(w, maxlevel);
+  if (next != NULL) {
+    w->requeue = w->current;
+    sthread_user_switch(w, next);
+  }
+}
+
+/* Clean up after a thread that has exited and been switched away from:
+ * detached threads are freed, joinable ones become zombies for
+ * sthread_user_join(). */
+static void sthread_user_reap(sthread_t t) {
+  sthread_t joiner;
+  int joinable = t->joinable;
+
+  sthread_user_unlink(t);
+  if (!joinable) {
+    sthread_user_recycle(t);
+    return;
+  }
+  spin_lock(&t->lock);
+  t->state = STHREAD_ZOMBIE;
+  joiner = t->joiner;
+  spin_unlock(&t->lock);
+  /* t may already be freed by a joiner that didn't have to wait. */
+  if (joiner != NULL)
+    sthread_user_ready(joiner);
+}
+
+/* Every new thread starts here, called from the initial stack frame
+ * that sthread_new_ctx() sets up. */
+static void sthread_user_start(void) {
+  sthread_t self;
+
+  sthread_user_finish_switch();
+  self = sthread_user_worker()->current;
+  splx(LOW);
+  sthread_user_exit(self->start_routine(self->arg));
+}
+
+/* Worker 0's idle thread starts here. */
+static void sthread_user_idle_start(void) {
+  sthread_user_finish_switch();
+  sthread_user_idle_loop(sthread_user_worker());
+}
+
+/* Workers 1..N-1 start here, running their idle loop directly on the
+ * kernel thread's stack. */
+static void *sthread_user_worker_main(void *arg) {
+  sthread_worker_t *w = (sthread_worker_t*)arg;
+
+  self_worker = w;
+  sthread_trace_thread_init();
+  sthread_preemption_thread_init();
+  w->idle = sthread_user_alloc(sthread_new_blank_ctx());
+  w->idle->state = STHREAD_RUNNING;
+  w->current = w->idle;
+  sthread_user_idle_loop(w);
+  return NULL;
+}
+
+/* Run whatever work w can find; sleep when there is none. The idle
+ * thread is never put on a run queue, so it never leaves w. It sleeps
+ * with interrupts disabled: a tick taken while it holds idle_lock could
+ * run a timer that makes a thread runnable, and sthread_user_ready()
+ * would then wait for idle_lock forever. */
+static void sthread_user_idle_loop(sthread_worker_t *w) {
+  sthread_t next;
+
+  for (;;) {
+    splx(HIGH);
+    sthread_timer_run(timers, sthread_timer_now());
+    next = sthread_user_find_work(w, STHREAD_PRIORITY_LEVELS - 1);
+    if (next != NULL)
+      sthread_user_switch(w, next);
+    else
+      sthread_user_idle_wait();
+    splx(LOW);
+  }
+}
+
+/* Return true if any worker has a runnable thread. Only a hint, since
+ * the queues aren't locked. */
+static int sthread_user_work_pending(void) {
+  int i;
+
+  for (i = 0; i < nworkers; i++) {
+    if (sthread_user_has_work(&workers[i]))
+      return 1;
+  }
+  return 0;
+}
+
+/* Sleep until sthread_user_ready() signals that there is work, or
+ * until the next timer is due. */
+static void sthread_user_idle_wait(void) {
+  struct timespec deadline;
+  uint64_t next;
+
+  /* If threads are waiting for I/O, one idle worker waits for it. */
+  if (sthread_netpoll_waiting(netpoll) > 0 &&
+      __sync_lock_test_and_set(&idle_polling, 1) == 0) {
+    sthread_user_idle_poll();
+    return;
+  }
+
+  pthread_mutex_lock(&idle_lock);
+  idle_sleepers++;
+  __sync_synchronize();
+  next = sthread_timer_next(timers);
+  if (!sthread_user_work_pending() && next > sthread_timer_now()) {
+    idle_deadline = next;
+    if (next == UINT64_MAX) {
+      pthread_cond_wait(&idle_cond, &idle_lock);
+    } else {
+      deadline.tv_sec = next / 1000000000ULL;
+      deadline.tv_nsec = next % 1000000000ULL;
+      pthread_cond_timedwait(&idle_cond, &idle_lock, &deadline);
+    }
+    idle_deadline = UINT64_MAX;
+  }
+  idle_sleepers--;
+  pthread_mutex_unlock(&idle_lock);
+}
+
+/* Like sthread_user_idle_wait(), but wait in the netpoller, so that
+ * descriptors becoming ready wake us up too. The caller has set
+ * idle_polling, so sthread_user_ready() kicks the netpoller. */
+static void sthread_user_idle_poll(void) {
+  uint64_t next, now;
+  int old, timeout;
+
+  next = sthread_timer_next(timers);
+  idle_poll_deadline = next;
+  __sync_synchronize();
+  now = sthread_timer_now();
+  if (!sthread_user_work_pending() && next > now) {
+    if (next == UINT64_MAX)
+      timeout = -1;
+    else if (next - now >= (uint64_t)INT_MAX * 1000000)
+      timeout = INT_MAX;
+    else
+      timeout = (int)((next - now + 999999) / 1000000);
+    old = splx(HIGH);
+    sthread_netpoll_run(netpoll, timeout);
+    splx(old);
+  }
+  idle_poll_deadline = UINT64_MAX;
+  __sync_lock_release(&idle_polling);
+}
+
+/* Start t's timer, to call func in usec microseconds, and make sure an
+ * idle worker will be awake to run it. Interrupts must be disabled. */
+static void sthread_user_timer_add(sthread_t t, sthread_timer_func_t func,
+                                   unsigned long usec) {
+  uint64_t deadline = sthread_timer_now() + (uint64_t)usec * 1000;
+
+  sthread_init_timer(&t->timer, func);
+  sthread_timer_add(timers, &t->timer, deadline);
+
+  __sync_synchronize();
+  if (idle_sleepers > 0) {
+    pthread_mutex_lock(&idle_lock);
+    if (deadline < idle_deadline)
+      pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+  }
+  if (idle_polling && deadline < idle_poll_deadline)
+    sthread_netpoll_kick(netpoll);
+}
+
+/* The thread whose timer this is. */
+static sthread_t sthread_user_timer_thread(sthread_timer_t *timer) {
+  return (sthread_t)((char*)timer - offsetof(struct _sthread, timer));
+}
+
+/* A sleeping thread's timer expired: wake it up. Holding its lock makes
+ * sure it has finished switching out. */
+static void sthread_user_sleep_expired(sthread_timer_t *timer) {
+  sthread_t t = sthread_user_timer_thread(timer);
+
+  spin_lock(&t->lock);
+  sthread_user_ready(t);
+  spin_unlock(&t->lock);
+}
+
+void sthread_user_sleep_usec(unsigned long usec) {
+  sthread_t self;
+  int old;
+
+  if (usec == 0) {
+    sthread_user_yield();
+    return;
+  }
+
+  old = splx(HIGH);
+  self = sthread_user_worker()->current;
+  spin_lock(&self->lock);
+  sthread_user_timer_add(self, sthread_user_sleep_expired, usec);
+  sthread_user_block(&self->lock, STHREAD_TRACE_SLEEP);
+  /* Wait for sthread_user_sleep_expired() to be done with us. */
+  sthread_timer_del(timers, &self->timer);
+  splx(old);
+}
 
 
 /*********************************************************************/
 /* Part 2: Synchronization Primitives                                */
 /*********************************************************************/
 
+/* The mutex word is MUTEX_FREE, MUTEX_LOCKED, or MUTEX_CONTENDED (held,
+ * and there may be threads on the wait queue). Taking a free mutex and
+ * releasing one nobody is waiting for are a single compare-and-swap on
+ * the word; only when there are waiters do we need the guard. */
+#define MUTEX_FREE      0
+#define MUTEX_LOCKED    1
+#define MUTEX_CONTENDED 2
+
+/* A thread that finds the mutex held by a thread running on another
+ * worker spins this many times for it to be released before it goes on
+ * the wait queue, since a switch costs more than most critical sections. */
+#define MUTEX_SPINS 100
+
 struct _sthread_mutex {
-  /* Fill in mutex data structure */
+  lock_t word;
+  /* Protects waiters, and the hand-off of the mutex to a waiter. */
+  lock_t guard;
+  sthread_t volatile owner;
+  sthread_queue_t waiters;
 };
 
 sthread_mutex_t sthread_user_mutex_init() {
-  return NULL;
+  sthread_mutex_t lock;
+
+  lock = (sthread_mutex_t)malloc(sizeof(struct _sthread_mutex));
+  assert(lock != NULL);
+  lock->word = MUTEX_FREE;
+  lock->guard = 0;
+  lock->owner = NULL;
+  lock->waiters = sthread_new_queue();
+  return lock;
 }
 
 void sthread_user_mutex_free(sthread_mutex_t lock) {
+  assert(lock->word == MUTEX_FREE);
+  sthread_free_queue(lock->waiters);
+  free(lock);
+}
+
+/* Spin while the owner is running on another worker. Returns 1 if we got
+ * the mutex. */
+static int sthread_user_mutex_spin(sthread_mutex_t lock) {
+  sthread_t owner;
+  int i;
+
+  for (i = 0; i < MUTEX_SPINS; i++) {
+    if (lock->word == MUTEX_FREE) {
+      if (atomic_test_and_set(&lock->word) == MUTEX_FREE)
+        return 1;
+      continue;
+    }
+    owner = lock->owner;
+    if (owner == NULL || owner->state != STHREAD_RUNNING)
+      return 0;
+    __asm__ __volatile__("pause" ::: "memory");
+  }
+  return 0;
 }
 
 void sthread_user_mutex_lock(sthread_mutex_t lock) {
+  sthread_t self;
+  int old;
+
+  old = splx(HIGH);
+  self = sthread_user_worker()->current;
+  assert(lock->owner != self);
+  if (atomic_test_and_set(&lock->word) == MUTEX_FREE) {
+    lock->owner = self;
+    splx(old);
+    return;
+  }
+  self->counters.mutex_contended++;
+  if (nworkers > 1 && sthread_user_mutex_spin(lock)) {
+    lock->owner = self;
+    splx(old);
+    return;
+  }
+
+  spin_lock(&lock->guard);
+  if (atomic_swap(&lock->word, MUTEX_CONTENDED) == MUTEX_FREE) {
+    /* It was released after all. Nobody can be waiting (a mutex with
+     * waiters is handed off, never freed), so it isn't contended. */
+    lock->word = MUTEX_LOCKED;
+    lock->owner = self;
+    spin_unlock(&lock->guard);
+  } else {
+    sthread_enqueue(lock->waiters, self);
+    sthread_user_block(&lock->guard, STHREAD_TRACE_MUTEX);
+    /* The unlocking thread handed the mutex to us. */
+    assert(lock->owner == self);
+  }
+  splx(old);
 }
 
 void sthread_user_mutex_unlock(sthread_mutex_t lock) {
+  sthread_t next;
+  int old;
+
+  old = splx(HIGH);
+  assert(lock->owner == sthread_user_worker()->current);
+  lock->owner = NULL;
+  if (atomic_cmpxchg(&lock->word, MUTEX_LOCKED, MUTEX_FREE) == MUTEX_LOCKED) {
+    splx(old);
+    return;
+  }
+
+  spin_lock(&lock->guard);
+  /* Hand the mutex straight to the first waiter, so that it can't be
+   * taken away from it before it gets to run. */
+  next = sthread_dequeue(lock->waiters);
+  assert(next != NULL);
+  lock->owner = next;
+  lock->word = sthread_queue_is_empty(lock->waiters) ?
+      MUTEX_LOCKED : MUTEX_CONTENDED;
+  sthread_user_ready(next);
+  spin_unlock(&lock->guard);
+  splx(old);
 }
 
 
+/* Signal and broadcast don't wake waiters up to fight over the mutex:
+ * they move them straight onto the mutex's wait queue ("wait morphing"),
+ * where each is woken exactly once, when the mutex is handed to it. So a
+ * thread returning from sthread_user_block() in sthread_user_cond_wait()
+ * already holds the mutex. */
 struct _sthread_cond {
-  /* Fill in condition variable structure */
+  /* Protects waiters and mutex. */
+  lock_t guard;
+  sthread_queue_t waiters;
+  /* The mutex the waiters released; they must all use the same one. */
+  sthread_mutex_t mutex;
 };
 
 sthread_cond_t sthread_user_cond_init(void) {
-  return NULL;
+  sthread_cond_t cond;
+
+  cond = (sthread_cond_t)malloc(sizeof(struct _sthread_cond));
+  assert(cond != NULL);
+  cond->guard = 0;
+  cond->waiters = sthread_new_queue();
+  cond->mutex = NULL;
+  return cond;
 }
 
 void sthread_user_cond_free(sthread_cond_t cond) {
+  sthread_free_queue(cond->waiters);
+  free(cond);
+}
+
+/* Move up to max waiters of cond to the wait queue of its mutex. If the
+ * mutex is free, the first of them gets it and is made runnable. Called
+ * with interrupts off and cond->guard held. */
+static void sthread_user_cond_morph(sthread_cond_t cond, int max) {
+  sthread_mutex_t lock = cond->mutex;
+  sthread_t t, first = NULL;
+
+  if (sthread_queue_is_empty(cond->waiters))
+    return;
+
+  spin_lock(&lock->guard);
+  if (atomic_swap(&lock->word, MUTEX_CONTENDED) == MUTEX_FREE) {
+    first = sthread_dequeue(cond->waiters);
+    max--;
+  }
+  while (max-- > 0 && (t = sthread_dequeue(cond->waiters)) != NULL)
+    sthread_enqueue(lock->waiters, t);
+  if (first != NULL) {
+    lock->owner = first;
+    if (sthread_queue_is_empty(lock->waiters))
+      lock->word = MUTEX_LOCKED;
+    sthread_user_ready(first);
+  }
+  spin_unlock(&lock->guard);
 }
 
 void sthread_user_cond_signal(sthread_cond_t cond) {
+  int old;
+
+  old = splx(HIGH);
+  spin_lock(&cond->guard);
+  sthread_user_cond_morph(cond, 1);
+  spin_unlock(&cond->guard);
+  splx(old);
 }
 
 void sthread_user_cond_broadcast(sthread_cond_t cond) {
+  int old;
+
+  old = splx(HIGH);
+  spin_lock(&cond->guard);
+  sthread_user_cond_morph(cond, INT_MAX);
+  spin_unlock(&cond->guard);
+  splx(old);
 }
 
 void sthread_user_cond_wait(sthread_cond_t cond,
                             sthread_mutex_t lock) {
+  sthread_t self;
+  int old;
+
+  old = splx(HIGH);
+  self = sthread_user_worker()->current;
+  /* Get on the wait queue before releasing the mutex, so that a signal
+   * sent as soon as the mutex is free can't be missed. */
+  spin_lock(&cond->guard);
+  assert(cond->mutex == NULL || cond->mutex == lock ||
+         sthread_queue_is_empty(cond->waiters));
+  cond->mutex = lock;
+  sthread_enqueue(cond->waiters, self);
+  sthread_user_mutex_unlock(lock);
+  sthread_user_block(&cond->guard, STHREAD_TRACE_COND);
+  /* We were handed the mutex on the way out; see above. */
+  assert(lock->owner == self);
+  splx(old);
+}
+
+/* A timed wait's timer expired. If the thread is still waiting on the
+ * condition variable, take it off and wake it up without the mutex;
+ * otherwise it has just been signalled, and there's nothing to do. */
+static void sthread_user_cond_expired(sthread_timer_t *timer) {
+  sthread_t t = sthread_user_timer_thread(timer);
+  sthread_cond_t cond = t->wait_cond;
+
+  spin_lock(&cond->guard);
+  if (sthread_queue_remove(cond->waiters, t)) {
+    t->timed_out = 1;
+    sthread_user_ready(t);
+  }
+  spin_unlock(&cond->guard);
+}
+
+int sthread_user_cond_timedwait(sthread_cond_t cond, sthread_mutex_t lock,
+                                unsigned long usec) {
+  sthread_t self;
+  int old, timed_out;
+
+  old = splx(HIGH);
+  self = sthread_user_worker()->current;
+  spin_lock(&cond->guard);
+  assert(cond->mutex == NULL || cond->mutex == lock ||
+         sthread_queue_is_empty(cond->waiters));
+  cond->mutex = lock;
+  sthread_enqueue(cond->waiters, self);
+  self->wait_cond = cond;
+  self->timed_out = 0;
+  sthread_user_timer_add(self, sthread_user_cond_expired, usec);
+  sthread_user_mutex_unlock(lock);
+  sthread_user_block(&cond->guard, STHREAD_TRACE_COND);
+
+  /* Either way, wait for sthread_user_cond_expired() to be done with us. */
+  sthread_timer_del(timers, &self->timer);
+  timed_out = self->timed_out;
+  if (timed_out)
+    sthread_user_mutex_lock(lock);
+  assert(lock->owner == self);
+  splx(old);
+  return timed_out ? ETIMEDOUT : 0;
+}
+
+
+/* The reader-writer lock word holds the number of readers (in units of
+ * RWLOCK_READER), and two flags: RWLOCK_WRITER while a writer holds the
+ * lock, and RWLOCK_WAITERS while there may be threads on the wait
+ * queues. As with mutexes, taking and releasing the lock is a single
+ * compare-and-swap on the word as long as nobody has to wait; readers
+ * on different workers share it without touching anything else. Only
+ * threads that have to block, and the thread releasing the lock to
+ * them, take the guard. Waiters are handed the lock, as with mutexes: a
+ * thread returning from sthread_user_block() already holds it. */
+#define RWLOCK_WRITER  1
+#define RWLOCK_WAITERS 2
+#define RWLOCK_READER  4
+
+struct _sthread_rwlock {
+  lock_t word;
+  sthread_rwlock_pref_t pref;
+  /* Protects the wait queues, and the hand-off of the lock to them. */
+  lock_t guard;
+  sthread_t volatile writer;
+  sthread_queue_t read_waiters;
+  sthread_queue_t write_waiters;
+};
+
+sthread_rwlock_t sthread_user_rwlock_init(sthread_rwlock_pref_t pref) {
+  sthread_rwlock_t lock;
+
+  lock = (sthread_rwlock_t)malloc(sizeof(struct _sthread_rwlock));
+  assert(lock != NULL);
+  lock->word = 0;
+  lock->pref = pref;
+  lock->guard = 0;
+  lock->writer = NULL;
+  lock->read_waiters = sthread_new_queue();
+  lock->write_waiters = sthread_new_queue();
+  return lock;
+}
+
+void sthread_user_rwlock_free(sthread_rwlock_t lock) {
+  assert(lock->word == 0);
+  sthread_free_queue(lock->read_waiters);
+  sthread_free_queue(lock->write_waiters);
+  free(lock);
+}
+
+void sthread_user_rwlock_rdlock(sthread_rwlock_t lock) {
+  sthread_t self;
+  lock_t word;
+  int old;
+
+  old = splx(HIGH);
+  word = lock->word;
+  /* Readers go around waiting writers unless writers are preferred. */
+  while (!(word & RWLOCK_WRITER) &&
+         !(lock->pref == STHREAD_RWLOCK_PREFER_WRITERS &&
+           (word & RWLOCK_WAITERS))) {
+    if (atomic_cmpxchg(&lock->word, word, word + RWLOCK_READER) == word) {
+      splx(old);
+      return;
+    }
+    word = lock->word;
+  }
+
+  self = sthread_user_worker()->current;
+  spin_lock(&lock->guard);
+  for (;;) {
+    word = lock->word;
+    if (!(word & RWLOCK_WRITER) &&
+        !(lock->pref == STHREAD_RWLOCK_PREFER_WRITERS &&
+          !sthread_queue_is_empty(lock->write_waiters))) {
+      if (atomic_cmpxchg(&lock->word, word, word + RWLOCK_READER) == word) {
+        spin_unlock(&lock->guard);
+        break;
+      }
+    } else if (atomic_cmpxchg(&lock->word, word, word | RWLOCK_WAITERS) ==
+               word) {
+      sthread_enqueue(lock->read_waiters, self);
+      sthread_user_block(&lock->guard, STHREAD_TRACE_RWLOCK);
+      /* The releasing thread counted us in as a reader. */
+      break;
+    }
+  }
+  splx(old);
+}
+
+void sthread_user_rwlock_wrlock(sthread_rwlock_t lock) {
+  sthread_t self;
+  lock_t word;
+  int old;
+
+  old = splx(HIGH);
+  self = sthread_user_worker()->current;
+  assert(lock->writer != self);
+  if (atomic_cmpxchg(&lock->word, 0, RWLOCK_WRITER) == 0) {
+    lock->writer = self;
+    splx(old);
+    return;
+  }
+
+  spin_lock(&lock->guard);
+  for (;;) {
+    word = lock->word;
+    if ((word & ~RWLOCK_WAITERS) == 0) {
+      if (atomic_cmpxchg(&lock->word, word, word | RWLOCK_WRITER) == word) {
+        lock->writer = self;
+        spin_unlock(&lock->guard);
+        break;
+      }
+    } else if (atomic_cmpxchg(&lock->word, word, word | RWLOCK_WAITERS) ==
+               word) {
+      sthread_enqueue(lock->write_waiters, self);
+      sthread_user_block(&lock->guard, STHREAD_TRACE_RWLOCK);
+      /* The releasing thread made us the writer. */
+      assert(lock->writer == self);
+      break;
+    }
+  }
+  splx(old);
+}
+
+/* Release the lock held as mine (RWLOCK_WRITER or RWLOCK_READER) when
+ * there may be waiters: if nobody else holds it, hand it to the next
+ * writer, or to all of the waiting readers, as lock->pref says. Called
+ * with interrupts off. */
+static void sthread_user_rwlock_release(sthread_rwlock_t lock, lock_t mine) {
+  enum { TO_NOBODY, TO_WRITER, TO_READERS } handoff;
+  sthread_t t;
+  lock_t word, rest;
+
+  spin_lock(&lock->guard);
+  do {
+    word = lock->word;
+    rest = word - mine;
+    handoff = TO_NOBODY;
+    if (rest & ~RWLOCK_WAITERS) {
+      /* Other readers still hold it; the last of them hands it on. */
+    } else if (!sthread_queue_is_empty(lock->write_waiters) &&
+               (lock->pref == STHREAD_RWLOCK_PREFER_WRITERS ||
+                sthread_queue_is_empty(lock->read_waiters))) {
+      handoff = TO_WRITER;
+      rest = RWLOCK_WRITER;
+      if (sthread_queue_size(lock->write_waiters) > 1 ||
+          !sthread_queue_is_empty(lock->read_waiters))
+        rest |= RWLOCK_WAITERS;
+    } else {
+      handoff = TO_READERS;
+      rest = sthread_queue_size(lock->read_waiters) * RWLOCK_READER;
+      if (!sthread_queue_is_empty(lock->write_waiters))
+        rest |= RWLOCK_WAITERS;
+    }
+  } while (atomic_cmpxchg(&lock->word, word, rest) != word);
+
+  if (handoff == TO_WRITER) {
+    t = sthread_dequeue(lock->write_waiters);
+    lock->writer = t;
+    sthread_user_ready(t);
+  } else if (handoff == TO_READERS) {
+    while ((t = sthread_dequeue(lock->read_waiters)) != NULL)
+      sthread_user_ready(t);
+  }
+  spin_unlock(&lock->guard);
+}
+
+void sthread_user_rwlock_unlock(sthread_rwlock_t lock) {
+  lock_t word, mine;
+  int old;
+
+  old = splx(HIGH);
+  word = lock->word;
+  if (word & RWLOCK_WRITER) {
+    assert(lock->writer == sthread_user_worker()->current);
+    lock->writer = NULL;
+    mine = RWLOCK_WRITER;
+  } else {
+    assert(word >= RWLOCK_READER);
+    mine = RWLOCK_READER;
+  }
+  /* Without waiters, or with other readers left to hand the lock on,
+   * just let go of it. */
+  while (!(word & RWLOCK_WAITERS) ||
+         (mine == RWLOCK_READER && word >= 2 * RWLOCK_READER)) {
+    if (atomic_cmpxchg(&lock->word, word, word - mine) == word) {
+      splx(old);
+      return;
+    }
+    word = lock->word;
+  }
+  sthread_user_rwlock_release(lock, mine);
+  splx(old);
+}
+
+
+/* The semaphore word holds the value (in units of SEM_UNIT) and a flag,
+ * SEM_WAITERS, set while there are threads on the wait queue; the value
+ * is zero then. As with mutexes, waiting on a semaphore that is above
+ * zero, and posting one nobody waits for, are a single compare-and-swap.
+ * A post with waiters hands its unit straight to the first of them,
+ * without touching the value, so that no other thread can take it
+ * before the waiter gets to run. */
+#define SEM_WAITERS 1
+#define SEM_UNIT    2
+
+struct _sthread_sem {
+  lock_t word;
+  /* Protects waiters, and the hand-off of a unit to a waiter. */
+  lock_t guard;
+  sthread_queue_t waiters;
+};
+
+sthread_sem_t sthread_user_sem_init(unsigned int value) {
+  sthread_sem_t sem;
+
+  assert(value <= UINT32_MAX / SEM_UNIT);
+  sem = (sthread_sem_t)malloc(sizeof(struct _sthread_sem));
+  assert(sem != NULL);
+  sem->word = value * SEM_UNIT;
+  sem->guard = 0;
+  sem->waiters = sthread_new_queue();
+  return sem;
+}
+
+void sthread_user_sem_free(sthread_sem_t sem) {
+  assert(!(sem->word & SEM_WAITERS));
+  sthread_free_queue(sem->waiters);
+  free(sem);
+}
+
+/* Take a unit if there is one. Returns 1 if it did. */
+static int sthread_user_sem_take(sthread_sem_t sem) {
+  lock_t word = sem->word;
+
+  while (word >= SEM_UNIT) {
+    if (atomic_cmpxchg(&sem->word, word, word - SEM_UNIT) == word)
+      return 1;
+    word = sem->word;
+  }
+  return 0;
+}
+
+void sthread_user_sem_wait(sthread_sem_t sem) {
+  lock_t word;
+  int old;
+
+  old = splx(HIGH);
+  if (sthread_user_sem_take(sem)) {
+    splx(old);
+    return;
+  }
+
+  spin_lock(&sem->guard);
+  for (;;) {
+    if (sthread_user_sem_take(sem)) {
+      spin_unlock(&sem->guard);
+      break;
+    }
+    word = sem->word;
+    if (word == 0 && atomic_cmpxchg(&sem->word, 0, SEM_WAITERS) != 0)
+      continue;
+    sthread_enqueue(sem->waiters, sthread_user_worker()->current);
+    sthread_user_block(&sem->guard, STHREAD_TRACE_SEM);
+    /* The posting thread handed us its unit. */
+    break;
+  }
+  splx(old);
+}
+
+int sthread_user_sem_trywait(sthread_sem_t sem) {
+  int old, taken;
+
+  old = splx(HIGH);
+  taken = sthread_user_sem_take(sem);
+  splx(old);
+  return taken ? 0 : EAGAIN;
+}
+
+void sthread_user_sem_post(sthread_sem_t sem) {
+  lock_t word;
+  sthread_t next;
+  int old;
+
+  old = splx(HIGH);
+  word = sem->word;
+  while (!(word & SEM_WAITERS)) {
+    assert(word <= UINT32_MAX - SEM_UNIT);
+    if (atomic_cmpxchg(&sem->word, word, word + SEM_UNIT) == word) {
+      splx(old);
+      return;
+    }
+    word = sem->word;
+  }
+
+  spin_lock(&sem->guard);
+  next = sthread_dequeue(sem->waiters);
+  if (next == NULL) {
+    /* Another post took the last waiter, and cleared SEM_WAITERS, after
+     * we looked. Nobody can set it again while we hold the guard. */
+    do {
+      word = sem->word;
+    } while (atomic_cmpxchg(&sem->word, word, word + SEM_UNIT) != word);
+  } else {
+    if (sthread_queue_is_empty(sem->waiters))
+      atomic_swap(&sem->word, 0);
+    sthread_user_ready(next);
+  }
+  spin_unlock(&sem->guard);
+  splx(old);
+}
+
+
+/* A barrier's waiters wait on its queue until the last thread of the
+ * round arrives and makes them all runnable, each exactly once: nobody
+ * wakes up just to find that the round isn't over, as they would
+ * waiting on a condition variable. */
+struct _sthread_barrier {
+  /* Protects arrived and waiters. */
+  lock_t guard;
+  unsigned int count;
+  unsigned int arrived;
+  sthread_queue_t waiters;
+};
+
+sthread_barrier_t sthread_user_barrier_init(unsigned int count) {
+  sthread_barrier_t barrier;
+
+  assert(count > 0);
+  barrier = (sthread_barrier_t)malloc(sizeof(struct _sthread_barrier));
+  assert(barrier != NULL);
+  barrier->guard = 0;
+  barrier->count = count;
+  barrier->arrived = 0;
+  barrier->waiters = sthread_new_queue();
+  return barrier;
+}
+
+void sthread_user_barrier_free(sthread_barrier_t barrier) {
+  assert(barrier->arrived == 0);
+  sthread_free_queue(barrier->waiters);
+  free(barrier);
+}
+
+int sthread_user_barrier_wait(sthread_barrier_t barrier) {
+  sthread_t t;
+  int old;
+
+  old = splx(HIGH);
+  spin_lock(&barrier->guard);
+  if (++barrier->arrived < barrier->count) {
+    sthread_enqueue(barrier->waiters, sthread_user_worker()->current);
+    sthread_user_block(&barrier->guard, STHREAD_TRACE_BARRIER);
+    splx(old);
+    return 0;
+  }
+  barrier->arrived = 0;
+  while ((t = sthread_dequeue(barrier->waiters)) != NULL)
+    sthread_user_ready(t);
+  spin_unlock(&barrier->guard);
+  splx(old);
+  return STHREAD_BARRIER_SERIAL_THREAD;
+}
+
+
+/*********************************************************************/
+/* Part 3: Channels                                                  */
+/*********************************************************************/
+
+/* A thread blocked in sthread_user_chan_select() has a waiter on the
+ * send or receive queue of the channel of each of its cases, all
+ * pointing to the same sthread_chan_sel_t. The first thread that finds
+ * one of them claims the select, does that case's send or receive on the
+ * blocked thread's behalf, and wakes it up. Waiters whose select has
+ * already been claimed through another channel are dropped by whoever
+ * finds them on a queue, and removed by their own thread once it wakes.
+ * sthread_user_chan_send() and _recv() are selects with one case. */
+typedef struct _sthread_chan_sel {
+  sthread_t thread;
+  lock_t claimed;
+  int fired;                    /* the index of the case done */
+} sthread_chan_sel_t;
+
+typedef struct _sthread_chan_waiter {
+  struct _sthread_chan_waiter *next;
+  struct _sthread_chan_waiter *prev;
+  int queued;
+  sthread_chan_sel_t *sel;
+  int index;
+  sthread_chan_case_t *c;
+} sthread_chan_waiter_t;
+
+typedef struct {
+  sthread_chan_waiter_t *head;
+  sthread_chan_waiter_t *tail;
+} sthread_chan_waitq_t;
+
+struct _sthread_chan {
+  /* Protects everything below. */
+  lock_t guard;
+  int closed;
+  /* The values sent but not yet received: count of them, starting at
+   * buffer[head], in a ring of capacity. */
+  unsigned int capacity;
+  unsigned int count;
+  unsigned int head;
+  void **buffer;
+  sthread_chan_waitq_t senders;
+  sthread_chan_waitq_t receivers;
+};
+
+/* Selects with up to this many cases keep their waiters on the stack. */
+#define CHAN_SELECT_STACK 8
+
+sthread_chan_t sthread_user_chan_init(unsigned int capacity) {
+  sthread_chan_t chan;
+
+  chan = (sthread_chan_t)calloc(1, sizeof(struct _sthread_chan));
+  assert(chan != NULL);
+  chan->capacity = capacity;
+  if (capacity > 0) {
+    chan->buffer = (void**)malloc(capacity * sizeof(void*));
+    assert(chan->buffer != NULL);
+  }
+  return chan;
+}
+
+void sthread_user_chan_free(sthread_chan_t chan) {
+  assert(chan->senders.head == NULL && chan->receivers.head == NULL);
+  free(chan->buffer);
+  free(chan);
+}
+
+static void sthread_user_chan_enqueue(sthread_chan_waitq_t *q,
+                                      sthread_chan_waiter_t *w) {
+  w->next = NULL;
+  w->prev = q->tail;
+  if (q->tail != NULL)
+    q->tail->next = w;
+  else
+    q->head = w;
+  q->tail = w;
+  w->queued = 1;
+}
+
+static void sthread_user_chan_remove(sthread_chan_waitq_t *q,
+                                     sthread_chan_waiter_t *w) {
+  if (!w->queued)
+    return;
+  if (w->prev != NULL)
+    w->prev->next = w->next;
+  else
+    q->head = w->next;
+  if (w->next != NULL)
+    w->next->prev = w->prev;
+  else
+    q->tail = w->prev;
+  w->queued = 0;
+}
+
+/* Take the first waiter off q whose select nobody has claimed yet, and
+ * claim it. Returns NULL if there is none. */
+static sthread_chan_waiter_t *sthread_user_chan_claim(
+    sthread_chan_waitq_t *q) {
+  sthread_chan_waiter_t *w;
+
+  while ((w = q->head) != NULL) {
+    sthread_user_chan_remove(q, w);
+    if (atomic_cmpxchg(&w->sel->claimed, 0, 1) == 0) {
+      w->sel->fired = w->index;
+      return w;
+    }
+  }
+  return NULL;
+}
+
+/* Do the send or receive c on chan, which is locked, if it can go ahead
+ * without blocking; returns true if it did. If that meant taking over
+ * a blocked thread's half of the exchange, that thread is returned in
+ * *wake, for the caller to wake once it has unlocked chan. */
+static int sthread_user_chan_try(sthread_chan_t chan, sthread_chan_case_t *c,
+                                 sthread_t *wake) {
+  sthread_chan_waiter_t *w;
+
+  *wake = NULL;
+  c->err = 0;
+  if (c->dir == STHREAD_CHAN_SEND) {
+    if (chan->closed) {
+      c->err = EPIPE;
+      return 1;
+    }
+    if ((w = sthread_user_chan_claim(&chan->receivers)) != NULL) {
+      w->c->value = c->value;
+      w->c->err = 0;
+      *wake = w->sel->thread;
+      return 1;
+    }
+    if (chan->count < chan->capacity) {
+      chan->buffer[(chan->head + chan->count++) % chan->capacity] = c->value;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (chan->count > 0) {
+    c->value = chan->buffer[chan->head];
+    chan->head = (chan->head + 1) % chan->capacity;
+    chan->count--;
+    /* Make room for the first blocked sender's value. */
+    if ((w = sthread_user_chan_claim(&chan->senders)) != NULL) {
+      chan->buffer[(chan->head + chan->count++) % chan->capacity] =
+        w->c->value;
+      w->c->err = 0;
+      *wake = w->sel->thread;
+    }
+    return 1;
+  }
+  if ((w = sthread_user_chan_claim(&chan->senders)) != NULL) {
+    c->value = w->c->value;
+    w->c->err = 0;
+    *wake = w->sel->thread;
+    return 1;
+  }
+  if (chan->closed) {
+    c->value = NULL;
+    c->err = EPIPE;
+    return 1;
+  }
+  return 0;
+}
+
+/* Wake t, whose half of an exchange on a channel has just been done for
+ * it. A receiver is handed the CPU straight away, so that it can use the
+ * value while the sender's work is still in the cache. */
+static void sthread_user_chan_wake(sthread_t t, int receiver) {
+  /* Once we have its lock, t has finished switching out. */
+  spin_lock(&t->lock);
+  if (!receiver) {
+    sthread_user_ready(t);
+    spin_unlock(&t->lock);
+    return;
+  }
+  spin_unlock(&t->lock);
+  sthread_user_handoff(t);
+}
+
+/* Lock, or unlock, each channel of cases once, taking them in address
+ * order so that selects over the same channels can't deadlock. order
+ * holds the indexes of the n cases with channels, sorted by channel. */
+static void sthread_user_chan_lock_all(sthread_chan_case_t *cases,
+                                       int *order, int n, int lock) {
+  sthread_chan_t chan, prev = NULL;
+  int k;
+
+  for (k = 0; k < n; k++) {
+    chan = cases[order[k]].chan;
+    if (chan == prev)
+      continue;
+    if (lock)
+      spin_lock(&chan->guard);
+    else
+      spin_unlock(&chan->guard);
+    prev = chan;
+  }
+}
+
+int sthread_user_chan_select(sthread_chan_case_t *cases, int ncases,
+                             int block) {
+  sthread_chan_waiter_t stack_waiters[CHAN_SELECT_STACK], *waiters;
+  int stack_order[CHAN_SELECT_STACK], *order;
+  sthread_chan_sel_t sel;
+  sthread_worker_t *w;
+  sthread_chan_case_t *c;
+  sthread_t wake;
+  int i, j, k, n, start, fired = -1, old;
+
+  waiters = stack_waiters;
+  order = stack_order;
+  if (ncases > CHAN_SELECT_STACK) {
+    waiters = (sthread_chan_waiter_t*)malloc(ncases * sizeof(*waiters));
+    order = (int*)malloc(ncases * sizeof(int));
+    assert(waiters != NULL && order != NULL);
+  }
+  /* Sort the cases with channels by channel, for locking. */
+  n = 0;
+  for (i = 0; i < ncases; i++) {
+    if (cases[i].chan == NULL)
+      continue;
+    for (j = n; j > 0 && cases[order[j - 1]].chan > cases[i].chan; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+    n++;
+  }
+  assert(n > 0 || !block);
+
+  old = splx(HIGH);
+  w = sthread_user_worker();
+  start = 0;
+  if (n > 1) {
+    w->random ^= w->random << 13;
+    w->random ^= w->random >> 17;
+    w->random ^= w->random << 5;
+    start = w->random % ncases;
+  }
+  sthread_user_chan_lock_all(cases, order, n, 1);
+  for (k = 0; k < ncases && fired < 0; k++) {
+    c = &cases[(start + k) % ncases];
+    if (c->chan != NULL && sthread_user_chan_try(c->chan, c, &wake))
+      fired = (start + k) % ncases;
+  }
+  if (fired >= 0) {
+    sthread_user_chan_lock_all(cases, order, n, 0);
+    if (wake != NULL)
+      sthread_user_chan_wake(wake, cases[fired].dir == STHREAD_CHAN_SEND);
+  } else if (!block) {
+    sthread_user_chan_lock_all(cases, order, n, 0);
+  } else {
+    sel.thread = w->current;
+    sel.claimed = 0;
+    sel.fired = -1;
+    for (k = 0; k < n; k++) {
+      i = order[k];
+      waiters[i].sel = &sel;
+      waiters[i].index = i;
+      waiters[i].c = &cases[i];
+      sthread_user_chan_enqueue((cases[i].dir == STHREAD_CHAN_SEND) ?
+                                &cases[i].chan->senders :
+                                &cases[i].chan->receivers, &waiters[i]);
+    }
+    spin_lock(&sel.thread->lock);
+    sthread_user_chan_lock_all(cases, order, n, 0);
+    sthread_user_block(&sel.thread->lock, STHREAD_TRACE_CHAN);
+
+    /* Whoever claimed sel took that case's waiter off its queue; take
+     * the others off theirs. */
+    fired = sel.fired;
+    if (n > 1) {
+      sthread_user_chan_lock_all(cases, order, n, 1);
+      for (k = 0; k < n; k++) {
+        i = order[k];
+        sthread_user_chan_remove((cases[i].dir == STHREAD_CHAN_SEND) ?
+                                 &cases[i].chan->senders :
+                                 &cases[i].chan->receivers, &waiters[i]);
+      }
+      sthread_user_chan_lock_all(cases, order, n, 0);
+    }
+  }
+  splx(old);
+
+  if (waiters != stack_waiters) {
+    free(waiters);
+    free(order);
+  }
+  return fired;
+}
+
+int sthread_user_chan_send(sthread_chan_t chan, void *value) {
+  sthread_chan_case_t c;
+
+  c.chan = chan;
+  c.dir = STHREAD_CHAN_SEND;
+  c.value = value;
+  sthread_user_chan_select(&c, 1, 1);
+  return c.err;
+}
+
+int sthread_user_chan_recv(sthread_chan_t chan, void **value) {
+  sthread_chan_case_t c;
+
+  c.chan = chan;
+  c.dir = STHREAD_CHAN_RECV;
+  sthread_user_chan_select(&c, 1, 1);
+  *value = c.value;
+  return c.err;
+}
+
+void sthread_user_chan_close(sthread_chan_t chan) {
+  sthread_chan_waiter_t *w, *woken = NULL;
+  sthread_t t;
+  int old;
+
+  old = splx(HIGH);
+  spin_lock(&chan->guard);
+  assert(!chan->closed);
+  chan->closed = 1;
+  /* Nobody is waiting to receive if there are values left. */
+  while ((w = sthread_user_chan_claim(&chan->receivers)) != NULL ||
+         (w = sthread_user_chan_claim(&chan->senders)) != NULL) {
+    if (w->c->dir == STHREAD_CHAN_RECV)
+      w->c->value = NULL;
+    w->c->err = EPIPE;
+    w->next = woken;
+    woken = w;
+  }
+  spin_unlock(&chan->guard);
+  while (woken != NULL) {
+    /* Once t is awake, w may be gone. */
+    w = woken;
+    woken = w->next;
+    t = w->sel->thread;
+    sthread_user_chan_wake(t, 0);
+  }
+  splx(old);
+}
+
+
+/*********************************************************************/
+/* Part 4: I/O                                                       */
+/*********************************************************************/
+
+/* A descriptor a thread was waiting for is ready: wake the thread up.
+ * Holding its lock makes sure it has finished switching out. */
+static void sthread_user_io_ready(void *waiter) {
+  sthread_t t = (sthread_t)waiter;
+
+  spin_lock(&t->lock);
+  sthread_user_ready(t);
+  spin_unlock(&t->lock);
+}
+
+/* Put fd in non-blocking mode, so that the calls below return EAGAIN
+ * instead of blocking the worker. */
+static int sthread_user_nonblock(int fd) {
+  int flags;
+
+  flags = fcntl(fd, F_GETFL);
+  if (flags == -1)
+    return -1;
+  if (flags & O_NONBLOCK)
+    return 0;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Block the calling thread until fd is ready for mode. If the netpoller
+ * can't watch fd, block the whole worker in poll() instead. Returns 0, or
+ * -1 with errno set. */
+static int sthread_user_wait_fd(int fd, int mode) {
+  struct pollfd pfd;
+  sthread_t self;
+  int old, ret;
+
+  old = splx(HIGH);
+  self = sthread_user_worker()->current;
+  spin_lock(&self->lock);
+  ret = sthread_netpoll_arm(netpoll, fd, mode, self);
+  if (ret == 0) {
+    /* Make sure some idle worker is around to wait for it. */
+    __sync_synchronize();
+    if (!idle_polling && idle_sleepers > 0) {
+      pthread_mutex_lock(&idle_lock);
+      pthread_cond_signal(&idle_cond);
+      pthread_mutex_unlock(&idle_lock);
+    }
+    sthread_user_block(&self->lock, STHREAD_TRACE_IO);
+  } else {
+    spin_unlock(&self->lock);
+  }
+  splx(old);
+
+  if (ret != 0) {
+    pfd.fd = fd;
+    pfd.events = (mode == STHREAD_POLL_READ) ? POLLIN : POLLOUT;
+    ret = (poll(&pfd, 1, -1) == -1 && errno != EINTR) ? -1 : 0;
+  }
+  return ret;
+}
+
+ssize_t sthread_user_read(int fd, void *buf, size_t count) {
+  ssize_t n;
+
+  if (sthread_user_nonblock(fd) != 0)
+    return -1;
+  for (;;) {
+    n = read(fd, buf, count);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+      return n;
+    if (errno != EINTR && sthread_user_wait_fd(fd, STHREAD_POLL_READ) != 0)
+      return -1;
+  }
+}
+
+ssize_t sthread_user_write(int fd, const void *buf, size_t count) {
+  const char *p = (const char*)buf;
+  size_t done = 0;
+  ssize_t n;
+
+  if (sthread_user_nonblock(fd) != 0)
+    return -1;
+  while (done < count) {
+    n = write(fd, p + done, count - done);
+    if (n >= 0) {
+      done += n;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+        sthread_user_wait_fd(fd, STHREAD_POLL_WRITE) != 0)
+      return (done > 0) ? (ssize_t)done : -1;
+  }
+  return done;
+}
+
+int sthread_user_accept(int fd, struct sockaddr *addr, socklen_t *len) {
+  int conn;
+
+  if (sthread_user_nonblock(fd) != 0)
+    return -1;
+  for (;;) {
+    conn = accept(fd, addr, len);
+    if (conn >= 0 ||
+        (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+      return conn;
+    if (errno != EINTR && sthread_user_wait_fd(fd, STHREAD_POLL_READ) != 0)
+      return -1;
+  }
+}
+
+int sthread_user_connect(int fd, const struct sockaddr *addr, socklen_t len) {
+  socklen_t errlen = sizeof(int);
+  int err;
+
+  if (sthread_user_nonblock(fd) != 0)
+    return -1;
+  if (connect(fd, addr, len) == 0)
+    return 0;
+  if (errno != EINPROGRESS && errno != EINTR)
+    return -1;
+  /* The connection is made (or has failed) once fd is writable. */
+  if (sthread_user_wait_fd(fd, STHREAD_POLL_WRITE) != 0)
+    return -1;
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0)
+    return -1;
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+/*********************************************************************/
+/* Part 5: Statistics                                                */
+/*********************************************************************/
+
+void sthread_user_stats_snapshot(sthread_stats_t *stats) {
+  sthread_thread_stats_t *ts;
+  sthread_t t;
+  uint64_t now;
+  int old;
+
+  old = splx(HIGH);
+  spin_lock(&all_lock);
+  now = sthread_timer_now();
+  stats->threads = (sthread_thread_stats_t*)malloc(
+      nall_threads * sizeof(sthread_thread_stats_t));
+  assert(stats->threads != NULL || nall_threads == 0);
+  stats->nthreads = nall_threads;
+  stats->threads_created = threads_created;
+  stats->threads_exited = threads_exited;
+  stats->total = exited_counters;
+
+  for (t = all_threads, ts = stats->threads; t != NULL;
+       t = t->all_next, ts++) {
+    ts->thread = (t == main_thread) ? NULL : t;
+    strcpy(ts->name, t->name);
+    ts->priority = t->priority;
+    ts->counters = t->counters;
+    /* Count the time in the thread's current state so far. */
+    switch (t->state) {
+    case STHREAD_RUNNING:
+      ts->state = 'R';
+      ts->counters.run_ns += now - t->since;
+      break;
+    case STHREAD_RUNNABLE:
+      ts->state = 'W';
+      ts->counters.runnable_ns += now - t->since;
+      break;
+    default:
+      ts->state = 'B';
+      ts->counters.blocked_ns += now - t->since;
+      break;
+    }
+    sthread_counters_add(&stats->total, &ts->counters);
+  }
+  spin_unlock(&all_lock);
+  splx(old);
+
+  stats->interrupts = good_interrupts;
+  stats->dropped_interrupts = dropped_interrupts;
 }
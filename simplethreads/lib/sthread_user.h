@@ -10,11 +10,15 @@
 
 /* Part 1: Basic Threads */
 void sthread_user_init(void);
+void sthread_user_init_mn(void);
 sthread_t sthread_user_create(sthread_start_func_t start_routine, void *arg,
-                              int joinable);
+                              int joinable, const struct _sthread_attr *attr);
 void sthread_user_exit(void *ret);
 void sthread_user_yield(void);
 void* sthread_user_join(sthread_t t);
+void **sthread_user_specific(void);
+void sthread_user_sleep_usec(unsigned long usec);
+void sthread_user_set_priority(sthread_t t, int priority);
 
 /* Part 2: Synchronization Primitives */
 sthread_mutex_t sthread_user_mutex_init(void);
@@ -28,5 +32,39 @@ void sthread_user_cond_signal(sthread_cond_t cond);
 void sthread_user_cond_broadcast(sthread_cond_t cond);
 void sthread_user_cond_wait(sthread_cond_t cond,
                             sthread_mutex_t lock);
+int sthread_user_cond_timedwait(sthread_cond_t cond, sthread_mutex_t lock,
+                                unsigned long usec);
+
+sthread_rwlock_t sthread_user_rwlock_init(sthread_rwlock_pref_t pref);
+void sthread_user_rwlock_free(sthread_rwlock_t lock);
+void sthread_user_rwlock_rdlock(sthread_rwlock_t lock);
+void sthread_user_rwlock_wrlock(sthread_rwlock_t lock);
+void sthread_user_rwlock_unlock(sthread_rwlock_t lock);
+
+sthread_sem_t sthread_user_sem_init(unsigned int value);
+void sthread_user_sem_free(sthread_sem_t sem);
+void sthread_user_sem_wait(sthread_sem_t sem);
+int sthread_user_sem_trywait(sthread_sem_t sem);
+void sthread_user_sem_post(sthread_sem_t sem);
+
+sthread_barrier_t sthread_user_barrier_init(unsigned int count);
+void sthread_user_barrier_free(sthread_barrier_t barrier);
+int sthread_user_barrier_wait(sthread_barrier_t barrier);
+
+sthread_chan_t sthread_user_chan_init(unsigned int capacity);
+void sthread_user_chan_free(sthread_chan_t chan);
+int sthread_user_chan_send(sthread_chan_t chan, void *value);
+int sthread_user_chan_recv(sthread_chan_t chan, void **value);
+void sthread_user_chan_close(sthread_chan_t chan);
+int sthread_user_chan_select(sthread_chan_case_t *cases, int ncases, int block);
+
+/* Part 3: I/O */
+ssize_t sthread_user_read(int fd, void *buf, size_t count);
+ssize_t sthread_user_write(int fd, const void *buf, size_t count);
+int sthread_user_accept(int fd, struct sockaddr *addr, socklen_t *len);
+int sthread_user_connect(int fd, const struct sockaddr *addr, socklen_t len);
+
+/* Part 4: Statistics */
+void sthread_user_stats_snapshot(sthread_stats_t *stats);
 
 #endif /* STHREAD_USER_H */
@@ -1,13 +1,141 @@
 #include <config.h>
 
+#include <stdlib.h>
 #include <string.h>
+#include <assert.h>
+#include <errno.h>
 
 #include <sthread.h>
+#include <sthread_attr.h>
+#include <sthread_stats.h>
+#include <sthread_key.h>
 
-sthread_impl_t sthread_get_impl(void) {
-#ifdef USE_PTHREADS
-  return STHREAD_PTHREAD_IMPL;
-#else
-  return STHREAD_USER_IMPL;
-#endif
+/**********************************************************************/
+/* Thread Attributes                                                  */
+/**********************************************************************/
+
+const struct _sthread_attr sthread_attr_default = {
+  0, "", STHREAD_PRIORITY_DEFAULT, -1
+};
+
+sthread_attr_t sthread_attr_init(void) {
+  sthread_attr_t attr;
+
+  attr = (sthread_attr_t)malloc(sizeof(struct _sthread_attr));
+  assert(attr != NULL);
+  *attr = sthread_attr_default;
+  return attr;
+}
+
+void sthread_attr_free(sthread_attr_t attr) {
+  free(attr);
+}
+
+void sthread_attr_setstacksize(sthread_attr_t attr, size_t size) {
+  attr->stacksize = size;
+}
+
+void sthread_attr_setname(sthread_attr_t attr, const char *name) {
+  strncpy(attr->name, name, STHREAD_NAME_MAX - 1);
+  attr->name[STHREAD_NAME_MAX - 1] = '\0';
+}
+
+void sthread_attr_setpriority(sthread_attr_t attr, int priority) {
+  assert(priority >= 0 && priority < STHREAD_PRIORITY_LEVELS);
+  attr->priority = priority;
+}
+
+void sthread_attr_setaffinity(sthread_attr_t attr, int cpu) {
+  assert(cpu >= -1);
+  attr->affinity = cpu;
+}
+
+/**********************************************************************/
+/* Thread-Local Storage                                               */
+/**********************************************************************/
+
+unsigned int sthread_nkeys;
+static void (*key_destructors[STHREAD_KEYS_MAX])(void*);
+
+int sthread_key_create(sthread_key_t *key, void (*destructor)(void*)) {
+  unsigned int k;
+
+  do {
+    k = sthread_nkeys;
+    if (k == STHREAD_KEYS_MAX)
+      return EAGAIN;
+  } while (!__sync_bool_compare_and_swap(&sthread_nkeys, k, k + 1));
+  /* Nobody can have a value for the key until we return it. */
+  key_destructors[k] = destructor;
+  *key = k;
+  return 0;
+}
+
+void sthread_key_run_destructors(void **specific) {
+  unsigned int k, nkeys = sthread_nkeys;
+  int round, again = 1;
+  void *value;
+
+  for (round = 0; again && round < STHREAD_DESTRUCTOR_ITERATIONS; round++) {
+    again = 0;
+    for (k = 0; k < nkeys; k++) {
+      if (specific[k] != NULL && key_destructors[k] != NULL) {
+        value = specific[k];
+        specific[k] = NULL;
+        key_destructors[k](value);
+        again = 1;
+      }
+    }
+  }
+}
+
+/**********************************************************************/
+/* Statistics                                                         */
+/**********************************************************************/
+
+void sthread_counters_add(sthread_counters_t *sum,
+                          const sthread_counters_t *c) {
+  sum->voluntary_switches += c->voluntary_switches;
+  sum->involuntary_switches += c->involuntary_switches;
+  sum->run_ns += c->run_ns;
+  sum->runnable_ns += c->runnable_ns;
+  sum->blocked_ns += c->blocked_ns;
+  sum->mutex_contended += c->mutex_contended;
+}
+
+void sthread_stats_free(sthread_stats_t *stats) {
+  free(stats->threads);
+  free(stats);
+}
+
+/* Print one line of counters, with times in milliseconds. */
+static void sthread_counters_print(FILE *out, const sthread_counters_t *c) {
+  fprintf(out, "%11.3f %11.3f %11.3f %9lu %9lu %9lu\n",
+          c->run_ns / 1e6, c->runnable_ns / 1e6, c->blocked_ns / 1e6,
+          c->voluntary_switches, c->involuntary_switches,
+          c->mutex_contended);
+}
+
+void sthread_stats_print(FILE *out, const sthread_stats_t *stats) {
+  const sthread_thread_stats_t *ts;
+  int i;
+
+  fprintf(out, "sthread stats (%s): %lu threads created, %lu exited, "
+          "%d alive; %lu interrupts, %lu dropped\n", stats->impl,
+          stats->threads_created, stats->threads_exited, stats->nthreads,
+          stats->interrupts, stats->dropped_interrupts);
+  fprintf(out, "%-18s %3s %2s %11s %11s %11s %9s %9s %9s\n", "thread",
+          "pri", "st", "run_ms", "runnable_ms", "blocked_ms", "vol_sw",
+          "invol_sw", "contended");
+  for (i = 0; i < stats->nthreads; i++) {
+    ts = &stats->threads[i];
+    if (ts->name[0] != '\0')
+      fprintf(out, "%-18s", ts->name);
+    else
+      fprintf(out, "%-18p", (void*)ts->thread);
+    fprintf(out, " %3d %2c ", ts->priority, ts->state);
+    sthread_counters_print(out, &ts->counters);
+  }
+  fprintf(out, "%-18s %3s %2s ", "total", "", "");
+  sthread_counters_print(out, &stats->total);
 }
@@ -0,0 +1,104 @@
+/*
+ * test-attr.c - Test creating threads with sthread_attr_t settings:
+ *               many threads with small stacks, one with a stack too
+ *               deep for the default size, and threads with names,
+ *               priorities and affinities.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sthread.h>
+
+#define NSMALL 1000
+#define SMALL_STACK (16 * 1024)
+#define BIG_STACK (16 * 1024 * 1024)
+/* Each level uses at least this much stack. */
+#define FRAME 1024
+
+void *small_start(void *arg);
+void *deep_start(void *arg);
+int recurse(int depth);
+
+int main(int argc, char **argv) {
+  sthread_t child[NSMALL];
+  sthread_t deep;
+  sthread_attr_t attr;
+  char name[STHREAD_NAME_MAX];
+  int depth = 8 * 1024;  /* 8 MB of frames: overflows a 2 MB stack */
+  long n, sum;
+
+  printf("Testing sthread_attr, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  attr = sthread_attr_init();
+  sthread_attr_setstacksize(attr, SMALL_STACK);
+  for (n = 0; n < NSMALL; n++) {
+    sprintf(name, "small-%ld", n);
+    sthread_attr_setname(attr, name);
+    sthread_attr_setpriority(attr, n % STHREAD_PRIORITY_LEVELS);
+    sthread_attr_setaffinity(attr, (n % 3 == 0) ? -1 : (int)n % 4);
+    child[n] = sthread_create_attr(small_start, (void*)n, 1, attr);
+    if (child[n] == NULL) {
+      printf("sthread_create_attr failed\n");
+      exit(1);
+    }
+  }
+  sthread_attr_free(attr);
+
+  attr = sthread_attr_init();
+  sthread_attr_setstacksize(attr, BIG_STACK);
+  sthread_attr_setname(attr, "a-rather-long-thread-name");
+  deep = sthread_create_attr(deep_start, (void*)(long)depth, 1, attr);
+  sthread_attr_free(attr);
+  if (deep == NULL) {
+    printf("sthread_create_attr failed\n");
+    exit(1);
+  }
+
+  sum = 0;
+  for (n = 0; n < NSMALL; n++)
+    sum += (long)sthread_join(child[n]);
+  if (sum != (long)NSMALL * (NSMALL - 1) / 2) {
+    printf("small threads returned %ld, expected %ld\n", sum,
+           (long)NSMALL * (NSMALL - 1) / 2);
+    exit(1);
+  }
+  printf("joined %d threads with %d byte stacks\n", NSMALL, SMALL_STACK);
+
+  if ((long)sthread_join(deep) != depth) {
+    printf("deep thread returned the wrong value\n");
+    exit(1);
+  }
+  printf("recursed %d KB deep on a %d MB stack\n", depth * FRAME / 1024,
+         BIG_STACK / (1024 * 1024));
+
+  printf("sthread_attr PASSED\n");
+  return 0;
+}
+
+void *small_start(void *arg) {
+  char buf[4 * 1024];
+
+  /* Use a good part of the stack, and give the others a turn. */
+  memset(buf, (int)(long)arg, sizeof(buf));
+  sthread_yield();
+  return (void*)(long)(buf[0] == (char)(long)arg ? (long)arg : -1);
+}
+
+void *deep_start(void *arg) {
+  return (void*)(long)recurse((int)(long)arg);
+}
+
+int recurse(int depth) {
+  volatile char frame[FRAME];
+
+  frame[0] = 1;
+  if (depth == 0)
+    return 0;
+  return recurse(depth - 1) + frame[0];
+}
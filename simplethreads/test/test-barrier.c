@@ -0,0 +1,82 @@
+/*
+ * test-barrier.c - Test of barriers.
+ *
+ * THREADS threads go through ROUNDS phases. In each, every thread writes
+ * the phase number into its own slot, waits at the barrier, and checks
+ * that every other slot has it too; a second barrier keeps anybody from
+ * starting the next phase while others are still checking. Exactly one
+ * thread per round must be told it is the serial thread. A barrier for
+ * one thread must never block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sthread.h>
+
+#define THREADS 8
+#define ROUNDS 200
+
+static sthread_barrier_t barrier;
+static volatile int slots[THREADS];
+static volatile int serials;
+
+static void fail(const char *msg) {
+  printf("%s\n", msg);
+  exit(1);
+}
+
+static void wait_at_barrier(void) {
+  if (sthread_barrier_wait(barrier) == STHREAD_BARRIER_SERIAL_THREAD)
+    __sync_add_and_fetch(&serials, 1);
+}
+
+void *phaser(void *arg) {
+  int me = (int)(long)arg, round, i;
+
+  for (round = 1; round <= ROUNDS; round++) {
+    slots[me] = round;
+    if (round % 3 == 0)
+      sthread_yield();
+    wait_at_barrier();
+    for (i = 0; i < THREADS; i++) {
+      if (slots[i] != round)
+        fail("a thread got past the barrier before the others arrived");
+    }
+    wait_at_barrier();
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  sthread_t threads[THREADS];
+  sthread_barrier_t single;
+  int i;
+
+  printf("Testing sthread_barrier_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  barrier = sthread_barrier_init(THREADS);
+  for (i = 0; i < THREADS; i++) {
+    threads[i] = sthread_create(phaser, (void*)(long)i, 1);
+    if (threads[i] == NULL)
+      fail("sthread_create failed");
+  }
+  for (i = 0; i < THREADS; i++)
+    sthread_join(threads[i]);
+  if (serials != 2 * ROUNDS)
+    fail("wrong number of serial threads");
+  sthread_barrier_free(barrier);
+
+  single = sthread_barrier_init(1);
+  for (i = 0; i < 3; i++) {
+    if (sthread_barrier_wait(single) != STHREAD_BARRIER_SERIAL_THREAD)
+      fail("a barrier for one thread didn't let it straight through");
+  }
+  sthread_barrier_free(single);
+
+  printf("sthread barrier PASSED\n");
+  return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * test-broadcast.c - Test of sthread_cond_broadcast() with many waiters.
+ *
+ * One producer and 1000 consumers: each round, the producer waits for
+ * every consumer to be waiting on the condition variable, bumps the
+ * round number and broadcasts. Every consumer must see every round, and
+ * must hold the mutex whenever it returns from sthread_cond_wait(). Then
+ * the consumers are let go one sthread_cond_signal() at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <sthread.h>
+
+#define NUM_CONSUMERS 1000
+#define NUM_ROUNDS 20
+
+static sthread_mutex_t mutex;
+static sthread_cond_t round_cond;   /* producer -> consumers */
+static sthread_cond_t ready_cond;   /* consumers -> producer */
+static int round_num = 0;
+static int waiting = 0;
+static int inside = 0;              /* threads that think they hold mutex */
+static int tokens = 0;              /* signals not yet acted on */
+static int left = 0;
+
+void *consumer(void *arg);
+
+int main(int argc, char **argv) {
+  sthread_t child[NUM_CONSUMERS];
+  int i, r;
+
+  printf("Testing sthread_cond_broadcast, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  mutex = sthread_mutex_init();
+  round_cond = sthread_cond_init();
+  ready_cond = sthread_cond_init();
+
+  for (i = 0; i < NUM_CONSUMERS; i++) {
+    child[i] = sthread_create(consumer, NULL, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create %d failed\n", i);
+      exit(1);
+    }
+  }
+
+  for (r = 1; r <= NUM_ROUNDS; r++) {
+    sthread_mutex_lock(mutex);
+    while (waiting < NUM_CONSUMERS)
+      sthread_cond_wait(ready_cond, mutex);
+    waiting = 0;
+    round_num = r;
+    sthread_cond_broadcast(round_cond);
+    sthread_mutex_unlock(mutex);
+  }
+
+  /* Wait for the last round to be seen, then let the consumers go one
+   * signal at a time. */
+  sthread_mutex_lock(mutex);
+  while (waiting < NUM_CONSUMERS)
+    sthread_cond_wait(ready_cond, mutex);
+  round_num = -1;
+  for (i = 0; i < NUM_CONSUMERS; i++) {
+    tokens++;
+    sthread_cond_signal(round_cond);
+    while (left == i)
+      sthread_cond_wait(ready_cond, mutex);
+  }
+  sthread_mutex_unlock(mutex);
+
+  for (i = 0; i < NUM_CONSUMERS; i++)
+    sthread_join(child[i]);
+
+  sthread_cond_free(round_cond);
+  sthread_cond_free(ready_cond);
+  sthread_mutex_free(mutex);
+
+  printf("sthread_cond_broadcast passed\n");
+  return 0;
+}
+
+void *consumer(void *arg) {
+  int seen = 0;
+
+  sthread_mutex_lock(mutex);
+  for (;;) {
+    /* Tell the producer we're ready for the next round. */
+    waiting++;
+    if (waiting == NUM_CONSUMERS)
+      sthread_cond_signal(ready_cond);
+    while (round_num == seen)
+      sthread_cond_wait(round_cond, mutex);
+    if (inside++ != 0) {
+      printf("two threads returned from sthread_cond_wait holding mutex\n");
+      exit(1);
+    }
+    inside--;
+    if (round_num < 0)
+      break;
+    if (round_num != seen + 1) {
+      printf("consumer missed round %d\n", seen + 1);
+      exit(1);
+    }
+    seen = round_num;
+  }
+
+  /* Leave one at a time, each on its own signal. */
+  while (tokens == 0)
+    sthread_cond_wait(round_cond, mutex);
+  tokens--;
+  left++;
+  sthread_cond_signal(ready_cond);
+  sthread_mutex_unlock(mutex);
+  return NULL;
+}
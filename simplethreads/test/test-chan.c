@@ -0,0 +1,378 @@
+/*
+ * test-chan.c - Test of channels and select.
+ *
+ * Values go down a pipeline of unbuffered channels and must come out in
+ * order; several producers and consumers share a buffered channel, and
+ * every value must arrive exactly once. A send on an unbuffered channel
+ * must wait for a receiver, and a send on a full buffered one for room.
+ * Closing a channel must let receivers drain it and then fail, and must
+ * fail waiting senders and receivers. A select must take values from
+ * whichever channel has them, send when there is room, skip NULL
+ * channels, and not block when told not to; selects sending to selects
+ * must pass every value exactly once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#define STAGES 4
+#define VALUES 10000
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define CAPACITY 8
+
+static void fail(const char *msg) {
+  printf("%s\n", msg);
+  exit(1);
+}
+
+static sthread_t create(sthread_start_func_t func, void *arg) {
+  sthread_t t = sthread_create(func, arg, 1);
+
+  if (t == NULL)
+    fail("sthread_create failed");
+  return t;
+}
+
+static void send_value(sthread_chan_t chan, intptr_t value) {
+  if (sthread_chan_send(chan, (void*)value) != 0)
+    fail("sthread_chan_send failed");
+}
+
+static intptr_t recv_value(sthread_chan_t chan) {
+  void *value;
+
+  if (sthread_chan_recv(chan, &value) != 0)
+    fail("sthread_chan_recv failed");
+  return (intptr_t)value;
+}
+
+/* Pipeline: each stage passes values from one channel to the next, until
+ * its input is closed, and then closes its output. */
+static sthread_chan_t pipe_chans[STAGES + 1];
+
+void *stage(void *arg) {
+  int i = (int)(intptr_t)arg;
+  void *value;
+
+  while (sthread_chan_recv(pipe_chans[i], &value) == 0)
+    send_value(pipe_chans[i + 1], (intptr_t)value + 1);
+  sthread_chan_close(pipe_chans[i + 1]);
+  return NULL;
+}
+
+static void pipeline_test(void) {
+  sthread_t threads[STAGES];
+  void *value;
+  intptr_t i;
+
+  for (i = 0; i <= STAGES; i++)
+    pipe_chans[i] = sthread_chan_init(0);
+  for (i = 0; i < STAGES; i++)
+    threads[i] = create(stage, (void*)i);
+  for (i = 0; i < VALUES; i++) {
+    send_value(pipe_chans[0], i);
+    if (recv_value(pipe_chans[STAGES]) != i + STAGES)
+      fail("the pipeline lost or reordered a value");
+  }
+  sthread_chan_close(pipe_chans[0]);
+  if (sthread_chan_recv(pipe_chans[STAGES], &value) != EPIPE ||
+      value != NULL)
+    fail("closing the pipeline didn't close its end");
+  for (i = 0; i < STAGES; i++)
+    sthread_join(threads[i]);
+  for (i = 0; i <= STAGES; i++)
+    sthread_chan_free(pipe_chans[i]);
+}
+
+/* Many to many, through a buffered channel. */
+static sthread_chan_t shared;
+
+void *producer(void *arg) {
+  intptr_t base = (intptr_t)arg * VALUES, i;
+
+  for (i = 1; i <= VALUES; i++)
+    send_value(shared, base + i);
+  return NULL;
+}
+
+void *consumer(void *arg) {
+  intptr_t sum = 0;
+  void *value;
+
+  while (sthread_chan_recv(shared, &value) == 0)
+    sum += (intptr_t)value;
+  return (void*)sum;
+}
+
+static void shared_test(void) {
+  sthread_t threads[PRODUCERS + CONSUMERS];
+  intptr_t sum = 0, expected;
+  int i;
+
+  shared = sthread_chan_init(CAPACITY);
+  for (i = 0; i < PRODUCERS + CONSUMERS; i++)
+    threads[i] = create((i < PRODUCERS) ? producer : consumer,
+                        (void*)(intptr_t)i);
+  for (i = 0; i < PRODUCERS; i++)
+    sthread_join(threads[i]);
+  sthread_chan_close(shared);
+  for (i = PRODUCERS; i < PRODUCERS + CONSUMERS; i++)
+    sum += (intptr_t)sthread_join(threads[i]);
+  expected = (intptr_t)PRODUCERS * VALUES * (PRODUCERS * VALUES + 1) / 2;
+  if (sum != expected)
+    fail("values were lost or duplicated");
+  sthread_chan_free(shared);
+}
+
+/* Blocking: sent counts the sends that have returned. */
+static sthread_chan_t chan;
+static volatile int sent;
+
+void *sender(void *arg) {
+  intptr_t i;
+
+  for (i = 0; i < (intptr_t)arg; i++) {
+    send_value(chan, i);
+    sent++;
+  }
+  return NULL;
+}
+
+void *blocked_sender(void *arg) {
+  return (void*)(intptr_t)sthread_chan_send(chan, NULL);
+}
+
+void *blocked_receiver(void *arg) {
+  void *value = arg;
+  int err = sthread_chan_recv(chan, &value);
+
+  return (void*)(intptr_t)((err == EPIPE && value == NULL) ? EPIPE : 0);
+}
+
+static void blocking_test(void) {
+  sthread_t t;
+  void *value;
+  int i;
+
+  /* Unbuffered: nothing is sent until somebody receives. */
+  chan = sthread_chan_init(0);
+  sent = 0;
+  t = create(sender, (void*)1);
+  sthread_sleep_usec(50000);
+  if (sent != 0)
+    fail("a send on an unbuffered channel didn't wait for a receiver");
+  if (recv_value(chan) != 0)
+    fail("received the wrong value");
+  sthread_join(t);
+  if (sent != 1)
+    fail("the sender didn't finish");
+  sthread_chan_free(chan);
+
+  /* Buffered: CAPACITY sends go through, the next waits for room. */
+  chan = sthread_chan_init(CAPACITY);
+  sent = 0;
+  t = create(sender, (void*)(CAPACITY + 1));
+  sthread_sleep_usec(50000);
+  if (sent != CAPACITY)
+    fail("sends on a buffered channel didn't fill it and then wait");
+  for (i = 0; i <= CAPACITY; i++) {
+    if (recv_value(chan) != i)
+      fail("a buffered channel reordered values");
+  }
+  sthread_join(t);
+
+  /* Closed: the values still in it, then EPIPE. */
+  send_value(chan, 1);
+  send_value(chan, 2);
+  sthread_chan_close(chan);
+  if (sthread_chan_send(chan, NULL) != EPIPE)
+    fail("sent on a closed channel");
+  if (recv_value(chan) != 1 || recv_value(chan) != 2)
+    fail("closing a channel lost its values");
+  if (sthread_chan_recv(chan, &value) != EPIPE || value != NULL)
+    fail("received from a closed, empty channel");
+  sthread_chan_free(chan);
+
+  /* Closing fails threads waiting on the channel. */
+  chan = sthread_chan_init(0);
+  t = create(blocked_receiver, (void*)1);
+  sthread_sleep_usec(50000);
+  sthread_chan_close(chan);
+  if (sthread_join(t) != (void*)EPIPE)
+    fail("closing a channel didn't fail a waiting receiver");
+  sthread_chan_free(chan);
+  chan = sthread_chan_init(0);
+  t = create(blocked_sender, NULL);
+  sthread_sleep_usec(50000);
+  sthread_chan_close(chan);
+  if (sthread_join(t) != (void*)EPIPE)
+    fail("closing a channel didn't fail a waiting sender");
+  sthread_chan_free(chan);
+}
+
+/* Select: a and b get VALUES values each from their own senders, and
+ * the receiver takes them from whichever has one. */
+static sthread_chan_t a, b;
+
+void *a_sender(void *arg) {
+  intptr_t i;
+
+  for (i = 1; i <= VALUES; i++)
+    send_value(a, i);
+  sthread_chan_close(a);
+  return NULL;
+}
+
+void *b_sender(void *arg) {
+  intptr_t i;
+
+  for (i = 1; i <= VALUES; i++)
+    send_value(b, -i);
+  sthread_chan_close(b);
+  return NULL;
+}
+
+static void select_test(void) {
+  sthread_chan_case_t cases[3];
+  sthread_t ta, tb;
+  intptr_t from_a = 0, from_b = 0, value;
+  int i, open = 2;
+
+  a = sthread_chan_init(0);
+  b = sthread_chan_init(2);
+  ta = create(a_sender, NULL);
+  tb = create(b_sender, NULL);
+  cases[0].chan = a;
+  cases[0].dir = STHREAD_CHAN_RECV;
+  cases[1].chan = NULL;
+  cases[1].dir = STHREAD_CHAN_RECV;
+  cases[2].chan = b;
+  cases[2].dir = STHREAD_CHAN_RECV;
+  while (open > 0) {
+    i = sthread_chan_select(cases, 3, 1);
+    if (i != 0 && i != 2)
+      fail("select chose a case it shouldn't have");
+    if (cases[i].err == EPIPE) {
+      cases[i].chan = NULL;
+      open--;
+      continue;
+    }
+    value = (intptr_t)cases[i].value;
+    if (i == 0 && value == from_a + 1)
+      from_a++;
+    else if (i == 2 && value == -(from_b + 1))
+      from_b++;
+    else
+      fail("select received the wrong value");
+  }
+  if (from_a != VALUES || from_b != VALUES)
+    fail("select lost values");
+  sthread_join(ta);
+  sthread_join(tb);
+  sthread_chan_free(a);
+  sthread_chan_free(b);
+
+  /* Without blocking: nothing to receive, and no room to send. */
+  a = sthread_chan_init(1);
+  cases[0].chan = a;
+  cases[0].dir = STHREAD_CHAN_RECV;
+  if (sthread_chan_select(cases, 1, 0) != -1)
+    fail("select received from an empty channel");
+  cases[0].dir = STHREAD_CHAN_SEND;
+  cases[0].value = (void*)7;
+  if (sthread_chan_select(cases, 1, 0) != 0 || cases[0].err != 0)
+    fail("select didn't send when there was room");
+  if (sthread_chan_select(cases, 1, 0) != -1)
+    fail("select sent to a full channel");
+  cases[1].chan = a;
+  cases[1].dir = STHREAD_CHAN_RECV;
+  if (sthread_chan_select(cases, 2, 0) != 1 || cases[1].value != (void*)7)
+    fail("select didn't receive when it could");
+  sthread_chan_free(a);
+}
+
+/* Selects on both ends: senders send each value on a or b, whichever
+ * has a receiver, and receivers take them from either. */
+#define SELECTORS 4
+
+void *select_sender(void *arg) {
+  sthread_chan_case_t cases[2];
+  intptr_t i;
+
+  cases[0].chan = a;
+  cases[0].dir = STHREAD_CHAN_SEND;
+  cases[1].chan = b;
+  cases[1].dir = STHREAD_CHAN_SEND;
+  for (i = 1; i <= VALUES; i++) {
+    cases[0].value = cases[1].value = (void*)i;
+    if (cases[sthread_chan_select(cases, 2, 1)].err != 0)
+      fail("select failed to send");
+  }
+  return NULL;
+}
+
+void *select_receiver(void *arg) {
+  sthread_chan_case_t cases[2];
+  intptr_t sum = 0;
+  int i, open = 2;
+
+  cases[0].chan = a;
+  cases[0].dir = STHREAD_CHAN_RECV;
+  cases[1].chan = b;
+  cases[1].dir = STHREAD_CHAN_RECV;
+  while (open > 0) {
+    i = sthread_chan_select(cases, 2, 1);
+    if (cases[i].err == EPIPE) {
+      cases[i].chan = NULL;
+      open--;
+    } else {
+      sum += (intptr_t)cases[i].value;
+    }
+  }
+  return (void*)sum;
+}
+
+static void selectors_test(void) {
+  sthread_t threads[2 * SELECTORS];
+  intptr_t sum = 0, expected;
+  int i;
+
+  a = sthread_chan_init(0);
+  b = sthread_chan_init(0);
+  for (i = 0; i < 2 * SELECTORS; i++)
+    threads[i] = create((i < SELECTORS) ? select_sender : select_receiver,
+                        NULL);
+  for (i = 0; i < SELECTORS; i++)
+    sthread_join(threads[i]);
+  sthread_chan_close(a);
+  sthread_chan_close(b);
+  for (i = SELECTORS; i < 2 * SELECTORS; i++)
+    sum += (intptr_t)sthread_join(threads[i]);
+  expected = (intptr_t)SELECTORS * VALUES * (VALUES + 1) / 2;
+  if (sum != expected)
+    fail("selects lost or duplicated values");
+  sthread_chan_free(a);
+  sthread_chan_free(b);
+}
+
+int main(int argc, char **argv) {
+  printf("Testing sthread_chan_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  pipeline_test();
+  shared_test();
+  blocking_test();
+  select_test();
+  selectors_test();
+
+  printf("sthread chan PASSED\n");
+  return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * test-fpu.c - Test that each thread keeps its own floating-point
+ *              control state (here, the rounding mode) across context
+ *              switches. Each thread sets a different rounding mode and
+ *              checks, after every yield, that it still has it and that
+ *              arithmetic still rounds its way.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fenv.h>
+
+#include <sthread.h>
+
+#define NROUNDS 1000
+
+static const int modes[] = { FE_TONEAREST, FE_UPWARD, FE_DOWNWARD,
+                             FE_TOWARDZERO };
+#define NMODES ((int)(sizeof(modes) / sizeof(modes[0])))
+
+void *thread_start(void *arg);
+
+int main(int argc, char **argv) {
+  sthread_t child[NMODES];
+  int i, failed = 0;
+
+  printf("Testing floating-point state across switches, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  for (i = 0; i < NMODES; i++) {
+    child[i] = sthread_create(thread_start, (void*)(long)i, 1);
+    if (child[i] == NULL) {
+      printf("sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < NMODES; i++)
+    failed += (int)(long)sthread_join(child[i]);
+
+  if (failed) {
+    printf("%d thread(s) lost their rounding mode\n", failed);
+    exit(1);
+  }
+  printf("sthread_fpu PASSED\n");
+  return 0;
+}
+
+void *thread_start(void *arg) {
+  int mode = modes[(long)arg];
+  volatile double one = 1.0, three = 3.0;
+  double expected, q;
+  int i;
+
+  fesetround(mode);
+  expected = one / three;
+  for (i = 0; i < NROUNDS; i++) {
+    sthread_yield();
+    q = one / three;
+    if (fegetround() != mode || q != expected) {
+      printf("thread %ld: rounding mode changed after %d yields\n",
+             (long)arg, i);
+      return (void*)1;
+    }
+  }
+  return NULL;
+}
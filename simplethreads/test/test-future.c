@@ -0,0 +1,135 @@
+/*
+ * test-future.c - Test of futures, sthread_join_all() and
+ *                 sthread_when_any().
+ *
+ * A future must hold its thread's return value (or NULL, if the thread
+ * called sthread_exit()) once sthread_future_get() returns, as often as
+ * it is called. sthread_join_all() must not return before every future
+ * is complete, and sthread_when_any() must return a complete one, the
+ * only one if the others are still blocked, skipping NULL entries. A
+ * future freed before its thread finishes must not be disturbed by it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#define FUTURES 20
+#define YIELDS 10
+
+static volatile int finished[FUTURES];
+static sthread_sem_t go;
+
+static void fail(const char *msg) {
+  printf("%s\n", msg);
+  exit(1);
+}
+
+static sthread_future_t spawn(sthread_start_func_t func, void *arg) {
+  sthread_future_t f = sthread_future_spawn(func, arg);
+
+  if (f == NULL)
+    fail("sthread_future_spawn failed");
+  return f;
+}
+
+/* Squares its argument, taking a while about it. */
+void *square(void *arg) {
+  intptr_t i = (intptr_t)arg;
+  int j;
+
+  for (j = 0; j < YIELDS * (int)(i % 4); j++)
+    sthread_yield();
+  finished[i] = 1;
+  return (void*)(i * i);
+}
+
+/* Returns its argument once it is let go. */
+void *held(void *arg) {
+  sthread_sem_wait(go);
+  return arg;
+}
+
+void *exits(void *arg) {
+  sthread_exit(arg);
+  return arg;
+}
+
+int main(int argc, char **argv) {
+  sthread_future_t futures[FUTURES];
+  intptr_t i;
+  int n, open;
+
+  printf("Testing sthread_future_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+  go = sthread_sem_init(0);
+
+  /* One at a time. */
+  for (i = 0; i < FUTURES; i++)
+    futures[i] = spawn(square, (void*)i);
+  for (i = FUTURES - 1; i >= 0; i--) {
+    if (sthread_future_get(futures[i]) != (void*)(i * i) ||
+        sthread_future_get(futures[i]) != (void*)(i * i))
+      fail("a future had the wrong result");
+  }
+  for (i = 0; i < FUTURES; i++)
+    sthread_future_free(futures[i]);
+
+  /* All together, with a NULL among them. */
+  for (i = 0; i < FUTURES; i++) {
+    finished[i] = 0;
+    futures[i] = (i == 3) ? NULL : spawn(square, (void*)i);
+  }
+  sthread_join_all(futures, FUTURES);
+  for (i = 0; i < FUTURES; i++) {
+    if (i != 3 && !finished[i])
+      fail("sthread_join_all returned before a future was complete");
+  }
+  sthread_join_all(futures, FUTURES);
+  for (i = 0; i < FUTURES; i++) {
+    if (futures[i] != NULL) {
+      if (sthread_future_get(futures[i]) != (void*)(i * i))
+        fail("sthread_join_all lost a result");
+      sthread_future_free(futures[i]);
+    }
+  }
+
+  /* Any: only the last one can complete until the others are let go. */
+  for (i = 0; i < FUTURES; i++)
+    futures[i] = spawn((i == FUTURES - 1) ? square : held, (void*)i);
+  if (sthread_when_any(futures, FUTURES) != FUTURES - 1)
+    fail("sthread_when_any returned a future that wasn't complete");
+  sthread_future_free(futures[FUTURES - 1]);
+  futures[FUTURES - 1] = NULL;
+  for (open = FUTURES - 1; open > 0; open--) {
+    sthread_sem_post(go);
+    n = sthread_when_any(futures, FUTURES);
+    if (n < 0 || futures[n] == NULL ||
+        sthread_future_get(futures[n]) != (void*)(intptr_t)n)
+      fail("sthread_when_any returned the wrong future");
+    sthread_future_free(futures[n]);
+    futures[n] = NULL;
+  }
+  if (sthread_when_any(futures, FUTURES) != -1)
+    fail("sthread_when_any chose a NULL future");
+
+  /* sthread_exit() completes the future too, with NULL. */
+  futures[0] = spawn(exits, (void*)1);
+  if (sthread_future_get(futures[0]) != NULL)
+    fail("a future whose thread exited didn't hold NULL");
+  sthread_future_free(futures[0]);
+
+  /* Freed while its thread is still running. */
+  futures[0] = spawn(held, NULL);
+  sthread_future_free(futures[0]);
+  sthread_sem_post(go);
+  sthread_sleep_usec(10000);
+
+  sthread_sem_free(go);
+  printf("sthread future PASSED\n");
+  return 0;
+}
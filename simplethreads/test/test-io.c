@@ -0,0 +1,189 @@
+/*
+ * test-io.c - Test of sthread_read(), sthread_write(), sthread_accept()
+ *             and sthread_connect().
+ *
+ * A thread blocked reading an empty pipe must not stop the other threads
+ * from running. Then a server thread accepts connections on a loopback
+ * socket, with a thread per connection echoing back what it reads, while
+ * client threads each connect, write a buffer too big to fit in the
+ * socket buffers in one go, and read it back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <sthread.h>
+
+#define NUM_CLIENTS 50
+#define ECHO_SIZE (256 * 1024)
+
+static int pipefd[2];
+static volatile int progress = 0;
+static int listen_fd;
+static struct sockaddr_in server_addr;
+
+static void fail(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+void *pipe_reader(void *arg) {
+  char c;
+
+  if (sthread_read(pipefd[0], &c, 1) != 1 || c != 'x')
+    fail("sthread_read from pipe");
+  /* Nothing could have been written until the other thread ran. */
+  if (!progress) {
+    printf("pipe read returned before anything was written\n");
+    exit(1);
+  }
+  return NULL;
+}
+
+void *echo(void *arg) {
+  int conn = (int)(intptr_t)arg;
+  char buf[4096];
+  ssize_t n;
+
+  while ((n = sthread_read(conn, buf, sizeof(buf))) > 0) {
+    if (sthread_write(conn, buf, n) != n)
+      fail("sthread_write echo");
+  }
+  if (n < 0)
+    fail("sthread_read echo");
+  close(conn);
+  return NULL;
+}
+
+void *server(void *arg) {
+  int i, conn;
+
+  for (i = 0; i < NUM_CLIENTS; i++) {
+    conn = sthread_accept(listen_fd, NULL, NULL);
+    if (conn < 0)
+      fail("sthread_accept");
+    if (sthread_create(echo, (void*)(intptr_t)conn, 0) == NULL)
+      fail("sthread_create echo");
+  }
+  return NULL;
+}
+
+/* A client writes its whole buffer before reading any of it back, so the
+ * echo thread (and the client) must block for writing once the socket
+ * buffers fill; so the client writes from another thread. */
+typedef struct {
+  int fd;
+  unsigned char *out;
+} writer_arg_t;
+
+void *writer(void *arg) {
+  writer_arg_t *w = (writer_arg_t*)arg;
+
+  if (sthread_write(w->fd, w->out, ECHO_SIZE) != ECHO_SIZE)
+    fail("sthread_write");
+  shutdown(w->fd, SHUT_WR);
+  return NULL;
+}
+
+void *client(void *arg) {
+  int id = (int)(intptr_t)arg, i;
+  unsigned char *in;
+  writer_arg_t w;
+  sthread_t wt;
+  size_t got = 0;
+  ssize_t n;
+
+  w.out = malloc(ECHO_SIZE);
+  in = malloc(ECHO_SIZE);
+  if (w.out == NULL || in == NULL)
+    fail("malloc");
+  for (i = 0; i < ECHO_SIZE; i++)
+    w.out[i] = (unsigned char)(i * 7 + id);
+
+  w.fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (w.fd < 0)
+    fail("socket");
+  if (sthread_connect(w.fd, (struct sockaddr*)&server_addr,
+                      sizeof(server_addr)) != 0)
+    fail("sthread_connect");
+
+  wt = sthread_create(writer, &w, 1);
+  if (wt == NULL)
+    fail("sthread_create writer");
+  while (got < ECHO_SIZE &&
+         (n = sthread_read(w.fd, in + got, ECHO_SIZE - got)) > 0)
+    got += n;
+  sthread_join(wt);
+  if (got != ECHO_SIZE || memcmp(in, w.out, ECHO_SIZE) != 0) {
+    printf("client %d got back %lu bytes, not what it sent\n", id,
+           (unsigned long)got);
+    exit(1);
+  }
+
+  close(w.fd);
+  free(w.out);
+  free(in);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  sthread_t reader, srv, clients[NUM_CLIENTS];
+  socklen_t len = sizeof(server_addr);
+  int i;
+
+  printf("Testing sthread_read/write/accept/connect, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  /* A reader blocked on an empty pipe doesn't block us. */
+  if (pipe(pipefd) != 0)
+    fail("pipe");
+  reader = sthread_create(pipe_reader, NULL, 1);
+  if (reader == NULL)
+    fail("sthread_create");
+  sthread_sleep_usec(10000);
+  progress = 1;
+  if (sthread_write(pipefd[1], "x", 1) != 1)
+    fail("sthread_write to pipe");
+  sthread_join(reader);
+  close(pipefd[0]);
+  close(pipefd[1]);
+  printf("blocked read didn't block other threads\n");
+
+  /* Echo over loopback TCP. */
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+    fail("socket");
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server_addr.sin_port = 0;
+  if (bind(listen_fd, (struct sockaddr*)&server_addr,
+           sizeof(server_addr)) != 0 ||
+      listen(listen_fd, NUM_CLIENTS) != 0 ||
+      getsockname(listen_fd, (struct sockaddr*)&server_addr, &len) != 0)
+    fail("setting up listening socket");
+
+  srv = sthread_create(server, NULL, 1);
+  if (srv == NULL)
+    fail("sthread_create server");
+  for (i = 0; i < NUM_CLIENTS; i++) {
+    clients[i] = sthread_create(client, (void*)(intptr_t)i, 1);
+    if (clients[i] == NULL)
+      fail("sthread_create client");
+  }
+  for (i = 0; i < NUM_CLIENTS; i++)
+    sthread_join(clients[i]);
+  sthread_join(srv);
+  close(listen_fd);
+
+  printf("sthread I/O passed\n");
+  return 0;
+}
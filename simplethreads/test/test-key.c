@@ -0,0 +1,122 @@
+/*
+ * test-key.c - Test of thread-local storage (sthread_key_create() and
+ *              friends).
+ *
+ * Every thread must see its own values for the keys, NULL to begin
+ * with, however the threads are switched (and moved between workers) in
+ * between. An exiting thread's destructors must be called once for each
+ * non-NULL value, and again if a destructor sets a new one, but only so
+ * many times. Keys that don't exist must be refused, and so must a key
+ * beyond STHREAD_KEYS_MAX.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#define THREADS 16
+#define ROUNDS 1000
+
+static sthread_key_t key, other_key, again_key;
+static volatile int destroyed, again_calls;
+
+static void fail(const char *msg) {
+  printf("%s\n", msg);
+  exit(1);
+}
+
+static void destroy(void *value) {
+  __sync_fetch_and_add(&destroyed, 1);
+}
+
+/* Sets its value again every time, so only the limit stops it. */
+static void destroy_again(void *value) {
+  __sync_fetch_and_add(&again_calls, 1);
+  sthread_setspecific(again_key, value);
+}
+
+void *thread_start(void *arg) {
+  intptr_t me = (intptr_t)arg, i;
+
+  if (sthread_getspecific(key) != NULL ||
+      sthread_getspecific(other_key) != NULL)
+    fail("a new thread's values weren't NULL");
+  for (i = 0; i < ROUNDS; i++) {
+    sthread_setspecific(key, (void*)(me * ROUNDS + i));
+    sthread_yield();
+    if (sthread_getspecific(key) != (void*)(me * ROUNDS + i))
+      fail("a thread's value changed under it");
+  }
+  /* Only key has a destructor. */
+  sthread_setspecific(other_key, (void*)1);
+  if (me == 0)
+    sthread_exit(NULL);
+  return NULL;
+}
+
+void *again_start(void *arg) {
+  sthread_setspecific(again_key, (void*)1);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  sthread_t threads[THREADS];
+  sthread_key_t k;
+  intptr_t i;
+  int err;
+
+  printf("Testing sthread_key_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  if (sthread_key_create(&key, destroy) != 0 ||
+      sthread_key_create(&other_key, NULL) != 0 ||
+      sthread_key_create(&again_key, destroy_again) != 0)
+    fail("sthread_key_create failed");
+  if (key == other_key || key == again_key || other_key == again_key)
+    fail("sthread_key_create returned the same key twice");
+  if (sthread_getspecific(key) != NULL)
+    fail("the main thread's value wasn't NULL");
+  sthread_setspecific(key, (void*)-1);
+
+  for (i = 0; i < THREADS; i++) {
+    threads[i] = sthread_create(thread_start, (void*)i, 1);
+    if (threads[i] == NULL)
+      fail("sthread_create failed");
+  }
+  for (i = 0; i < THREADS; i++)
+    sthread_join(threads[i]);
+  if (sthread_getspecific(key) != (void*)-1)
+    fail("the main thread's value changed");
+  if (destroyed != THREADS)
+    fail("the destructor wasn't called once per thread");
+
+  /* Reused threads start out with NULL values again. */
+  destroyed = 0;
+  for (i = 0; i < THREADS; i++)
+    threads[i] = sthread_create(thread_start, (void*)i, 1);
+  for (i = 0; i < THREADS; i++)
+    sthread_join(threads[i]);
+  if (destroyed != THREADS)
+    fail("the destructor wasn't called once per reused thread");
+
+  sthread_join(sthread_create(again_start, NULL, 1));
+  if (again_calls < 1 || again_calls > 10)
+    fail("a destructor that set a value again wasn't called a few times");
+
+  k = STHREAD_KEYS_MAX;
+  if (sthread_setspecific(k, NULL) != EINVAL)
+    fail("set a value for a key that doesn't exist");
+  do {
+    err = sthread_key_create(&k, NULL);
+  } while (err == 0);
+  if (err != EAGAIN || k != STHREAD_KEYS_MAX - 1)
+    fail("created more than STHREAD_KEYS_MAX keys");
+
+  printf("sthread key PASSED\n");
+  return 0;
+}
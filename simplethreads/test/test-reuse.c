@@ -0,0 +1,124 @@
+/*
+ * test-reuse.c - Test that threads whose descriptors (and, with pthreads,
+ *                kernel threads) are reused behave like new ones.
+ *
+ * Waves of short threads are created and joined, some returning and some
+ * calling sthread_exit() from a nested call; every joiner must get its
+ * own thread's value. Detached threads, and threads created by other
+ * threads, are mixed in, so descriptors are freed from every direction.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sthread.h>
+
+#define WAVES 200
+#define WAVE 50
+#define NDETACHED 2000
+
+static sthread_mutex_t count_lock;
+static sthread_cond_t count_cond;
+static int detached_done = 0;
+
+void finish(long n) {
+  sthread_exit((void*)(n * 3));
+}
+
+void *short_start(void *arg) {
+  long n = (long)arg;
+
+  if (n % 2)
+    finish(n);
+  return (void*)(n * 3);
+}
+
+void *detached_start(void *arg) {
+  sthread_mutex_lock(count_lock);
+  detached_done++;
+  if (detached_done == NDETACHED)
+    sthread_cond_signal(count_cond);
+  sthread_mutex_unlock(count_lock);
+  if ((long)arg % 2)
+    sthread_exit(NULL);
+  return NULL;
+}
+
+/* Creates and joins a wave of its own. */
+void *parent_start(void *arg) {
+  sthread_t child[WAVE];
+  long n, base = (long)arg;
+
+  for (n = 0; n < WAVE; n++) {
+    child[n] = sthread_create(short_start, (void*)(base + n), 1);
+    if (child[n] == NULL) {
+      printf("sthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (n = 0; n < WAVE; n++) {
+    if ((long)sthread_join(child[n]) != (base + n) * 3) {
+      printf("thread %ld returned the wrong value\n", base + n);
+      exit(1);
+    }
+  }
+  return arg;
+}
+
+int main(int argc, char **argv) {
+  sthread_t child[WAVE];
+  long n, w;
+
+  printf("Testing thread reuse, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  count_lock = sthread_mutex_init();
+  count_cond = sthread_cond_init();
+
+  for (w = 0; w < WAVES; w++) {
+    for (n = 0; n < WAVE; n++) {
+      child[n] = sthread_create(short_start, (void*)(w * WAVE + n), 1);
+      if (child[n] == NULL) {
+        printf("sthread_create failed\n");
+        exit(1);
+      }
+    }
+    /* Join in reverse order half the time. */
+    for (n = 0; n < WAVE; n++) {
+      long i = (w % 2) ? WAVE - 1 - n : n;
+      if ((long)sthread_join(child[i]) != (w * WAVE + i) * 3) {
+        printf("thread %ld returned the wrong value\n", w * WAVE + i);
+        exit(1);
+      }
+    }
+  }
+  printf("joined %d waves of %d threads\n", WAVES, WAVE);
+
+  for (n = 0; n < NDETACHED; n++) {
+    if (sthread_create(detached_start, (void*)n, 0) == NULL) {
+      printf("sthread_create failed\n");
+      exit(1);
+    }
+    /* Keep some joinable threads coming and going in between. */
+    if (n % 100 == 0) {
+      sthread_t p = sthread_create(parent_start, (void*)(n * WAVE), 1);
+      if (p == NULL || (long)sthread_join(p) != n * WAVE) {
+        printf("parent thread failed\n");
+        exit(1);
+      }
+    }
+  }
+  sthread_mutex_lock(count_lock);
+  while (detached_done < NDETACHED)
+    sthread_cond_wait(count_cond, count_lock);
+  sthread_mutex_unlock(count_lock);
+  printf("%d detached threads finished\n", NDETACHED);
+
+  sthread_cond_free(count_cond);
+  sthread_mutex_free(count_lock);
+
+  printf("thread reuse PASSED\n");
+  return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * test-rwlock.c - Test of reader-writer locks, with each preference.
+ *
+ * Readers and writers take turns with the lock, yielding while they hold
+ * it. Writers must always be alone with it, and readers must see the
+ * writers' updates whole; several readers should get to hold it at once.
+ *
+ * Then, with a reader holding the lock and a writer waiting for it, a
+ * second reader must get in right away if readers are preferred, and
+ * only after the writer if writers are.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sthread.h>
+
+#define READERS 4
+#define WRITERS 4
+#define ROUNDS 1000
+
+static sthread_rwlock_t lock;
+static int a, b;
+static volatile int readers_in, writers_in, max_readers_in;
+
+static void fail(const char *msg) {
+  printf("%s\n", msg);
+  exit(1);
+}
+
+void *reader(void *arg) {
+  int i, n;
+
+  for (i = 0; i < ROUNDS; i++) {
+    sthread_rwlock_rdlock(lock);
+    n = __sync_add_and_fetch(&readers_in, 1);
+    if (n > max_readers_in)
+      max_readers_in = n;
+    if (writers_in != 0)
+      fail("reader got in with a writer");
+    sthread_yield();
+    if (a != b)
+      fail("reader saw a half-done write");
+    __sync_sub_and_fetch(&readers_in, 1);
+    sthread_rwlock_unlock(lock);
+    sthread_yield();
+  }
+  return NULL;
+}
+
+void *writer(void *arg) {
+  int i;
+
+  for (i = 0; i < ROUNDS; i++) {
+    sthread_rwlock_wrlock(lock);
+    if (__sync_add_and_fetch(&writers_in, 1) != 1 || readers_in != 0)
+      fail("writer didn't get the lock to itself");
+    a++;
+    sthread_yield();
+    b++;
+    __sync_sub_and_fetch(&writers_in, 1);
+    sthread_rwlock_unlock(lock);
+    sthread_yield();
+  }
+  return NULL;
+}
+
+static void exclusion_test(sthread_rwlock_pref_t pref) {
+  sthread_t threads[READERS + WRITERS];
+  int i;
+
+  lock = sthread_rwlock_init(pref);
+  a = b = 0;
+  max_readers_in = 0;
+  for (i = 0; i < READERS + WRITERS; i++) {
+    threads[i] = sthread_create((i < READERS) ? reader : writer, NULL, 1);
+    if (threads[i] == NULL)
+      fail("sthread_create failed");
+  }
+  for (i = 0; i < READERS + WRITERS; i++)
+    sthread_join(threads[i]);
+  if (a != WRITERS * ROUNDS || b != WRITERS * ROUNDS)
+    fail("writes were lost");
+  if (max_readers_in < 2)
+    fail("readers never shared the lock");
+  sthread_rwlock_free(lock);
+}
+
+/* For the preference test: the order the threads got the lock in. */
+static volatile int order, writer_order, reader_order;
+
+void *late_writer(void *arg) {
+  sthread_rwlock_wrlock(lock);
+  writer_order = ++order;
+  sthread_rwlock_unlock(lock);
+  return NULL;
+}
+
+void *late_reader(void *arg) {
+  sthread_rwlock_rdlock(lock);
+  reader_order = ++order;
+  sthread_rwlock_unlock(lock);
+  return NULL;
+}
+
+static void preference_test(sthread_rwlock_pref_t pref) {
+  sthread_t w, r;
+
+  lock = sthread_rwlock_init(pref);
+  order = writer_order = reader_order = 0;
+  sthread_rwlock_rdlock(lock);
+  w = sthread_create(late_writer, NULL, 1);
+  sthread_sleep_usec(50000);
+  r = sthread_create(late_reader, NULL, 1);
+  sthread_sleep_usec(50000);
+  if (writer_order != 0)
+    fail("writer got in with a reader");
+  if (pref == STHREAD_RWLOCK_PREFER_READERS && reader_order == 0)
+    fail("reader waited for a writer when readers are preferred");
+  if (pref == STHREAD_RWLOCK_PREFER_WRITERS && reader_order != 0)
+    fail("reader went ahead of a writer when writers are preferred");
+  sthread_rwlock_unlock(lock);
+  sthread_join(w);
+  sthread_join(r);
+  if (pref == STHREAD_RWLOCK_PREFER_WRITERS &&
+      !(writer_order == 1 && reader_order == 2))
+    fail("writer didn't go before the waiting reader");
+  sthread_rwlock_free(lock);
+}
+
+int main(int argc, char **argv) {
+  printf("Testing sthread_rwlock_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  exclusion_test(STHREAD_RWLOCK_PREFER_READERS);
+  exclusion_test(STHREAD_RWLOCK_PREFER_WRITERS);
+  preference_test(STHREAD_RWLOCK_PREFER_READERS);
+  preference_test(STHREAD_RWLOCK_PREFER_WRITERS);
+
+  printf("sthread rwlock PASSED\n");
+  return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * test-sem.c - Test of counting semaphores.
+ *
+ * Producers and consumers pass items through a bounded buffer guarded by
+ * two semaphores (free slots and full slots); every item must arrive
+ * exactly once, and the buffer must never over- or underflow. Then a
+ * semaphore starting at LIMIT lets threads into a section LIMIT at a
+ * time, and sthread_sem_trywait() must take what there is and no more.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <sthread.h>
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define ITEMS 5000          /* per producer */
+#define SLOTS 8
+
+#define LIMIT 3
+#define LIMITED 10
+
+static sthread_sem_t free_slots, full_slots;
+static sthread_mutex_t buffer_lock;
+static long buffer[SLOTS];
+static int head, tail, used;
+static long consumed_sum;
+
+static sthread_sem_t limit;
+static volatile int inside;
+
+static void fail(const char *msg) {
+  printf("%s\n", msg);
+  exit(1);
+}
+
+void *producer(void *arg) {
+  long base = (long)arg * ITEMS, i;
+
+  for (i = 1; i <= ITEMS; i++) {
+    sthread_sem_wait(free_slots);
+    sthread_mutex_lock(buffer_lock);
+    if (++used > SLOTS)
+      fail("buffer overflowed");
+    buffer[tail] = base + i;
+    tail = (tail + 1) % SLOTS;
+    sthread_mutex_unlock(buffer_lock);
+    sthread_sem_post(full_slots);
+  }
+  return NULL;
+}
+
+void *consumer(void *arg) {
+  long i, item, sum = 0;
+
+  for (i = 0; i < PRODUCERS * ITEMS / CONSUMERS; i++) {
+    sthread_sem_wait(full_slots);
+    sthread_mutex_lock(buffer_lock);
+    if (--used < 0)
+      fail("buffer underflowed");
+    item = buffer[head];
+    head = (head + 1) % SLOTS;
+    sthread_mutex_unlock(buffer_lock);
+    sthread_sem_post(free_slots);
+    sum += item;
+  }
+  sthread_mutex_lock(buffer_lock);
+  consumed_sum += sum;
+  sthread_mutex_unlock(buffer_lock);
+  return NULL;
+}
+
+void *limited(void *arg) {
+  int i;
+
+  for (i = 0; i < 100; i++) {
+    sthread_sem_wait(limit);
+    if (__sync_add_and_fetch(&inside, 1) > LIMIT)
+      fail("too many threads got past the semaphore");
+    sthread_yield();
+    __sync_sub_and_fetch(&inside, 1);
+    sthread_sem_post(limit);
+    sthread_yield();
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  sthread_t threads[PRODUCERS + CONSUMERS + LIMITED];
+  long expected;
+  int i;
+
+  printf("Testing sthread_sem_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  free_slots = sthread_sem_init(SLOTS);
+  full_slots = sthread_sem_init(0);
+  buffer_lock = sthread_mutex_init();
+  for (i = 0; i < PRODUCERS + CONSUMERS; i++) {
+    threads[i] = sthread_create((i < PRODUCERS) ? producer : consumer,
+                                (void*)(long)i, 1);
+    if (threads[i] == NULL)
+      fail("sthread_create failed");
+  }
+  for (i = 0; i < PRODUCERS + CONSUMERS; i++)
+    sthread_join(threads[i]);
+  expected = (long)PRODUCERS * ITEMS * (PRODUCERS * ITEMS + 1) / 2;
+  if (consumed_sum != expected || used != 0)
+    fail("items were lost or duplicated");
+
+  limit = sthread_sem_init(LIMIT);
+  for (i = 0; i < LIMITED; i++) {
+    threads[i] = sthread_create(limited, NULL, 1);
+    if (threads[i] == NULL)
+      fail("sthread_create failed");
+  }
+  for (i = 0; i < LIMITED; i++)
+    sthread_join(threads[i]);
+
+  for (i = 0; i < LIMIT; i++) {
+    if (sthread_sem_trywait(limit) != 0)
+      fail("sthread_sem_trywait failed with units left");
+  }
+  if (sthread_sem_trywait(limit) != EAGAIN)
+    fail("sthread_sem_trywait took a unit that wasn't there");
+  sthread_sem_post(limit);
+  if (sthread_sem_trywait(limit) != 0)
+    fail("sthread_sem_trywait missed a post");
+
+  sthread_sem_free(free_slots);
+  sthread_sem_free(full_slots);
+  sthread_sem_free(limit);
+  sthread_mutex_free(buffer_lock);
+  printf("sthread sem PASSED\n");
+  return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * test-sleep.c - Test of sthread_sleep_usec() and sthread_cond_timedwait().
+ *
+ * Checks that sleeps last at least as long as asked (and not absurdly
+ * longer), that sleepers wake in deadline order, that a sleeping
+ * program doesn't use the CPU, and that a timed wait returns ETIMEDOUT
+ * when nobody signals, and 0 when somebody does, holding the mutex
+ * either way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sthread.h>
+
+#define NUM_SLEEPERS 8
+
+static sthread_mutex_t mutex;
+static sthread_cond_t cond;
+static int wake_order[NUM_SLEEPERS];
+static int nwoken = 0;
+static int flag = 0;
+
+static uint64_t now_usec(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void fail(const char *msg) {
+  printf("%s\n", msg);
+  exit(1);
+}
+
+void *sleeper(void *arg) {
+  int i = (int)(intptr_t)arg;
+
+  /* Later threads sleep for less, and should wake first. */
+  sthread_sleep_usec((NUM_SLEEPERS - i) * 10000);
+  sthread_mutex_lock(mutex);
+  wake_order[nwoken++] = i;
+  sthread_mutex_unlock(mutex);
+  return NULL;
+}
+
+void *signaller(void *arg) {
+  sthread_sleep_usec(5000);
+  sthread_mutex_lock(mutex);
+  flag = 1;
+  sthread_cond_signal(cond);
+  sthread_mutex_unlock(mutex);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  sthread_t child[NUM_SLEEPERS];
+  uint64_t start, cpu, elapsed;
+  int i, ret;
+
+  printf("Testing sthread_sleep_usec and sthread_cond_timedwait, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+  mutex = sthread_mutex_init();
+  cond = sthread_cond_init();
+
+  /* A plain sleep, which shouldn't cost any CPU time. */
+  start = now_usec(CLOCK_MONOTONIC);
+  cpu = now_usec(CLOCK_PROCESS_CPUTIME_ID);
+  sthread_sleep_usec(100000);
+  elapsed = now_usec(CLOCK_MONOTONIC) - start;
+  cpu = now_usec(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+  if (elapsed < 100000 || elapsed > 2000000)
+    fail("sthread_sleep_usec(100000) took the wrong time");
+  if (cpu > 50000)
+    fail("sthread_sleep_usec used the CPU while sleeping");
+  printf("slept %llu usec, using %llu usec of CPU\n",
+         (unsigned long long)elapsed, (unsigned long long)cpu);
+
+  /* Sleepers wake in deadline order. */
+  for (i = 0; i < NUM_SLEEPERS; i++) {
+    child[i] = sthread_create(sleeper, (void*)(intptr_t)i, 1);
+    if (child[i] == NULL)
+      fail("sthread_create failed");
+  }
+  for (i = 0; i < NUM_SLEEPERS; i++)
+    sthread_join(child[i]);
+  for (i = 0; i < NUM_SLEEPERS; i++) {
+    if (wake_order[i] != NUM_SLEEPERS - 1 - i)
+      fail("sleepers woke out of order");
+  }
+
+  /* A timed wait that nobody signals times out, holding the mutex. */
+  sthread_mutex_lock(mutex);
+  start = now_usec(CLOCK_MONOTONIC);
+  ret = sthread_cond_timedwait(cond, mutex, 20000);
+  elapsed = now_usec(CLOCK_MONOTONIC) - start;
+  if (ret != ETIMEDOUT)
+    fail("sthread_cond_timedwait didn't time out");
+  if (elapsed < 20000)
+    fail("sthread_cond_timedwait timed out early");
+  sthread_mutex_unlock(mutex);
+
+  /* A timed wait that is signalled returns 0, well before its (far off)
+   * timeout. */
+  sthread_mutex_lock(mutex);
+  child[0] = sthread_create(signaller, NULL, 1);
+  start = now_usec(CLOCK_MONOTONIC);
+  while (!flag) {
+    ret = sthread_cond_timedwait(cond, mutex, 100000000);
+    if (ret != 0)
+      fail("signalled sthread_cond_timedwait timed out");
+  }
+  elapsed = now_usec(CLOCK_MONOTONIC) - start;
+  if (elapsed > 2000000)
+    fail("signalled sthread_cond_timedwait took too long");
+  sthread_mutex_unlock(mutex);
+  sthread_join(child[0]);
+
+  sthread_cond_free(cond);
+  sthread_mutex_free(mutex);
+  printf("sthread_sleep_usec and sthread_cond_timedwait passed\n");
+  return 0;
+}
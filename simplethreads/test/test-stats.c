@@ -0,0 +1,136 @@
+/*
+ * test-stats.c - Test of sthread_stats_snapshot().
+ *
+ * Two CPU-bound threads compete for the CPU, a third sleeps, and a
+ * fourth waits for a mutex the sleeper holds. While they are at it, a
+ * snapshot must show each doing what it does: the spinners running (and
+ * preempted, on a single worker), the sleeper and the waiter
+ * blocked, and the waiter's contended lock. Afterwards the counters of
+ * the exited threads must still be in the totals.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sthread.h>
+
+/* The snapshot is taken SPIN_USEC into the sleeper's sleep. */
+#define SLEEP_USEC 500000
+#define SPIN_USEC 300000
+
+static sthread_mutex_t mutex;
+static volatile int stop = 0;
+
+static void fail(const char *msg) {
+  printf("%s\n", msg);
+  exit(1);
+}
+
+void *spinner(void *arg) {
+  while (!stop)
+    ;
+  return NULL;
+}
+
+void *sleeper(void *arg) {
+  sthread_mutex_lock(mutex);
+  sthread_sleep_usec(SLEEP_USEC);
+  sthread_mutex_unlock(mutex);
+  return NULL;
+}
+
+void *waiter(void *arg) {
+  sthread_sleep_usec(SLEEP_USEC / 10);
+  sthread_mutex_lock(mutex);
+  sthread_mutex_unlock(mutex);
+  return NULL;
+}
+
+static sthread_t create_named(sthread_start_func_t func, const char *name) {
+  sthread_attr_t attr = sthread_attr_init();
+  sthread_t t;
+
+  sthread_attr_setname(attr, name);
+  t = sthread_create_attr(func, NULL, 1, attr);
+  sthread_attr_free(attr);
+  if (t == NULL)
+    fail("sthread_create_attr failed");
+  return t;
+}
+
+static const sthread_thread_stats_t *find(const sthread_stats_t *stats,
+                                          const char *name) {
+  int i;
+
+  for (i = 0; i < stats->nthreads; i++) {
+    if (strcmp(stats->threads[i].name, name) == 0)
+      return &stats->threads[i];
+  }
+  printf("no stats for thread %s\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  sthread_t spin1, spin2, sleep1, wait1;
+  const sthread_thread_stats_t *ts;
+  sthread_stats_t *stats;
+  unsigned long long run;
+
+  printf("Testing sthread_stats_snapshot, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+  mutex = sthread_mutex_init();
+
+  spin1 = create_named(spinner, "spin1");
+  spin2 = create_named(spinner, "spin2");
+  sleep1 = create_named(sleeper, "sleeper");
+  wait1 = create_named(waiter, "waiter");
+  sthread_sleep_usec(SPIN_USEC);
+
+  stats = sthread_stats_snapshot();
+  sthread_stats_print(stdout, stats);
+  if (stats->nthreads != 5 || stats->threads_created != 5 ||
+      stats->threads_exited != 0)
+    fail("wrong thread counts");
+  run = find(stats, "spin1")->counters.run_ns +
+        find(stats, "spin2")->counters.run_ns;
+  /* With one CPU the spinners share it; give them plenty of slack. */
+  if (run < SPIN_USEC * 1000ULL / 4)
+    fail("spinners didn't run");
+  /* On a single worker, the spinners have to take turns. */
+  if (strcmp(sthread_get_impl_name(), "user") == 0 &&
+      getenv("STHREAD_WORKERS") == NULL &&
+      find(stats, "spin1")->counters.involuntary_switches +
+      find(stats, "spin2")->counters.involuntary_switches == 0)
+    fail("spinners were never preempted");
+  ts = find(stats, "main");
+  if (ts->thread != NULL || ts->counters.blocked_ns < SPIN_USEC * 500ULL)
+    fail("main thread didn't block while it slept");
+  ts = find(stats, "waiter");
+  if (ts->counters.mutex_contended != 1)
+    fail("waiter's lock wasn't counted as contended");
+  if (ts->state != 'B' || ts->counters.blocked_ns < SPIN_USEC * 500ULL)
+    fail("waiter didn't block");
+  if (stats->total.mutex_contended < 1 || stats->total.run_ns < run)
+    fail("totals are short");
+  sthread_stats_free(stats);
+
+  stop = 1;
+  sthread_join(spin1);
+  sthread_join(spin2);
+  sthread_join(sleep1);
+  sthread_join(wait1);
+
+  stats = sthread_stats_snapshot();
+  if (stats->nthreads != 1 || stats->threads_exited != 4)
+    fail("wrong thread counts after joining");
+  if (stats->total.mutex_contended < 1 || stats->total.run_ns < run)
+    fail("exited threads' counters are missing from the totals");
+  sthread_stats_free(stats);
+
+  sthread_mutex_free(mutex);
+  printf("sthread stats PASSED\n");
+  return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * test-task.c - Test of tasks (sthread_task_spawn() and
+ *               sthread_task_wait()).
+ *
+ * Tasks spawned by a thread must each run once and return their result
+ * to sthread_task_wait(), including when several threads spawn at once.
+ * Tasks that spawn and wait for tasks of their own, recursively, must
+ * not tie the workers up: a parallel Fibonacci spawns far more waiting
+ * tasks than there are workers, and must still get the right answer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sthread.h>
+
+#define TASKS 10000
+#define SPAWNERS 4
+#define FIB 20
+
+static volatile int runs[TASKS];
+
+static void fail(const char *msg) {
+  printf("%s\n", msg);
+  exit(1);
+}
+
+void *count(void *arg) {
+  intptr_t i = (intptr_t)arg;
+
+  __sync_fetch_and_add(&runs[i], 1);
+  return (void*)(i * 2);
+}
+
+/* Waits for every task before it has run. */
+static void spawn_all(intptr_t first, intptr_t n) {
+  sthread_task_t *tasks;
+  intptr_t i;
+
+  tasks = malloc(n * sizeof(sthread_task_t));
+  if (tasks == NULL)
+    fail("malloc failed");
+  for (i = 0; i < n; i++)
+    tasks[i] = sthread_task_spawn(count, (void*)(first + i));
+  for (i = n - 1; i >= 0; i--) {
+    if (sthread_task_wait(tasks[i]) != (void*)((first + i) * 2))
+      fail("a task returned the wrong result");
+  }
+  free(tasks);
+}
+
+void *spawner(void *arg) {
+  intptr_t i = (intptr_t)arg;
+
+  spawn_all(i * (TASKS / SPAWNERS), TASKS / SPAWNERS);
+  return NULL;
+}
+
+void *fib(void *arg) {
+  intptr_t n = (intptr_t)arg, a;
+  sthread_task_t t;
+
+  if (n < 2)
+    return (void*)n;
+  t = sthread_task_spawn(fib, (void*)(n - 1));
+  a = (intptr_t)fib((void*)(n - 2));
+  return (void*)(a + (intptr_t)sthread_task_wait(t));
+}
+
+static intptr_t serial_fib(intptr_t n) {
+  return (n < 2) ? n : serial_fib(n - 1) + serial_fib(n - 2);
+}
+
+int main(int argc, char **argv) {
+  sthread_t threads[SPAWNERS];
+  sthread_task_t t;
+  intptr_t i;
+
+  printf("Testing sthread_task_*, impl: %s\n",
+         (sthread_get_impl() == STHREAD_PTHREAD_IMPL) ? "pthread" : "user");
+
+  sthread_init();
+
+  spawn_all(0, TASKS);
+  for (i = 0; i < TASKS; i++) {
+    if (runs[i] != 1)
+      fail("a task didn't run exactly once");
+    runs[i] = 0;
+  }
+
+  for (i = 0; i < SPAWNERS; i++) {
+    threads[i] = sthread_create(spawner, (void*)i, 1);
+    if (threads[i] == NULL)
+      fail("sthread_create failed");
+  }
+  for (i = 0; i < SPAWNERS; i++)
+    sthread_join(threads[i]);
+  for (i = 0; i < TASKS; i++) {
+    if (runs[i] != 1)
+      fail("a task spawned by a thread didn't run exactly once");
+  }
+
+  t = sthread_task_spawn(fib, (void*)FIB);
+  if ((intptr_t)sthread_task_wait(t) != serial_fib(FIB))
+    fail("tasks waiting for tasks got the wrong answer");
+
+  printf("sthread task PASSED\n");
+  return 0;
+}
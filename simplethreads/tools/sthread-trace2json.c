@@ -0,0 +1,370 @@
+/*
+ * sthread-trace2json.c - Converts a trace written by the sthread library
+ *                        (see lib/sthread_trace.h) into Chrome trace JSON,
+ *                        which chrome://tracing and Perfetto
+ *                        (ui.perfetto.dev) display.
+ *
+ * Usage: sthread-trace2json trace-file [json-file]
+ *
+ * Writes to standard output if no json-file is given.
+ *
+ * The events from all rings are merged in timestamp order and replayed
+ * through a little state machine per thread, which turns them into
+ * slices:
+ *
+ *   - "sthreads": a track per thread, showing when it ran, when it was
+ *     runnable but waiting for a worker, and when it was blocked (and on
+ *     what). Created and exited threads are marked.
+ *
+ *   - "workers": a track per worker, showing which thread it ran, and
+ *     its timer ticks.
+ *
+ * With the pthread implementation the kernel does the switching, so
+ * there are no switch events, and a thread counts as running whenever
+ * it isn't blocked.
+ *
+ * Events lost to a ring that wrapped around leave a thread's state
+ * unknown until its next event.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sthread_trace.h>
+
+#define PID_THREADS 1
+#define PID_WORKERS 2
+
+typedef struct {
+  sthread_trace_event_t e;
+  uint64_t seq;             /* order in the file, to keep the sort stable */
+} event_t;
+
+enum { NONE, RUNNING, RUNNABLE, BLOCKED };
+
+typedef struct {
+  int seen;
+  int state;
+  int why;                  /* for BLOCKED */
+  uint32_t waker;           /* for BLOCKED: set by the WAKE ending it */
+  double since;             /* when it entered state, in microseconds */
+} thread_state_t;
+
+typedef struct {
+  uint32_t thread;          /* running on the worker, 0 if none */
+  double since;
+} worker_state_t;
+
+static sthread_trace_header_t header;
+static double us_per_tick;
+
+static thread_state_t *threads;
+static uint32_t nthreads;
+static worker_state_t *workers;
+static uint32_t nworkers;
+static int kernel_scheduled;
+
+static FILE *out;
+static int first_event = 1;
+
+static void die(const char *msg) {
+  fprintf(stderr, "sthread-trace2json: %s\n", msg);
+  exit(1);
+}
+
+static void read_or_die(void *buf, size_t size, size_t n, FILE *f) {
+  if (fread(buf, size, n, f) != n)
+    die("trace file is truncated");
+}
+
+static int compare_events(const void *a, const void *b) {
+  const event_t *x = (const event_t*)a, *y = (const event_t*)b;
+
+  if (x->e.tsc != y->e.tsc)
+    return (x->e.tsc < y->e.tsc) ? -1 : 1;
+  return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+/* Timestamps are unsigned; events from before tracing started (there
+ * are none, but the clocks of different CPUs may disagree by a little)
+ * come out at 0. */
+static double to_us(uint64_t tsc) {
+  if (tsc < header.tsc_start)
+    return 0;
+  return (double)(tsc - header.tsc_start) * us_per_tick;
+}
+
+static thread_state_t *thread_state(uint32_t id) {
+  uint32_t n;
+
+  if (id >= nthreads) {
+    n = (id + 1 > nthreads * 2) ? id + 1 : nthreads * 2;
+    threads = (thread_state_t*)realloc(threads, n * sizeof(thread_state_t));
+    if (threads == NULL)
+      die("out of memory");
+    memset(&threads[nthreads], 0, (n - nthreads) * sizeof(thread_state_t));
+    nthreads = n;
+  }
+  threads[id].seen = 1;
+  return &threads[id];
+}
+
+static worker_state_t *worker_state(uint32_t w) {
+  uint32_t n;
+
+  if (w >= nworkers) {
+    n = w + 1;
+    workers = (worker_state_t*)realloc(workers, n * sizeof(worker_state_t));
+    if (workers == NULL)
+      die("out of memory");
+    memset(&workers[nworkers], 0, (n - nworkers) * sizeof(worker_state_t));
+    nworkers = n;
+  }
+  return &workers[w];
+}
+
+static void emit_start(void) {
+  fprintf(out, first_event ? "\n  " : ",\n  ");
+  first_event = 0;
+}
+
+static void thread_name(char *buf, size_t size, uint32_t id) {
+  if (id == 1)
+    snprintf(buf, size, "main");
+  else
+    snprintf(buf, size, "sthread %u", id);
+}
+
+static const char *block_name(int why) {
+  switch (why) {
+  case STHREAD_TRACE_MUTEX: return "blocked: mutex";
+  case STHREAD_TRACE_COND: return "blocked: cond";
+  case STHREAD_TRACE_JOIN: return "blocked: join";
+  case STHREAD_TRACE_SLEEP: return "blocked: sleep";
+  case STHREAD_TRACE_IO: return "blocked: io";
+  case STHREAD_TRACE_RWLOCK: return "blocked: rwlock";
+  case STHREAD_TRACE_SEM: return "blocked: sem";
+  case STHREAD_TRACE_BARRIER: return "blocked: barrier";
+  case STHREAD_TRACE_CHAN: return "blocked: chan";
+  default: return "blocked";
+  }
+}
+
+static void emit_slice(int pid, uint32_t tid, const char *name, double start,
+                       double end, uint32_t waker) {
+  emit_start();
+  fprintf(out, "{\"name\": \"%s\", \"cat\": \"sched\", \"ph\": \"X\", "
+          "\"pid\": %d, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f",
+          name, pid, tid, start, end - start);
+  if (waker != 0)
+    fprintf(out, ", \"args\": {\"woken_by\": %u}", waker);
+  fprintf(out, "}");
+}
+
+static void emit_instant(int pid, uint32_t tid, const char *name, double at,
+                         const char *arg_name, uint32_t arg) {
+  emit_start();
+  fprintf(out, "{\"name\": \"%s\", \"cat\": \"sched\", \"ph\": \"i\", "
+          "\"s\": \"t\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f",
+          name, pid, tid, at);
+  if (arg_name != NULL)
+    fprintf(out, ", \"args\": {\"%s\": %u}", arg_name, arg);
+  fprintf(out, "}");
+}
+
+static void emit_metadata(int pid, uint32_t tid, const char *what,
+                          const char *name) {
+  emit_start();
+  fprintf(out, "{\"name\": \"%s\", \"ph\": \"M\", \"pid\": %d, "
+          "\"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+          what, pid, tid, name);
+}
+
+/* End id's current slice at now, and put it in state. */
+static void thread_enter(uint32_t id, int state, double now) {
+  thread_state_t *t = thread_state(id);
+
+  switch (t->state) {
+  case RUNNING:
+    emit_slice(PID_THREADS, id, "run", t->since, now, 0);
+    break;
+  case RUNNABLE:
+    emit_slice(PID_THREADS, id, "runnable", t->since, now, 0);
+    break;
+  case BLOCKED:
+    emit_slice(PID_THREADS, id, block_name(t->why), t->since, now,
+               t->waker);
+    break;
+  }
+  t->state = state;
+  t->since = now;
+  t->waker = 0;
+}
+
+static void worker_switch(uint32_t w, uint32_t next, double now) {
+  worker_state_t *ws = worker_state(w);
+  char name[32];
+
+  if (ws->thread != 0) {
+    thread_name(name, sizeof(name), ws->thread);
+    emit_slice(PID_WORKERS, w, name, ws->since, now, 0);
+  }
+  ws->thread = next;
+  ws->since = now;
+}
+
+static void replay(const sthread_trace_event_t *e) {
+  double now = to_us(e->tsc);
+  thread_state_t *t;
+
+  if (e->thread == 0 && e->type != STHREAD_TRACE_SWITCH &&
+      e->type != STHREAD_TRACE_TICK)
+    return;
+  switch (e->type) {
+  case STHREAD_TRACE_CREATE:
+    thread_enter(e->thread, kernel_scheduled ? RUNNING : RUNNABLE, now);
+    emit_instant(PID_THREADS, e->thread, "create", now, "creator", e->other);
+    break;
+  case STHREAD_TRACE_SWITCH:
+    if (e->thread != 0) {
+      t = thread_state(e->thread);
+      /* A thread switched out without blocking was preempted, or
+       * yielded; either way it can run again. */
+      if (t->state != BLOCKED && t->state != NONE)
+        thread_enter(e->thread, RUNNABLE, now);
+    }
+    if (e->other != 0)
+      thread_enter(e->other, RUNNING, now);
+    worker_switch(e->arg, e->other, now);
+    break;
+  case STHREAD_TRACE_BLOCK:
+    thread_enter(e->thread, BLOCKED, now);
+    threads[e->thread].why = e->arg;
+    break;
+  case STHREAD_TRACE_WAKE:
+    t = thread_state(e->thread);
+    if (t->state == BLOCKED)
+      t->waker = e->other;
+    thread_enter(e->thread, kernel_scheduled ? RUNNING : RUNNABLE, now);
+    break;
+  case STHREAD_TRACE_EXIT:
+    thread_enter(e->thread, NONE, now);
+    emit_instant(PID_THREADS, e->thread, "exit", now, NULL, 0);
+    break;
+  case STHREAD_TRACE_TICK:
+    worker_state(e->arg);
+    emit_instant(PID_WORKERS, e->arg, "tick", now, "thread", e->thread);
+    break;
+  default:
+    break;
+  }
+}
+
+int main(int argc, char **argv) {
+  sthread_trace_ring_header_t rh;
+  event_t *events = NULL;
+  uint64_t nevents = 0, i;
+  double end;
+  char name[32];
+  uint32_t r, j;
+  FILE *f;
+
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s trace-file [json-file]\n", argv[0]);
+    return 1;
+  }
+  f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  read_or_die(&header, sizeof(header), 1, f);
+  if (memcmp(header.magic, STHREAD_TRACE_MAGIC, sizeof(header.magic)) != 0)
+    die("not an sthread trace file");
+  if (header.event_size != sizeof(sthread_trace_event_t))
+    die("trace file has events of the wrong size");
+  if (header.tsc_end > header.tsc_start)
+    us_per_tick = (double)(header.ns_end - header.ns_start) /
+                  (double)(header.tsc_end - header.tsc_start) / 1000.0;
+  else
+    us_per_tick = 0.001;
+
+  for (r = 0; r < header.nrings; r++) {
+    read_or_die(&rh, sizeof(rh), 1, f);
+    events = (event_t*)realloc(events, (nevents + rh.nevents) *
+                                       sizeof(event_t));
+    if (events == NULL && nevents + rh.nevents > 0)
+      die("out of memory");
+    for (j = 0; j < rh.nevents; j++) {
+      read_or_die(&events[nevents].e, sizeof(sthread_trace_event_t), 1, f);
+      events[nevents].seq = nevents;
+      nevents++;
+    }
+  }
+  fclose(f);
+  qsort(events, nevents, sizeof(event_t), compare_events);
+
+  /* Without switch events, the kernel schedules the threads. */
+  kernel_scheduled = 1;
+  for (i = 0; i < nevents; i++) {
+    if (events[i].e.type == STHREAD_TRACE_SWITCH) {
+      kernel_scheduled = 0;
+      break;
+    }
+  }
+
+  if (argc == 3) {
+    out = fopen(argv[2], "w");
+    if (out == NULL) {
+      perror(argv[2]);
+      return 1;
+    }
+  } else {
+    out = stdout;
+  }
+
+  fprintf(out, "{\"traceEvents\": [");
+  /* The main thread is running (on the first worker) when tracing
+   * starts. */
+  thread_enter(1, RUNNING, 0);
+  if (!kernel_scheduled)
+    worker_switch(0, 1, 0);
+  for (i = 0; i < nevents; i++)
+    replay(&events[i].e);
+
+  /* Close whatever is still open when the trace ends. */
+  end = to_us(header.tsc_end);
+  for (j = 1; j < nthreads; j++) {
+    if (threads[j].seen)
+      thread_enter(j, NONE, end);
+  }
+  for (j = 0; j < nworkers; j++)
+    worker_switch(j, 0, end);
+
+  emit_metadata(PID_THREADS, 0, "process_name", "sthreads");
+  for (j = 1; j < nthreads; j++) {
+    if (threads[j].seen) {
+      thread_name(name, sizeof(name), j);
+      emit_metadata(PID_THREADS, j, "thread_name", name);
+    }
+  }
+  if (nworkers > 0)
+    emit_metadata(PID_WORKERS, 0, "process_name", "workers");
+  for (j = 0; j < nworkers; j++) {
+    snprintf(name, sizeof(name), "worker %u", j);
+    emit_metadata(PID_WORKERS, j, "thread_name", name);
+  }
+  fprintf(out, "\n],\n\"displayTimeUnit\": \"ns\"}\n");
+
+  if (out != stdout && fclose(out) != 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  free(events);
+  free(threads);
+  free(workers);
+  return 0;
+}
@@ -83,6 +83,6 @@ const char *web_getdocroot() {
 void web_printurl(const char *host, int port) {
   host = (host == NULL) ? "UNKNOWN" : host;
   printf("starting sioux web server (%s threads) on:\n",
-         sthread_get_impl() == STHREAD_USER_IMPL ? "user" : "pthread");
+         sthread_get_impl_name());
   printf("     http://%s:%d\n", host, port);
 }
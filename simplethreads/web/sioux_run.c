@@ -2,6 +2,9 @@
  * sioux_run.c - Implements the main loop for the webserver, processing
  *               requests and sending replies.
  *
+ * Each connection is handled by a thread of its own. All the socket I/O
+ * goes through sthread_accept(), sthread_read() and sthread_write(), so
+ * a thread waiting for a slow client only blocks itself.
  */
 
 #include <config.h>
@@ -12,6 +15,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -39,7 +43,7 @@ typedef enum _status {
 /* How many connections can be waiting, but not accepted,
  * before the kernel starts refusing new connections.
  */
-static const int BACKLOG = 5;
+static const int BACKLOG = 128;
 
 /* Requests really do get this big: */
 static const int REQUEST_MAX_SIZE = 4096;
@@ -54,17 +58,22 @@ static const char SERVER[] = "Sioux/1.0 (Unix)";
 static const char HTTP_VERSION[] = "HTTP/1.1";
 static const char INDEX_FILE[] = "index.html";
 
+/* The directory the documents are in, for the connection threads. */
+static const char *web_docroot;
+
 static int web_setup_socket(int port);
 static int web_next_connection(int listen_socket);
+static void *web_connection_thread(void *arg);
 static void web_handle_connection(int conn, const char *docroot);
 static int web_read_request(int conn, char *request_buf, size_t size);
 static status_t web_parse_request(char *request_buf, char *filename,
                                   size_t filename_len, const char *docroot);
-static void web_send_headers(FILE* stream, status_t status);
+static int web_printf(int conn, const char *format, ...);
+static void web_send_headers(int conn, status_t status);
 static const char *web_get_status_string(status_t status);
 static status_t web_open_file(const char *filename, FILE **file);
-static void web_send_file(FILE *stream, FILE *file);
-static void web_send_error_doc(FILE *stream, status_t status);
+static void web_send_file(int conn, FILE *file);
+static void web_send_error_doc(int conn, status_t status);
 
 
 /* Run the webserver. Our host is given, as well as the port to listen
@@ -74,10 +83,15 @@ static void web_send_error_doc(FILE *stream, status_t status);
 void web_runloop(const char *host, int port, const char *docroot) {
   int listen_socket, next_conn;
 
+  web_docroot = docroot;
   listen_socket = web_setup_socket(port);
 
   while ((next_conn = web_next_connection(listen_socket)) >= 0) {
-    web_handle_connection(next_conn, docroot);
+    if (sthread_create(web_connection_thread, (void*)(intptr_t)next_conn,
+                       0) == NULL) {
+      fprintf(stderr, "sioux: failed to create connection thread\n");
+      close(next_conn);
+    }
   }
 
   close(listen_socket);
@@ -117,8 +131,8 @@ int web_setup_socket(int port) {
 
 /* Get the next incoming connection from the given socket,
  * which should be bound and listening for connections.
- * Will block until a connection is available. Return
- * -1 on error, 0 or greater on success.
+ * Will block (the calling thread) until a connection is available.
+ * Return -1 on error, 0 or greater on success.
  * This function is not thread safe - multiple threads should
  * not invoke it simultaneously. */
 int web_next_connection(int listen_socket) {
@@ -126,18 +140,24 @@ int web_next_connection(int listen_socket) {
   struct sockaddr_in addr;
   socklen_t len = sizeof(struct sockaddr_in);
 
-  next_conn = accept(listen_socket, (struct sockaddr*)&addr, &len);
+  next_conn = sthread_accept(listen_socket, (struct sockaddr*)&addr, &len);
   if (next_conn == -1)
     perror("sioux: error accepting connections");
 
   return next_conn;
 }
 
+/* Each connection's thread starts here. */
+void *web_connection_thread(void *arg) {
+  web_handle_connection((int)(intptr_t)arg, web_docroot);
+  return NULL;
+}
+
 /* Do all the actual request handling.
  * Read in the request, parse it, and send the requested file
  * back (or send an error back) */
 void web_handle_connection(int conn, const char *docroot) {
-  FILE *stream = NULL, *file = NULL;
+  FILE *file = NULL;
   char *request_buf, *filename;
   status_t status;
   request_buf = malloc(REQUEST_MAX_SIZE);
@@ -150,20 +170,13 @@ void web_handle_connection(int conn, const char *docroot) {
     goto done;
   }
 
-  stream = fdopen(conn, "w");
-  if (stream == NULL) {
-    /* Couldn't open a stream; no way to send a response to the client. */
-    perror("sioux: stream fdopen error");
-    goto done;
-  }
-
   /* Get the filename out of the request. */
   status = web_parse_request(request_buf, filename, REQUEST_MAX_SIZE, docroot);
 
   if (status != STATUS_200_OK) {
     fprintf(stderr, "request error %d\n", status);
-    web_send_headers(stream, status);
-    web_send_error_doc(stream, status);
+    web_send_headers(conn, status);
+    web_send_error_doc(conn, status);
     goto done;
   }
 
@@ -172,20 +185,18 @@ void web_handle_connection(int conn, const char *docroot) {
 
   if (status != STATUS_200_OK) {
     fprintf(stderr, "request error %d\n", status);
-    web_send_headers(stream, status);
-    web_send_error_doc(stream, status);
+    web_send_headers(conn, status);
+    web_send_error_doc(conn, status);
     goto done;
   }
 
   /* Finally - send the file */
-  web_send_headers(stream, status);
-  web_send_file(stream, file);
-  fflush(stream);
+  web_send_headers(conn, status);
+  web_send_file(conn, file);
   fclose(file);
 
  done:
-  if (stream != NULL)
-    fclose(stream);
+  close(conn);
   free(request_buf);
   free(filename);
 }
@@ -196,7 +207,7 @@ void web_handle_connection(int conn, const char *docroot) {
 int web_read_request(int conn, char *request_buf, size_t size) {
   ssize_t count = 0, rd;
   /* save 1 char for the '\0' terminator */
-  while ((rd = read(conn, request_buf + count, size-1 - count))) {
+  while ((rd = sthread_read(conn, request_buf + count, size-1 - count))) {
     if (rd == -1) {
       perror("sioux: read error");
       return -1;
@@ -260,16 +271,32 @@ status_t web_parse_request(char *request, char *filename,
   return STATUS_200_OK;
 }
 
+/* Like fprintf, for a connection. Return -1 on error. */
+int web_printf(int conn, const char *format, ...) {
+  char buf[1024];     /* plenty for headers and error documents */
+  va_list ap;
+  int len;
+
+  va_start(ap, format);
+  len = vsnprintf(buf, sizeof(buf), format, ap);
+  va_end(ap);
+  if (len < 0)
+    return -1;
+  if (len >= (int)sizeof(buf))
+    len = sizeof(buf) - 1;
+  return (sthread_write(conn, buf, len) == len) ? 0 : -1;
+}
+
 /* Every http response must begin with a set of headers, indicating
  * at least the version of the protocol and code for what happened
  */
-void web_send_headers(FILE *stream, status_t status) {
-  fprintf(stream, "%s %d %s\r\n", HTTP_VERSION, status,
-          web_get_status_string(status));
-  fprintf(stream, "Server: %s\r\n", SERVER);
-  fprintf(stream, "Content-Type: text/html\r\n");
-  fprintf(stream, "Connection: close\r\n");
-  fprintf(stream, CRLF);
+void web_send_headers(int conn, status_t status) {
+  web_printf(conn, "%s %d %s\r\n"
+             "Server: %s\r\n"
+             "Content-Type: text/html\r\n"
+             "Connection: close\r\n"
+             "%s", HTTP_VERSION, status, web_get_status_string(status),
+             SERVER, CRLF);
 }
 
 /* Open a file. Return a status code indicating success (200) or failure
@@ -282,9 +309,9 @@ status_t web_open_file(const char *filename, FILE **file) {
   return STATUS_200_OK;
 }
 
-/* Given an open stream to send to, and an open file to read from,
+/* Given an open connection to send to, and an open file to read from,
  * transfer the file. */
-void web_send_file(FILE *stream, FILE *file) {
+void web_send_file(int conn, FILE *file) {
   size_t count;
   char *buf;
   buf = (char*)malloc(BUFFER_SIZE);
@@ -292,8 +319,7 @@ void web_send_file(FILE *stream, FILE *file) {
 
   while ((count = fread(buf, 1, BUFFER_SIZE, file)) != 0) {
     //    fprintf(stderr, "sending file: %d\n", (int)count);
-    count = fwrite(buf, 1, count, stream);
-    if (count == 0) {
+    if (sthread_write(conn, buf, count) != (ssize_t)count) {
       fprintf(stderr, "error sending file\n");
       break;
     }
@@ -303,10 +329,10 @@ void web_send_file(FILE *stream, FILE *file) {
 }
 
 /* Send an html document describing the error that occurred. */
-void web_send_error_doc(FILE *stream, status_t status) {
-  fprintf(stream, "<html><head><title>Error %d</title></head>\n", status);
-  fprintf(stream, "<body><h1>Error %d: %s</h1></body></html>\n", status,
-          web_get_status_string(status));
+void web_send_error_doc(int conn, status_t status) {
+  web_printf(conn, "<html><head><title>Error %d</title></head>\n"
+             "<body><h1>Error %d: %s</h1></body></html>\n", status, status,
+             web_get_status_string(status));
 }
 
 /* Each status number has an associated string. Return it. */